@@ -16,6 +16,30 @@ const (
 	PAGE_SIZE      = 0x1000
 
 	BUFSIZE = PAGE_SIZE * 1024 // 4Mb
+
+	// Layout of IOCTL_READ_BATCH, see winpmem_shared.h
+	MAX_READ_DESCRIPTORS = 0x10000
+	READ_BATCH_HEADER    = 8
+	READ_DESCRIPTOR_SIZE = 16
+	READ_STATUS_SIZE     = 8
+
+	// Layout of IOCTL_READ_PHYSICAL_CONTINUE
+	READ_CONTINUE_SIZE          = 24
+	READ_CONTINUE_RESULT_HEADER = 16
+
+	// Layout of IOCTL_GET_BAD_PAGES and IOCTL_SET_BAD_PAGES
+	MAX_BAD_PAGE_RANGES = 0x4000
+	BAD_PAGES_HEADER    = 16
+	PAGE_RANGE_SIZE     = 16
+
+	// Layout of IOCTL_GET_STATS
+	NUMBER_OF_MODES = 3
+	STATS_SIZE      = 16 + NUMBER_OF_MODES*72
+
+	// Why a page could not be read
+	PMEM_PAGE_OK            = 0
+	PMEM_PAGE_ACCESS_FAILED = 1 // Usually blocked by the hypervisor (VSM)
+	PMEM_PAGE_MAP_FAILED    = 2
 )
 
 var (
@@ -27,6 +51,24 @@ var (
 
 	IOCTL_REVERSE_SEARCH_QUERY = CTL_CODE(0x22, 0x104, 3, 3)
 
+	// METHOD_OUT_DIRECT: the output buffer is locked once per request.
+	IOCTL_READ_PHYSICAL = CTL_CODE(0x22, 0x105, 2, 3)
+
+	IOCTL_READ_BATCH = CTL_CODE(0x22, 0x106, 3, 3)
+
+	IOCTL_READ_PHYSICAL_CONTINUE = CTL_CODE(0x22, 0x107, 3, 3)
+
+	// METHOD_BUFFERED: the pages the driver found unreadable.
+	IOCTL_GET_BAD_PAGES = CTL_CODE(0x22, 0x108, 0, 3)
+	IOCTL_SET_BAD_PAGES = CTL_CODE(0x22, 0x109, 0, 3)
+
+	// METHOD_BUFFERED: read counters and cycle timings per mode.
+	IOCTL_GET_STATS   = CTL_CODE(0x22, 0x10A, 0, 3)
+	IOCTL_RESET_STATS = CTL_CODE(0x22, 0x10B, 0, 3)
+
+	// IOCTL_READ_PHYSICAL_CONTINUE with a mode of its own.
+	IOCTL_PROBE_READ = CTL_CODE(0x22, 0x10C, 3, 3)
+
 	YamlFixup = regexp.MustCompile(`"(0x[a-f0-9]+)"`)
 )
 
@@ -38,12 +80,27 @@ const (
 	PMEM_MODE_PTE      = PmemMode(2)
 )
 
+var mode_names = []string{"iospace", "physical", "pte"}
+
+func (self PmemMode) String() string {
+	if int(self) < len(mode_names) {
+		return mode_names[self]
+	}
+	return fmt.Sprintf("mode %d", uint32(self))
+}
+
 type Run struct {
 	Address int64
 	Size    int64
 	Sparse  bool
 }
 
+// A range of page frame numbers.
+type PageRange struct {
+	FirstPage     uint64
+	NumberOfPages uint64
+}
+
 type PHYSICAL_MEMORY_RANGE struct {
 	BaseAddress   Uint64Hex `yaml:"BaseAddress"`
 	NumberOfBytes Uint64Hex `yaml:"NumberOfBytes"`
@@ -102,6 +159,86 @@ type WinpmemInfo struct {
 	KPCR              []Uint64Hex             `yaml:"KPCR"`
 	NtBuildNumberAddr Uint64Hex               `yaml:"NtBuildNumberAddr"`
 	Run               []PHYSICAL_MEMORY_RANGE `yaml:"Run"`
+
+	// The mode set with SetMode and, if it was picked by SelectMode,
+	// how each mode did.
+	Mode   string      `yaml:"Mode,omitempty"`
+	Probes []ModeProbe `yaml:"Probes,omitempty"`
+}
+
+// Where the driver's reads spent their time in one acquisition mode,
+// see WINPMEM_MODE_STATS. Cycles are time stamp counter ticks.
+type ModeStats struct {
+	Reads           uint64
+	BytesRead       uint64
+	PagesRemapped   uint64
+	Exceptions      uint64
+	MdlLockFailures uint64
+	WaitCycles      uint64
+	MdlCycles       uint64
+	RemapCycles     uint64
+	CopyCycles      uint64
+}
+
+// The driver's counters since they were last reset (WINPMEM_STATS).
+type DriverStats struct {
+	ElapsedCycles uint64
+	ElapsedTime   uint64 // In 100ns units.
+	Mode          [NUMBER_OF_MODES]ModeStats
+}
+
+// Turns cycles into milliseconds, at the rate the counter ran since
+// the reset.
+func (self *DriverStats) Milliseconds(cycles uint64) float64 {
+	if self.ElapsedCycles == 0 {
+		return 0
+	}
+	return float64(cycles) * float64(self.ElapsedTime) / 1e4 /
+		float64(self.ElapsedCycles)
+}
+
+type ModeStatsSummary struct {
+	Mode            string  `yaml:"Mode"`
+	Reads           uint64  `yaml:"Reads"`
+	BytesRead       uint64  `yaml:"BytesRead"`
+	PagesRemapped   uint64  `yaml:"PagesRemapped"`
+	Exceptions      uint64  `yaml:"Exceptions"`
+	MdlLockFailures uint64  `yaml:"MdlLockFailures"`
+	WaitMs          float64 `yaml:"WaitMs"`
+	MdlMs           float64 `yaml:"MdlMs"`
+	RemapMs         float64 `yaml:"RemapMs"`
+	CopyMs          float64 `yaml:"CopyMs"`
+}
+
+// The modes that were read with, with their times in milliseconds.
+func (self *DriverStats) Summary() []ModeStatsSummary {
+	result := []ModeStatsSummary{}
+	for i, s := range self.Mode {
+		if s.Reads == 0 && s.MdlLockFailures == 0 {
+			continue
+		}
+		result = append(result, ModeStatsSummary{
+			Mode:            PmemMode(i).String(),
+			Reads:           s.Reads,
+			BytesRead:       s.BytesRead,
+			PagesRemapped:   s.PagesRemapped,
+			Exceptions:      s.Exceptions,
+			MdlLockFailures: s.MdlLockFailures,
+			WaitMs:          self.Milliseconds(s.WaitCycles),
+			MdlMs:           self.Milliseconds(s.MdlCycles),
+			RemapMs:         self.Milliseconds(s.RemapCycles),
+			CopyMs:          self.Milliseconds(s.CopyCycles),
+		})
+	}
+	return result
+}
+
+func (self *DriverStats) ToYaml() string {
+	serialized, err := yaml.Marshal(self.Summary())
+	if err != nil {
+		return ""
+	}
+	return string(serialized)
 }
 
 func (self *WinpmemInfo) ToYaml() string {
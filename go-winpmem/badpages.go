@@ -0,0 +1,79 @@
+package winpmem
+
+import (
+	"bufio"
+	"fmt"
+	"io"
+	"os"
+	"strings"
+)
+
+// The unreadable pages are kept in a text file, the same one the C++
+// imager uses: one range per line with the first page frame number and
+// the number of pages in hex. Lines starting with # are comments.
+
+func ReadBadPages(r io.Reader) ([]PageRange, error) {
+	var result []PageRange
+
+	scanner := bufio.NewScanner(r)
+	for scanner.Scan() {
+		line := strings.TrimSpace(scanner.Text())
+		if line == "" || strings.HasPrefix(line, "#") {
+			continue
+		}
+
+		var r PageRange
+		_, err := fmt.Sscanf(line, "0x%x 0x%x", &r.FirstPage, &r.NumberOfPages)
+		if err != nil {
+			return nil, fmt.Errorf("ReadBadPages: %q: %w", line, err)
+		}
+		result = append(result, r)
+	}
+
+	return result, scanner.Err()
+}
+
+func WriteBadPages(w io.Writer, ranges []PageRange) error {
+	_, err := fmt.Fprintf(w,
+		"# Unreadable pages: first page frame number, number of pages.\n")
+	if err != nil {
+		return err
+	}
+
+	for _, r := range ranges {
+		_, err = fmt.Fprintf(w, "%#x %#x\n", r.FirstPage, r.NumberOfPages)
+		if err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// LoadBadPagesFile returns no ranges if the file does not exist yet.
+func LoadBadPagesFile(filename string) ([]PageRange, error) {
+	fd, err := os.Open(filename)
+	if os.IsNotExist(err) {
+		return nil, nil
+	}
+	if err != nil {
+		return nil, err
+	}
+	defer fd.Close()
+
+	return ReadBadPages(fd)
+}
+
+func SaveBadPagesFile(filename string, ranges []PageRange) error {
+	fd, err := os.OpenFile(filename,
+		os.O_WRONLY|os.O_CREATE|os.O_TRUNC, 0600)
+	if err != nil {
+		return err
+	}
+
+	err = WriteBadPages(fd, ranges)
+	if err != nil {
+		fd.Close()
+		return err
+	}
+	return fd.Close()
+}
@@ -1,7 +1,9 @@
 package main
 
 import (
+	"context"
 	"fmt"
+	"io"
 	"io/ioutil"
 	"os"
 	"time"
@@ -26,7 +28,37 @@ var (
 	progress = acquire.Flag("progress", "Show progress").Bool()
 
 	compression = acquire.Flag("compression", "Type of compression to apply").
-			Default("none").PlaceHolder("snappy|gzip").String()
+			Default("none").PlaceHolder("snappy|s2|gzip|zstd").String()
+
+	compression_threads = acquire.Flag("compression-threads",
+		"Blocks to compress at the same time, 0 for one per core").
+		Default("0").Int()
+
+	compression_block_size = acquire.Flag("compression-block-size",
+		"Size of the blocks to compress with s2 and gzip, 0 for the default").
+		Default("0").Int()
+
+	bad_pages = acquire.Flag("bad_pages",
+		"Keep the unreadable pages in this file, so the driver skips them next time").
+		String()
+
+	driver_stats = acquire.Flag("driver_stats",
+		"Show where the driver spent its time reading").Bool()
+
+	acquisition_mode = acquire.Flag("mode",
+		"How the driver reads memory. auto times a few reads with each mode and picks the best").
+		Default("pte").Enum("auto", "pte", "physical")
+
+	hash_tree = acquire.Flag("hash",
+		"Hash the image and write its SHA-256 hash tree to this file").String()
+
+	baseline = acquire.Flag("baseline",
+		"Only write the chunks that changed since the image with this hash tree. "+
+			"Merge the images back with reconstruct").String()
+
+	readers = acquire.Flag("readers",
+		"Number of reads to keep in flight while taking the image").
+		Default("4").Int()
 )
 
 func doAcquire() error {
@@ -88,8 +120,39 @@ func doAcquire() error {
 	}
 	defer imager.Close()
 
-	// We only support this mode now - it is the most reliable.
-	imager.SetMode(winpmem.PMEM_MODE_PTE)
+	// PTE remapping is the most reliable, and what auto falls back to.
+	switch *acquisition_mode {
+	case "auto":
+		mode, err := imager.SelectMode(
+			winpmem.PMEM_MODE_PTE, winpmem.PMEM_MODE_PHYSICAL)
+		if err != nil {
+			logger.Info("Unable to select a mode, using pte: %v", err)
+			imager.SetMode(winpmem.PMEM_MODE_PTE)
+		} else {
+			logger.Info("Selected mode %v", mode)
+		}
+
+	case "physical":
+		imager.SetMode(winpmem.PMEM_MODE_PHYSICAL)
+
+	default:
+		imager.SetMode(winpmem.PMEM_MODE_PTE)
+	}
+
+	if *bad_pages != "" {
+		ranges, err := winpmem.LoadBadPagesFile(*bad_pages)
+		if err != nil {
+			return err
+		}
+
+		err = imager.SetBadPages(ranges)
+		if err != nil {
+			logger.Info("Unable to load unreadable pages: %v", err)
+		} else {
+			logger.Info("Loaded %v ranges of unreadable pages from %v",
+				len(ranges), *bad_pages)
+		}
+	}
 
 	logger.Info("Memory Info:\n")
 	logger.Info(imager.Stats().ToYaml())
@@ -104,6 +167,8 @@ func doAcquire() error {
 		*nosparse = true
 	}
 
+	imager.SetReaders(*readers)
+
 	if !*nosparse {
 		logger.Info("Setting sparse output file %v", *filename)
 		imager.SetSparse()
@@ -116,20 +181,152 @@ func doAcquire() error {
 	defer out_fd.Close()
 
 	start := time.Now()
-	defer func() {
-		logger.Info("Completed imaging in %v", time.Now().Sub(start))
-	}()
 
-	compressed_writer, closer, err := winpmem.GetCompressor(*compression, out_fd)
+	// Count both sides of the compressor, to report how well it did.
+	var image_writer io.Writer = out_fd
+	var out_counter *winpmem.CountingWriter
+	if *compression != "" && *compression != "none" {
+		out_counter = winpmem.NewCountingWriter(out_fd)
+		image_writer = out_counter
+	}
+
+	compressed_writer, closer, err := winpmem.GetCompressor(
+		*compression, image_writer, winpmem.CompressionOptions{
+			Threads:   *compression_threads,
+			BlockSize: *compression_block_size,
+		})
 	if err != nil {
 		return err
 	}
-	defer closer()
+
+	// Closing writes the last blocks, so on success it is done below
+	// where its error is returned.
+	closed := false
+	defer func() {
+		if !closed {
+			closer()
+		}
+	}()
+
+	var in_counter *winpmem.CountingWriter
+	if out_counter != nil {
+		in_counter = winpmem.NewCountingWriter(compressed_writer)
+		compressed_writer = in_counter
+	}
 
 	ctx, cancel := install_sig_handler()
 	defer cancel()
 
-	return imager.WriteTo(ctx, compressed_writer)
+	if *driver_stats {
+		err = imager.ResetDriverStats()
+		if err != nil {
+			return err
+		}
+	}
+
+	if *hash_tree != "" || *baseline != "" {
+		err = writeDelta(ctx, imager, compressed_writer, logger)
+	} else {
+		err = imager.WriteTo(ctx, compressed_writer)
+	}
+	if err != nil {
+		return err
+	}
+
+	// The compressor's time is what its Write and Close took, not the
+	// reads from the device.
+	closed = true
+	close_start := time.Now()
+	err = closer()
+	if err != nil {
+		return fmt.Errorf("Closing %v compressor: %w", *compression, err)
+	}
+	compression_elapsed := time.Now().Sub(close_start)
+	if in_counter != nil {
+		compression_elapsed += in_counter.Elapsed
+	}
+
+	if *driver_stats {
+		stats, err := imager.GetDriverStats()
+		if err != nil {
+			return err
+		}
+
+		logger.Info("Driver stats:\n")
+		logger.Info(stats.ToYaml())
+	}
+
+	if *bad_pages != "" {
+		ranges, err := imager.GetBadPages()
+		if err != nil {
+			return err
+		}
+
+		logger.Info("Saving %v ranges of unreadable pages to %v",
+			len(ranges), *bad_pages)
+		err = winpmem.SaveBadPagesFile(*bad_pages, ranges)
+		if err != nil {
+			return err
+		}
+	}
+
+	logger.Info("Completed imaging in %v", time.Now().Sub(start))
+
+	if in_counter != nil && in_counter.Count > 0 {
+		logger.Info("Compressed %v Mb to %v Mb (%.1f%%) with %v at %.1f Mb/s",
+			in_counter.Count/1024/1024, out_counter.Count/1024/1024,
+			100*float64(out_counter.Count)/float64(in_counter.Count),
+			*compression,
+			float64(in_counter.Count)/1024/1024/compression_elapsed.Seconds())
+	}
+
+	return nil
+}
+
+// writeDelta writes the image, or only what changed since the
+// baseline, and its hash tree.
+func writeDelta(ctx context.Context, imager *winpmem.Imager,
+	w io.Writer, logger winpmem.Logger) error {
+	var baseline_tree *winpmem.HashTree
+	var err error
+
+	if *baseline != "" {
+		baseline_tree, err = winpmem.LoadHashTreeFile(*baseline)
+		if err != nil {
+			return err
+		}
+
+		// The tree of a delta is needed to reconstruct it.
+		if *hash_tree == "" {
+			*hash_tree = *filename + ".hash"
+		}
+	}
+
+	// The imager can not seek over the padding through the hashing,
+	// so skip zeros here instead.
+	var sparse_writer *winpmem.SparseWriter
+	if !*nosparse {
+		write_seeker, ok := w.(io.WriteSeeker)
+		if ok {
+			sparse_writer = winpmem.NewSparseWriter(write_seeker)
+			w = sparse_writer
+		}
+	}
+
+	tree, err := imager.WriteDelta(ctx, w, baseline_tree)
+	if err != nil {
+		return err
+	}
+
+	if sparse_writer != nil {
+		err = sparse_writer.Close()
+		if err != nil {
+			return err
+		}
+	}
+
+	logger.Info("Writing hash tree with root %v to %v", tree.Root, *hash_tree)
+	return winpmem.SaveHashTreeFile(*hash_tree, tree)
 }
 
 func init() {
@@ -1,6 +1,7 @@
 package main
 
 import (
+	"math"
 	"os"
 	"time"
 
@@ -15,6 +16,12 @@ var (
 
 	decompress_output_filename = decompress.Arg("filename",
 		"Output path to write image to").Required().String()
+
+	decompress_offset = decompress.Flag("offset",
+		"Only extract the physical range from this address").Default("0").Int64()
+
+	decompress_length = decompress.Flag("length",
+		"Only extract this many bytes from --offset").Default("0").Int64()
 )
 
 func doDecompress() error {
@@ -24,19 +31,6 @@ func doDecompress() error {
 	}
 	defer fd.Close()
 
-	header := make([]byte, 10)
-	n, err := fd.Read(header)
-	if err != nil {
-		return err
-	}
-
-	fd.Seek(0, os.SEEK_SET)
-
-	decompressed_fd, err := winpmem.GetDecompressor(header[:n], fd)
-	if err != nil {
-		return err
-	}
-
 	out_fd, err := winpmem.CreateFileForWriting(true, *decompress_output_filename)
 	if err != nil {
 		return err
@@ -46,8 +40,26 @@ func doDecompress() error {
 	ctx, cancel := install_sig_handler()
 	defer cancel()
 
+	// Zero pages are skipped, so they take no space in the output.
+	out := winpmem.NewSparseWriter(out_fd)
+
 	logger := &DecompressionLogger{Logger: winpmem.NewLogger(*verbose)}
-	return winpmem.CopyAndLog(ctx, decompressed_fd, out_fd, logger)
+	if *decompress_offset > 0 || *decompress_length > 0 {
+		length := *decompress_length
+		if length == 0 {
+			length = math.MaxInt64
+		}
+
+		err = winpmem.DecompressRange(ctx, fd, out,
+			*decompress_offset, length, logger)
+	} else {
+		err = winpmem.Decompress(ctx, fd, out, logger)
+	}
+	if err != nil {
+		return err
+	}
+
+	return out.Close()
 }
 
 func init() {
@@ -68,8 +80,10 @@ type DecompressionLogger struct {
 }
 
 func (self *DecompressionLogger) Progress(pages int) {
+	// Decoded blocks are of any size, log when passing each mark.
+	last := self.count / 20000
 	self.count += pages
-	if self.count%20000 == 0 {
+	if self.count/20000 != last {
 		self.Info("%v: Decompressed %v Mb", time.Now().Format(time.RFC3339),
 			self.count*winpmem.PAGE_SIZE/1024/1024)
 	}
@@ -0,0 +1,89 @@
+package main
+
+import (
+	"bufio"
+	"fmt"
+	"io"
+	"os"
+
+	"github.com/Velocidex/WinPmem/go-winpmem"
+	"github.com/alecthomas/kingpin"
+)
+
+var (
+	reconstruct = app.Command("reconstruct",
+		"Merge a full image and the deltas taken after it with acquire --baseline into a raw image")
+
+	reconstruct_output_filename = reconstruct.Arg("filename",
+		"Output path to write image to").Required().String()
+
+	reconstruct_images = reconstruct.Flag("image",
+		"The full image first, then each delta in the order they were taken").
+		Required().Strings()
+
+	reconstruct_trees = reconstruct.Flag("tree",
+		"The hash tree of each image, in the same order").
+		Required().Strings()
+)
+
+func doReconstruct() error {
+	if len(*reconstruct_images) != len(*reconstruct_trees) {
+		return fmt.Errorf("%v images but %v hash trees",
+			len(*reconstruct_images), len(*reconstruct_trees))
+	}
+
+	var images []io.Reader
+	var trees []*winpmem.HashTree
+
+	for i, filename := range *reconstruct_images {
+		tree, err := winpmem.LoadHashTreeFile((*reconstruct_trees)[i])
+		if err != nil {
+			return err
+		}
+		trees = append(trees, tree)
+
+		fd, err := os.Open(filename)
+		if err != nil {
+			return err
+		}
+		defer fd.Close()
+
+		image, err := winpmem.OpenImage(fd)
+		if err != nil {
+			return err
+		}
+		images = append(images, bufio.NewReaderSize(image, winpmem.HASH_CHUNK_SIZE))
+	}
+
+	out_fd, err := winpmem.CreateFileForWriting(true, *reconstruct_output_filename)
+	if err != nil {
+		return err
+	}
+	defer out_fd.Close()
+
+	// Zero pages are skipped, so they take no space in the output.
+	out := winpmem.NewSparseWriter(out_fd)
+
+	err = winpmem.Reconstruct(out, images, trees)
+	if err != nil {
+		return err
+	}
+
+	logger := winpmem.NewLogger(*verbose)
+	logger.Info("Reconstructed image with hash tree root %v",
+		trees[len(trees)-1].Root)
+
+	return out.Close()
+}
+
+func init() {
+	command_handlers = append(command_handlers, func(command string) bool {
+		switch command {
+		case reconstruct.FullCommand():
+			kingpin.FatalIfError(doReconstruct(), "reconstruct")
+		default:
+			return false
+		}
+		return true
+	})
+}
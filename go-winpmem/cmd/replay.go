@@ -0,0 +1,115 @@
+package main
+
+import (
+	"fmt"
+	"os"
+	"time"
+
+	"github.com/Velocidex/WinPmem/go-winpmem"
+	"github.com/alecthomas/kingpin"
+)
+
+var (
+	replay = app.Command("replay",
+		"Time a recorded trace of random reads against a raw image, with and without the page cache")
+
+	replay_image = replay.Arg("image", "Path to a raw image").
+			Required().String()
+
+	replay_trace = replay.Arg("trace",
+		"Reads to replay, one \"offset length\" per line as recorded by SetTrace()").
+		Required().String()
+
+	replay_cache = replay.Flag("cache", "Size of the page cache in Mb").
+			Default("64").Int()
+
+	replay_read_ahead = replay.Flag("read_ahead",
+		"Pages to read on a miss in a sequential pattern").
+		Default("16").Int()
+)
+
+func loadTrace(filename string) ([]winpmem.TraceRead, error) {
+	fd, err := os.Open(filename)
+	if err != nil {
+		return nil, err
+	}
+	defer fd.Close()
+
+	result, err := winpmem.ReadTrace(fd)
+	if err != nil {
+		return nil, fmt.Errorf("%v: %w", filename, err)
+	}
+	return result, nil
+}
+
+func doReplay() error {
+	logger := winpmem.NewLogger(*verbose)
+
+	trace, err := loadTrace(*replay_trace)
+	if err != nil {
+		return err
+	}
+
+	fd, err := os.Open(*replay_image)
+	if err != nil {
+		return err
+	}
+	defer fd.Close()
+
+	stat, err := fd.Stat()
+	if err != nil {
+		return err
+	}
+
+	// A raw image is a single run, zero padded where there was no
+	// memory.
+	reader := winpmem.NewMemoryReader(winpmem.NewFileDevice(fd),
+		[]winpmem.PHYSICAL_MEMORY_RANGE{{
+			NumberOfBytes: winpmem.Uint64Hex(stat.Size()),
+		}})
+
+	for _, cache_mb := range []int{0, *replay_cache} {
+		reader.SetCache(cache_mb*1024*1024/winpmem.PAGE_SIZE, *replay_read_ahead)
+
+		var total int64
+		buf := make([]byte, 0, winpmem.PAGE_SIZE)
+
+		start := time.Now()
+		for _, r := range trace {
+			if cap(buf) < r.Length {
+				buf = make([]byte, r.Length)
+			}
+
+			n, err := reader.ReadAt(buf[:r.Length], r.Offset)
+			if err != nil {
+				return err
+			}
+			total += int64(n)
+		}
+		elapsed := time.Now().Sub(start)
+
+		logger.Info("Cache %vMb: %v reads (%v bytes) in %v, %.0f reads/s",
+			cache_mb, len(trace), total, elapsed,
+			float64(len(trace))/elapsed.Seconds())
+
+		if cache_mb > 0 {
+			stats := reader.CacheStats()
+			logger.Info("Cache hits %v, misses %v, read ahead %v pages",
+				stats.Hits, stats.Misses, stats.ReadAhead)
+		}
+	}
+
+	return nil
+}
+
+func init() {
+	command_handlers = append(command_handlers, func(command string) bool {
+		switch command {
+		case replay.FullCommand():
+			kingpin.FatalIfError(doReplay(), "replay")
+		default:
+			return false
+		}
+		return true
+	})
+}
@@ -6,42 +6,87 @@ import (
 	"errors"
 	"fmt"
 	"io"
+	"runtime"
 	"strings"
+	"time"
 
 	"github.com/klauspost/compress/gzip"
 	"github.com/klauspost/compress/s2"
 	"github.com/klauspost/compress/snappy"
+	"github.com/klauspost/compress/zstd"
 )
 
-func GetCompressor(name string, w io.Writer) (io.Writer, func(), error) {
+// CompressionOptions tune the encoders for the host.
+type CompressionOptions struct {
+	// Blocks compressed at the same time, 0 for one per core.
+	Threads int
+
+	// Size of the blocks the input is compressed in (s2 and gzip), 0
+	// for the default.
+	BlockSize int
+}
+
+// GetCompressor wraps w in the named compressor. The returned closer
+// writes out what is still buffered, so its error must be checked.
+func GetCompressor(name string, w io.Writer,
+	options CompressionOptions) (io.Writer, func() error, error) {
+	threads := options.Threads
+	if threads <= 0 {
+		threads = runtime.GOMAXPROCS(0)
+	}
+
 	name = strings.ToLower(name)
 	switch name {
 	case "", "stored", "none":
-		return w, func() {}, nil
+		return w, func() error { return nil }, nil
 
 	case "s2":
-		res := s2.NewWriter(w)
-		return res, func() {
-			res.Close()
-		}, nil
+		// The index lets extract read a range without decompressing
+		// everything before it.
+		s2_options := []s2.WriterOption{
+			s2.WriterAddIndex(), s2.WriterConcurrency(threads)}
+
+		if options.BlockSize > 0 {
+			if options.BlockSize < 4096 || options.BlockSize > 4*1024*1024 {
+				return nil, nil, fmt.Errorf(
+					"s2 block size must be between 4kb and 4Mb, not %v",
+					options.BlockSize)
+			}
+			s2_options = append(s2_options, s2.WriterBlockSize(options.BlockSize))
+		}
+
+		res := s2.NewWriter(w, s2_options...)
+		return res, res.Close, nil
 
 	case "snappy":
-		res := snappy.NewWriter(w)
-		return res, func() {
-			res.Close()
-		}, nil
+		// Snappy blocks are always 64kb.
+		res := s2.NewWriter(w, s2.WriterSnappyCompat(),
+			s2.WriterConcurrency(threads))
+		return res, res.Close, nil
 
 	case "gzip", "gz":
+		if threads > 1 {
+			res := NewParallelGzipWriter(w, threads, options.BlockSize)
+			return res, res.Close, nil
+		}
+
 		res, err := gzip.NewWriterLevel(w, gzip.BestSpeed)
 		if err != nil {
 			return nil, nil, err
 		}
-		return res, func() {
-			res.Close()
-		}, nil
+		return res, res.Close, nil
+
+	case "zstd":
+		res, err := zstd.NewWriter(w,
+			zstd.WithEncoderLevel(zstd.SpeedFastest),
+			zstd.WithEncoderConcurrency(threads))
+		if err != nil {
+			return nil, nil, err
+		}
+		return res, res.Close, nil
 
 	default:
-		return nil, nil, fmt.Errorf("Compression method %v not supported. Valid methods are: none, snappy, s2, gzip, gz", name)
+		return nil, nil, fmt.Errorf("Compression method %v not supported. Valid methods are: none, snappy, s2, gzip, gz, zstd", name)
 	}
 }
 
@@ -49,6 +94,10 @@ var (
 	SNAPPY = []byte{0xFF, 0x06, 0x00, 0x00, 0x73, 0x4E, 0x61, 0x50, 0x70, 0x59}
 	S2     = []byte{0xFF, 0x06, 0x00, 0x00, 0x53, 0x32, 0x73, 0x54, 0x77, 0x4F}
 	GZIP   = []byte{0x1F, 0x8B, 0x08}
+	ZSTD   = []byte{0x28, 0xB5, 0x2F, 0xFD}
+
+	// winpmem -c writes XPRESS chunks, which only Windows decompresses.
+	WPMC = []byte("WPMC")
 )
 
 func GetDecompressor(header []byte, r io.Reader) (io.Reader, error) {
@@ -64,6 +113,15 @@ func GetDecompressor(header []byte, r io.Reader) (io.Reader, error) {
 		return gzip.NewReader(r)
 	}
 
+	if bytes.HasPrefix(header, ZSTD) {
+		return zstd.NewReader(r)
+	}
+
+	if bytes.HasPrefix(header, WPMC) {
+		return nil, errors.New(
+			"Image compressed by winpmem -c: decompress it with winpmem -x first")
+	}
+
 	return nil, errors.New("Unknown compression scheme")
 }
 
@@ -93,3 +151,23 @@ func CopyAndLog(
 		}
 	}
 }
+
+// CountingWriter counts the bytes written through it, and the time
+// spent in the writer under it.
+type CountingWriter struct {
+	w       io.Writer
+	Count   int64
+	Elapsed time.Duration
+}
+
+func NewCountingWriter(w io.Writer) *CountingWriter {
+	return &CountingWriter{w: w}
+}
+
+func (self *CountingWriter) Write(buf []byte) (int, error) {
+	start := time.Now()
+	n, err := self.w.Write(buf)
+	self.Elapsed += time.Since(start)
+	self.Count += int64(n)
+	return n, err
+}
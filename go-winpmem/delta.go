@@ -0,0 +1,297 @@
+package winpmem
+
+import (
+	"bytes"
+	"errors"
+	"fmt"
+	"io"
+	"sync"
+)
+
+// DeltaWriter hashes the image written through it into a HashTree, on
+// several cores. Against a baseline tree only the chunks whose hash
+// changed are passed on, so the output is a delta that Reconstruct
+// merges with the baseline image. Without a baseline every chunk is
+// passed on, and the tree can be the baseline of the next image.
+type DeltaWriter struct {
+	w        io.Writer
+	baseline *HashTree
+	tree     *HashTree
+
+	buf []byte
+
+	// The queue holds the chunks in order, and limits how many are
+	// hashed ahead of the writer.
+	queue chan *deltaChunk
+	jobs  chan *deltaChunk
+
+	workers sync.WaitGroup
+	written chan struct{}
+
+	mu  sync.Mutex
+	err error
+
+	pool sync.Pool
+
+	zero_once sync.Once
+	zero_leaf Digest
+
+	// Chunks passed on.
+	Changed int
+}
+
+type deltaChunk struct {
+	data *[]byte
+	leaf Digest
+	done chan struct{}
+}
+
+func NewDeltaWriter(
+	w io.Writer, baseline *HashTree, threads int) (*DeltaWriter, error) {
+	if baseline != nil && baseline.ChunkSize != HASH_CHUNK_SIZE {
+		return nil, fmt.Errorf("Baseline chunk size %v is not %v",
+			baseline.ChunkSize, HASH_CHUNK_SIZE)
+	}
+
+	if threads < 1 {
+		threads = 1
+	}
+
+	self := &DeltaWriter{
+		w:        w,
+		baseline: baseline,
+		tree:     &HashTree{ChunkSize: HASH_CHUNK_SIZE},
+		queue:    make(chan *deltaChunk, threads*2),
+		jobs:     make(chan *deltaChunk),
+		written:  make(chan struct{}),
+	}
+
+	if baseline != nil {
+		self.tree.Baseline = &baseline.Root
+	}
+
+	self.pool.New = func() interface{} {
+		buf := make([]byte, 0, HASH_CHUNK_SIZE)
+		return &buf
+	}
+
+	for i := 0; i < threads; i++ {
+		self.workers.Add(1)
+		go self.hash()
+	}
+
+	go self.write()
+
+	return self, nil
+}
+
+// The gaps between runs are mostly whole chunks of zeros, which all
+// have the same leaf.
+func (self *DeltaWriter) zeroLeaf() Digest {
+	self.zero_once.Do(func() {
+		self.zero_leaf = hashLeaf(make([]byte, HASH_CHUNK_SIZE))
+	})
+	return self.zero_leaf
+}
+
+func (self *DeltaWriter) hash() {
+	defer self.workers.Done()
+
+	zero := make([]byte, HASH_CHUNK_SIZE)
+	for chunk := range self.jobs {
+		data := *chunk.data
+		if len(data) == HASH_CHUNK_SIZE && bytes.Equal(data, zero) {
+			chunk.leaf = self.zeroLeaf()
+		} else {
+			chunk.leaf = hashLeaf(data)
+		}
+		close(chunk.done)
+	}
+}
+
+func (self *DeltaWriter) write() {
+	defer close(self.written)
+
+	for chunk := range self.queue {
+		<-chunk.done
+
+		i := len(self.tree.Leaves)
+		self.tree.Leaves = append(self.tree.Leaves, chunk.leaf)
+		self.tree.ImageSize += uint64(len(*chunk.data))
+
+		changed := self.baseline == nil ||
+			i >= len(self.baseline.Leaves) ||
+			self.baseline.Leaves[i] != chunk.leaf ||
+			self.baseline.ChunkLength(i) != uint64(len(*chunk.data))
+
+		if self.baseline != nil {
+			self.tree.InDelta = append(self.tree.InDelta, changed)
+		}
+
+		// Keep taking chunks off the queue after an error, so Write
+		// does not block.
+		if changed && self.getErr() == nil {
+			self.Changed++
+
+			_, err := self.w.Write(*chunk.data)
+			if err != nil {
+				self.setErr(err)
+			}
+		}
+
+		*chunk.data = (*chunk.data)[:0]
+		self.pool.Put(chunk.data)
+	}
+}
+
+func (self *DeltaWriter) getErr() error {
+	self.mu.Lock()
+	defer self.mu.Unlock()
+	return self.err
+}
+
+func (self *DeltaWriter) setErr(err error) {
+	self.mu.Lock()
+	defer self.mu.Unlock()
+	if self.err == nil {
+		self.err = err
+	}
+}
+
+func (self *DeltaWriter) flush() {
+	if len(self.buf) == 0 {
+		return
+	}
+
+	data := self.buf
+	self.buf = nil
+
+	chunk := &deltaChunk{data: &data, done: make(chan struct{})}
+	self.queue <- chunk
+	self.jobs <- chunk
+}
+
+func (self *DeltaWriter) Write(buf []byte) (int, error) {
+	if self.queue == nil {
+		return 0, errors.New("DeltaWriter: Write after Close")
+	}
+
+	written := 0
+	for len(buf) > 0 {
+		err := self.getErr()
+		if err != nil {
+			return written, err
+		}
+
+		if self.buf == nil {
+			self.buf = *self.pool.Get().(*[]byte)
+		}
+
+		n := HASH_CHUNK_SIZE - len(self.buf)
+		if n > len(buf) {
+			n = len(buf)
+		}
+
+		self.buf = append(self.buf, buf[:n]...)
+		buf = buf[n:]
+		written += n
+
+		if len(self.buf) == HASH_CHUNK_SIZE {
+			self.flush()
+		}
+	}
+
+	return written, nil
+}
+
+// Close hashes what is left and waits for all the chunks to be
+// written. It does not close the underlying writer.
+func (self *DeltaWriter) Close() error {
+	if self.queue == nil {
+		return self.getErr()
+	}
+
+	self.flush()
+
+	close(self.queue)
+	close(self.jobs)
+	self.workers.Wait()
+	<-self.written
+
+	self.queue = nil
+	self.tree.ComputeRoot()
+
+	return self.getErr()
+}
+
+// Tree is the hash tree of the image, once closed.
+func (self *DeltaWriter) Tree() *HashTree {
+	return self.tree
+}
+
+// Reconstruct merges images back into a full raw image written to w.
+// The first image is a full image, each of the others a delta against
+// the one before, read in step with its tree. Every chunk is checked
+// against the tree of the last image.
+func Reconstruct(w io.Writer, images []io.Reader, trees []*HashTree) error {
+	if len(images) == 0 || len(images) != len(trees) {
+		return errors.New("Reconstruct: Need an image and a tree for each step")
+	}
+
+	if trees[0].Baseline != nil {
+		return errors.New("Reconstruct: The first image must be a full image")
+	}
+
+	for i, tree := range trees {
+		if tree.ChunkSize != trees[0].ChunkSize {
+			return fmt.Errorf("Reconstruct: Chunk size of image %v is %v, not %v",
+				i, tree.ChunkSize, trees[0].ChunkSize)
+		}
+
+		if i > 0 && (tree.Baseline == nil || *tree.Baseline != trees[i-1].Root) {
+			return fmt.Errorf("Reconstruct: Image %v is not a delta against image %v",
+				i, i-1)
+		}
+	}
+
+	last := trees[len(trees)-1]
+	buf := make([]byte, last.ChunkSize)
+
+	for i := range last.Leaves {
+		length := uint64(0)
+
+		// Each step has chunk i in its image if it is a full image,
+		// or if the chunk changed in it.
+		for step, tree := range trees {
+			step_length := tree.ChunkLength(i)
+			if step_length == 0 || step > 0 && !tree.InDelta[i] {
+				continue
+			}
+
+			_, err := io.ReadFull(images[step], buf[:step_length])
+			if err != nil {
+				return fmt.Errorf("Reconstruct: Reading chunk at %#x of image %v: %w",
+					uint64(i)*tree.ChunkSize, step, err)
+			}
+			length = step_length
+		}
+
+		// The image grew since the step that last had the chunk.
+		want := last.ChunkLength(i)
+		for j := length; j < want; j++ {
+			buf[j] = 0
+		}
+
+		if hashLeaf(buf[:want]) != last.Leaves[i] {
+			return fmt.Errorf("Reconstruct: Chunk at %#x does not match its hash",
+				uint64(i)*last.ChunkSize)
+		}
+
+		_, err := w.Write(buf[:want])
+		if err != nil {
+			return err
+		}
+	}
+
+	return nil
+}
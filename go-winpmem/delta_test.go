@@ -0,0 +1,137 @@
+package winpmem
+
+import (
+	"bytes"
+	"io"
+	"math/rand"
+	"reflect"
+	"testing"
+)
+
+// writeDelta writes image through a DeltaWriter in pieces that do not
+// line up with the chunks, and returns what it passed on.
+func writeDelta(t *testing.T, image []byte,
+	baseline *HashTree) ([]byte, *HashTree, int) {
+	out := &bytes.Buffer{}
+	writer, err := NewDeltaWriter(out, baseline, 4)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	for pos := 0; pos < len(image); pos += 300 * 1024 {
+		end := pos + 300*1024
+		if end > len(image) {
+			end = len(image)
+		}
+
+		_, err := writer.Write(image[pos:end])
+		if err != nil {
+			t.Fatal(err)
+		}
+	}
+
+	err = writer.Close()
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	return out.Bytes(), writer.Tree(), writer.Changed
+}
+
+// The tree survives being written and read back.
+func checkTreeFile(t *testing.T, tree *HashTree) {
+	out := &bytes.Buffer{}
+	err := tree.Write(out)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	read, err := ReadHashTree(out)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	if !reflect.DeepEqual(read, tree) {
+		t.Fatalf("Hash tree changed when read back")
+	}
+}
+
+// Two deltas, one of an image that grew, merge back to the last image.
+func TestDeltaReconstruct(t *testing.T) {
+	random := rand.New(rand.NewSource(1))
+
+	// A chunk of zeros, and a last chunk that is not full.
+	image0 := make([]byte, 3*MB+MB/2)
+	random.Read(image0[:MB])
+	random.Read(image0[2*MB:])
+
+	full0, tree0, changed := writeDelta(t, image0, nil)
+	if !bytes.Equal(full0, image0) || changed != 4 {
+		t.Fatalf("Full image was not passed on")
+	}
+	checkTreeFile(t, tree0)
+
+	// One chunk changes, and the last one grows into a full chunk
+	// with another after it.
+	image1 := append(append([]byte(nil), image0...), make([]byte, MB)...)
+	random.Read(image1[MB+100 : MB+200])
+	random.Read(image1[3*MB+MB/2:])
+
+	delta1, tree1, changed := writeDelta(t, image1, tree0)
+	if changed != 3 || len(delta1) != 2*MB+MB/2 {
+		t.Fatalf("Delta has %v chunks, not 3", changed)
+	}
+
+	if !reflect.DeepEqual(tree1.InDelta, []bool{false, true, false, true, true}) {
+		t.Fatalf("Delta chunks are %v", tree1.InDelta)
+	}
+
+	if *tree1.Baseline != tree0.Root {
+		t.Fatalf("Delta is not against the baseline")
+	}
+	checkTreeFile(t, tree1)
+
+	// The tree of a delta is the tree of the whole image.
+	_, full_tree1, _ := writeDelta(t, image1, nil)
+	if full_tree1.Root != tree1.Root {
+		t.Fatalf("Delta root %v is not the image root %v",
+			tree1.Root, full_tree1.Root)
+	}
+
+	image2 := append([]byte(nil), image1...)
+	image2[0] ^= 1
+
+	delta2, tree2, changed := writeDelta(t, image2, tree1)
+	if changed != 1 || !bytes.Equal(delta2, image2[:MB]) {
+		t.Fatalf("Delta has %v chunks, not 1", changed)
+	}
+
+	out := &bytes.Buffer{}
+	err := Reconstruct(out, []io.Reader{
+		bytes.NewReader(full0), bytes.NewReader(delta1), bytes.NewReader(delta2),
+	}, []*HashTree{tree0, tree1, tree2})
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	if !bytes.Equal(out.Bytes(), image2) {
+		t.Fatalf("Reconstructed image is wrong")
+	}
+
+	// A changed chunk in a delta is caught.
+	delta2[MB/2] ^= 1
+	err = Reconstruct(io.Discard, []io.Reader{
+		bytes.NewReader(full0), bytes.NewReader(delta1), bytes.NewReader(delta2),
+	}, []*HashTree{tree0, tree1, tree2})
+	if err == nil {
+		t.Fatalf("Corrupt delta was reconstructed")
+	}
+
+	// So are deltas out of order.
+	err = Reconstruct(io.Discard, []io.Reader{
+		bytes.NewReader(full0), bytes.NewReader(delta2),
+	}, []*HashTree{tree0, tree2})
+	if err == nil {
+		t.Fatalf("Delta against another image was reconstructed")
+	}
+}
@@ -0,0 +1,118 @@
+package winpmem
+
+import (
+	"errors"
+	"fmt"
+	"os"
+)
+
+// Device is where the imager reads physical memory from. Reads are
+// positional, so several goroutines can read at the same time.
+type Device interface {
+	// ReadAt fails if any page in the range can not be read.
+	ReadAt(buf []byte, offset int64) (int, error)
+
+	// ReadContinue reads buf from offset in a single call, zero
+	// filling unreadable pages instead of stopping at them. Returns
+	// the offsets of the failed pages with the reason for each.
+	ReadContinue(buf []byte, offset uint64) (map[uint64]int, error)
+}
+
+// FileDevice reads physical memory from a raw image instead of the
+// driver, to test and benchmark the imager on any platform. Pages
+// marked bad fail the way they do on a host.
+type FileDevice struct {
+	fd *os.File
+
+	// Set up before reading starts.
+	bad_pages        map[uint64]int
+	no_read_continue bool
+}
+
+func NewFileDevice(fd *os.File) *FileDevice {
+	return &FileDevice{
+		fd:        fd,
+		bad_pages: make(map[uint64]int),
+	}
+}
+
+// SetBadPage makes the page at offset unreadable for reason (one of
+// PMEM_PAGE_*).
+func (self *FileDevice) SetBadPage(offset uint64, reason int) {
+	self.bad_pages[offset&^(PAGE_SIZE-1)] = reason
+}
+
+// SetReadContinue turns ReadContinue off, like on an older driver.
+func (self *FileDevice) SetReadContinue(supported bool) {
+	self.no_read_continue = !supported
+}
+
+func (self *FileDevice) firstBadPage(offset, length uint64) (uint64, bool) {
+	for page := offset &^ (PAGE_SIZE - 1); page < offset+length; page += PAGE_SIZE {
+		if _, pres := self.bad_pages[page]; pres {
+			return page, true
+		}
+	}
+	return 0, false
+}
+
+// ReadAt reads up to the first bad page, like the driver.
+func (self *FileDevice) ReadAt(buf []byte, offset int64) (int, error) {
+	to_read := uint64(len(buf))
+	page, bad := self.firstBadPage(uint64(offset), to_read)
+	if bad {
+		to_read = 0
+		if page > uint64(offset) {
+			to_read = page - uint64(offset)
+		}
+	}
+
+	n, err := self.fd.ReadAt(buf[:to_read], offset)
+	if err != nil {
+		return n, err
+	}
+
+	if bad {
+		return n, fmt.Errorf("FileDevice: page %#x is unreadable", page)
+	}
+	return n, nil
+}
+
+func (self *FileDevice) ReadContinue(
+	buf []byte, offset uint64) (map[uint64]int, error) {
+	if self.no_read_continue {
+		return nil, errors.New("FileDevice: can not read past bad pages")
+	}
+
+	_, err := self.fd.ReadAt(buf, int64(offset))
+	if err != nil {
+		return nil, err
+	}
+
+	failed := make(map[uint64]int)
+	if len(self.bad_pages) == 0 {
+		return failed, nil
+	}
+
+	end := offset + uint64(len(buf))
+	for page := offset &^ (PAGE_SIZE - 1); page < end; page += PAGE_SIZE {
+		reason, pres := self.bad_pages[page]
+		if !pres {
+			continue
+		}
+
+		start, stop := page, page+PAGE_SIZE
+		if start < offset {
+			start = offset
+		}
+		if stop > end {
+			stop = end
+		}
+		for i := start; i < stop; i++ {
+			buf[i-offset] = 0
+		}
+		failed[page] = reason
+	}
+
+	return failed, nil
+}
@@ -0,0 +1,159 @@
+package winpmem
+
+import (
+	"encoding/binary"
+	"fmt"
+	"runtime"
+	"syscall"
+	"unsafe"
+
+	"golang.org/x/sys/windows"
+)
+
+const (
+	// Handles kept open between reads.
+	MAX_IDLE_HANDLES = 16
+)
+
+// PmemDevice reads physical memory through the driver. The I/O manager
+// serializes the reads on a synchronous handle, so every concurrent
+// read gets a handle of its own. Idle handles are kept for the next
+// reads.
+type PmemDevice struct {
+	device_name string
+	idle        chan windows.Handle
+}
+
+func NewPmemDevice(device_name string) *PmemDevice {
+	return &PmemDevice{
+		device_name: device_name,
+		idle:        make(chan windows.Handle, MAX_IDLE_HANDLES),
+	}
+}
+
+func (self *PmemDevice) get() (windows.Handle, error) {
+	select {
+	case fd := <-self.idle:
+		return fd, nil
+	default:
+		return openDevice(self.device_name)
+	}
+}
+
+func (self *PmemDevice) put(fd windows.Handle) {
+	select {
+	case self.idle <- fd:
+	default:
+		windows.CloseHandle(fd)
+	}
+}
+
+func (self *PmemDevice) ReadAt(buf []byte, offset int64) (int, error) {
+	fd, err := self.get()
+	if err != nil {
+		return 0, err
+	}
+	defer self.put(fd)
+
+	// The offset goes in the OVERLAPPED instead of a separate
+	// seek. The handle is synchronous so ReadFile still blocks
+	// until done.
+	overlapped := windows.Overlapped{
+		Offset:     uint32(offset),
+		OffsetHigh: uint32(offset >> 32),
+	}
+
+	actual_read := uint32(0)
+	err = windows.ReadFile(fd, buf, &actual_read, &overlapped)
+	if err != nil {
+		return int(actual_read), fmt.Errorf("ReadAt: reading %#x: %w", offset, err)
+	}
+	return int(actual_read), nil
+}
+
+func (self *PmemDevice) ReadContinue(
+	buf []byte, offset uint64) (map[uint64]int, error) {
+	fd, err := self.get()
+	if err != nil {
+		return nil, err
+	}
+	defer self.put(fd)
+
+	return readContinue(fd, IOCTL_READ_PHYSICAL_CONTINUE, 0, buf, offset)
+}
+
+func (self *PmemDevice) Close() {
+	for {
+		select {
+		case fd := <-self.idle:
+			windows.CloseHandle(fd)
+		default:
+			return
+		}
+	}
+}
+
+func openDevice(device_name string) (windows.Handle, error) {
+	var nullHandle windows.Handle
+
+	device_name_utf16, err := syscall.UTF16FromString(device_name)
+	if err != nil {
+		return nullHandle, err
+	}
+	return windows.CreateFile(&device_name_utf16[0], windows.GENERIC_READ|windows.GENERIC_WRITE,
+		windows.FILE_SHARE_READ|windows.FILE_SHARE_WRITE,
+		nil,
+		windows.OPEN_EXISTING,
+		windows.FILE_ATTRIBUTE_NORMAL,
+		nullHandle,
+	)
+}
+
+// readContinue reads buf from offset in a single call. The driver
+// zero fills unreadable pages instead of stopping at them. Returns the
+// offsets of the failed pages with the reason for each. With
+// IOCTL_PROBE_READ the driver reads with mode instead of the one that
+// was set.
+func readContinue(fd windows.Handle, ioctl uint32, mode PmemMode,
+	buf []byte, offset uint64) (map[uint64]int, error) {
+	pages := (int(offset%PAGE_SIZE) + len(buf) + PAGE_SIZE - 1) / PAGE_SIZE
+	out := make([]byte, READ_CONTINUE_RESULT_HEADER+(pages+3)/4)
+
+	in := make([]byte, 0, READ_CONTINUE_SIZE)
+	in = binary.LittleEndian.AppendUint64(in, offset)
+	in = binary.LittleEndian.AppendUint64(in,
+		uint64(uintptr(unsafe.Pointer(&buf[0]))))
+	in = binary.LittleEndian.AppendUint32(in, uint32(len(buf)))
+	in = binary.LittleEndian.AppendUint32(in, uint32(mode))
+
+	var length uint32
+	err := windows.DeviceIoControl(fd,
+		ioctl, &in[0], uint32(len(in)),
+		&out[0], uint32(len(out)), &length, nil)
+	runtime.KeepAlive(buf)
+	if err != nil {
+		return nil, err
+	}
+
+	bytes_read := binary.LittleEndian.Uint32(out[0:])
+	if int(bytes_read) != len(buf) {
+		return nil, fmt.Errorf("readContinue: short read of %#x at %#x",
+			bytes_read, offset)
+	}
+
+	failed := make(map[uint64]int)
+	if binary.LittleEndian.Uint32(out[4:]) == 0 {
+		return failed, nil
+	}
+
+	bitmap := out[READ_CONTINUE_RESULT_HEADER:]
+	first_page := offset - offset%PAGE_SIZE
+	for i := 0; i < pages; i++ {
+		reason := int(bitmap[i/4]>>((i%4)*2)) & 3
+		if reason != PMEM_PAGE_OK {
+			failed[first_page+uint64(i)*PAGE_SIZE] = reason
+		}
+	}
+
+	return failed, nil
+}
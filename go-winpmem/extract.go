@@ -0,0 +1,217 @@
+package winpmem
+
+import (
+	"bytes"
+	"context"
+	"errors"
+	"fmt"
+	"io"
+	"runtime"
+
+	"github.com/klauspost/compress/s2"
+)
+
+// SparseWriter seeks over all zero pages instead of writing them, so
+// they take no space in a sparse file.
+type SparseWriter struct {
+	w      io.WriteSeeker
+	offset int64
+
+	// The file is shorter than offset, the end was skipped.
+	skipped bool
+}
+
+func NewSparseWriter(w io.WriteSeeker) *SparseWriter {
+	return &SparseWriter{w: w}
+}
+
+var zero_page = make([]byte, PAGE_SIZE)
+
+func (self *SparseWriter) Write(buf []byte) (int, error) {
+	for i := 0; i < len(buf); {
+		// Gather the non zero pages into one write.
+		end := i
+		for end < len(buf) {
+			page_end := end + PAGE_SIZE
+			if page_end > len(buf) {
+				page_end = len(buf)
+			}
+			if bytes.Equal(buf[end:page_end], zero_page[:page_end-end]) {
+				break
+			}
+			end = page_end
+		}
+
+		if end > i {
+			n, err := self.w.Write(buf[i:end])
+			self.offset += int64(n)
+			if err != nil {
+				return i + n, err
+			}
+			self.skipped = false
+			i = end
+			continue
+		}
+
+		// And skip the zero pages.
+		for end < len(buf) {
+			page_end := end + PAGE_SIZE
+			if page_end > len(buf) {
+				page_end = len(buf)
+			}
+			if !bytes.Equal(buf[end:page_end], zero_page[:page_end-end]) {
+				break
+			}
+			end = page_end
+		}
+
+		_, err := self.w.Seek(int64(end-i), io.SeekCurrent)
+		if err != nil {
+			return i, err
+		}
+		self.offset += int64(end - i)
+		self.skipped = true
+		i = end
+	}
+
+	return len(buf), nil
+}
+
+// Close makes the file as long as what was written, in case it ended
+// with zeros. It does not close the underlying writer.
+func (self *SparseWriter) Close() error {
+	if !self.skipped {
+		return nil
+	}
+
+	truncater, ok := self.w.(interface{ Truncate(size int64) error })
+	if ok {
+		return truncater.Truncate(self.offset)
+	}
+
+	// Write the last byte instead.
+	_, err := self.w.Seek(self.offset-1, io.SeekStart)
+	if err != nil {
+		return err
+	}
+	_, err = self.w.Write(zero_page[:1])
+	return err
+}
+
+// progressWriter logs the progress of decompression and stops it when
+// the context is done.
+type progressWriter struct {
+	ctx    context.Context
+	w      io.Writer
+	logger Logger
+}
+
+func (self *progressWriter) Write(buf []byte) (int, error) {
+	select {
+	case <-self.ctx.Done():
+		return 0, errors.New("Cancelled!")
+	default:
+	}
+
+	n, err := self.w.Write(buf)
+	self.logger.Progress(n / PAGE_SIZE)
+	return n, err
+}
+
+// Decompress writes the decompressed image in r to w. Snappy and s2
+// streams are made of independent blocks, so they are decoded on all
+// cores. Gzip is decoded as a stream.
+func Decompress(ctx context.Context, r io.ReadSeeker, w io.Writer,
+	logger Logger) error {
+	header, err := readHeader(r)
+	if err != nil {
+		return err
+	}
+
+	if bytes.HasPrefix(header, SNAPPY) || bytes.HasPrefix(header, S2) {
+		// The s2 reader also reads snappy streams.
+		_, err := s2.NewReader(r).DecodeConcurrent(
+			&progressWriter{ctx: ctx, w: w, logger: logger},
+			runtime.GOMAXPROCS(0))
+		return err
+	}
+
+	decompressed, err := GetDecompressor(header, r)
+	if err != nil {
+		return err
+	}
+
+	return CopyAndLog(ctx, decompressed, w, logger)
+}
+
+// DecompressRange writes length bytes of the image in r, from offset,
+// to w. An s2 image with a seek index is read from the block holding
+// offset, others are decompressed up to offset first.
+func DecompressRange(ctx context.Context, r io.ReadSeeker, w io.Writer,
+	offset, length int64, logger Logger) error {
+	header, err := readHeader(r)
+	if err != nil {
+		return err
+	}
+
+	if bytes.HasPrefix(header, S2) {
+		seeker, err := s2.NewReader(r).ReadSeeker(true, nil)
+		if err == nil {
+			_, err = seeker.Seek(offset, io.SeekStart)
+			if err != nil {
+				return err
+			}
+			return CopyAndLog(ctx, io.LimitReader(seeker, length), w, logger)
+		}
+
+		logger.Info("No seek index in the image (%v), decompressing up to %#x",
+			err, offset)
+
+		_, err = r.Seek(0, io.SeekStart)
+		if err != nil {
+			return err
+		}
+	}
+
+	decompressed, err := GetDecompressor(header, r)
+	if err != nil {
+		return err
+	}
+
+	n, err := io.CopyN(io.Discard, decompressed, offset)
+	if err != nil {
+		return fmt.Errorf("Seeking to %#x: only %#x bytes in image: %w",
+			offset, n, err)
+	}
+
+	return CopyAndLog(ctx, io.LimitReader(decompressed, length), w, logger)
+}
+
+// OpenImage reads the image in r, decompressed if it is compressed.
+func OpenImage(r io.ReadSeeker) (io.Reader, error) {
+	header, err := readHeader(r)
+	if err != nil {
+		return nil, err
+	}
+
+	if bytes.HasPrefix(header, SNAPPY) || bytes.HasPrefix(header, S2) ||
+		bytes.HasPrefix(header, GZIP) || bytes.HasPrefix(header, ZSTD) ||
+		bytes.HasPrefix(header, WPMC) {
+		return GetDecompressor(header, r)
+	}
+
+	// A raw image.
+	return r, nil
+}
+
+// readHeader returns the start of the image and rewinds r.
+func readHeader(r io.ReadSeeker) ([]byte, error) {
+	header := make([]byte, 10)
+	n, err := io.ReadFull(r, header)
+	if err != nil && !errors.Is(err, io.ErrUnexpectedEOF) {
+		return nil, err
+	}
+
+	_, err = r.Seek(0, io.SeekStart)
+	return header[:n], err
+}
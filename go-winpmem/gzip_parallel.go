@@ -0,0 +1,196 @@
+package winpmem
+
+import (
+	"bytes"
+	"errors"
+	"io"
+	"sync"
+
+	"github.com/klauspost/compress/gzip"
+)
+
+const DEFAULT_GZIP_BLOCK_SIZE = 1024 * 1024
+
+// ParallelGzipWriter compresses blocks of the input on several cores,
+// each into a gzip member of its own. Members are written in order,
+// and gzip readers read the concatenated members as a single stream.
+type ParallelGzipWriter struct {
+	w          io.Writer
+	block_size int
+
+	buf []byte
+
+	// The queue holds the blocks in order, and limits how many are
+	// compressed ahead of the writer.
+	queue chan *gzipBlock
+	jobs  chan *gzipBlock
+
+	workers sync.WaitGroup
+	written chan struct{}
+
+	mu  sync.Mutex
+	err error
+
+	pool sync.Pool
+}
+
+type gzipBlock struct {
+	in   *[]byte
+	out  bytes.Buffer
+	err  error
+	done chan struct{}
+}
+
+func NewParallelGzipWriter(
+	w io.Writer, threads int, block_size int) *ParallelGzipWriter {
+	if threads < 1 {
+		threads = 1
+	}
+
+	if block_size <= 0 {
+		block_size = DEFAULT_GZIP_BLOCK_SIZE
+	}
+
+	self := &ParallelGzipWriter{
+		w:          w,
+		block_size: block_size,
+		queue:      make(chan *gzipBlock, threads*2),
+		jobs:       make(chan *gzipBlock),
+		written:    make(chan struct{}),
+	}
+
+	self.pool.New = func() interface{} {
+		buf := make([]byte, 0, self.block_size)
+		return &buf
+	}
+
+	for i := 0; i < threads; i++ {
+		self.workers.Add(1)
+		go self.compress()
+	}
+
+	go self.write()
+
+	return self
+}
+
+func (self *ParallelGzipWriter) compress() {
+	defer self.workers.Done()
+
+	var compressor *gzip.Writer
+	for block := range self.jobs {
+		if compressor == nil {
+			compressor, block.err = gzip.NewWriterLevel(
+				&block.out, gzip.BestSpeed)
+		} else {
+			compressor.Reset(&block.out)
+		}
+
+		if block.err == nil {
+			_, block.err = compressor.Write(*block.in)
+		}
+		if block.err == nil {
+			block.err = compressor.Close()
+		}
+		close(block.done)
+	}
+}
+
+func (self *ParallelGzipWriter) write() {
+	defer close(self.written)
+
+	for block := range self.queue {
+		<-block.done
+
+		// Keep taking blocks off the queue after an error, so Write
+		// does not block.
+		err := block.err
+		if err == nil && self.getErr() == nil {
+			_, err = self.w.Write(block.out.Bytes())
+		}
+		if err != nil {
+			self.setErr(err)
+		}
+
+		*block.in = (*block.in)[:0]
+		self.pool.Put(block.in)
+	}
+}
+
+func (self *ParallelGzipWriter) getErr() error {
+	self.mu.Lock()
+	defer self.mu.Unlock()
+	return self.err
+}
+
+func (self *ParallelGzipWriter) setErr(err error) {
+	self.mu.Lock()
+	defer self.mu.Unlock()
+	if self.err == nil {
+		self.err = err
+	}
+}
+
+func (self *ParallelGzipWriter) flush() {
+	if len(self.buf) == 0 {
+		return
+	}
+
+	in := self.buf
+	self.buf = nil
+
+	block := &gzipBlock{in: &in, done: make(chan struct{})}
+	self.queue <- block
+	self.jobs <- block
+}
+
+func (self *ParallelGzipWriter) Write(buf []byte) (int, error) {
+	if self.queue == nil {
+		return 0, errors.New("ParallelGzipWriter: Write after Close")
+	}
+
+	written := 0
+	for len(buf) > 0 {
+		err := self.getErr()
+		if err != nil {
+			return written, err
+		}
+
+		if self.buf == nil {
+			self.buf = *self.pool.Get().(*[]byte)
+		}
+
+		n := self.block_size - len(self.buf)
+		if n > len(buf) {
+			n = len(buf)
+		}
+
+		self.buf = append(self.buf, buf[:n]...)
+		buf = buf[n:]
+		written += n
+
+		if len(self.buf) >= self.block_size {
+			self.flush()
+		}
+	}
+
+	return written, nil
+}
+
+// Close compresses what is left and waits for all the blocks to be
+// written. It does not close the underlying writer.
+func (self *ParallelGzipWriter) Close() error {
+	if self.queue == nil {
+		return self.getErr()
+	}
+
+	self.flush()
+
+	close(self.queue)
+	close(self.jobs)
+	self.workers.Wait()
+	<-self.written
+
+	self.queue = nil
+	return self.getErr()
+}
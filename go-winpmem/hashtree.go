@@ -0,0 +1,258 @@
+package winpmem
+
+import (
+	"bufio"
+	"crypto/sha256"
+	"encoding/hex"
+	"fmt"
+	"io"
+	"os"
+	"strconv"
+	"strings"
+)
+
+// The hash tree of an image, in the text format the C++ imager writes
+// with -H: leaf = H(0x00 || chunk), node = H(0x01 || left || right),
+// and an odd node is carried up to the next level unchanged.
+//
+// The tree of a delta image names the root of the tree it was taken
+// against, and marks the chunks that are in the delta. The others are
+// the same as in the baseline.
+
+const HASH_CHUNK_SIZE = 1024 * 1024
+
+type Digest [sha256.Size]byte
+
+func (self Digest) String() string {
+	return hex.EncodeToString(self[:])
+}
+
+type HashTree struct {
+	ChunkSize uint64
+	ImageSize uint64
+	Root      Digest
+	Leaves    []Digest
+
+	// Only for delta images.
+	Baseline *Digest
+	InDelta  []bool
+}
+
+func hashLeaf(buf []byte) Digest {
+	h := sha256.New()
+	h.Write([]byte{0})
+	h.Write(buf)
+
+	var result Digest
+	h.Sum(result[:0])
+	return result
+}
+
+func hashNode(left, right Digest) Digest {
+	h := sha256.New()
+	h.Write([]byte{1})
+	h.Write(left[:])
+	h.Write(right[:])
+
+	var result Digest
+	h.Sum(result[:0])
+	return result
+}
+
+// ComputeRoot sets the root from the leaves.
+func (self *HashTree) ComputeRoot() {
+	// An empty image is a single empty leaf.
+	level := append([]Digest(nil), self.Leaves...)
+	if len(level) == 0 {
+		level = append(level, hashLeaf(nil))
+	}
+
+	for len(level) > 1 {
+		next := make([]Digest, (len(level)+1)/2)
+		for i := 0; i+1 < len(level); i += 2 {
+			next[i/2] = hashNode(level[i], level[i+1])
+		}
+
+		if len(level)%2 == 1 {
+			next[len(next)-1] = level[len(level)-1]
+		}
+		level = next
+	}
+
+	self.Root = level[0]
+}
+
+// ChunkLength is the length of chunk i, the last one may be short.
+func (self *HashTree) ChunkLength(i int) uint64 {
+	offset := uint64(i) * self.ChunkSize
+	if offset >= self.ImageSize {
+		return 0
+	}
+
+	if self.ImageSize-offset < self.ChunkSize {
+		return self.ImageSize - offset
+	}
+	return self.ChunkSize
+}
+
+func parseDigest(text string) (Digest, error) {
+	var result Digest
+
+	decoded, err := hex.DecodeString(text)
+	if err != nil {
+		return result, err
+	}
+
+	if len(decoded) != len(result) {
+		return result, fmt.Errorf("digest %q is not SHA256", text)
+	}
+
+	copy(result[:], decoded)
+	return result, nil
+}
+
+func ReadHashTree(r io.Reader) (*HashTree, error) {
+	result := &HashTree{}
+	have_root := false
+
+	scanner := bufio.NewScanner(r)
+	for scanner.Scan() {
+		line := strings.TrimSpace(scanner.Text())
+		if line == "" || strings.HasPrefix(line, "#") {
+			continue
+		}
+
+		fields := strings.Fields(line)
+		if len(fields) < 2 {
+			return nil, fmt.Errorf("ReadHashTree: %q: Invalid line", line)
+		}
+
+		var err error
+		switch fields[0] {
+		case "algorithm":
+			if fields[1] != "SHA256" {
+				err = fmt.Errorf("algorithm %v not supported", fields[1])
+			}
+
+		case "chunk_size":
+			result.ChunkSize, err = strconv.ParseUint(fields[1], 0, 64)
+
+		case "image_size":
+			result.ImageSize, err = strconv.ParseUint(fields[1], 0, 64)
+
+		case "root":
+			result.Root, err = parseDigest(fields[1])
+			have_root = true
+
+		case "baseline":
+			var baseline Digest
+			baseline, err = parseDigest(fields[1])
+			result.Baseline = &baseline
+
+		case "leaves":
+			// Just a count, the leaves follow.
+
+		default:
+			if !strings.HasPrefix(fields[0], "0x") {
+				err = fmt.Errorf("unknown keyword %v", fields[0])
+				break
+			}
+
+			var offset uint64
+			offset, err = strconv.ParseUint(fields[0], 0, 64)
+			if err != nil {
+				break
+			}
+
+			if result.ChunkSize == 0 ||
+				offset != uint64(len(result.Leaves))*result.ChunkSize {
+				err = fmt.Errorf("leaf at %#x out of order", offset)
+				break
+			}
+
+			var leaf Digest
+			leaf, err = parseDigest(fields[1])
+			result.Leaves = append(result.Leaves, leaf)
+
+			if result.Baseline != nil {
+				result.InDelta = append(result.InDelta,
+					len(fields) > 2 && fields[2] == "delta")
+			}
+		}
+
+		if err != nil {
+			return nil, fmt.Errorf("ReadHashTree: %q: %w", line, err)
+		}
+	}
+
+	if err := scanner.Err(); err != nil {
+		return nil, err
+	}
+
+	if !have_root || result.ChunkSize == 0 {
+		return nil, fmt.Errorf("ReadHashTree: Not a hash tree")
+	}
+
+	if uint64(len(result.Leaves)) !=
+		(result.ImageSize+result.ChunkSize-1)/result.ChunkSize {
+		return nil, fmt.Errorf("ReadHashTree: %v leaves for an image of %v bytes",
+			len(result.Leaves), result.ImageSize)
+	}
+
+	return result, nil
+}
+
+func (self *HashTree) Write(w io.Writer) error {
+	out := bufio.NewWriter(w)
+
+	fmt.Fprintf(out, "# WinPmem image hash tree.\n"+
+		"# leaf = H(0x00 || chunk), node = H(0x01 || left || right).\n"+
+		"# An odd node is carried up to the next level unchanged.\n")
+	if self.Baseline != nil {
+		fmt.Fprintf(out, "# Chunks marked delta are in this image, the others\n"+
+			"# are the same as in the baseline.\n")
+	}
+
+	fmt.Fprintf(out, "algorithm SHA256\n")
+	fmt.Fprintf(out, "chunk_size %d\n", self.ChunkSize)
+	fmt.Fprintf(out, "image_size %d\n", self.ImageSize)
+	fmt.Fprintf(out, "root %v\n", self.Root)
+	if self.Baseline != nil {
+		fmt.Fprintf(out, "baseline %v\n", *self.Baseline)
+	}
+	fmt.Fprintf(out, "leaves %d\n", len(self.Leaves))
+
+	for i, leaf := range self.Leaves {
+		if self.Baseline != nil && self.InDelta[i] {
+			fmt.Fprintf(out, "%#x %v delta\n", uint64(i)*self.ChunkSize, leaf)
+		} else {
+			fmt.Fprintf(out, "%#x %v\n", uint64(i)*self.ChunkSize, leaf)
+		}
+	}
+
+	return out.Flush()
+}
+
+func LoadHashTreeFile(filename string) (*HashTree, error) {
+	fd, err := os.Open(filename)
+	if err != nil {
+		return nil, err
+	}
+	defer fd.Close()
+
+	return ReadHashTree(fd)
+}
+
+func SaveHashTreeFile(filename string, tree *HashTree) error {
+	fd, err := os.OpenFile(filename, os.O_WRONLY|os.O_CREATE|os.O_TRUNC, 0600)
+	if err != nil {
+		return err
+	}
+
+	err = tree.Write(fd)
+	if err != nil {
+		fd.Close()
+		return err
+	}
+	return fd.Close()
+}
@@ -1,3 +1,5 @@
+//go:build windows
+
 package winpmem
 
 import (
@@ -7,9 +9,8 @@ import (
 	"errors"
 	"fmt"
 	"io"
-	"os"
+	"runtime"
 	"sync"
-	"syscall"
 
 	"golang.org/x/sys/windows"
 )
@@ -17,123 +18,125 @@ import (
 type Imager struct {
 	mu sync.Mutex
 
-	fd windows.Handle
+	// For the IOCTLs. Memory is read through device, with a handle
+	// for each reader.
+	fd     windows.Handle
+	device *PmemDevice
 
 	stats         *WinpmemInfo
-	last_run      *Run
 	sparse_output bool
 
-	logger Logger
-}
-
-func (self *Imager) getRun(offset int64) *Run {
-	if self.last_run != nil &&
-		self.last_run.Address <= offset &&
-		self.last_run.Address+self.last_run.Size > offset {
-		return self.last_run
-	}
+	// Random access for ReadAt.
+	reader *MemoryReader
 
-	for _, run := range self.stats.Run {
-		if offset < int64(run.BaseAddress) {
-			res := &Run{
-				Address: offset,
-				Size:    int64(run.BaseAddress) - offset,
-				Sparse:  true,
-			}
-			self.last_run = res
-			return res
-		}
+	// The bounds of the bulk reads in WriteTo, by how many readers.
+	read_size *ReadSizeController
+	readers   int
 
-		if offset >= int64(run.BaseAddress) &&
-			offset < int64(run.BaseAddress+run.NumberOfBytes) {
-			res := &Run{
-				Address: int64(run.BaseAddress),
-				Size:    int64(run.NumberOfBytes),
-				Sparse:  false,
-			}
-			self.last_run = res
-			return res
-		}
-	}
-
-	return &Run{Sparse: true}
+	logger Logger
 }
 
-func (self *Imager) readAt(buf []byte, offset int64) (int, error) {
-	run := self.getRun(offset)
+// ReadAt reads physical memory, zero padded between the runs. Reads
+// are positional, so callers don't wait for each other.
+func (self *Imager) ReadAt(buf []byte, offset int64) (int, error) {
+	return self.reader.ReadAt(buf, offset)
+}
 
-	if run.Size == 0 {
-		return 0, io.EOF
-	}
+// SetCache keeps up to pages pages read by ReadAt, see MemoryReader.
+func (self *Imager) SetCache(pages int, read_ahead int) {
+	self.reader.SetCache(pages, read_ahead)
+}
 
-	to_read := int(run.Size)
-	if to_read > len(buf) {
-		to_read = len(buf)
-	}
+func (self *Imager) CacheStats() PageCacheStats {
+	return self.reader.CacheStats()
+}
 
-	// Zero pad if needed
-	if run.Sparse {
-		for i := 0; i < to_read; i++ {
-			buf[i] = 0
-		}
-		return to_read, nil
-	}
+// SetTrace records the ReadAt calls to w, for the replay command.
+func (self *Imager) SetTrace(w io.Writer) {
+	self.reader.SetTrace(w)
+}
 
-	_, err := windows.Seek(self.fd, int64(offset), os.SEEK_SET)
-	if err != nil {
-		return 0, fmt.Errorf("windows.Seek: seeking to %v %w", offset, err)
-	}
+// One range of a ReadBatch() call.
+type ReadRequest struct {
+	Address int64
+	Buffer  []byte
 
-	actual_read := uint32(0)
-	err = windows.ReadFile(self.fd, buf[:to_read], &actual_read, nil)
-	if err != nil {
-		pages_read := int(actual_read) / PAGE_SIZE
+	// Filled in by ReadBatch(). On error BytesRead are still good,
+	// the read stopped at the first unreadable page.
+	BytesRead int
+	Err       error
+}
 
-		// Large Read failed, read in pages from the last successful
-		// place and pad any failed pages
-		for i := pages_read * PAGE_SIZE; i < to_read; i += PAGE_SIZE {
+// Reads many small scattered ranges with a few calls into the
+// driver. Errors of single ranges are reported in their ReadRequest.
+func (self *Imager) ReadBatch(requests []*ReadRequest) error {
+	self.mu.Lock()
+	defer self.mu.Unlock()
 
-			_, err = windows.Seek(self.fd, int64(i)+offset, os.SEEK_SET)
-			if err != nil {
-				return 0, fmt.Errorf("windows.Seek: to %v %w", int64(i)+offset, err)
+	for len(requests) > 0 {
+		// Keep each call to about BUFSIZE of data.
+		n, data_size := 0, 0
+		for n < len(requests) && n < MAX_READ_DESCRIPTORS {
+			if n > 0 && data_size+len(requests[n].Buffer) > BUFSIZE {
+				break
 			}
+			data_size += len(requests[n].Buffer)
+			n++
+		}
 
-			err := windows.ReadFile(self.fd, buf[:PAGE_SIZE], &actual_read, nil)
-			if err != nil {
-				// Pad the bad page
-				for j := 0; j < PAGE_SIZE; j++ {
-					buf[i+j] = 0
-				}
-			}
+		err := self.readBatch(requests[:n], data_size)
+		if err != nil {
+			return err
 		}
-		return to_read, nil
+		requests = requests[n:]
 	}
 
-	return int(actual_read), fmt.Errorf("readAt: %w", err)
+	return nil
 }
 
-func (self *Imager) ReadAt(buf []byte, offset int64) (int, error) {
-	self.mu.Lock()
-	defer self.mu.Unlock()
+func (self *Imager) readBatch(requests []*ReadRequest, data_size int) error {
+	in := make([]byte, READ_BATCH_HEADER,
+		READ_BATCH_HEADER+len(requests)*READ_DESCRIPTOR_SIZE)
+	binary.LittleEndian.PutUint32(in, uint32(len(requests)))
+
+	// The output starts with the status of each request, then the data.
+	status_size := len(requests) * READ_STATUS_SIZE
+	out := make([]byte, status_size+data_size)
+
+	offset := status_size
+	for _, r := range requests {
+		in = binary.LittleEndian.AppendUint64(in, uint64(r.Address))
+		in = binary.LittleEndian.AppendUint32(in, uint32(len(r.Buffer)))
+		in = binary.LittleEndian.AppendUint32(in, uint32(offset))
+		offset += len(r.Buffer)
+	}
 
-	// Combine short reads into large ones
-	i := 0
-	for {
-		n, err := self.readAt(buf[i:], offset+int64(i))
-		if err == io.EOF || n == 0 {
-			return i, nil
-		}
+	var length uint32
+	err := windows.DeviceIoControl(self.fd,
+		IOCTL_READ_BATCH, &in[0], uint32(len(in)),
+		&out[0], uint32(len(out)), &length, nil)
+	if err != nil {
+		return fmt.Errorf("ReadBatch: %w", err)
+	}
 
-		if err != nil {
-			return i, err
+	offset = status_size
+	for i, r := range requests {
+		status := binary.LittleEndian.Uint32(out[i*READ_STATUS_SIZE:])
+		r.BytesRead = int(binary.LittleEndian.Uint32(out[i*READ_STATUS_SIZE+4:]))
+		if r.BytesRead > len(r.Buffer) {
+			r.BytesRead = len(r.Buffer)
 		}
+		copy(r.Buffer, out[offset:offset+r.BytesRead])
 
-		i += n
-
-		if i >= len(buf) {
-			return i, nil
+		r.Err = nil
+		if status != 0 {
+			r.Err = fmt.Errorf("ReadBatch: reading %#x: %w",
+				r.Address, windows.NTStatus(status))
 		}
+		offset += len(r.Buffer)
 	}
+
+	return nil
 }
 
 func (self *Imager) SetMode(mode PmemMode) error {
@@ -142,8 +145,14 @@ func (self *Imager) SetMode(mode PmemMode) error {
 
 	buff = binary.LittleEndian.AppendUint32(buff, uint32(mode))
 
-	return windows.DeviceIoControl(self.fd,
+	err := windows.DeviceIoControl(self.fd,
 		IOCTL_SET_MODE, &buff[0], 4, nil, 0, &length, nil)
+	if err != nil {
+		return err
+	}
+
+	self.stats.Mode = mode.String()
+	return nil
 }
 
 func (self *Imager) Stats() *WinpmemInfo {
@@ -179,190 +188,166 @@ func (self *Imager) SetSparse() {
 	self.sparse_output = true
 }
 
-func (self *Imager) pad(
-	ctx context.Context,
-	size uint64, w io.Writer) error {
-	if self.sparse_output {
-		write_seeker, ok := w.(io.WriteSeeker)
-		if ok {
-			self.logger.Progress(int(size / PAGE_SIZE))
-
-			// Support sparse files if the filesystem allows it
-			_, err := write_seeker.Seek(int64(size), os.SEEK_CUR)
-			return err
-		}
-	}
+// GetBadPages returns the pages the driver found unreadable, so they
+// can be given back to it with SetBadPages on the next run.
+func (self *Imager) GetBadPages() ([]PageRange, error) {
+	out := make([]byte, BAD_PAGES_HEADER)
 
-	for offset := uint64(0); offset < size; {
-		to_write := size - offset
-		if to_write > BUFSIZE {
-			to_write = BUFSIZE
+	for {
+		var length uint32
+		err := windows.DeviceIoControl(self.fd,
+			IOCTL_GET_BAD_PAGES, nil, 0,
+			&out[0], uint32(len(out)), &length, nil)
+		if err == nil {
+			break
 		}
 
-		buff := make([]byte, to_write)
-		n, err := w.Write(buff)
-		if err != nil {
-			return err
+		// Too small a buffer only gets the number of ranges. More
+		// may turn up before the next try, so leave some room.
+		if !errors.Is(err, windows.ERROR_MORE_DATA) {
+			return nil, fmt.Errorf("GetBadPages: %w", err)
 		}
+		count := int(binary.LittleEndian.Uint32(out))
+		out = make([]byte, BAD_PAGES_HEADER+(count+64)*PAGE_RANGE_SIZE)
+	}
 
-		self.logger.Progress(int(to_write / PAGE_SIZE))
-
-		offset += uint64(n)
-
-		select {
-		case <-ctx.Done():
-			return errors.New("Cancelled!")
-		default:
-		}
+	count := int(binary.LittleEndian.Uint32(out))
+	result := make([]PageRange, 0, count)
+	for i := 0; i < count; i++ {
+		offset := BAD_PAGES_HEADER + i*PAGE_RANGE_SIZE
+		result = append(result, PageRange{
+			FirstPage:     binary.LittleEndian.Uint64(out[offset:]),
+			NumberOfPages: binary.LittleEndian.Uint64(out[offset+8:]),
+		})
 	}
 
-	return nil
+	return result, nil
 }
 
-// copyRange copies a range from the base_addr to the writer. We
-// assume size is a multiple of PAGE_SIZE
-func (self *Imager) copyRange(
-	ctx context.Context,
-	base_addr, size uint64, w io.Writer) error {
-	buff := make([]byte, BUFSIZE)
-	pad := make([]byte, PAGE_SIZE)
-	end := base_addr + size
-
-	for offset := base_addr; offset < end; {
-		to_read := end - offset
-		if to_read > BUFSIZE {
-			to_read = BUFSIZE
-		}
-
-		actual_read := uint32(0)
-
-		self.logger.Debug("Reading %#x from %#x", to_read, offset)
-		_, err := windows.Seek(self.fd, int64(offset), os.SEEK_SET)
-		if err != nil {
-			return fmt.Errorf("windows.Seek: ro %v %w", offset, err)
-		}
+// SetBadPages replaces the pages the driver knows to be unreadable.
+// Reads of them fail at once, without faulting on each page again.
+func (self *Imager) SetBadPages(ranges []PageRange) error {
+	if len(ranges) > MAX_BAD_PAGE_RANGES {
+		return fmt.Errorf("SetBadPages: too many ranges (%v)", len(ranges))
+	}
 
-		err = windows.ReadFile(self.fd, buff[:to_read], &actual_read, nil)
-		if err != nil {
-			// Large Read failed, read in pages and pad any failed pages
-			for i := offset; i < offset+to_read; i += PAGE_SIZE {
-
-				_, err = windows.Seek(self.fd, int64(i), os.SEEK_SET)
-				if err != nil {
-					return fmt.Errorf("windows.Seek: ro %v %w", offset, err)
-				}
-				err := windows.ReadFile(self.fd, buff[:PAGE_SIZE], &actual_read, nil)
-				if err != nil {
-					_, err := w.Write(pad)
-					if err != nil {
-						return fmt.Errorf("write:  %w", err)
-					}
-					continue
-				}
-
-				// Cant really happen but we can check anyway.
-				if actual_read > uint32(len(buff)) {
-					actual_read = uint32(len(buff))
-				}
-
-				self.logger.Progress(int(actual_read / PAGE_SIZE))
-
-				_, err = w.Write(buff[:actual_read])
-				if err != nil {
-					return err
-				}
-			}
-			offset += uint64(to_read)
+	in := make([]byte, BAD_PAGES_HEADER,
+		BAD_PAGES_HEADER+len(ranges)*PAGE_RANGE_SIZE)
+	binary.LittleEndian.PutUint32(in, uint32(len(ranges)))
 
-		} else {
-			// Large read succeeded - just copy the whole buffer to the writer.
+	for _, r := range ranges {
+		in = binary.LittleEndian.AppendUint64(in, r.FirstPage)
+		in = binary.LittleEndian.AppendUint64(in, r.NumberOfPages)
+	}
 
-			// Cant really happen but we can check anyway.
-			if actual_read > uint32(len(buff)) {
-				actual_read = uint32(len(buff))
-			}
+	var length uint32
+	err := windows.DeviceIoControl(self.fd,
+		IOCTL_SET_BAD_PAGES, &in[0], uint32(len(in)),
+		nil, 0, &length, nil)
+	if err != nil {
+		return fmt.Errorf("SetBadPages: %w", err)
+	}
+	return nil
+}
 
-			self.logger.Progress(int(actual_read / PAGE_SIZE))
+// GetDriverStats returns the driver's read counters and timings.
+func (self *Imager) GetDriverStats() (*DriverStats, error) {
+	out := make([]byte, STATS_SIZE)
 
-			_, err := w.Write(buff[:actual_read])
-			if err != nil {
-				return err
-			}
-			offset += uint64(actual_read)
-		}
+	var length uint32
+	err := windows.DeviceIoControl(self.fd,
+		IOCTL_GET_STATS, nil, 0,
+		&out[0], uint32(len(out)), &length, nil)
+	if err != nil {
+		return nil, fmt.Errorf("GetDriverStats: %w", err)
+	}
 
-		select {
-		case <-ctx.Done():
-			return errors.New("Cancelled!")
-		default:
-		}
+	result := &DriverStats{}
+	err = binary.Read(bytes.NewReader(out[:length]), binary.LittleEndian, result)
+	if err != nil {
+		return nil, fmt.Errorf("GetDriverStats: %w", err)
 	}
+	return result, nil
+}
 
+// ResetDriverStats zeroes the driver's read counters.
+func (self *Imager) ResetDriverStats() error {
+	var length uint32
+	err := windows.DeviceIoControl(self.fd,
+		IOCTL_RESET_STATS, nil, 0, nil, 0, &length, nil)
+	if err != nil {
+		return fmt.Errorf("ResetDriverStats: %w", err)
+	}
 	return nil
 }
 
-func (self *Imager) WriteTo(ctx context.Context, w io.Writer) error {
-	var offset uint64
-	for _, r := range self.stats.Run {
-		base_addr := uint64(r.BaseAddress)
-		number_of_bytes := uint64(r.NumberOfBytes)
-
-		// Pad up to the next range
-		if offset < base_addr {
-			pad_size := base_addr - offset
+// SetReadSizeBounds lets bulk reads shrink to min around bad pages and
+// grow to max where memory reads cleanly.
+func (self *Imager) SetReadSizeBounds(min, max uint64) {
+	self.read_size.SetBounds(min, max)
+}
 
-			self.logger.Info(
-				"Padding %v pages from %#x", pad_size/PAGE_SIZE, offset)
+// SetReaders sets how many chunks WriteTo reads at the same time.
+func (self *Imager) SetReaders(readers int) {
+	self.readers = readers
+}
 
-			err := self.pad(ctx, pad_size, w)
-			if err != nil {
-				return err
-			}
+// WriteTo writes a raw image to w. Chunks are read on several handles
+// at once and written in order, see Pipeline.
+func (self *Imager) WriteTo(ctx context.Context, w io.Writer) error {
+	pipeline := NewPipeline(self.device, self.logger, self.readers, self.read_size)
+	pipeline.SetSparse(self.sparse_output)
 
-			offset = base_addr
-		}
+	return pipeline.CopyRuns(ctx, self.stats.Run, w)
+}
 
-		self.logger.Info(
-			"Copying %v pages (%#x) from %#x", number_of_bytes/PAGE_SIZE,
-			number_of_bytes, offset)
+// WriteDelta writes the chunks of the image that changed since the
+// baseline to w, and returns the tree of the new image. Without a
+// baseline it writes the whole image, see DeltaWriter.
+func (self *Imager) WriteDelta(ctx context.Context, w io.Writer,
+	baseline *HashTree) (*HashTree, error) {
+	delta, err := NewDeltaWriter(w, baseline, runtime.GOMAXPROCS(0))
+	if err != nil {
+		return nil, err
+	}
 
-		err := self.copyRange(ctx, base_addr, number_of_bytes, w)
-		if err != nil {
-			return err
-		}
+	err = self.WriteTo(ctx, delta)
+	close_err := delta.Close()
+	if err != nil {
+		return nil, err
+	}
+	if close_err != nil {
+		return nil, close_err
+	}
 
-		offset = base_addr + number_of_bytes
+	tree := delta.Tree()
+	if baseline != nil {
+		self.logger.Info("Wrote %v of %v chunks, the others are in the baseline",
+			delta.Changed, len(tree.Leaves))
 	}
-	return nil
+
+	return tree, nil
 }
 
 func (self *Imager) Close() {
+	self.device.Close()
 	windows.CloseHandle(self.fd)
 }
 
 func NewImager(
 	device_name string,
 	logger Logger) (*Imager, error) {
-	var nullHandle windows.Handle
-
-	device_name_utf16, err := syscall.UTF16FromString(device_name)
-	if err != nil {
-		return nil, err
-	}
-	fd, err := windows.CreateFile(&device_name_utf16[0], windows.GENERIC_READ|windows.GENERIC_WRITE,
-		windows.FILE_SHARE_READ|windows.FILE_SHARE_WRITE,
-		nil,
-		windows.OPEN_EXISTING,
-		windows.FILE_ATTRIBUTE_NORMAL,
-		nullHandle,
-	)
+	fd, err := openDevice(device_name)
 	if err != nil {
 		return nil, err
 	}
 
 	res := &Imager{
-		fd:     fd,
-		logger: logger,
+		fd:        fd,
+		device:    NewPmemDevice(device_name),
+		logger:    logger,
+		read_size: NewReadSizeController(PAGE_SIZE, BUFSIZE),
+		readers:   DEFAULT_READERS,
 	}
 
 	res.stats, err = res.getStats()
@@ -371,5 +356,7 @@ func NewImager(
 		return nil, err
 	}
 
+	res.reader = NewMemoryReader(res.device, res.stats.Run)
+
 	return res, nil
 }
@@ -0,0 +1,195 @@
+package winpmem
+
+import (
+	"bufio"
+	"fmt"
+	"io"
+	"strconv"
+	"strings"
+	"sync"
+)
+
+// MemoryReader reads physical memory at random offsets, zero padded
+// between the runs, for analysis code that wants an io.ReaderAt.
+// Pages can be kept in a PageCache, since such code tends to read the
+// same structures many times over in small pieces.
+type MemoryReader struct {
+	device Device
+	index  *RunIndex
+	cache  *PageCache
+
+	// Records each read as a line of "offset length", to be replayed
+	// later.
+	trace_mu sync.Mutex
+	trace    io.Writer
+}
+
+func NewMemoryReader(device Device, ranges []PHYSICAL_MEMORY_RANGE) *MemoryReader {
+	return &MemoryReader{
+		device: device,
+		index:  NewRunIndex(ranges),
+	}
+}
+
+// SetCache keeps up to pages pages, reading read_ahead pages at a time
+// when the reads are sequential. Zero pages turns the cache off. Not
+// safe to call while reading.
+func (self *MemoryReader) SetCache(pages int, read_ahead int) {
+	if pages <= 0 {
+		self.cache = nil
+		return
+	}
+	self.cache = NewPageCache(pages, read_ahead)
+}
+
+func (self *MemoryReader) CacheStats() PageCacheStats {
+	if self.cache == nil {
+		return PageCacheStats{}
+	}
+	return self.cache.Stats()
+}
+
+// SetTrace records every ReadAt call to w. Not safe to call while
+// reading.
+func (self *MemoryReader) SetTrace(w io.Writer) {
+	self.trace = w
+}
+
+// TraceRead is a ReadAt call recorded by SetTrace.
+type TraceRead struct {
+	Offset int64
+	Length int
+}
+
+// ReadTrace parses the reads recorded by SetTrace.
+func ReadTrace(r io.Reader) ([]TraceRead, error) {
+	var result []TraceRead
+
+	scanner := bufio.NewScanner(r)
+	for line_no := 1; scanner.Scan(); line_no++ {
+		fields := strings.Fields(scanner.Text())
+		if len(fields) == 0 {
+			continue
+		}
+
+		if len(fields) != 2 {
+			return nil, fmt.Errorf("ReadTrace: line %v: expected offset and length",
+				line_no)
+		}
+
+		offset, err := strconv.ParseInt(fields[0], 0, 64)
+		if err != nil {
+			return nil, fmt.Errorf("ReadTrace: line %v: %w", line_no, err)
+		}
+
+		length, err := strconv.ParseInt(fields[1], 0, 32)
+		if err != nil {
+			return nil, fmt.Errorf("ReadTrace: line %v: %w", line_no, err)
+		}
+
+		result = append(result, TraceRead{Offset: offset, Length: int(length)})
+	}
+
+	return result, scanner.Err()
+}
+
+func (self *MemoryReader) ReadAt(buf []byte, offset int64) (int, error) {
+	if self.trace != nil {
+		self.trace_mu.Lock()
+		fmt.Fprintf(self.trace, "%#x %d\n", offset, len(buf))
+		self.trace_mu.Unlock()
+	}
+
+	// Short reads stop at the end of a run, combine them.
+	i := 0
+	for i < len(buf) {
+		run := self.index.Find(offset + int64(i))
+		if run == nil {
+			break
+		}
+
+		to_read := run.Address + run.Size - (offset + int64(i))
+		if to_read > int64(len(buf)-i) {
+			to_read = int64(len(buf) - i)
+		}
+
+		part := buf[i : i+int(to_read)]
+		if run.Sparse {
+			for j := range part {
+				part[j] = 0
+			}
+		} else if self.cache != nil {
+			self.readCached(part, offset+int64(i), run)
+		} else {
+			self.readDevice(part, offset+int64(i))
+		}
+
+		i += len(part)
+	}
+
+	return i, nil
+}
+
+// readCached reads buf through the cache, a page at a time. Misses
+// read ahead, but not past the end of the run.
+func (self *MemoryReader) readCached(buf []byte, offset int64, run *Run) {
+	page_buf := make([]byte, PAGE_SIZE)
+	run_end := run.Address + run.Size
+
+	for i := 0; i < len(buf); {
+		page := (offset + int64(i)) / PAGE_SIZE
+		page_offset := int((offset + int64(i)) % PAGE_SIZE)
+
+		if !self.cache.Get(page, page_buf) {
+			pages := self.cache.FillSize(page)
+			if max := (run_end - page*PAGE_SIZE + PAGE_SIZE - 1) / PAGE_SIZE; pages > max {
+				pages = max
+			}
+
+			fill := make([]byte, pages*PAGE_SIZE)
+			self.readDevice(fill, page*PAGE_SIZE)
+
+			for j := int64(0); j < pages; j++ {
+				self.cache.Put(page+j, fill[j*PAGE_SIZE:(j+1)*PAGE_SIZE])
+			}
+			self.cache.Filled(page, pages)
+
+			copy(page_buf, fill)
+		}
+
+		i += copy(buf[i:], page_buf[page_offset:])
+	}
+}
+
+// readDevice reads buf from the device in one read if it can, or else
+// a page at a time from where the read stopped. Unreadable pages are
+// zero filled.
+func (self *MemoryReader) readDevice(buf []byte, offset int64) {
+	n, err := self.device.ReadAt(buf, offset)
+	if err == nil && n == len(buf) {
+		return
+	}
+
+	// Back to the start of the page the read stopped in. Offset may
+	// not be page aligned.
+	i := n - int((offset+int64(n))%PAGE_SIZE)
+	if i < 0 {
+		i = 0
+	}
+
+	for i < len(buf) {
+		end := i + PAGE_SIZE - int((offset+int64(i))%PAGE_SIZE)
+		if end > len(buf) {
+			end = len(buf)
+		}
+
+		page := buf[i:end]
+		n, err := self.device.ReadAt(page, offset+int64(i))
+		if err != nil || n != len(page) {
+			for j := range page {
+				page[j] = 0
+			}
+		}
+		i = end
+	}
+}
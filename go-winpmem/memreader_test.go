@@ -0,0 +1,233 @@
+package winpmem
+
+import (
+	"bytes"
+	"fmt"
+	"math/rand"
+	"testing"
+)
+
+func TestRunIndex(t *testing.T) {
+	// Out of order, overlapping, and not starting at zero.
+	index := NewRunIndex([]PHYSICAL_MEMORY_RANGE{
+		{BaseAddress: 0x10000, NumberOfBytes: 0x4000},
+		{BaseAddress: 0x2000, NumberOfBytes: 0x3000},
+		{BaseAddress: 0x3000, NumberOfBytes: 0x1000},
+		{BaseAddress: 0x4000, NumberOfBytes: 0x2000},
+	})
+
+	for _, test := range []struct {
+		offset  int64
+		address int64
+		size    int64
+		sparse  bool
+	}{
+		{0, 0, 0x2000, true},
+		{0x1fff, 0, 0x2000, true},
+		{0x2000, 0x2000, 0x3000, false},
+		{0x4fff, 0x2000, 0x3000, false},
+		{0x5000, 0x5000, 0x1000, false},
+		{0x6000, 0x6000, 0xa000, true},
+		{0x13fff, 0x10000, 0x4000, false},
+	} {
+		run := index.Find(test.offset)
+		if run == nil || run.Address != test.address ||
+			run.Size != test.size || run.Sparse != test.sparse {
+			t.Fatalf("Find(%#x) = %+v", test.offset, run)
+		}
+	}
+
+	if index.Find(0x14000) != nil || index.End() != 0x14000 {
+		t.Fatalf("Index runs past %#x", index.End())
+	}
+
+	if NewRunIndex(nil).Find(0) != nil {
+		t.Fatalf("Empty index found a run")
+	}
+}
+
+func cachePage(page int64) []byte {
+	return bytes.Repeat([]byte{byte(page)}, PAGE_SIZE)
+}
+
+func TestPageCacheEviction(t *testing.T) {
+	// Two pages in each shard.
+	cache := NewPageCache(2*CACHE_SHARDS, 1)
+	buf := make([]byte, PAGE_SIZE)
+
+	// Pages 0, 16 and 32 share a shard, page 1 does not.
+	cache.Put(0, cachePage(0))
+	cache.Put(1, cachePage(1))
+	cache.Put(CACHE_SHARDS, cachePage(CACHE_SHARDS))
+
+	// Using page 0 makes page 16 the oldest.
+	if !cache.Get(0, buf) || !bytes.Equal(buf, cachePage(0)) {
+		t.Fatalf("Page 0 is not cached")
+	}
+
+	cache.Put(2*CACHE_SHARDS, cachePage(2*CACHE_SHARDS))
+
+	if cache.Get(CACHE_SHARDS, buf) {
+		t.Fatalf("Least recently used page was not evicted")
+	}
+
+	for _, page := range []int64{0, 1, 2 * CACHE_SHARDS} {
+		if !cache.Get(page, buf) || !bytes.Equal(buf, cachePage(page)) {
+			t.Fatalf("Page %v is not cached", page)
+		}
+	}
+
+	// Putting a cached page again replaces it.
+	cache.Put(1, cachePage(7))
+	if !cache.Get(1, buf) || !bytes.Equal(buf, cachePage(7)) {
+		t.Fatalf("Page 1 was not replaced")
+	}
+
+	stats := cache.Stats()
+	if stats.Hits != 5 || stats.Misses != 1 {
+		t.Fatalf("%v hits and %v misses, not 5 and 1", stats.Hits, stats.Misses)
+	}
+}
+
+func TestPageCacheReadAhead(t *testing.T) {
+	cache := NewPageCache(64, 8)
+
+	if cache.FillSize(5) != 1 {
+		t.Fatalf("First miss reads ahead")
+	}
+	cache.Filled(5, 1)
+
+	if cache.FillSize(6) != 8 {
+		t.Fatalf("Sequential miss does not read ahead")
+	}
+	cache.Filled(6, 8)
+
+	if cache.FillSize(20) != 1 || cache.FillSize(14) != 8 {
+		t.Fatalf("Read ahead does not follow the last fill")
+	}
+
+	if cache.Stats().ReadAhead != 7 {
+		t.Fatalf("%v pages read ahead, not 7", cache.Stats().ReadAhead)
+	}
+}
+
+// Reads at random offsets and lengths, across run edges, gaps, bad
+// pages and the end of memory, match the image the pipeline writes.
+func TestMemoryReader(t *testing.T) {
+	bad_pages := []uint64{0x1000, 2 * MB, 5*MB + 0x10000, 5*MB + 0x11000}
+
+	device, data := newTestDevice(t, 11*MB)
+	for _, page := range bad_pages {
+		device.SetBadPage(page, PMEM_PAGE_ACCESS_FAILED)
+	}
+
+	want := expectedImage(data, testRuns, bad_pages)
+	end := int64(len(want))
+
+	for _, cache_pages := range []int{0, 256} {
+		reader := NewMemoryReader(device, testRuns)
+		reader.SetCache(cache_pages, 4)
+
+		random := rand.New(rand.NewSource(int64(cache_pages)))
+		buf := make([]byte, 3*PAGE_SIZE)
+
+		// Repeats of the same few offsets are what the cache is for.
+		offsets := []int64{
+			0, 3*MB - 10, 5*MB - 1, 5*MB + 0x10ff0, 7*MB + 0x3000 - 5, end - 100,
+		}
+		for i := 0; i < 2000; i++ {
+			offsets = append(offsets, random.Int63n(end+PAGE_SIZE))
+		}
+
+		for i, offset := range offsets {
+			if i >= 6 && i%4 == 0 {
+				offset = offsets[random.Intn(i)]
+			}
+
+			length := 1 + random.Intn(len(buf))
+
+			n, err := reader.ReadAt(buf[:length], offset)
+			if err != nil {
+				t.Fatal(err)
+			}
+
+			expected := 0
+			if offset < end {
+				expected = int(end - offset)
+				if expected > length {
+					expected = length
+				}
+			}
+
+			if n != expected ||
+				n > 0 && !bytes.Equal(buf[:n], want[offset:offset+int64(n)]) {
+				t.Fatalf("Cache %v: ReadAt(%v, %#x) is wrong", cache_pages, length, offset)
+			}
+		}
+
+		stats := reader.CacheStats()
+		if cache_pages > 0 && (stats.Hits == 0 || stats.ReadAhead == 0) {
+			t.Fatalf("Cache was not used: %+v", stats)
+		}
+	}
+}
+
+// BenchmarkReplay records the reads of a walk over linked structures,
+// like an analysis of the kernel does, and replays them with and
+// without the cache.
+func BenchmarkReplay(b *testing.B) {
+	const size = 64 * MB
+
+	device, _ := newTestDevice(b, size)
+	runs := []PHYSICAL_MEMORY_RANGE{{BaseAddress: 0, NumberOfBytes: size}}
+
+	trace := &bytes.Buffer{}
+	reader := NewMemoryReader(device, runs)
+	reader.SetTrace(trace)
+
+	random := rand.New(rand.NewSource(1))
+	hot := make([]int64, 2000)
+	for i := range hot {
+		hot[i] = random.Int63n(size-PAGE_SIZE) &^ 7
+	}
+
+	buf := make([]byte, 4*PAGE_SIZE)
+	for i := 0; i < 20000; i++ {
+		offset := hot[random.Intn(len(hot))]
+
+		switch {
+		// A list head and the fields of its entry.
+		case i%10 < 7:
+			reader.ReadAt(buf[:8], offset)
+			reader.ReadAt(buf[:64], offset+8)
+
+		// Something read sequentially, like a page table.
+		case i%10 < 9:
+			for j := int64(0); j < 8; j++ {
+				reader.ReadAt(buf[:PAGE_SIZE], offset&^(PAGE_SIZE-1)+j*PAGE_SIZE)
+			}
+
+		default:
+			reader.ReadAt(buf[:4*PAGE_SIZE], random.Int63n(size-4*PAGE_SIZE))
+		}
+	}
+
+	reads, err := ReadTrace(trace)
+	if err != nil {
+		b.Fatal(err)
+	}
+
+	for _, cache_pages := range []int{0, 16 * MB / PAGE_SIZE} {
+		b.Run(fmt.Sprintf("cache=%vMb", cache_pages*PAGE_SIZE/MB), func(b *testing.B) {
+			for i := 0; i < b.N; i++ {
+				reader := NewMemoryReader(device, runs)
+				reader.SetCache(cache_pages, DEFAULT_READ_AHEAD)
+
+				for _, r := range reads {
+					reader.ReadAt(buf[:r.Length], r.Offset)
+				}
+			}
+			b.ReportMetric(float64(len(reads)), "reads/op")
+		})
+	}
+}
@@ -0,0 +1,150 @@
+package winpmem
+
+import (
+	"container/list"
+	"sync"
+	"sync/atomic"
+)
+
+const (
+	// Pages are spread over the shards by page number, so readers on
+	// different pages rarely wait on the same lock.
+	CACHE_SHARDS = 16
+
+	DEFAULT_READ_AHEAD = 16 // Pages
+)
+
+type PageCacheStats struct {
+	Hits      uint64 `yaml:"Hits"`
+	Misses    uint64 `yaml:"Misses"`
+	ReadAhead uint64 `yaml:"ReadAhead"`
+}
+
+// PageCache keeps recently read pages of physical memory. Each shard
+// evicts its least recently used page when full.
+type PageCache struct {
+	shards [CACHE_SHARDS]cacheShard
+
+	// How many pages to fill on a miss that continues a sequential
+	// pattern.
+	read_ahead int64
+
+	// The page after the last fill. A miss here is sequential.
+	next_page atomic.Int64
+
+	hits             atomic.Uint64
+	misses           atomic.Uint64
+	read_ahead_pages atomic.Uint64
+}
+
+type cacheShard struct {
+	mu    sync.Mutex
+	pages map[int64]*list.Element
+	lru   *list.List
+	max   int
+}
+
+type cachedPage struct {
+	page int64
+	data []byte
+}
+
+// NewPageCache holds up to size pages.
+func NewPageCache(size int, read_ahead int) *PageCache {
+	if size < CACHE_SHARDS {
+		size = CACHE_SHARDS
+	}
+
+	if read_ahead < 1 {
+		read_ahead = 1
+	}
+
+	self := &PageCache{read_ahead: int64(read_ahead)}
+	self.next_page.Store(-1)
+
+	for i := range self.shards {
+		self.shards[i].pages = make(map[int64]*list.Element)
+		self.shards[i].lru = list.New()
+		self.shards[i].max = size / CACHE_SHARDS
+	}
+
+	return self
+}
+
+func (self *PageCache) shard(page int64) *cacheShard {
+	return &self.shards[uint64(page)%CACHE_SHARDS]
+}
+
+// Get copies the page into buf and returns true if it is cached.
+func (self *PageCache) Get(page int64, buf []byte) bool {
+	shard := self.shard(page)
+
+	shard.mu.Lock()
+	defer shard.mu.Unlock()
+
+	element, pres := shard.pages[page]
+	if !pres {
+		self.misses.Add(1)
+		return false
+	}
+
+	shard.lru.MoveToFront(element)
+	copy(buf, element.Value.(*cachedPage).data)
+	self.hits.Add(1)
+	return true
+}
+
+// Put adds a copy of the page.
+func (self *PageCache) Put(page int64, data []byte) {
+	shard := self.shard(page)
+
+	shard.mu.Lock()
+	defer shard.mu.Unlock()
+
+	element, pres := shard.pages[page]
+	if pres {
+		copy(element.Value.(*cachedPage).data, data)
+		shard.lru.MoveToFront(element)
+		return
+	}
+
+	// Reuse the buffer of the evicted page.
+	var cached *cachedPage
+	if shard.lru.Len() >= shard.max {
+		oldest := shard.lru.Back()
+		shard.lru.Remove(oldest)
+		cached = oldest.Value.(*cachedPage)
+		delete(shard.pages, cached.page)
+		cached.page = page
+	} else {
+		cached = &cachedPage{page: page, data: make([]byte, PAGE_SIZE)}
+	}
+
+	copy(cached.data, data)
+	shard.pages[page] = shard.lru.PushFront(cached)
+}
+
+// FillSize returns how many pages to read on a miss at page: more
+// than one only if the miss carries on from the last fill.
+func (self *PageCache) FillSize(page int64) int64 {
+	if page == self.next_page.Load() {
+		return self.read_ahead
+	}
+	return 1
+}
+
+// Filled records that pages from page were read into the cache.
+func (self *PageCache) Filled(page int64, pages int64) {
+	self.next_page.Store(page + pages)
+	if pages > 1 {
+		self.read_ahead_pages.Add(uint64(pages - 1))
+	}
+}
+
+func (self *PageCache) Stats() PageCacheStats {
+	return PageCacheStats{
+		Hits:      self.hits.Load(),
+		Misses:    self.misses.Load(),
+		ReadAhead: self.read_ahead_pages.Load(),
+	}
+}
@@ -0,0 +1,346 @@
+package winpmem
+
+import (
+	"context"
+	"errors"
+	"io"
+	"os"
+	"sync"
+)
+
+const (
+	DEFAULT_READERS = 4
+
+	// Chunks read ahead of the writer, per reader.
+	CHUNKS_PER_READER = 2
+)
+
+// A piece of the image in file order: length bytes at offset, read
+// from the device or padding between the runs.
+type chunk struct {
+	offset uint64
+	length uint64
+	pad    bool
+
+	// The first chunk of a run, whose length this is.
+	run_length uint64
+
+	// Filled in by the reader, then done is closed.
+	buf          *[]byte
+	failed_pages int
+	err          error
+	done         chan struct{}
+}
+
+// Pipeline copies the runs of physical memory to an image. Several
+// readers read disjoint chunks at the same time, each into a buffer
+// from a pool, and a single writer puts the chunks back in order. The
+// writer is where compression happens, so it runs while the next
+// chunks are being read.
+type Pipeline struct {
+	device  Device
+	logger  Logger
+	readers int
+	sparse  bool
+
+	// Every reader gets its own controller with these bounds. Chunks
+	// are as large as the largest read.
+	min_read_size uint64
+	chunk_size    uint64
+
+	pool sync.Pool
+	zero []byte
+}
+
+func NewPipeline(device Device, logger Logger,
+	readers int, read_size *ReadSizeController) *Pipeline {
+	if readers < 1 {
+		readers = 1
+	}
+
+	self := &Pipeline{
+		device:        device,
+		logger:        logger,
+		readers:       readers,
+		min_read_size: read_size.Min(),
+		chunk_size:    read_size.Max(),
+	}
+
+	self.pool.New = func() interface{} {
+		buf := make([]byte, self.chunk_size)
+		return &buf
+	}
+
+	return self
+}
+
+// SetSparse seeks over the padding instead of writing zeros, if the
+// output can seek.
+func (self *Pipeline) SetSparse(sparse bool) {
+	self.sparse = sparse
+}
+
+// CopyRuns writes the runs to w as a raw image, zero padded between
+// them. Unreadable pages are zero filled.
+func (self *Pipeline) CopyRuns(ctx context.Context,
+	runs []PHYSICAL_MEMORY_RANGE, w io.Writer) error {
+	ctx, cancel := context.WithCancel(ctx)
+	defer cancel()
+
+	// The queue holds the chunks in file order and limits how far the
+	// readers get ahead of the writer.
+	queue := make(chan *chunk, self.readers*CHUNKS_PER_READER)
+	jobs := make(chan *chunk)
+
+	go self.produce(ctx, runs, queue, jobs)
+
+	wg := &sync.WaitGroup{}
+	for i := 0; i < self.readers; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			self.read(ctx, jobs)
+		}()
+	}
+
+	err := self.write(ctx, queue, w)
+
+	// Stop the producer and let the readers finish their chunks.
+	cancel()
+	wg.Wait()
+
+	return err
+}
+
+func (self *Pipeline) produce(ctx context.Context,
+	runs []PHYSICAL_MEMORY_RANGE, queue, jobs chan *chunk) {
+	defer close(queue)
+	defer close(jobs)
+
+	send := func(c *chunk) bool {
+		c.done = make(chan struct{})
+
+		select {
+		case queue <- c:
+		case <-ctx.Done():
+			return false
+		}
+
+		// Padding needs no reading.
+		if c.pad {
+			close(c.done)
+			return true
+		}
+
+		select {
+		case jobs <- c:
+			return true
+		case <-ctx.Done():
+			return false
+		}
+	}
+
+	var offset uint64
+	for _, r := range runs {
+		base_addr := uint64(r.BaseAddress)
+		number_of_bytes := uint64(r.NumberOfBytes)
+
+		// Pad up to the next range
+		if offset < base_addr {
+			if !send(&chunk{offset: offset, length: base_addr - offset, pad: true}) {
+				return
+			}
+		}
+
+		for i := uint64(0); i < number_of_bytes; i += self.chunk_size {
+			c := &chunk{offset: base_addr + i, length: self.chunk_size}
+			if c.length > number_of_bytes-i {
+				c.length = number_of_bytes - i
+			}
+			if i == 0 {
+				c.run_length = number_of_bytes
+			}
+
+			if !send(c) {
+				return
+			}
+		}
+
+		offset = base_addr + number_of_bytes
+	}
+}
+
+func (self *Pipeline) read(ctx context.Context, jobs chan *chunk) {
+	reader := &chunkReader{
+		device:    self.device,
+		read_size: NewReadSizeController(self.min_read_size, self.chunk_size),
+	}
+
+	for c := range jobs {
+		if ctx.Err() != nil {
+			c.err = errors.New("Cancelled!")
+			close(c.done)
+			continue
+		}
+
+		c.buf = self.pool.Get().(*[]byte)
+		c.failed_pages = reader.read((*c.buf)[:c.length], c.offset)
+		close(c.done)
+	}
+}
+
+func (self *Pipeline) write(
+	ctx context.Context, queue chan *chunk, w io.Writer) error {
+	for c := range queue {
+		select {
+		case <-c.done:
+		case <-ctx.Done():
+			return errors.New("Cancelled!")
+		}
+
+		if c.err != nil {
+			return c.err
+		}
+
+		if c.pad {
+			self.logger.Info(
+				"Padding %v pages from %#x", c.length/PAGE_SIZE, c.offset)
+
+			err := self.pad(ctx, c.length, w)
+			if err != nil {
+				return err
+			}
+			continue
+		}
+
+		if c.run_length > 0 {
+			self.logger.Info(
+				"Copying %v pages (%#x) from %#x", c.run_length/PAGE_SIZE,
+				c.run_length, c.offset)
+		}
+
+		if c.failed_pages > 0 {
+			self.logger.Info("Padded %v unreadable pages between %#x and %#x",
+				c.failed_pages, c.offset, c.offset+c.length)
+		}
+
+		self.logger.Progress(int(c.length / PAGE_SIZE))
+
+		_, err := w.Write((*c.buf)[:c.length])
+		self.pool.Put(c.buf)
+		if err != nil {
+			return err
+		}
+	}
+
+	// The producer stops early when cancelled.
+	if ctx.Err() != nil {
+		return errors.New("Cancelled!")
+	}
+	return nil
+}
+
+func (self *Pipeline) pad(
+	ctx context.Context, size uint64, w io.Writer) error {
+	if self.sparse {
+		write_seeker, ok := w.(io.WriteSeeker)
+		if ok {
+			self.logger.Progress(int(size / PAGE_SIZE))
+
+			// Support sparse files if the filesystem allows it
+			_, err := write_seeker.Seek(int64(size), os.SEEK_CUR)
+			return err
+		}
+	}
+
+	if self.zero == nil {
+		self.zero = make([]byte, BUFSIZE)
+	}
+
+	for offset := uint64(0); offset < size; {
+		to_write := size - offset
+		if to_write > BUFSIZE {
+			to_write = BUFSIZE
+		}
+
+		n, err := w.Write(self.zero[:to_write])
+		if err != nil {
+			return err
+		}
+
+		self.logger.Progress(int(to_write / PAGE_SIZE))
+
+		offset += uint64(n)
+
+		select {
+		case <-ctx.Done():
+			return errors.New("Cancelled!")
+		default:
+		}
+	}
+
+	return nil
+}
+
+// chunkReader fills the chunks of one reader goroutine.
+type chunkReader struct {
+	device Device
+
+	// Picks the size of each bulk read when the device can not read
+	// past bad pages.
+	read_size *ReadSizeController
+
+	// Older drivers can not read past bad pages.
+	no_read_continue bool
+}
+
+// read fills buf with the memory at offset. Unreadable pages are zero
+// filled, and their number returned. We assume offset and the length
+// of buf are multiples of PAGE_SIZE.
+func (self *chunkReader) read(buf []byte, offset uint64) int {
+	// Let the driver skip over bad pages if it can, rather than
+	// finding them one page at a time.
+	if !self.no_read_continue {
+		failed, err := self.device.ReadContinue(buf, offset)
+		if err == nil {
+			return len(failed)
+		}
+		self.no_read_continue = true
+	}
+
+	failed_pages := 0
+	size := uint64(len(buf))
+	for pos := uint64(0); pos < size; {
+		to_read := self.read_size.Size()
+		if to_read > size-pos {
+			to_read = size - pos
+		}
+
+		n, err := self.device.ReadAt(buf[pos:pos+to_read], int64(offset+pos))
+		if err == nil && uint64(n) == to_read {
+			pos += to_read
+			self.read_size.OnCleanRead()
+			continue
+		}
+
+		// We don't know which page failed. Try again with less.
+		if to_read > PAGE_SIZE && self.read_size.OnFailedRead() {
+			continue
+		}
+
+		// Can't get any smaller, read in pages and pad any failed pages
+		for i := pos; i < pos+to_read; i += PAGE_SIZE {
+			page := buf[i : i+PAGE_SIZE]
+			n, err := self.device.ReadAt(page, int64(offset+i))
+			if err != nil || n != PAGE_SIZE {
+				for j := range page {
+					page[j] = 0
+				}
+				failed_pages++
+			}
+		}
+		pos += to_read
+	}
+
+	return failed_pages
+}
@@ -0,0 +1,219 @@
+package winpmem
+
+import (
+	"bytes"
+	"context"
+	"fmt"
+	"io"
+	"math/rand"
+	"os"
+	"path/filepath"
+	"testing"
+)
+
+const MB = 1024 * 1024
+
+type testLogger struct{}
+
+func (self testLogger) Info(format string, args ...interface{})  {}
+func (self testLogger) Debug(format string, args ...interface{}) {}
+func (self testLogger) Progress(pages int)                       {}
+func (self testLogger) SetProgress(pages_per_dot int)            {}
+
+// newTestDevice writes size bytes of noise to a file and reads it as
+// physical memory.
+func newTestDevice(t testing.TB, size int) (*FileDevice, []byte) {
+	data := make([]byte, size)
+	rand.New(rand.NewSource(int64(size))).Read(data)
+
+	path := filepath.Join(t.TempDir(), "physmem.raw")
+	err := os.WriteFile(path, data, 0600)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	fd, err := os.Open(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	t.Cleanup(func() { fd.Close() })
+
+	return NewFileDevice(fd), data
+}
+
+// The runs of a host: a hole at 3 Mb, one of a few pages, and a last
+// run that does not end on a chunk.
+var testRuns = []PHYSICAL_MEMORY_RANGE{
+	{BaseAddress: 0x1000, NumberOfBytes: 3*MB - 0x1000},
+	{BaseAddress: 5 * MB, NumberOfBytes: 2*MB + 0x3000},
+	{BaseAddress: 7*MB + 0x8000, NumberOfBytes: 3*MB + 0x5000},
+}
+
+// expectedImage is what CopyRuns should write from data, with the bad
+// pages zero filled.
+func expectedImage(data []byte, runs []PHYSICAL_MEMORY_RANGE,
+	bad_pages []uint64) []byte {
+	last := runs[len(runs)-1]
+	result := make([]byte, last.BaseAddress+last.NumberOfBytes)
+
+	for _, r := range runs {
+		copy(result[r.BaseAddress:r.BaseAddress+r.NumberOfBytes],
+			data[r.BaseAddress:r.BaseAddress+r.NumberOfBytes])
+	}
+
+	for _, page := range bad_pages {
+		copy(result[page:page+PAGE_SIZE], make([]byte, PAGE_SIZE))
+	}
+
+	return result
+}
+
+func copyRuns(t *testing.T, device Device, readers int) []byte {
+	pipeline := NewPipeline(device, testLogger{}, readers,
+		NewReadSizeController(PAGE_SIZE, MB))
+
+	out := &bytes.Buffer{}
+	err := pipeline.CopyRuns(context.Background(), testRuns, out)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	return out.Bytes()
+}
+
+func checkImage(t *testing.T, got, want []byte) {
+	if len(got) != len(want) {
+		t.Fatalf("Image is %#x bytes, not %#x", len(got), len(want))
+	}
+
+	for i := 0; i < len(want); i += PAGE_SIZE {
+		if !bytes.Equal(got[i:i+PAGE_SIZE], want[i:i+PAGE_SIZE]) {
+			t.Fatalf("Page at %#x is wrong", i)
+		}
+	}
+}
+
+// The chunks are read out of order by several readers, but written in
+// file order with zeros between the runs.
+func TestCopyRunsOrder(t *testing.T) {
+	device, data := newTestDevice(t, 11*MB)
+	want := expectedImage(data, testRuns, nil)
+
+	for _, readers := range []int{1, 4, 16} {
+		checkImage(t, copyRuns(t, device, readers), want)
+	}
+}
+
+// Only the bad pages are zero filled, whether the device reads past
+// them or the readers have to find them with ever smaller reads.
+func TestCopyRunsBadPages(t *testing.T) {
+	bad_pages := []uint64{
+		// The first page of a run.
+		0x1000,
+		// Two pages either side of a chunk boundary.
+		MB - PAGE_SIZE, MB,
+		// A region of bad pages with a good page in it.
+		5*MB + 0x10000, 5*MB + 0x11000, 5*MB + 0x13000, 5*MB + 0x14000,
+		// The last page of the image.
+		10*MB + 0xc000,
+	}
+
+	for _, read_continue := range []bool{true, false} {
+		device, data := newTestDevice(t, 11*MB)
+		device.SetReadContinue(read_continue)
+		for _, page := range bad_pages {
+			device.SetBadPage(page, PMEM_PAGE_ACCESS_FAILED)
+		}
+
+		checkImage(t, copyRuns(t, device, 4),
+			expectedImage(data, testRuns, bad_pages))
+	}
+}
+
+// The readers fall back to ReadAt the first time ReadContinue fails.
+func TestReadContinueFallback(t *testing.T) {
+	device, data := newTestDevice(t, 4*MB)
+	device.SetReadContinue(false)
+	device.SetBadPage(2*MB+PAGE_SIZE, PMEM_PAGE_MAP_FAILED)
+
+	reader := &chunkReader{
+		device:    device,
+		read_size: NewReadSizeController(PAGE_SIZE, MB),
+	}
+
+	buf := make([]byte, 4*MB)
+	failed_pages := reader.read(buf, 0)
+	if failed_pages != 1 {
+		t.Fatalf("%v failed pages, not 1", failed_pages)
+	}
+
+	if !reader.no_read_continue {
+		t.Fatalf("ReadContinue is still used after failing")
+	}
+
+	want := append([]byte(nil), data...)
+	copy(want[2*MB+PAGE_SIZE:2*MB+2*PAGE_SIZE], make([]byte, PAGE_SIZE))
+	checkImage(t, buf, want)
+}
+
+// Writes cancel the copy after the first few chunks.
+type cancellingWriter struct {
+	cancel func()
+	writes int
+}
+
+func (self *cancellingWriter) Write(buf []byte) (int, error) {
+	self.writes++
+	if self.writes == 3 {
+		self.cancel()
+	}
+	return len(buf), nil
+}
+
+func TestCopyRunsCancelled(t *testing.T) {
+	device, _ := newTestDevice(t, 32*MB)
+	runs := []PHYSICAL_MEMORY_RANGE{{BaseAddress: 0, NumberOfBytes: 32 * MB}}
+	pipeline := NewPipeline(device, testLogger{}, 4,
+		NewReadSizeController(PAGE_SIZE, MB))
+
+	ctx, cancel := context.WithCancel(context.Background())
+	defer cancel()
+
+	w := &cancellingWriter{cancel: cancel}
+	err := pipeline.CopyRuns(ctx, runs, w)
+	if err == nil {
+		t.Fatalf("Cancelled copy did not fail")
+	}
+
+	if w.writes == 32 {
+		t.Fatalf("Cancelled copy wrote the whole image")
+	}
+
+	// Cancelled before the first chunk.
+	err = pipeline.CopyRuns(ctx, runs, io.Discard)
+	if err == nil {
+		t.Fatalf("Cancelled copy did not fail")
+	}
+}
+
+func BenchmarkCopyRuns(b *testing.B) {
+	const size = 64 * MB
+
+	device, _ := newTestDevice(b, size)
+	runs := []PHYSICAL_MEMORY_RANGE{{BaseAddress: 0, NumberOfBytes: size}}
+
+	for _, readers := range []int{1, DEFAULT_READERS} {
+		b.Run(fmt.Sprintf("readers=%v", readers), func(b *testing.B) {
+			pipeline := NewPipeline(device, testLogger{}, readers,
+				NewReadSizeController(PAGE_SIZE, BUFSIZE))
+
+			b.SetBytes(size)
+			for i := 0; i < b.N; i++ {
+				err := pipeline.CopyRuns(context.Background(), runs, io.Discard)
+				if err != nil {
+					b.Fatal(err)
+				}
+			}
+		})
+	}
+}
@@ -0,0 +1,131 @@
+//go:build windows
+
+package winpmem
+
+import (
+	"errors"
+	"time"
+)
+
+const (
+	// Each probe read, clipped to the end of the run.
+	PROBE_READ_SIZE = 1024 * 1024
+
+	// Spread evenly over each run.
+	PROBE_READS_PER_RUN = 8
+)
+
+// How one mode did on the probe reads of SelectMode.
+type ModeProbe struct {
+	Mode        string  `yaml:"Mode"`
+	Available   bool    `yaml:"Available"`
+	Chosen      bool    `yaml:"Chosen"`
+	Reads       uint64  `yaml:"Reads"`
+	Pages       uint64  `yaml:"Pages"`
+	FailedPages uint64  `yaml:"FailedPages"`
+	Ms          float64 `yaml:"Ms"`
+
+	mode    PmemMode
+	elapsed time.Duration
+}
+
+// Fewer failed pages first, then the shorter time for the same pages.
+func (self *ModeProbe) betterThan(other *ModeProbe) bool {
+	if other == nil || self.FailedPages < other.FailedPages {
+		return true
+	}
+	return self.FailedPages == other.FailedPages && self.elapsed < other.elapsed
+}
+
+// SelectMode reads a spread of pages from every run with each of
+// modes and sets the one that failed on the fewest pages, the fastest
+// of those if several tie. The driver reads with a mode for a probe
+// without setting it, so this works before SetMode. How each mode did
+// goes into Stats().
+func (self *Imager) SelectMode(modes ...PmemMode) (PmemMode, error) {
+	probes := make([]*ModeProbe, 0, len(modes))
+	for _, mode := range modes {
+		probes = append(probes, &ModeProbe{
+			Mode:      mode.String(),
+			Available: true,
+			mode:      mode,
+		})
+	}
+
+	if len(probes) == 0 {
+		return 0, errors.New("SelectMode: no modes to probe")
+	}
+
+	buf := make([]byte, PROBE_READ_SIZE)
+	for _, run := range self.stats.Run {
+		base_addr := uint64(run.BaseAddress)
+		number_of_bytes := uint64(run.NumberOfBytes)
+		last_offset := ^uint64(0)
+
+		for i := 0; i < PROBE_READS_PER_RUN; i++ {
+			offset := base_addr + (number_of_bytes/PROBE_READS_PER_RUN*
+				uint64(i))&^(PAGE_SIZE-1)
+			to_read := base_addr + number_of_bytes - offset
+			if to_read > PROBE_READ_SIZE {
+				to_read = PROBE_READ_SIZE
+			}
+
+			// Small runs have fewer distinct places to read.
+			if to_read == 0 || offset == last_offset {
+				continue
+			}
+			last_offset = offset
+
+			// Take turns going first, so no mode always finds the
+			// caches warmed up by another.
+			for j := range probes {
+				probe := probes[(i+j)%len(probes)]
+				if !probe.Available {
+					continue
+				}
+
+				start := time.Now()
+				failed, err := readContinue(self.fd, IOCTL_PROBE_READ,
+					probe.mode, buf[:to_read], offset)
+				if err != nil {
+					self.logger.Debug("Probing %v at %#x: %v",
+						probe.mode, offset, err)
+					probe.Available = false
+					continue
+				}
+
+				probe.elapsed += time.Now().Sub(start)
+				probe.Reads++
+				probe.Pages += (to_read + PAGE_SIZE - 1) / PAGE_SIZE
+				probe.FailedPages += uint64(len(failed))
+			}
+		}
+	}
+
+	var best *ModeProbe
+	for _, probe := range probes {
+		probe.Ms = float64(probe.elapsed) / float64(time.Millisecond)
+		if probe.Reads == 0 {
+			probe.Available = false
+		}
+
+		if probe.Available && probe.betterThan(best) {
+			best = probe
+		}
+	}
+
+	if best != nil {
+		best.Chosen = true
+	}
+
+	self.stats.Probes = nil
+	for _, probe := range probes {
+		self.stats.Probes = append(self.stats.Probes, *probe)
+	}
+
+	if best == nil {
+		return 0, errors.New("SelectMode: the driver can not probe any mode")
+	}
+
+	return best.mode, self.SetMode(best.mode)
+}
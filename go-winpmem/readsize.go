@@ -0,0 +1,69 @@
+package winpmem
+
+// ReadSizeController picks the size of the next bulk read. The driver
+// fails a whole read for a single bad page, so after a failure reads
+// shrink quickly until they find it, instead of reading the region
+// around it over and over in large pieces. Through clean stretches
+// they grow back to the maximum, where reads on a clean host stay.
+type ReadSizeController struct {
+	min, max, size uint64
+}
+
+func NewReadSizeController(min, max uint64) *ReadSizeController {
+	self := &ReadSizeController{}
+	self.SetBounds(min, max)
+	return self
+}
+
+// SetBounds rounds both to whole pages and starts at the maximum.
+func (self *ReadSizeController) SetBounds(min, max uint64) {
+	min &^= PAGE_SIZE - 1
+	if min < PAGE_SIZE {
+		min = PAGE_SIZE
+	}
+
+	max &^= PAGE_SIZE - 1
+	if max < min {
+		max = min
+	}
+
+	self.min = min
+	self.max = max
+	self.size = max
+}
+
+func (self *ReadSizeController) Size() uint64 {
+	return self.size
+}
+
+func (self *ReadSizeController) Min() uint64 {
+	return self.min
+}
+
+func (self *ReadSizeController) Max() uint64 {
+	return self.max
+}
+
+// OnCleanRead returns true if the size changed.
+func (self *ReadSizeController) OnCleanRead() bool {
+	old_size := self.size
+
+	self.size *= 2
+	if self.size > self.max {
+		self.size = self.max
+	}
+
+	return self.size != old_size
+}
+
+// OnFailedRead returns true if the size changed.
+func (self *ReadSizeController) OnFailedRead() bool {
+	old_size := self.size
+
+	self.size = (self.size / 4) &^ (PAGE_SIZE - 1)
+	if self.size < self.min {
+		self.size = self.min
+	}
+
+	return self.size != old_size
+}
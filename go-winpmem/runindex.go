@@ -0,0 +1,74 @@
+package winpmem
+
+import (
+	"sort"
+)
+
+// RunIndex finds the run holding an offset with a binary search. The
+// gaps between the runs are in the index as sparse runs, so every
+// offset up to the end of the last run has exactly one.
+type RunIndex struct {
+	runs []Run
+}
+
+func NewRunIndex(ranges []PHYSICAL_MEMORY_RANGE) *RunIndex {
+	sorted := append([]PHYSICAL_MEMORY_RANGE(nil), ranges...)
+	sort.Slice(sorted, func(i, j int) bool {
+		return sorted[i].BaseAddress < sorted[j].BaseAddress
+	})
+
+	self := &RunIndex{}
+
+	var offset int64
+	for _, r := range sorted {
+		base_addr := int64(r.BaseAddress)
+		end := base_addr + int64(r.NumberOfBytes)
+
+		// Overlapping ranges only add what is past the last one.
+		if base_addr < offset {
+			base_addr = offset
+		}
+		if end <= base_addr {
+			continue
+		}
+
+		if offset < base_addr {
+			self.runs = append(self.runs, Run{
+				Address: offset,
+				Size:    base_addr - offset,
+				Sparse:  true,
+			})
+		}
+
+		self.runs = append(self.runs, Run{
+			Address: base_addr,
+			Size:    end - base_addr,
+		})
+		offset = end
+	}
+
+	return self
+}
+
+// Find returns the run holding offset, or nil past the end.
+func (self *RunIndex) Find(offset int64) *Run {
+	i := sort.Search(len(self.runs), func(i int) bool {
+		return self.runs[i].Address+self.runs[i].Size > offset
+	})
+
+	if i == len(self.runs) || offset < self.runs[i].Address {
+		return nil
+	}
+
+	return &self.runs[i]
+}
+
+// End is where the last run ends.
+func (self *RunIndex) End() int64 {
+	if len(self.runs) == 0 {
+		return 0
+	}
+
+	last := self.runs[len(self.runs)-1]
+	return last.Address + last.Size
+}
@@ -1,3 +1,5 @@
+//go:build windows
+
 package winpmem
 
 import (
@@ -27,6 +29,15 @@ func (self *WindowsFile) Write(buf []byte) (int, error) {
 	return int(actual_written), err
 }
 
+// Truncate sets the end of the file to size.
+func (self *WindowsFile) Truncate(size int64) error {
+	_, err := self.Seek(size, io.SeekStart)
+	if err != nil {
+		return err
+	}
+	return windows.SetEndOfFile(self.fd)
+}
+
 func (self *WindowsFile) Close() error {
 	return windows.CloseHandle(self.fd)
 }
@@ -0,0 +1,541 @@
+/*
+  Copyright 2026 Velocidex Innovations <mike@velocidex.com>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "compress.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+
+CompressingSink::CompressingSink(ImageSink *inner, int algorithm,
+                                 const std::vector<BlockCompressor *> &compressors,
+                                 size_t chunk_size):
+    inner_(inner),
+    algorithm_(algorithm),
+    chunk_size_(chunk_size),
+    max_in_flight_(std::max(compressors.size() * 2, (size_t)2)),
+    header_written_(false),
+    raw_bytes_(0),
+    stored_bytes_(0),
+    image_offset_(0),
+    current_(NULL),
+    stop_(false)
+{
+    for (size_t i = 0; i < compressors.size(); i++)
+    {
+        workers_.push_back(std::thread(&CompressingSink::worker_, this, compressors[i]));
+    }
+}
+
+CompressingSink::~CompressingSink()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        workers_[i].join();
+    }
+
+    delete current_;
+
+    for (size_t i = 0; i < free_.size(); i++) delete free_[i];
+    for (size_t i = 0; i < in_flight_.size(); i++) delete in_flight_[i];
+}
+
+void CompressingSink::worker_(BlockCompressor *compressor)
+{
+    while (true)
+    {
+        Job *job;
+
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            work_cv_.wait(lock, [this] { return stop_ || !todo_.empty(); });
+
+            if (todo_.empty()) return;
+
+            job = todo_.front();
+            todo_.pop_front();
+        }
+
+        job->output.resize(job->input.size());
+
+        size_t stored_size = compressor->compress(
+            job->input.data(), job->input.size(),
+            job->output.data(), job->output.size());
+
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+
+            job->stored_size = stored_size;
+            job->done = true;
+        }
+        done_cv_.notify_all();
+    }
+}
+
+bool CompressingSink::write_header_()
+{
+    CompressedImageHeader header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COMPRESSED_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = COMPRESSED_IMAGE_VERSION;
+    header.algorithm = (uint16_t)algorithm_;
+    header.chunk_size = (uint32_t)chunk_size_;
+
+    if (!inner_->write((const unsigned char *)&header, sizeof(header))) return false;
+
+    stored_bytes_ += sizeof(header);
+    header_written_ = true;
+
+    return true;
+}
+
+bool CompressingSink::write(const unsigned char *buffer, size_t length)
+{
+    if (!header_written_ && !write_header_()) return false;
+
+    while (length > 0)
+    {
+        if (!current_)
+        {
+            if (free_.empty())
+            {
+                current_ = new Job();
+                current_->input.reserve(chunk_size_);
+            }
+            else
+            {
+                current_ = free_.back();
+                free_.pop_back();
+            }
+
+            current_->image_offset = image_offset_;
+            current_->input.clear();
+            current_->stored_size = 0;
+            current_->done = false;
+        }
+
+        size_t to_copy = std::min(length, chunk_size_ - current_->input.size());
+
+        current_->input.insert(current_->input.end(), buffer, buffer + to_copy);
+        buffer += to_copy;
+        length -= to_copy;
+        raw_bytes_ += to_copy;
+        image_offset_ += to_copy;
+
+        if (current_->input.size() == chunk_size_ && !submit_()) return false;
+    }
+
+    return true;
+}
+
+bool CompressingSink::pad(uint64_t length)
+{
+    CompressedRange range = { image_offset_, length, COMPRESSED_RANGE_PAD, 0 };
+
+    if (!length) return true;
+
+    // The next chunk starts after the gap.
+    if (current_ && !current_->input.empty() && !submit_()) return false;
+
+    ranges_.push_back(range);
+    image_offset_ += length;
+
+    return true;
+}
+
+void CompressingSink::add_run(uint64_t offset, uint64_t length)
+{
+    CompressedRange range = { offset, length, COMPRESSED_RANGE_RUN, 0 };
+
+    ranges_.push_back(range);
+}
+
+// Hand the current chunk to the workers. Blocks while too many chunks
+// are in flight, so memory use stays bounded.
+bool CompressingSink::submit_()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+
+        in_flight_.push_back(current_);
+
+        // Without workers, everything is stored as is.
+        if (workers_.empty()) current_->done = true;
+        else todo_.push_back(current_);
+
+        current_ = NULL;
+    }
+    work_cv_.notify_one();
+
+    return drain_(max_in_flight_);
+}
+
+// Write out finished chunks in order, waiting for them until no more
+// than limit are left in flight.
+bool CompressingSink::drain_(size_t limit)
+{
+    while (true)
+    {
+        Job *job;
+
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+
+            if (in_flight_.empty()) return true;
+
+            job = in_flight_.front();
+
+            if (in_flight_.size() > limit)
+            {
+                done_cv_.wait(lock, [job] { return job->done; });
+            }
+            else if (!job->done)
+            {
+                return true;
+            }
+
+            in_flight_.pop_front();
+        }
+
+        bool result = write_chunk_(job);
+
+        free_.push_back(job);
+
+        if (!result) return false;
+    }
+}
+
+bool CompressingSink::write_chunk_(Job *job)
+{
+    CompressedChunkHeader header;
+    const unsigned char *data = job->output.data();
+
+    header.raw_size = (uint32_t)job->input.size();
+    header.stored_size = (uint32_t)job->stored_size;
+
+    // Did not compress, store it as is.
+    if (!job->stored_size || job->stored_size >= job->input.size())
+    {
+        header.stored_size = header.raw_size;
+        data = job->input.data();
+    }
+
+    if (!inner_->write((const unsigned char *)&header, sizeof(header))) return false;
+    if (!inner_->write(data, header.stored_size)) return false;
+
+    CompressedChunkEntry entry = {
+        job->image_offset, stored_bytes_ + sizeof(header),
+        header.stored_size, header.raw_size };
+
+    chunks_.push_back(entry);
+    stored_bytes_ += sizeof(header) + header.stored_size;
+
+    return true;
+}
+
+bool CompressingSink::finish()
+{
+    CompressedChunkHeader end = { 0, 0 };
+
+    // An empty image still gets its header.
+    if (!header_written_ && !write_header_()) return false;
+
+    if (current_ && !current_->input.empty())
+    {
+        if (!submit_()) return false;
+    }
+
+    if (!drain_(0)) return false;
+
+    if (!inner_->write((const unsigned char *)&end, sizeof(end))) return false;
+
+    stored_bytes_ += sizeof(end);
+
+    return write_index_();
+}
+
+bool CompressingSink::write_index_()
+{
+    CompressedImageFooter footer;
+
+    memset(&footer, 0, sizeof(footer));
+    footer.index_offset = stored_bytes_;
+    footer.chunk_count = chunks_.size();
+    footer.range_count = ranges_.size();
+    footer.image_size = image_offset_;
+    memcpy(footer.magic, COMPRESSED_INDEX_MAGIC, sizeof(footer.magic));
+
+    if (!chunks_.empty() &&
+        !inner_->write((const unsigned char *)chunks_.data(),
+                       chunks_.size() * sizeof(CompressedChunkEntry)))
+    {
+        return false;
+    }
+
+    if (!ranges_.empty() &&
+        !inner_->write((const unsigned char *)ranges_.data(),
+                       ranges_.size() * sizeof(CompressedRange)))
+    {
+        return false;
+    }
+
+    if (!inner_->write((const unsigned char *)&footer, sizeof(footer))) return false;
+
+    stored_bytes_ += chunks_.size() * sizeof(CompressedChunkEntry) +
+        ranges_.size() * sizeof(CompressedRange) + sizeof(footer);
+
+    return true;
+}
+
+
+CompressedImageReader::CompressedImageReader(BlockDecompressor *decompressor,
+                                             size_t cache_chunks):
+    decompressor_(decompressor),
+    cache_chunks_(std::max(cache_chunks, (size_t)1)),
+    fd_(NULL),
+    algorithm_(COMPRESSION_NONE),
+    size_(0)
+{}
+
+CompressedImageReader::~CompressedImageReader()
+{
+    if (fd_) fclose(fd_);
+}
+
+bool CompressedImageReader::open(const char *filename)
+{
+    FILE *fd = fopen(filename, "rb");
+
+    if (!fd) return false;
+
+    return open(fd);
+}
+
+bool CompressedImageReader::open(FILE *fd)
+{
+    CompressedImageHeader header;
+    CompressedImageFooter footer;
+
+    if (fd_) fclose(fd_);
+    fd_ = fd;
+
+    if (fread(&header, sizeof(header), 1, fd_) != 1) return false;
+
+    if (memcmp(header.magic, COMPRESSED_IMAGE_MAGIC, sizeof(header.magic)) ||
+        header.version != COMPRESSED_IMAGE_VERSION)
+    {
+        return false;
+    }
+
+    if (fseek64(fd_, -(int64_t)sizeof(footer), SEEK_END)) return false;
+    if (fread(&footer, sizeof(footer), 1, fd_) != 1) return false;
+
+    if (memcmp(footer.magic, COMPRESSED_INDEX_MAGIC, sizeof(footer.magic))) return false;
+
+    // The index must fill the file up to the footer exactly. Check this
+    // before trusting the counts with an allocation.
+    uint64_t index_end = ftell64(fd_) - sizeof(footer);
+
+    if (footer.index_offset > index_end ||
+        footer.chunk_count > index_end / sizeof(CompressedChunkEntry) ||
+        footer.range_count > index_end / sizeof(CompressedRange) ||
+        footer.index_offset + footer.chunk_count * sizeof(CompressedChunkEntry) +
+        footer.range_count * sizeof(CompressedRange) != index_end)
+    {
+        return false;
+    }
+
+    chunks_.resize((size_t)footer.chunk_count);
+    ranges_.resize((size_t)footer.range_count);
+
+    if (fseek64(fd_, footer.index_offset, SEEK_SET)) return false;
+
+    if (!chunks_.empty() &&
+        fread(chunks_.data(), sizeof(CompressedChunkEntry), chunks_.size(), fd_) != chunks_.size())
+    {
+        return false;
+    }
+
+    if (!ranges_.empty() &&
+        fread(ranges_.data(), sizeof(CompressedRange), ranges_.size(), fd_) != ranges_.size())
+    {
+        return false;
+    }
+
+    // read() relies on the chunks being sorted and inside the image.
+    for (size_t i = 0; i < chunks_.size(); i++)
+    {
+        const CompressedChunkEntry &chunk = chunks_[i];
+
+        if (chunk.raw_size == 0 || chunk.raw_size > header.chunk_size ||
+            chunk.stored_size > chunk.raw_size ||
+            chunk.file_offset + chunk.stored_size > footer.index_offset ||
+            chunk.image_offset + chunk.raw_size > footer.image_size ||
+            (i > 0 && chunk.image_offset < chunks_[i - 1].image_offset + chunks_[i - 1].raw_size))
+        {
+            return false;
+        }
+    }
+
+    algorithm_ = header.algorithm;
+    size_ = footer.image_size;
+
+    return true;
+}
+
+// Images without runs in the index are all one run.
+bool CompressedImageReader::get_runs(std::vector<MemoryRun> *runs)
+{
+    bool found = false;
+
+    if (!fd_) return false;
+
+    for (size_t i = 0; i < ranges_.size(); i++)
+    {
+        if (ranges_[i].type == COMPRESSED_RANGE_RUN)
+        {
+            MemoryRun run = { ranges_[i].offset, ranges_[i].length };
+
+            runs->push_back(run);
+            found = true;
+        }
+    }
+
+    if (!found)
+    {
+        MemoryRun run = { 0, size_ };
+
+        runs->push_back(run);
+    }
+
+    return true;
+}
+
+// Called with mu_ held. The result is valid until the next call.
+const std::vector<unsigned char> *CompressedImageReader::load_chunk_(size_t index)
+{
+    std::list<CachedChunk>::iterator it;
+
+    for (it = cache_.begin(); it != cache_.end(); ++it)
+    {
+        if (it->index == index)
+        {
+            cache_.splice(cache_.begin(), cache_, it);
+            return &cache_.front().data;
+        }
+    }
+
+    const CompressedChunkEntry &chunk = chunks_[index];
+
+    // Reuse the least recently used chunk's buffer once the cache is full.
+    if (cache_.size() < cache_chunks_) cache_.push_front(CachedChunk());
+    else cache_.splice(cache_.begin(), cache_, --cache_.end());
+
+    CachedChunk &cached = cache_.front();
+
+    // Not valid until the chunk decompressed.
+    cached.index = (size_t)-1;
+    cached.data.resize(chunk.raw_size);
+    stored_.resize(chunk.stored_size);
+
+    if (fseek64(fd_, chunk.file_offset, SEEK_SET) ||
+        fread(stored_.data(), 1, stored_.size(), fd_) != stored_.size())
+    {
+        return NULL;
+    }
+
+    if (chunk.stored_size == chunk.raw_size)
+    {
+        memcpy(cached.data.data(), stored_.data(), chunk.raw_size);
+    }
+    else if (!decompressor_->decompress(stored_.data(), stored_.size(),
+                                        cached.data.data(), chunk.raw_size))
+    {
+        return NULL;
+    }
+
+    cached.index = index;
+
+    return &cached.data;
+}
+
+bool CompressedImageReader::read(uint64_t offset, unsigned char *buffer, size_t length,
+                                 size_t *bytes_read)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+
+    *bytes_read = 0;
+
+    if (!fd_) return false;
+
+    while (length > 0)
+    {
+        if (offset >= size_) return false;
+
+        // The last chunk starting at or before offset.
+        CompressedChunkEntry key = { offset, 0, 0, 0 };
+        std::vector<CompressedChunkEntry>::iterator next = std::upper_bound(
+            chunks_.begin(), chunks_.end(), key,
+            [](const CompressedChunkEntry &a, const CompressedChunkEntry &b) {
+                return a.image_offset < b.image_offset;
+            });
+        size_t to_copy;
+
+        if (next != chunks_.begin() &&
+            offset < (next - 1)->image_offset + (next - 1)->raw_size)
+        {
+            size_t index = next - chunks_.begin() - 1;
+            const std::vector<unsigned char> *data = load_chunk_(index);
+            uint64_t in_chunk = offset - chunks_[index].image_offset;
+
+            if (!data) return false;
+
+            to_copy = (size_t)std::min((uint64_t)length, chunks_[index].raw_size - in_chunk);
+            memcpy(buffer, data->data() + in_chunk, to_copy);
+        }
+        else
+        {
+            // Padding up to the next chunk.
+            uint64_t end = next == chunks_.end() ? size_ : next->image_offset;
+
+            to_copy = (size_t)std::min((uint64_t)length, end - offset);
+            memset(buffer, 0, to_copy);
+        }
+
+        buffer += to_copy;
+        offset += to_copy;
+        length -= to_copy;
+        *bytes_read += to_copy;
+    }
+
+    return true;
+}
@@ -0,0 +1,254 @@
+/*
+  Copyright 2026 Velocidex Innovations <mike@velocidex.com>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+// Parallel block compression of the image.
+//
+// A compressed image starts with a CompressedImageHeader. Then come the
+// chunks, each a CompressedChunkHeader and its data. Every chunk is
+// compressed on its own. If compression did not make a chunk smaller it
+// is stored as is (stored_size == raw_size). A chunk header of all
+// zeros ends the chunks.
+//
+// The index follows: a CompressedChunkEntry for every chunk, then a
+// CompressedRange for every run and every padded gap between runs. Gaps
+// have no chunks and read as zeros. A CompressedImageFooter at the very
+// end of the file says where the index is, so a reader can seek to any
+// physical offset without decompressing the chunks before it.
+
+#include "pipeline.h"
+
+#include <deque>
+#include <list>
+#include <thread>
+
+// The algorithm ids in the image header.
+enum CompressionAlgorithm
+{
+    COMPRESSION_NONE = 0,
+    COMPRESSION_XPRESS = 1,       // Fast, LZ77 only.
+    COMPRESSION_XPRESS_HUFF = 2   // Slower, LZ77 and Huffman.
+};
+
+#define COMPRESSED_IMAGE_MAGIC "WPMC"
+#define COMPRESSED_IMAGE_VERSION 2
+#define COMPRESSED_INDEX_MAGIC "WPMI"
+#define COMPRESSED_CHUNK_SIZE (1024 * 1024)
+
+#pragma pack(push, 1)
+
+struct CompressedImageHeader
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t algorithm;
+    uint32_t chunk_size;    // Uncompressed size of every chunk but the last.
+    uint32_t reserved;
+};
+
+struct CompressedChunkHeader
+{
+    uint32_t stored_size;
+    uint32_t raw_size;
+};
+
+struct CompressedChunkEntry
+{
+    uint64_t image_offset;  // Physical offset of the first byte.
+    uint64_t file_offset;   // Of the data, just after the chunk header.
+    uint32_t stored_size;
+    uint32_t raw_size;
+};
+
+enum CompressedRangeType
+{
+    COMPRESSED_RANGE_RUN = 1,  // A run from WINPMEM_MEMORY_INFO.
+    COMPRESSED_RANGE_PAD = 2   // Not stored, reads as zeros.
+};
+
+struct CompressedRange
+{
+    uint64_t offset;
+    uint64_t length;
+    uint32_t type;
+    uint32_t reserved;
+};
+
+struct CompressedImageFooter
+{
+    uint64_t index_offset;  // Of the first CompressedChunkEntry.
+    uint64_t chunk_count;
+    uint64_t range_count;   // The ranges follow the chunk entries.
+    uint64_t image_size;
+    char magic[4];
+    uint32_t reserved;
+};
+
+#pragma pack(pop)
+
+
+// Compresses one chunk. Not thread safe: each worker has its own.
+class BlockCompressor
+{
+public:
+    virtual ~BlockCompressor() {}
+
+    // Compress length bytes into output, which has room for capacity
+    // bytes. Returns the compressed size, or 0 if it failed or did not
+    // fit. The chunk is stored uncompressed then.
+    virtual size_t compress(const unsigned char *input, size_t length,
+                            unsigned char *output, size_t capacity) = 0;
+};
+
+
+// Cuts the image into chunks, compresses them on a pool of worker
+// threads and writes them to the inner sink in their original order.
+class CompressingSink: public ImageSink
+{
+public:
+    // One worker per compressor. The inner sink and the compressors must
+    // outlive this sink.
+    CompressingSink(ImageSink *inner, int algorithm,
+                    const std::vector<BlockCompressor *> &compressors,
+                    size_t chunk_size);
+    virtual ~CompressingSink();
+
+    virtual bool write(const unsigned char *buffer, size_t length);
+
+    // Padding is not stored, only recorded in the index.
+    virtual bool pad(uint64_t length);
+
+    // Runs are recorded in the index.
+    virtual void add_run(uint64_t offset, uint64_t length);
+
+    // Writes out the last chunk, the end marker and the index. Must be
+    // called once all the image has been written.
+    bool finish();
+
+    uint64_t raw_bytes() const { return raw_bytes_; }
+    uint64_t image_size() const { return image_offset_; }
+    uint64_t stored_bytes() const { return stored_bytes_; }
+
+private:
+    struct Job
+    {
+        uint64_t image_offset;
+        std::vector<unsigned char> input;
+        std::vector<unsigned char> output;
+        size_t stored_size;  // 0 if not compressed.
+        bool done;
+    };
+
+    void worker_(BlockCompressor *compressor);
+    bool submit_();
+    bool drain_(size_t limit);
+    bool write_chunk_(Job *job);
+    bool write_header_();
+    bool write_index_();
+
+    ImageSink *inner_;
+    int algorithm_;
+    size_t chunk_size_;
+    size_t max_in_flight_;
+    bool header_written_;
+
+    uint64_t raw_bytes_;
+    uint64_t stored_bytes_;
+    uint64_t image_offset_;
+
+    // Only used by the writing thread.
+    Job *current_;
+    std::vector<Job *> free_;
+    std::vector<CompressedChunkEntry> chunks_;
+    std::vector<CompressedRange> ranges_;
+
+    // Shared with the workers, protected by mu_.
+    std::mutex mu_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    std::deque<Job *> in_flight_;  // In image order.
+    std::deque<Job *> todo_;       // Not picked up by a worker yet.
+    bool stop_;
+
+    std::vector<std::thread> workers_;
+};
+
+
+// Decompresses one chunk. Not thread safe.
+class BlockDecompressor
+{
+public:
+    virtual ~BlockDecompressor() {}
+
+    // Decompress length bytes into output, which must come out at
+    // exactly raw_size bytes.
+    virtual bool decompress(const unsigned char *input, size_t length,
+                            unsigned char *output, size_t raw_size) = 0;
+};
+
+
+// Random access to a compressed image through its index. Recently used
+// chunks are kept decompressed in an LRU cache, so nearby reads don't
+// decompress the same chunk again. Thread safe.
+class CompressedImageReader: public PhysicalMemorySource
+{
+public:
+    // The decompressor must outlive the reader.
+    CompressedImageReader(BlockDecompressor *decompressor, size_t cache_chunks);
+    virtual ~CompressedImageReader();
+
+    bool open(const char *filename);
+
+    // Reads the image from fd, which the reader closes.
+    bool open(FILE *fd);
+
+    int algorithm() const { return algorithm_; }
+    uint64_t size() const { return size_; }
+    const std::vector<CompressedRange> &ranges() const { return ranges_; }
+
+    virtual bool get_runs(std::vector<MemoryRun> *runs);
+
+    // Padding reads as zeros. Fails past the end of the image, or if a
+    // chunk is corrupt.
+    virtual bool read(uint64_t offset, unsigned char *buffer, size_t length,
+                      size_t *bytes_read);
+
+private:
+    struct CachedChunk
+    {
+        size_t index;
+        std::vector<unsigned char> data;
+    };
+
+    const std::vector<unsigned char> *load_chunk_(size_t index);
+
+    BlockDecompressor *decompressor_;
+    size_t cache_chunks_;
+    FILE *fd_;
+    int algorithm_;
+    uint64_t size_;
+    std::vector<CompressedChunkEntry> chunks_;
+    std::vector<CompressedRange> ranges_;
+
+    // Most recently used first.
+    std::list<CachedChunk> cache_;
+    std::vector<unsigned char> stored_;
+    std::mutex mu_;
+};
+
+#endif
@@ -0,0 +1,570 @@
+/*
+  Copyright 2026 Velocidex Innovations <mike@velocidex.com>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+
+HashingSink::HashingSink(ImageSink *inner, ChunkHasher *hasher,
+                         const std::vector<ChunkHasher *> &workers,
+                         size_t chunk_size):
+    inner_(inner),
+    hasher_(hasher),
+    chunk_size_(chunk_size),
+    max_in_flight_(std::max(workers.size() * 2, (size_t)2)),
+    image_size_(0),
+    current_(NULL),
+    have_zero_leaf_(false),
+    baseline_(NULL),
+    delta_chunks_(0),
+    in_place_(false),
+    in_flight_(0),
+    failed_(false),
+    stop_(false)
+{
+    memset(&root_, 0, sizeof(root_));
+
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers_.push_back(std::thread(&HashingSink::worker_, this, workers[i]));
+    }
+}
+
+HashingSink::~HashingSink()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        workers_[i].join();
+    }
+
+    delete current_;
+
+    // Held jobs stay pending once hashed.
+    for (size_t i = 0; i < pending_.size(); i++) delete pending_[i].job;
+
+    for (size_t i = 0; i < free_.size(); i++) delete free_[i];
+    for (size_t i = 0; i < todo_.size(); i++) delete todo_[i];
+}
+
+bool HashingSink::hash_leaf_(ChunkHasher *hasher, const unsigned char *buffer,
+                             size_t length, Digest *digest)
+{
+    static const unsigned char prefix = 0;
+
+    return hasher->begin() &&
+        hasher->update(&prefix, 1) &&
+        hasher->update(buffer, length) &&
+        hasher->finish(digest);
+}
+
+bool HashingSink::hash_node_(const Digest &left, const Digest &right, Digest *digest)
+{
+    static const unsigned char prefix = 1;
+
+    return hasher_->begin() &&
+        hasher_->update(&prefix, 1) &&
+        hasher_->update(left.bytes, sizeof(left.bytes)) &&
+        hasher_->update(right.bytes, sizeof(right.bytes)) &&
+        hasher_->finish(digest);
+}
+
+// The gaps between runs are mostly whole chunks of zeros, which all have
+// the same leaf.
+bool HashingSink::zero_leaf_(Digest *digest)
+{
+    static const unsigned char zeros[PAGE_SIZE * 16] = { 0 };
+    static const unsigned char prefix = 0;
+
+    if (!have_zero_leaf_)
+    {
+        if (!hasher_->begin() || !hasher_->update(&prefix, 1)) return false;
+
+        for (size_t done = 0; done < chunk_size_; done += sizeof(zeros))
+        {
+            size_t to_hash = std::min(sizeof(zeros), chunk_size_ - done);
+
+            if (!hasher_->update(zeros, to_hash)) return false;
+        }
+
+        if (!hasher_->finish(&zero_leaf_digest_)) return false;
+
+        have_zero_leaf_ = true;
+    }
+
+    *digest = zero_leaf_digest_;
+
+    return true;
+}
+
+void HashingSink::worker_(ChunkHasher *hasher)
+{
+    while (true)
+    {
+        Job *job;
+        Digest digest;
+
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            work_cv_.wait(lock, [this] { return stop_ || !todo_.empty(); });
+
+            if (todo_.empty()) return;
+
+            job = todo_.front();
+            todo_.pop_front();
+        }
+
+        bool result = hash_leaf_(hasher, job->bytes(), job->size(), &digest);
+
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+
+            if (result) leaves_[job->index] = digest;
+            else failed_ = true;
+
+            // The writing thread writes a held job out and frees it.
+            if (hold_()) job->done = true;
+            else free_.push_back(job);
+
+            in_flight_--;
+        }
+        done_cv_.notify_all();
+    }
+}
+
+// Add to the current chunk. A NULL buffer adds zeros. If in_place, the
+// buffer is where the inner sink keeps these bytes, and the chunk is
+// hashed right there unless it has to be copied.
+bool HashingSink::append_(const unsigned char *buffer, size_t length, bool in_place)
+{
+    while (length > 0)
+    {
+        if (!current_)
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+
+            if (free_.empty())
+            {
+                current_ = new Job();
+                current_->data.reserve(chunk_size_);
+            }
+            else
+            {
+                current_ = free_.back();
+                free_.pop_back();
+            }
+
+            current_->data.clear();
+            current_->in_place = NULL;
+            current_->in_place_length = 0;
+            current_->done = false;
+        }
+
+        size_t to_copy = std::min(length, chunk_size_ - current_->size());
+
+        if (in_place && current_->size() == 0)
+        {
+            current_->in_place = buffer;
+            current_->in_place_length = to_copy;
+            buffer += to_copy;
+        }
+        else if (in_place && current_->in_place &&
+                 buffer == current_->in_place + current_->in_place_length)
+        {
+            current_->in_place_length += to_copy;
+            buffer += to_copy;
+        }
+        else if (buffer)
+        {
+            // Not all of the chunk is in one piece of the inner sink's
+            // memory, so it is copied after all.
+            if (current_->in_place)
+            {
+                current_->data.assign(current_->in_place,
+                                      current_->in_place + current_->in_place_length);
+                current_->in_place = NULL;
+            }
+
+            current_->data.insert(current_->data.end(), buffer, buffer + to_copy);
+            buffer += to_copy;
+        }
+        else
+        {
+            if (current_->in_place)
+            {
+                current_->data.assign(current_->in_place,
+                                      current_->in_place + current_->in_place_length);
+                current_->in_place = NULL;
+            }
+
+            current_->data.resize(current_->data.size() + to_copy, 0);
+        }
+
+        length -= to_copy;
+
+        if (current_->size() == chunk_size_ && !submit_()) return false;
+    }
+
+    return true;
+}
+
+// Hand the current chunk to the workers. Blocks while too many chunks
+// are in flight, so memory use stays bounded.
+bool HashingSink::submit_()
+{
+    Job *job = current_;
+
+    current_ = NULL;
+
+    // Without workers, hash right here.
+    if (workers_.empty())
+    {
+        Digest digest;
+        bool result = hash_leaf_(hasher_, job->bytes(), job->size(), &digest);
+
+        leaves_.push_back(digest);
+
+        if (!hold_())
+        {
+            free_.push_back(job);
+            return result;
+        }
+
+        Pending pending = { leaves_.size() - 1, job };
+
+        job->done = true;
+        pending_.push_back(pending);
+
+        return result && drain_(0);
+    }
+
+    // Write out the held chunks that are hashed, so no more than
+    // max_in_flight_ are held.
+    if (hold_() && !drain_(max_in_flight_ - 1)) return false;
+
+    {
+        std::unique_lock<std::mutex> lock(mu_);
+
+        done_cv_.wait(lock, [this] { return in_flight_ < max_in_flight_; });
+
+        job->index = leaves_.size();
+        leaves_.resize(leaves_.size() + 1);
+        todo_.push_back(job);
+        in_flight_++;
+
+        if (hold_())
+        {
+            Pending pending = { job->index, job };
+
+            pending_.push_back(pending);
+        }
+
+        if (failed_) return false;
+    }
+    work_cv_.notify_one();
+
+    return true;
+}
+
+// Writes out the held chunks in order, as far as they are hashed, and
+// in a delta only if they changed. Waits for the rest until no more than
+// keep are left.
+bool HashingSink::drain_(size_t keep)
+{
+    while (!pending_.empty())
+    {
+        Pending next = pending_.front();
+        Digest digest;
+
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+
+            if (next.job && !next.job->done)
+            {
+                if (pending_.size() <= keep) return !failed_;
+
+                done_cv_.wait(lock, [&next] { return next.job->done; });
+            }
+
+            if (failed_) return false;
+
+            digest = leaves_[next.index];
+        }
+
+        pending_.pop_front();
+
+        uint64_t length = next.job ? next.job->size() : chunk_size_;
+        bool changed = !baseline_ ||
+            next.index >= baseline_->leaves.size() ||
+            baseline_->chunk_length(next.index) != length ||
+            memcmp(&baseline_->leaves[next.index], &digest, sizeof(digest));
+        bool result = true;
+
+        if (baseline_)
+        {
+            in_delta_.push_back(changed);
+            if (changed) delta_chunks_++;
+        }
+
+        if (changed)
+        {
+            result = next.job ? inner_->write(next.job->bytes(), next.job->size()) :
+                inner_->pad(chunk_size_);
+        }
+
+        if (next.job)
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+
+            free_.push_back(next.job);
+        }
+
+        if (!result) return false;
+    }
+
+    return true;
+}
+
+bool HashingSink::write(const unsigned char *buffer, size_t length)
+{
+    // Did the engine read this into the inner sink's memory?
+    bool in_place = in_place_ && buffer == inner_->target(image_size_, length);
+
+    if (!append_(buffer, length, in_place)) return false;
+
+    image_size_ += length;
+
+    // Held chunks are written once they are hashed.
+    if (hold_()) return true;
+
+    return inner_->write(buffer, length);
+}
+
+bool HashingSink::pad(uint64_t length)
+{
+    uint64_t remaining = length;
+
+    // Fill up the current chunk first.
+    if (current_ && current_->size())
+    {
+        size_t to_fill = (size_t)std::min((uint64_t)(chunk_size_ - current_->size()), remaining);
+
+        if (!append_(NULL, to_fill, false)) return false;
+
+        remaining -= to_fill;
+    }
+
+    for (; remaining >= chunk_size_; remaining -= chunk_size_)
+    {
+        Digest digest;
+
+        if (!zero_leaf_(&digest)) return false;
+
+        std::lock_guard<std::mutex> lock(mu_);
+
+        if (hold_())
+        {
+            Pending pending = { leaves_.size(), NULL };
+
+            pending_.push_back(pending);
+        }
+
+        leaves_.push_back(digest);
+    }
+
+    if (!append_(NULL, (size_t)remaining, false)) return false;
+
+    image_size_ += length;
+
+    if (hold_()) return true;
+
+    return inner_->pad(length);
+}
+
+bool HashingSink::finish()
+{
+    if (current_ && current_->size() && !submit_()) return false;
+
+    std::vector<Digest> level;
+
+    {
+        std::unique_lock<std::mutex> lock(mu_);
+
+        done_cv_.wait(lock, [this] { return in_flight_ == 0; });
+
+        if (failed_) return false;
+
+        level = leaves_;
+    }
+
+    if (hold_() && !drain_(0)) return false;
+
+    // An empty image is a single empty leaf.
+    if (level.empty())
+    {
+        level.resize(1);
+        if (!hash_leaf_(hasher_, NULL, 0, &level[0])) return false;
+    }
+
+    while (level.size() > 1)
+    {
+        std::vector<Digest> next((level.size() + 1) / 2);
+
+        for (size_t i = 0; i + 1 < level.size(); i += 2)
+        {
+            if (!hash_node_(level[i], level[i + 1], &next[i / 2])) return false;
+        }
+
+        if (level.size() % 2) next.back() = level.back();
+
+        level.swap(next);
+    }
+
+    root_ = level[0];
+
+    return true;
+}
+
+static void format_digest(const Digest &digest, char *hex)
+{
+    for (size_t i = 0; i < sizeof(digest.bytes); i++)
+    {
+        sprintf(hex + i * 2, "%02x", digest.bytes[i]);
+    }
+}
+
+bool HashingSink::write_tree(FILE *fd, const char *algorithm) const
+{
+    char hex[HASH_DIGEST_SIZE * 2 + 1];
+
+    fprintf(fd, "# WinPmem image hash tree.\n"
+            "# leaf = H(0x00 || chunk), node = H(0x01 || left || right).\n"
+            "# An odd node is carried up to the next level unchanged.\n");
+    if (baseline_)
+    {
+        fprintf(fd, "# Chunks marked delta are in this image, the others\n"
+                "# are the same as in the baseline.\n");
+    }
+    fprintf(fd, "algorithm %s\n", algorithm);
+    fprintf(fd, "chunk_size %llu\n", (unsigned long long)chunk_size_);
+    fprintf(fd, "image_size %llu\n", (unsigned long long)image_size_);
+
+    format_digest(root_, hex);
+    fprintf(fd, "root %s\n", hex);
+
+    if (baseline_)
+    {
+        format_digest(baseline_->root, hex);
+        fprintf(fd, "baseline %s\n", hex);
+    }
+
+    fprintf(fd, "leaves %llu\n", (unsigned long long)leaves_.size());
+
+    for (size_t i = 0; i < leaves_.size(); i++)
+    {
+        format_digest(leaves_[i], hex);
+        fprintf(fd, "0x%llx %s%s\n", (unsigned long long)i * chunk_size_, hex,
+                baseline_ && in_delta_[i] ? " delta" : "");
+    }
+
+    return !ferror(fd);
+}
+
+static bool parse_digest(const char *hex, Digest *digest)
+{
+    for (size_t i = 0; i < sizeof(digest->bytes); i++)
+    {
+        unsigned char byte = 0;
+
+        for (int j = 0; j < 2; j++)
+        {
+            char c = *hex++;
+
+            byte <<= 4;
+            if (c >= '0' && c <= '9') byte |= c - '0';
+            else if (c >= 'a' && c <= 'f') byte |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') byte |= c - 'A' + 10;
+            else return false;
+        }
+
+        digest->bytes[i] = byte;
+    }
+
+    // Nothing but the end of the line may follow.
+    return !*hex || *hex == ' ' || *hex == '\r' || *hex == '\n';
+}
+
+bool read_hash_tree(FILE *fd, HashTree *tree)
+{
+    char line[256];
+    bool have_root = false;
+
+    tree->chunk_size = tree->image_size = 0;
+    tree->leaves.clear();
+
+    while (fgets(line, sizeof(line), fd))
+    {
+        char *end = NULL;
+
+        if (!strncmp(line, "algorithm ", 10))
+        {
+            if (strncmp(line + 10, "SHA256", 6)) return false;
+        }
+        else if (!strncmp(line, "chunk_size ", 11))
+        {
+            tree->chunk_size = strtoull(line + 11, NULL, 0);
+        }
+        else if (!strncmp(line, "image_size ", 11))
+        {
+            tree->image_size = strtoull(line + 11, NULL, 0);
+        }
+        else if (!strncmp(line, "root ", 5))
+        {
+            if (!parse_digest(line + 5, &tree->root)) return false;
+            have_root = true;
+        }
+        else if (!strncmp(line, "0x", 2))
+        {
+            // A leaf: its offset and digest, maybe marked as in a delta.
+            uint64_t offset = strtoull(line, &end, 16);
+            Digest leaf;
+
+            if (!tree->chunk_size || *end != ' ' ||
+                offset != tree->leaves.size() * tree->chunk_size ||
+                !parse_digest(end + 1, &leaf))
+            {
+                return false;
+            }
+
+            tree->leaves.push_back(leaf);
+        }
+
+        // Comments, the leaf count and the baseline of a delta are
+        // not needed.
+    }
+
+    return !ferror(fd) && have_root && tree->chunk_size &&
+        tree->leaves.size() == (tree->image_size + tree->chunk_size - 1) / tree->chunk_size;
+}
@@ -0,0 +1,205 @@
+/*
+  Copyright 2026 Velocidex Innovations <mike@velocidex.com>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+// Inline hashing of the image while it is written.
+//
+// The image is cut into fixed size chunks which are hashed on a pool of
+// worker threads. The chunk hashes are the leaves of a Merkle tree:
+//
+//   leaf = H(0x00 || chunk)
+//   node = H(0x01 || left || right)
+//
+// An odd node at the end of a level is carried up unchanged. Any region
+// of the image can then be checked against the tree by hashing only the
+// chunks it touches.
+//
+// Against the tree of an earlier image of the same machine, only the
+// chunks whose leaf changed are written. Most pages stay the same between
+// two images, so such a delta is much smaller. Its tree marks the chunks
+// it holds, and the chunks it does not hold are taken from the earlier
+// image when merging the two.
+
+#include "pipeline.h"
+
+#include <deque>
+#include <thread>
+
+#define HASH_DIGEST_SIZE 32  // SHA-256
+#define HASH_CHUNK_SIZE (1024 * 1024)
+
+struct Digest
+{
+    unsigned char bytes[HASH_DIGEST_SIZE];
+};
+
+
+// A tree read back from its text form. Only the leaves are kept.
+struct HashTree
+{
+    uint64_t chunk_size;
+    uint64_t image_size;
+    Digest root;
+    std::vector<Digest> leaves;
+
+    // The last chunk may be short.
+    uint64_t chunk_length(size_t index) const
+    {
+        uint64_t offset = index * chunk_size;
+
+        if (offset >= image_size) return 0;
+        return image_size - offset < chunk_size ? image_size - offset : chunk_size;
+    }
+};
+
+// Reads a tree written by HashingSink::write_tree().
+bool read_hash_tree(FILE *fd, HashTree *tree);
+
+
+// An incremental hash. Not thread safe: each worker has its own.
+class ChunkHasher
+{
+public:
+    virtual ~ChunkHasher() {}
+
+    virtual bool begin() = 0;
+    virtual bool update(const unsigned char *buffer, size_t length) = 0;
+    virtual bool finish(Digest *digest) = 0;
+};
+
+
+// Hashes everything written through it and passes it on to the inner
+// sink unchanged.
+class HashingSink: public ImageSink
+{
+public:
+    // hasher is used on the calling thread, and there is one worker per
+    // entry in workers. The inner sink and all the hashers must outlive
+    // this sink.
+    HashingSink(ImageSink *inner, ChunkHasher *hasher,
+                const std::vector<ChunkHasher *> &workers, size_t chunk_size);
+    virtual ~HashingSink();
+
+    virtual bool write(const unsigned char *buffer, size_t length);
+
+    // Padding is hashed as zeros, but stays padding in the inner sink.
+    virtual bool pad(uint64_t length);
+
+    // The runs are not where they were in the image in a delta.
+    virtual void add_run(uint64_t offset, uint64_t length)
+    {
+        if (!baseline_) inner_->add_run(offset, length);
+    }
+
+    // The inner sink's memory, with set_in_place().
+    virtual unsigned char *target(uint64_t offset, size_t length)
+    {
+        return in_place_ ? inner_->target(offset, length) : NULL;
+    }
+
+    // Only write the chunks that changed since the image of the
+    // baseline tree, which must outlive this sink. Must be called before
+    // anything is written.
+    void set_baseline(const HashTree *baseline) { baseline_ = baseline; }
+    size_t delta_chunks() const { return delta_chunks_; }
+
+    // Let the engine read straight into the inner sink's memory, and hash
+    // the chunks right there instead of copying them. Chunks are then
+    // held until hashed and written on in order, so the inner sink keeps
+    // their memory until then. Not for a delta. Must be called before
+    // anything is written.
+    void set_in_place(bool in_place) { in_place_ = in_place && !baseline_; }
+
+    // Hashes the last chunk, waits for the workers and builds the tree.
+    // Must be called once all the image has been written.
+    bool finish();
+
+    const Digest &root() const { return root_; }
+    const std::vector<Digest> &leaves() const { return leaves_; }
+    uint64_t image_size() const { return image_size_; }
+
+    // Write the tree as text, one line per leaf.
+    bool write_tree(FILE *fd, const char *algorithm) const;
+
+private:
+    struct Job
+    {
+        size_t index;
+        std::vector<unsigned char> data;
+
+        // The chunk in the inner sink's memory, instead of in data.
+        const unsigned char *in_place;
+        size_t in_place_length;
+        bool done;  // Hashed, if held.
+
+        const unsigned char *bytes() const { return in_place ? in_place : data.data(); }
+        size_t size() const { return in_place ? in_place_length : data.size(); }
+    };
+
+    // A held chunk waiting for its leaf. A NULL job is a whole chunk of
+    // padding.
+    struct Pending
+    {
+        size_t index;
+        Job *job;
+    };
+
+    void worker_(ChunkHasher *hasher);
+    bool hash_leaf_(ChunkHasher *hasher, const unsigned char *buffer, size_t length,
+                    Digest *digest);
+    bool hash_node_(const Digest &left, const Digest &right, Digest *digest);
+    bool zero_leaf_(Digest *digest);
+    bool append_(const unsigned char *buffer, size_t length, bool in_place);
+
+    // Are chunks written only once hashed?
+    bool hold_() const { return baseline_ || in_place_; }
+    bool submit_();
+    bool drain_(size_t keep);
+
+    ImageSink *inner_;
+    ChunkHasher *hasher_;
+    size_t chunk_size_;
+    size_t max_in_flight_;
+    uint64_t image_size_;
+    Digest root_;
+
+    // Only used by the writing thread.
+    Job *current_;
+    bool have_zero_leaf_;
+    Digest zero_leaf_digest_;
+    const HashTree *baseline_;
+    std::deque<Pending> pending_;
+    std::vector<bool> in_delta_;
+    size_t delta_chunks_;
+    bool in_place_;
+
+    // Shared with the workers, protected by mu_.
+    std::mutex mu_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    std::vector<Digest> leaves_;
+    std::deque<Job *> todo_;
+    std::vector<Job *> free_;
+    size_t in_flight_;
+    bool failed_;
+    bool stop_;
+
+    std::vector<std::thread> workers_;
+};
+
+#endif
@@ -38,11 +38,44 @@ void help(TCHAR* ExeName)
         L"  -w    Turn on write mode.\n"
         L"  -1    Use \\\\Device\\PhysicalMemory method (Default for 32bit OS).\n"
         L"  -2    Use PTE remapping (AMD64 only - Default for 64bit OS).\n"
+        L"  -a    Time a few reads with each method and use the one that\n"
+        L"        reads the most pages, the fastest if several do. What\n"
+        L"        each method did is kept in [output path].info.\n"
+        L"  -s    Write a sparse image: zero pages and gaps become holes.\n"
+        L"  -n    Write the image unbuffered to a preallocated file, so it\n"
+        L"        does not go through the file system cache.\n"
+        L"  -p    Read memory straight into a mapping of the output file,\n"
+        L"        saving a copy of every byte (uncompressed images only).\n"
+        L"  -c [xpress|huff]\n"
+        L"        Compress the image in 1 MB chunks (Windows 8 and later).\n"
+        L"  -x [filename]\n"
+        L"        Decompress this image, or delta, written with -c to the\n"
+        L"        output path instead of imaging memory (-s applies).\n"
+        L"  -m [filename]\n"
+        L"        Hash the image and write its SHA-256 hash tree to this file.\n"
+        L"  -b [filename]\n"
+        L"        Only write the 1 MB chunks that changed since the image with\n"
+        L"        the hash tree in this file (needs -m). Merge the images back\n"
+        L"        with go-winpmem reconstruct.\n"
+        L"  -r [min:max]\n"
+        L"        Bounds of the bulk read size in KB (Default 4:16384).\n"
+        L"  -k [filename]\n"
+        L"        Keep the unreadable pages in this file. The driver skips\n"
+        L"        them when imaging the same machine again.\n"
+        L"  -e    Don't skip unreadable regions once their end is found,\n"
+        L"        read every page in them with shrinking reads instead.\n"
+        L"  -j [filename]\n"
+        L"        Write read and write latencies, throughput and failure\n"
+        L"        counts to this file as JSON lines (- for stderr).\n"
+        L"  -t [threads]\n"
+        L"        Number of compression and hashing threads (Default one per\n"
+        L"        spare CPU).\n"
         L"\n");
 
     Log(L"NOTE: an output filename of - will write the image to STDOUT.\n");
     Log(L"\nExamples:\n");
     Log(L"%s physmem.raw\nWrites an image to physmem.raw\n", ExeName);
+    Log(L"%s -x physmem.wpmc physmem.raw\nDecompresses physmem.wpmc to physmem.raw\n", ExeName);
 }
 
 /* Create the corrent WinPmem object. Currently this selects between
@@ -79,6 +112,18 @@ int _tmain(int argc, _TCHAR* argv[])
     __int64 write_mode = 0;
     __int64 only_load_driver = 0;
     __int64 only_unload_driver = 0;
+    bool sparse = false;
+    int output_mode = OUTPUT_BUFFERED;
+    int compression = COMPRESSION_NONE;
+    unsigned __int32 worker_threads = 0;
+    TCHAR* hash_filename = NULL;
+    TCHAR* baseline_filename = NULL;
+    TCHAR* bad_pages_filename = NULL;
+    TCHAR* stats_filename = NULL;
+    TCHAR* extract_filename = NULL;
+    bool skip_bad_regions = true;
+    size_t read_min_kb = 0;
+    size_t read_max_kb = 0;
 
     WinPmem* pmem_handle = WinPmemFactory();
     TCHAR* driver_filename = NULL;
@@ -124,6 +169,113 @@ int _tmain(int argc, _TCHAR* argv[])
                     mode = PMEM_MODE_PTE;
                     break;
                 }
+                case 'a':
+                {
+                    mode = PMEM_MODE_AUTO;
+                    break;
+                }
+                case 's':
+                {
+                    sparse = true;
+                    break;
+                }
+                case 'n':
+                {
+                    output_mode = OUTPUT_UNBUFFERED;
+                    break;
+                }
+                case 'p':
+                {
+                    output_mode = OUTPUT_MAPPED;
+                    break;
+                }
+                case 'c':
+                {
+                    i++;
+                    if (!argv[i]) goto error;
+
+                    if (!_tcsicmp(argv[i], TEXT("xpress")))
+                    {
+                        compression = COMPRESSION_XPRESS;
+                    }
+                    else if (!_tcsicmp(argv[i], TEXT("huff")))
+                    {
+                        compression = COMPRESSION_XPRESS_HUFF;
+                    }
+                    else goto error;
+                }
+                break;
+
+                case 'x':
+                {
+                    i++;
+                    extract_filename = argv[i];
+                    if (!extract_filename) goto error;
+                }
+                break;
+
+                case 'm':
+                {
+                    i++;
+                    hash_filename = argv[i];
+                    if (!hash_filename) goto error;
+                }
+                break;
+
+                case 'b':
+                {
+                    i++;
+                    baseline_filename = argv[i];
+                    if (!baseline_filename) goto error;
+                }
+                break;
+
+                case 'r':
+                {
+                    TCHAR* separator = NULL;
+
+                    i++;
+                    if (!argv[i]) goto error;
+
+                    read_min_kb = _tcstoul(argv[i], &separator, 0);
+                    if (*separator != ':') goto error;
+
+                    read_max_kb = _tcstoul(separator + 1, NULL, 0);
+                    if (!read_min_kb || read_max_kb < read_min_kb) goto error;
+                }
+                break;
+
+                case 'k':
+                {
+                    i++;
+                    bad_pages_filename = argv[i];
+                    if (!bad_pages_filename) goto error;
+                }
+                break;
+
+                case 'j':
+                {
+                    i++;
+                    stats_filename = argv[i];
+                    if (!stats_filename) goto error;
+                }
+                break;
+
+                case 'e':
+                {
+                    skip_bad_regions = false;
+                    break;
+                }
+
+                case 't':
+                {
+                    i++;
+                    if (!argv[i]) goto error;
+
+                    worker_threads = _tcstoul(argv[i], NULL, 0);
+                }
+                break;
+
                 case 'w':
                 {
                     Log(TEXT("Enabling write mode.\n"));
@@ -168,13 +320,40 @@ int _tmain(int argc, _TCHAR* argv[])
         status = pmem_handle->uninstall_driver();
 
     }
+    else if (extract_filename && argv[i])
+    {
+        status = pmem_handle->create_output_file(argv[i], sparse);
+
+        if (status > 0)
+        {
+            status = pmem_handle->extract_image(extract_filename);
+        }
+    }
     else if (argv[i])
     {
         pmem_handle->set_driver_filename(driver_filename);
 
-        status = pmem_handle->create_output_file(argv[i]);
+        pmem_handle->set_output_mode(output_mode);
+        status = pmem_handle->create_output_file(argv[i], sparse);
+
+        if (status > 0)
+        {
+            status = pmem_handle->set_compression(compression);
+        }
+
+        pmem_handle->set_hash_file(hash_filename);
+        pmem_handle->set_baseline_file(baseline_filename);
+        pmem_handle->set_bad_pages_file(bad_pages_filename);
+        pmem_handle->set_stats_file(stats_filename);
+        pmem_handle->set_worker_threads(worker_threads);
+        pmem_handle->set_skip_bad_regions(skip_bad_regions);
+
+        if (read_max_kb)
+        {
+            pmem_handle->set_read_size_bounds(read_min_kb * 1024, read_max_kb * 1024);
+        }
 
-        if ((status) && (pmem_handle->install_driver() > 0) && (pmem_handle->set_acquisition_mode(mode) > 0))
+        if ((status > 0) && (pmem_handle->install_driver() > 0) && (pmem_handle->set_acquisition_mode(mode) > 0))
         {
             status = pmem_handle->write_raw_image();
         }
@@ -0,0 +1,709 @@
+/*
+  Copyright 2026 Velocidex Innovations <mike@velocidex.com>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "pipeline.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#ifdef _WIN32
+#include <malloc.h>
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+
+// Microseconds from since until now, for the observer.
+static uint64_t elapsed_us(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - since).count();
+}
+
+unsigned char *alloc_aligned_buffer(size_t size)
+{
+#ifdef _WIN32
+    return (unsigned char *)_aligned_malloc(size, PAGE_SIZE);
+#else
+    void *result = NULL;
+
+    if (posix_memalign(&result, PAGE_SIZE, size)) return NULL;
+
+    return (unsigned char *)result;
+#endif
+}
+
+void free_aligned_buffer(unsigned char *buffer)
+{
+#ifdef _WIN32
+    _aligned_free(buffer);
+#else
+    free(buffer);
+#endif
+}
+
+
+bool ImageSink::pad(uint64_t length)
+{
+    static const unsigned char zeros[PAGE_SIZE * 16] = { 0 };
+
+    while (length > 0)
+    {
+        size_t to_write = (size_t)std::min((uint64_t)sizeof(zeros), length);
+
+        if (!write(zeros, to_write)) return false;
+
+        length -= to_write;
+    }
+
+    return true;
+}
+
+
+ReadSizeController::ReadSizeController(size_t min_size, size_t max_size)
+{
+    set_bounds(min_size, max_size);
+}
+
+void ReadSizeController::set_bounds(size_t min_size, size_t max_size)
+{
+    min_size_ = std::max(min_size & ~(size_t)(PAGE_SIZE - 1), (size_t)PAGE_SIZE);
+    max_size_ = std::max(max_size & ~(size_t)(PAGE_SIZE - 1), min_size_);
+    size_ = max_size_;
+}
+
+bool ReadSizeController::on_clean_read()
+{
+    size_t old_size = size_;
+
+    size_ = std::min(size_ * 2, max_size_);
+
+    return size_ != old_size;
+}
+
+bool ReadSizeController::on_failed_read()
+{
+    size_t old_size = size_;
+
+    size_ = std::max((size_ / 4) & ~(size_t)(PAGE_SIZE - 1), min_size_);
+
+    return size_ != old_size;
+}
+
+
+CopyPipeline::CopyPipeline(size_t buffer_size, size_t buffer_count):
+    buffer_size_(buffer_size),
+    buffer_count_(std::max(buffer_count, (size_t)2)),
+    head_(0),
+    tail_(0),
+    filled_(0),
+    reader_done_(false),
+    aborted_(false),
+    read_size_(buffer_size, buffer_size),
+    skip_bad_regions_(false),
+    skip_until_(0),
+    last_bad_end_(UINT64_MAX),
+    probe_buffer_(NULL)
+{}
+
+CopyPipeline::~CopyPipeline()
+{
+    free_();
+}
+
+void CopyPipeline::free_()
+{
+    for (size_t i = 0; i < slots_.size(); i++)
+    {
+        free_aligned_buffer(slots_[i].data);
+    }
+
+    slots_.clear();
+
+    free_aligned_buffer(probe_buffer_);
+    probe_buffer_ = NULL;
+}
+
+void CopyPipeline::set_read_size_bounds(size_t min_size, size_t max_size)
+{
+    read_size_.set_bounds(min_size, max_size);
+
+    // The buffers must hold the largest read.
+    if (read_size_.max_size() != buffer_size_)
+    {
+        free_();
+        buffer_size_ = read_size_.max_size();
+    }
+}
+
+// The ring is allocated on first use and then reused for every copy.
+bool CopyPipeline::allocate_()
+{
+    if (!probe_buffer_) probe_buffer_ = alloc_aligned_buffer(PAGE_SIZE);
+    if (!probe_buffer_) return false;
+
+    while (slots_.size() < buffer_count_)
+    {
+        Slot slot;
+
+        slot.data = alloc_aligned_buffer(buffer_size_);
+        slot.buffer = slot.data;
+        slot.length = 0;
+
+        if (!slot.data) return false;
+
+        slots_.push_back(slot);
+    }
+
+    return true;
+}
+
+// Can the page at offset be read?
+bool CopyPipeline::probe_(PhysicalMemorySource *source, uint64_t offset, uint64_t end,
+                          CopyObserver *observer)
+{
+    size_t length = (size_t)std::min((uint64_t)PAGE_SIZE, end - offset);
+    size_t bytes_read = 0;
+
+    if (observer) observer->on_retry(offset, length);
+
+    return source->read(offset, probe_buffer_, length, &bytes_read) && bytes_read == length;
+}
+
+// The page before from is bad. Find the first readable page after it, or
+// end if there is none. Probes gallop ahead with growing strides until
+// one reads, then bisect back to where the bad region ends, so a region
+// of n pages costs O(log n) reads.
+uint64_t CopyPipeline::find_readable_(PhysicalMemorySource *source,
+                                      uint64_t from, uint64_t end,
+                                      CopyObserver *observer)
+{
+    uint64_t bad = from - PAGE_SIZE;
+    uint64_t good = end;
+    uint64_t stride = PAGE_SIZE;
+
+    while (bad + stride < end)
+    {
+        uint64_t probe = bad + stride;
+
+        if (probe_(source, probe, end, observer))
+        {
+            good = probe;
+            break;
+        }
+
+        bad = probe;
+        stride *= 2;
+    }
+
+    while (good - bad > PAGE_SIZE)
+    {
+        uint64_t middle = bad + (good - bad) / PAGE_SIZE / 2 * PAGE_SIZE;
+
+        if (probe_(source, middle, end, observer)) good = middle;
+        else bad = middle;
+    }
+
+    return good;
+}
+
+void CopyPipeline::read_loop_(PhysicalMemorySource *source, ImageSink *sink,
+                              uint64_t start, uint64_t end,
+                              CopyObserver *observer)
+{
+    while (start < end)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        Slot *slot;
+
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            cv_.wait(lock, [this] { return aborted_ || filled_ < slots_.size(); });
+
+            if (aborted_) break;
+
+            slot = &slots_[head_];
+        }
+
+        if (observer)
+        {
+            observer->on_read_wait(elapsed_us(now));
+            now = std::chrono::steady_clock::now();
+        }
+
+        // Reads end on a page boundary, so the smallest read that fails is
+        // exactly one page.
+        size_t to_read = (size_t)std::min(
+            (uint64_t)(read_size_.size() - start % PAGE_SIZE), end - start);
+        size_t bytes_read = 0;
+        bool failed;
+        bool resized;
+
+        failures_.clear();
+
+        if (start < skip_until_)
+        {
+            to_read = (size_t)std::min((uint64_t)buffer_size_, skip_until_ - start);
+        }
+
+        // Read straight into the sink if it lets us. That saves copying
+        // every byte once more.
+        slot->offset = start;
+        slot->buffer = sink->target(start, to_read);
+        if (!slot->buffer) slot->buffer = slot->data;
+
+        if (start < skip_until_)
+        {
+            // Inside a bad region whose end the probes found. It is not
+            // read, so its pages are zero filled and all reported.
+            memset(slot->buffer, 0, to_read);
+
+            for (size_t done = 0; done < to_read; done += PAGE_SIZE)
+            {
+                PageFailure failure = { start + done, PAGE_SKIPPED };
+
+                failures_.push_back(failure);
+            }
+
+            bytes_read = slot->length = to_read;
+            failed = true;
+            resized = false;
+        }
+        else if (source->read_all(start, slot->buffer, to_read, &failures_))
+        {
+            // The bad pages are already zero filled. Nothing is read
+            // twice, so there is no reason to read less.
+            bytes_read = slot->length = to_read;
+            failed = !failures_.empty();
+
+            if (observer) observer->on_read_time(start, bytes_read, elapsed_us(now));
+
+            resized = read_size_.on_clean_read();
+        }
+        else
+        {
+            bool result = source->read(start, slot->buffer, to_read, &bytes_read);
+
+            // Cant really happen but we can check anyway.
+            if (bytes_read > to_read) bytes_read = to_read;
+
+            if (observer) observer->on_read_time(start, bytes_read, elapsed_us(now));
+
+            slot->length = bytes_read;
+
+            failed = !result || bytes_read == 0;
+
+            // The device fails the whole read for one bad page, so we
+            // don't know where it is. Try again with less.
+            if (failed && bytes_read == 0 &&
+                to_read > PAGE_SIZE - start % PAGE_SIZE &&
+                read_size_.on_failed_read())
+            {
+                if (observer)
+                {
+                    observer->on_read_size(start, read_size_.size());
+                    observer->on_retry(start, std::min(to_read, read_size_.size()));
+                }
+                continue;
+            }
+
+            resized = failed ? read_size_.on_failed_read() : read_size_.on_clean_read();
+
+            // The bytes before a read error are still good. There is no
+            // point trying the failing page again, so pad it with zeros
+            // and carry on with the next one.
+            if (failed)
+            {
+                size_t pad = std::min(PAGE_SIZE - (size_t)((start + bytes_read) % PAGE_SIZE),
+                                      to_read - bytes_read);
+                PageFailure failure = { start + bytes_read, PAGE_FAILED };
+
+                memset(slot->buffer + bytes_read, 0, pad);
+                slot->length += pad;
+                failures_.push_back(failure);
+
+                // Only a read that failed on its first page tells us
+                // exactly which page is bad.
+                bool exact = bytes_read > 0 || to_read <= PAGE_SIZE - start % PAGE_SIZE;
+                uint64_t bad_end = start + bytes_read + pad;
+
+                if (exact && skip_bad_regions_ && last_bad_end_ == start + bytes_read &&
+                    bad_end < end)
+                {
+                    skip_until_ = find_readable_(source, bad_end, end, observer);
+
+                    if (skip_until_ > bad_end && observer)
+                    {
+                        observer->on_bad_region(bad_end, skip_until_ - bad_end);
+                    }
+                }
+
+                last_bad_end_ = exact ? bad_end : UINT64_MAX;
+            }
+        }
+
+        if (observer)
+        {
+            for (size_t i = 0; i < failures_.size(); i++)
+            {
+                observer->on_page_failure(failures_[i].offset, failures_[i].reason);
+            }
+        }
+
+        if (observer) observer->on_read(start, bytes_read, failed);
+
+        start += slot->length;
+
+        if (resized && observer) observer->on_read_size(start, read_size_.size());
+
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+
+            head_ = (head_ + 1) % slots_.size();
+            filled_++;
+        }
+        cv_.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        reader_done_ = true;
+    }
+    cv_.notify_all();
+}
+
+bool CopyPipeline::copy(PhysicalMemorySource *source, ImageSink *sink,
+                        uint64_t start, uint64_t end, CopyObserver *observer)
+{
+    bool result = true;
+
+    if (!allocate_()) return false;
+
+    head_ = tail_ = filled_ = 0;
+    reader_done_ = aborted_ = false;
+    skip_until_ = 0;
+    last_bad_end_ = UINT64_MAX;
+
+    std::thread reader(&CopyPipeline::read_loop_, this, source, sink, start, end, observer);
+
+    while (true)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        Slot *slot;
+
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            cv_.wait(lock, [this] { return filled_ > 0 || reader_done_; });
+
+            if (filled_ == 0) break;
+
+            slot = &slots_[tail_];
+        }
+
+        if (observer)
+        {
+            observer->on_write_wait(slot->offset, elapsed_us(now));
+            now = std::chrono::steady_clock::now();
+        }
+
+        bool written = sink->write(slot->buffer, slot->length);
+
+        if (observer) observer->on_write_time(slot->offset, slot->length, elapsed_us(now));
+
+        if (!written)
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+
+            aborted_ = true;
+            result = false;
+            break;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+
+            tail_ = (tail_ + 1) % slots_.size();
+            filled_--;
+        }
+        cv_.notify_all();
+    }
+
+    cv_.notify_all();
+    reader.join();
+
+    return result;
+}
+
+bool CopyPipeline::copy_image(PhysicalMemorySource *source, ImageSink *sink,
+                              CopyObserver *observer)
+{
+    std::vector<MemoryRun> runs;
+    uint64_t current = 0;
+
+    if (!source->get_runs(&runs)) return false;
+
+    read_size_.reset();
+
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        const MemoryRun &run = runs[i];
+
+        // The image is written sequentially.
+        if (run.offset < current) return false;
+
+        if (run.offset > current)
+        {
+            if (observer) observer->on_pad(current, run.offset - current);
+
+            // In sparse mode this is a hole, otherwise zeros.
+            if (!sink->pad(run.offset - current)) return false;
+        }
+
+        if (observer) observer->on_run(run.offset, run.length);
+
+        sink->add_run(run.offset, run.length);
+
+        if (!copy(source, sink, run.offset, run.offset + run.length, observer)) return false;
+
+        current = run.offset + run.length;
+    }
+
+    return true;
+}
+
+
+FileSource::FileSource():
+    fd_(NULL),
+    size_(0),
+    error_threshold_(0),
+    seed_(0),
+    call_us_(0),
+    mb_us_(0),
+    read_all_(false),
+    short_reads_(true),
+    calls_(0)
+{}
+
+FileSource::~FileSource()
+{
+    if (fd_) fclose(fd_);
+}
+
+bool FileSource::open(const char *filename)
+{
+    fd_ = fopen(filename, "rb");
+
+    if (!fd_) return false;
+
+    if (fseek64(fd_, 0, SEEK_END)) return false;
+
+    size_ = ftell64(fd_);
+
+    return true;
+}
+
+void FileSource::set_error_rate(double rate, uint32_t seed)
+{
+    rate = std::min(std::max(rate, 0.0), 1.0);
+
+    // 2^64 does not fit, so a rate of 1 misses one page in 2^64.
+    error_threshold_ = rate >= 1.0 ? UINT64_MAX : (uint64_t)(rate * 18446744073709551616.0);
+    seed_ = seed;
+}
+
+void FileSource::set_latency(uint32_t call_us, uint32_t mb_us)
+{
+    call_us_ = call_us;
+    mb_us_ = mb_us;
+}
+
+void FileSource::add_bad_range(uint64_t offset, uint64_t length)
+{
+    MemoryRun range = { offset, length };
+
+    bad_ranges_.push_back(range);
+}
+
+bool FileSource::get_runs(std::vector<MemoryRun> *runs)
+{
+    if (!fd_) return false;
+
+    if (runs_.empty())
+    {
+        MemoryRun run = { 0, size_ };
+
+        runs->push_back(run);
+    }
+    else
+    {
+        runs->insert(runs->end(), runs_.begin(), runs_.end());
+    }
+
+    return true;
+}
+
+// splitmix64 of the page number, so bad pages are spread evenly but are
+// the same every time.
+bool FileSource::is_bad_page_(uint64_t page) const
+{
+    uint64_t x = page + seed_ * 0x9E3779B97F4A7C15ULL;
+
+    for (size_t i = 0; i < bad_ranges_.size(); i++)
+    {
+        const MemoryRun &range = bad_ranges_[i];
+
+        if (page * PAGE_SIZE + PAGE_SIZE > range.offset &&
+            page * PAGE_SIZE < range.offset + range.length)
+        {
+            return true;
+        }
+    }
+
+    if (!error_threshold_) return false;
+
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x = x ^ (x >> 31);
+
+    return x < error_threshold_;
+}
+
+// Called with mu_ held. Returns how much was read before the end of the
+// file.
+size_t FileSource::read_file_(uint64_t offset, unsigned char *buffer, size_t length)
+{
+    if (offset >= size_) return 0;
+
+    size_t to_read = (size_t)std::min((uint64_t)length, size_ - offset);
+
+    if (fseek64(fd_, offset, SEEK_SET)) return 0;
+
+    return fread(buffer, 1, to_read, fd_);
+}
+
+void FileSource::delay_(size_t length)
+{
+    uint64_t us = call_us_ + (uint64_t)mb_us_ * length / (1024 * 1024);
+
+    if (us) std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+bool FileSource::read_all(uint64_t offset, unsigned char *buffer, size_t length,
+                          std::vector<PageFailure> *failures)
+{
+    if (!read_all_) return false;
+
+    std::lock_guard<std::mutex> lock(mu_);
+
+    calls_++;
+    delay_(length);
+
+    if (!fd_) return false;
+
+    size_t bytes_read = read_file_(offset, buffer, length);
+
+    // Past the end of the file is as bad as a bad page.
+    memset(buffer + bytes_read, 0, length - bytes_read);
+
+    for (uint64_t page = offset / PAGE_SIZE; page * PAGE_SIZE < offset + length; page++)
+    {
+        uint64_t page_offset = page * PAGE_SIZE;
+        uint64_t start = std::max(page_offset, offset);
+        uint64_t end = std::min(page_offset + PAGE_SIZE, offset + length);
+
+        if (end > offset + bytes_read)
+        {
+            PageFailure failure = { page_offset, PAGE_MAP_FAILED };
+
+            failures->push_back(failure);
+        }
+        else if (is_bad_page_(page))
+        {
+            PageFailure failure = { page_offset, PAGE_ACCESS_FAILED };
+
+            memset(buffer + (start - offset), 0, (size_t)(end - start));
+            failures->push_back(failure);
+        }
+    }
+
+    return true;
+}
+
+bool FileSource::read(uint64_t offset, unsigned char *buffer, size_t length,
+                      size_t *bytes_read)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+
+    calls_++;
+    delay_(length);
+
+    *bytes_read = 0;
+
+    if (!fd_) return false;
+
+    // Stop at the first bad page, like ReadFile() on the device does.
+    for (uint64_t page = offset / PAGE_SIZE; page * PAGE_SIZE < offset + length; page++)
+    {
+        if (is_bad_page_(page))
+        {
+            uint64_t page_offset = std::max(page * PAGE_SIZE, offset);
+
+            length = (size_t)(page_offset - offset);
+
+            if (short_reads_) *bytes_read = read_file_(offset, buffer, length);
+            return false;
+        }
+    }
+
+    *bytes_read = read_file_(offset, buffer, length);
+
+    if (*bytes_read != length)
+    {
+        if (!short_reads_) *bytes_read = 0;
+        return false;
+    }
+
+    return true;
+}
+
+
+FileSink::FileSink(): fd_(NULL) {}
+
+FileSink::~FileSink()
+{
+    if (fd_) fclose(fd_);
+}
+
+bool FileSink::open(const char *filename)
+{
+    fd_ = fopen(filename, "wb");
+
+    return fd_ != NULL;
+}
+
+bool FileSink::write(const unsigned char *buffer, size_t length)
+{
+    if (!fd_) return false;
+
+    return fwrite(buffer, 1, length, fd_) == length;
+}
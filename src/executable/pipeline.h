@@ -0,0 +1,345 @@
+/*
+  Copyright 2026 Velocidex Innovations <mike@velocidex.com>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+// The copy engine of the imager. Nothing in here depends on Win32 so the
+// engine can be built and benchmarked on any platform against a file
+// backed stand-in for the pmem device.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 0x1000
+#endif
+
+// Allocate/free a page aligned buffer.
+unsigned char *alloc_aligned_buffer(size_t size);
+void free_aligned_buffer(unsigned char *buffer);
+
+
+// Why a page could not be read. The known reasons have the same values
+// as PMEM_PAGE_* in winpmem_shared.h.
+enum PageFailureReason
+{
+    PAGE_ACCESS_FAILED = 1,  // Blocked, usually by the hypervisor.
+    PAGE_MAP_FAILED = 2,
+    PAGE_FAILED = 3,         // Don't know.
+    PAGE_SKIPPED = 4         // Not read, inside a region the probes found bad.
+};
+
+struct PageFailure
+{
+    uint64_t offset;
+    int reason;
+};
+
+// A range of physical memory that holds RAM.
+struct MemoryRun
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+
+// Somewhere to read physical memory from. This is the pmem device on a
+// live system.
+class PhysicalMemorySource
+{
+public:
+    virtual ~PhysicalMemorySource() {}
+
+    // The runs of memory to image, sorted by offset. The gaps between
+    // them are padded with zeros.
+    virtual bool get_runs(std::vector<MemoryRun> *runs) = 0;
+
+    // Read length bytes at offset, zero filling the pages that can't be
+    // read instead of stopping at them, and append those pages to
+    // failures. Sources that can't do this return false, and the engine
+    // uses read() instead.
+    virtual bool read_all(uint64_t offset, unsigned char *buffer, size_t length,
+                          std::vector<PageFailure> *failures) { return false; }
+
+    // Read up to length bytes at offset into buffer. This has the same
+    // semantics as ReadFile() on the pmem device: A false return means
+    // the read stopped at an unreadable page, but *bytes_read bytes
+    // before it are still good.
+    virtual bool read(uint64_t offset, unsigned char *buffer, size_t length,
+                      size_t *bytes_read) = 0;
+};
+
+
+// Somewhere to write the image to. Images are always written
+// sequentially.
+class ImageSink
+{
+public:
+    virtual ~ImageSink() {}
+
+    virtual bool write(const unsigned char *buffer, size_t length) = 0;
+
+    // Write length bytes of zeros.
+    virtual bool pad(uint64_t length);
+
+    // The run of memory at offset is written next. Sinks that keep an
+    // index of the image record it.
+    virtual void add_run(uint64_t offset, uint64_t length) {}
+
+    // Memory that holds the image bytes at offset, for the engine to read
+    // straight into. The same memory is passed to write() later, and the
+    // sink need not copy it then. Sinks without such memory return NULL.
+    virtual unsigned char *target(uint64_t offset, size_t length) { return NULL; }
+};
+
+
+// Receives progress from the copy engine. Called on the reader thread,
+// except where noted.
+class CopyObserver
+{
+public:
+    virtual ~CopyObserver() {}
+
+    // A read at offset returned bytes_read bytes. If failed is set some
+    // page in them, or the page right after them, could not be read and
+    // was zero padded.
+    virtual void on_read(uint64_t offset, size_t bytes_read, bool failed) {}
+
+    // The page at offset could not be read.
+    virtual void on_page_failure(uint64_t offset, int reason) {}
+
+    // Copying the run at offset starts.
+    virtual void on_run(uint64_t offset, uint64_t length) {}
+
+    // The gap at offset is padded with zeros.
+    virtual void on_pad(uint64_t offset, uint64_t length) {}
+
+    // From offset on, reads are size bytes long.
+    virtual void on_read_size(uint64_t offset, size_t size) {}
+
+    // The probes found the region at offset to be unreadable. It is not
+    // read, its pages are zero filled and reported to on_page_failure()
+    // as PAGE_SKIPPED.
+    virtual void on_bad_region(uint64_t offset, uint64_t length) {}
+
+    // A call to the source at offset returned bytes_read bytes after
+    // micros microseconds.
+    virtual void on_read_time(uint64_t offset, size_t bytes_read, uint64_t micros) {}
+
+    // The range at offset is read again after a failure, or probed for
+    // the end of a bad region.
+    virtual void on_retry(uint64_t offset, size_t length) {}
+
+    // The reader waited this long for a free buffer, so the sink is
+    // slower than the source.
+    virtual void on_read_wait(uint64_t micros) {}
+
+    // Called on the writer thread: Writing length bytes at offset to the
+    // sink took micros microseconds.
+    virtual void on_write_time(uint64_t offset, size_t length, uint64_t micros) {}
+
+    // Called on the writer thread: It waited this long for the buffer at
+    // offset, so the source is slower than the sink.
+    virtual void on_write_wait(uint64_t offset, uint64_t micros) {}
+};
+
+
+// Picks the size of the next bulk read. After a failure reads shrink
+// quickly, so the region around a bad page is not read over and over in
+// large pieces. Through clean stretches they grow back to the maximum,
+// where reads on a clean host stay.
+class ReadSizeController
+{
+public:
+    ReadSizeController(size_t min_size, size_t max_size);
+
+    // Both are rounded to whole pages. Starts at the maximum.
+    void set_bounds(size_t min_size, size_t max_size);
+    void reset() { size_ = max_size_; }
+
+    size_t size() const { return size_; }
+    size_t min_size() const { return min_size_; }
+    size_t max_size() const { return max_size_; }
+
+    // These return true if the size changed.
+    bool on_clean_read();
+    bool on_failed_read();
+
+private:
+    size_t min_size_;
+    size_t max_size_;
+    size_t size_;
+};
+
+
+// Copies a range of physical memory to an image sink. One thread keeps
+// reading from the source into a ring of reusable buffers while the
+// calling thread drains the filled buffers into the sink, so the device
+// and the disk work at the same time.
+class CopyPipeline
+{
+public:
+    CopyPipeline(size_t buffer_size, size_t buffer_count);
+    virtual ~CopyPipeline();
+
+    // Let the read size adapt between these. The default is a fixed
+    // buffer_size. The buffers are max_size large.
+    void set_read_size_bounds(size_t min_size, size_t max_size);
+
+    // After two bad pages in a row, find the end of the bad region with
+    // a few probes and zero fill up to there instead of reading it with
+    // shrinking reads. A readable page between the probes is lost, so
+    // every page in the region is reported as PAGE_SKIPPED.
+    void set_skip_bad_regions(bool skip) { skip_bad_regions_ = skip; }
+
+    // Copy [start, end) from source to sink. Returns false if the sink
+    // failed, or if buffers could not be allocated. As in copy_image(),
+    // start is taken to be the offset of the bytes in the image.
+    bool copy(PhysicalMemorySource *source, ImageSink *sink,
+              uint64_t start, uint64_t end, CopyObserver *observer);
+
+    // Copy every run of the source to the sink, padding the gaps. Returns
+    // false if the source has no runs, or copy() failed.
+    bool copy_image(PhysicalMemorySource *source, ImageSink *sink,
+                    CopyObserver *observer);
+
+    size_t buffer_size() const { return buffer_size_; }
+
+private:
+    struct Slot
+    {
+        unsigned char *data;
+        unsigned char *buffer;  // What was read: data, or the target of the sink.
+        uint64_t offset;
+        size_t length;
+    };
+
+    bool allocate_();
+    void free_();
+    bool probe_(PhysicalMemorySource *source, uint64_t offset, uint64_t end,
+                CopyObserver *observer);
+    uint64_t find_readable_(PhysicalMemorySource *source, uint64_t from, uint64_t end,
+                            CopyObserver *observer);
+    void read_loop_(PhysicalMemorySource *source, ImageSink *sink,
+                    uint64_t start, uint64_t end, CopyObserver *observer);
+
+    size_t buffer_size_;
+    size_t buffer_count_;
+    std::vector<Slot> slots_;
+
+    // Ring state, protected by mu_.
+    std::mutex mu_;
+    std::condition_variable cv_;
+    size_t head_;     // Next slot the reader fills.
+    size_t tail_;     // Next slot the writer drains.
+    size_t filled_;
+    bool reader_done_;
+    bool aborted_;
+
+    // Only used by the reader.
+    std::vector<PageFailure> failures_;
+    ReadSizeController read_size_;
+    bool skip_bad_regions_;
+    uint64_t skip_until_;     // The end of a bad region being skipped.
+    uint64_t last_bad_end_;   // Just after the last page known to be bad.
+    unsigned char *probe_buffer_;
+};
+
+
+// A file backed stand-in for the pmem device. Reads past the end of the
+// file fail like an unreadable page would. Bad pages and device latency
+// can be injected, to test and benchmark the engine without a driver.
+class FileSource: public PhysicalMemorySource
+{
+public:
+    FileSource();
+    virtual ~FileSource();
+
+    bool open(const char *filename);
+    uint64_t size() const { return size_; }
+
+    // The whole file is one run unless set here.
+    void set_runs(const std::vector<MemoryRun> &runs) { runs_ = runs; }
+
+    // Each page is unreadable with this probability. Which pages are bad
+    // only depends on the seed, so they fail on every read.
+    void set_error_rate(double rate, uint32_t seed);
+
+    // Make all of a range unreadable, like memory a hypervisor protects.
+    void add_bad_range(uint64_t offset, uint64_t length);
+
+    // Sleep for call_us on every read, plus mb_us for every MB read.
+    void set_latency(uint32_t call_us, uint32_t mb_us);
+
+    // Like a driver with IOCTL_READ_PHYSICAL_CONTINUE: read_all() reads
+    // past bad pages and reports them.
+    void set_read_all(bool read_all) { read_all_ = read_all; }
+
+    // By default a read() returns the bytes before a bad page. The driver
+    // returns nothing at all instead, which this emulates when off.
+    void set_short_reads(bool short_reads) { short_reads_ = short_reads; }
+
+    // How many reads were made, the syscalls on a real device.
+    uint64_t calls() const { return calls_; }
+
+    virtual bool get_runs(std::vector<MemoryRun> *runs);
+    virtual bool read_all(uint64_t offset, unsigned char *buffer, size_t length,
+                          std::vector<PageFailure> *failures);
+    virtual bool read(uint64_t offset, unsigned char *buffer, size_t length,
+                      size_t *bytes_read);
+
+private:
+    bool is_bad_page_(uint64_t page) const;
+    size_t read_file_(uint64_t offset, unsigned char *buffer, size_t length);
+    void delay_(size_t length);
+
+    FILE *fd_;
+    uint64_t size_;
+    std::vector<MemoryRun> runs_;
+    std::vector<MemoryRun> bad_ranges_;
+    uint64_t error_threshold_;  // Out of 2^64.
+    uint32_t seed_;
+    uint32_t call_us_;
+    uint32_t mb_us_;
+    bool read_all_;
+    bool short_reads_;
+    uint64_t calls_;
+    std::mutex mu_;
+};
+
+
+// Writes the image to a stdio stream.
+class FileSink: public ImageSink
+{
+public:
+    FileSink();
+    virtual ~FileSink();
+
+    bool open(const char *filename);
+
+    virtual bool write(const unsigned char *buffer, size_t length);
+
+private:
+    FILE *fd_;
+};
+
+#endif
@@ -0,0 +1,200 @@
+/*
+  Copyright 2026 Velocidex Innovations <mike@velocidex.com>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "sparse.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define ZERO_SCAN_X86
+
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SSE2_TARGET
+#define AVX2_TARGET
+#else
+#include <cpuid.h>
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+
+// Plain C for whatever is left over.
+static bool is_zero_tail(const unsigned char *buffer, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (buffer[i]) return false;
+    }
+
+    return true;
+}
+
+#ifdef ZERO_SCAN_X86
+
+// AVX2 also needs the OS to save the ymm registers.
+static bool cpu_has_avx2()
+{
+#ifdef _MSC_VER
+    int info[4];
+
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28))) return false;  // OSXSAVE, AVX
+
+    if ((_xgetbv(0) & 6) != 6) return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    unsigned int a, b, c, d;
+    unsigned int xcr0_low, xcr0_high;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) return false;
+
+    __asm__ ("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+    if ((xcr0_low & 6) != 6) return false;
+
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+    return (b & bit_AVX2) != 0;
+#endif
+}
+
+AVX2_TARGET
+static bool is_zero_avx2(const unsigned char *buffer, size_t length)
+{
+    size_t i = 0;
+
+    // Four registers at a time, and only look at the result once per 128
+    // bytes. Pages are almost never zero in their first bytes only.
+    for (; i + 128 <= length; i += 128)
+    {
+        __m256i acc = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buffer + i)),
+                            _mm256_loadu_si256((const __m256i *)(buffer + i + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buffer + i + 64)),
+                            _mm256_loadu_si256((const __m256i *)(buffer + i + 96))));
+
+        if (!_mm256_testz_si256(acc, acc)) return false;
+    }
+
+    return is_zero_tail(buffer + i, length - i);
+}
+
+SSE2_TARGET
+static bool is_zero_sse2(const unsigned char *buffer, size_t length)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 64 <= length; i += 64)
+    {
+        __m128i acc = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(buffer + i)),
+                         _mm_loadu_si128((const __m128i *)(buffer + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(buffer + i + 32)),
+                         _mm_loadu_si128((const __m128i *)(buffer + i + 48))));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) return false;
+    }
+
+    return is_zero_tail(buffer + i, length - i);
+}
+
+bool is_zero_block(const unsigned char *buffer, size_t length)
+{
+    static const bool has_avx2 = cpu_has_avx2();
+
+    if (has_avx2) return is_zero_avx2(buffer, length);
+
+    return is_zero_sse2(buffer, length);
+}
+
+#else
+
+bool is_zero_block(const unsigned char *buffer, size_t length)
+{
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+    {
+        uint64_t value;
+
+        memcpy(&value, buffer + i, sizeof(value));
+        if (value) return false;
+    }
+
+    return is_zero_tail(buffer + i, length - i);
+}
+
+#endif
+
+
+bool SparseSink::write(const unsigned char *buffer, size_t length)
+{
+    size_t i = 0;
+
+    if (!sparse_) return write_data(buffer, length);
+
+    // Split the buffer into runs of zero and non zero pages. Zero runs
+    // become holes, the rest is written in as few calls as possible.
+    while (i < length)
+    {
+        size_t run = std::min((size_t)PAGE_SIZE, length - i);
+        bool zero = is_zero_block(buffer + i, run);
+
+        while (i + run < length)
+        {
+            size_t next = std::min((size_t)PAGE_SIZE, length - i - run);
+
+            if (is_zero_block(buffer + i + run, next) != zero) break;
+
+            run += next;
+        }
+
+        if (zero)
+        {
+            if (!skip(run)) return false;
+            hole_bytes_ += run;
+        }
+        else if (!write_data(buffer + i, run))
+        {
+            return false;
+        }
+
+        i += run;
+    }
+
+    return true;
+}
+
+bool SparseSink::pad(uint64_t length)
+{
+    if (!sparse_) return ImageSink::pad(length);
+
+    if (!skip(length)) return false;
+    hole_bytes_ += length;
+
+    return true;
+}
@@ -0,0 +1,52 @@
+/*
+  Copyright 2026 Velocidex Innovations <mike@velocidex.com>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _SPARSE_H_
+#define _SPARSE_H_
+
+#include "pipeline.h"
+
+// Returns true if all length bytes at buffer are zero. Uses AVX2 if the
+// CPU has it, SSE2 otherwise.
+bool is_zero_block(const unsigned char *buffer, size_t length);
+
+
+// An image sink that turns runs of zero pages, and padding, into holes
+// in the output file. Subclasses do the actual writing and seeking.
+class SparseSink: public ImageSink
+{
+public:
+    SparseSink(): sparse_(false), hole_bytes_(0) {}
+
+    void set_sparse(bool sparse) { sparse_ = sparse; }
+
+    virtual bool write(const unsigned char *buffer, size_t length);
+    virtual bool pad(uint64_t length);
+
+    // How much of the image was left as holes.
+    uint64_t hole_bytes() const { return hole_bytes_; }
+
+protected:
+    virtual bool write_data(const unsigned char *buffer, size_t length) = 0;
+
+    // Move the end of the file length bytes forward without writing.
+    virtual bool skip(uint64_t length) = 0;
+
+    bool sparse_;
+    uint64_t hole_bytes_;
+};
+
+#endif
@@ -0,0 +1,393 @@
+/*
+  Copyright 2026 Velocidex Innovations <mike@velocidex.com>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "stats.h"
+
+#include <string.h>
+
+#define MB (1024.0 * 1024.0)
+
+
+void LatencyHistogram::reset()
+{
+    memset(buckets_, 0, sizeof(buckets_));
+    count_ = total_ = max_ = 0;
+}
+
+void LatencyHistogram::add(uint64_t micros)
+{
+    int bucket = 0;
+
+    while (bucket < BUCKETS - 1 && (micros >> (bucket + 1))) bucket++;
+
+    buckets_[bucket]++;
+    count_++;
+    total_ += micros;
+    if (micros > max_) max_ = micros;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+    uint64_t wanted = (uint64_t)(p * count_ + 0.5);
+    uint64_t seen = 0;
+
+    if (!count_) return 0;
+    if (wanted < 1) wanted = 1;
+
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        seen += buckets_[i];
+
+        if (seen >= wanted)
+        {
+            uint64_t bound = ((uint64_t)2 << i) - 1;
+
+            return bound < max_ ? bound : max_;
+        }
+    }
+
+    return max_;
+}
+
+void LatencyHistogram::write_json(FILE *fd, bool buckets) const
+{
+    fprintf(fd, "{\"count\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu",
+            (unsigned long long)count_, mean(),
+            (unsigned long long)percentile(0.5),
+            (unsigned long long)percentile(0.9),
+            (unsigned long long)percentile(0.99),
+            (unsigned long long)max_);
+
+    if (buckets)
+    {
+        int last = BUCKETS - 1;
+
+        while (last > 0 && !buckets_[last]) last--;
+
+        fprintf(fd, ",\"buckets\":[");
+        for (int i = 0; i <= last; i++)
+        {
+            fprintf(fd, i ? ",%llu" : "%llu", (unsigned long long)buckets_[i]);
+        }
+        fprintf(fd, "]");
+    }
+
+    fprintf(fd, "}");
+}
+
+
+void ThroughputWindow::reset()
+{
+    samples_.clear();
+    bytes_ = 0;
+}
+
+void ThroughputWindow::expire_(double now)
+{
+    while (!samples_.empty() && samples_.front().time < now - seconds_)
+    {
+        bytes_ -= samples_.front().bytes;
+        samples_.pop_front();
+    }
+}
+
+void ThroughputWindow::add(double now, uint64_t bytes)
+{
+    Sample sample = { now, bytes };
+
+    samples_.push_back(sample);
+    bytes_ += bytes;
+    expire_(now);
+}
+
+double ThroughputWindow::rate(double now)
+{
+    expire_(now);
+
+    // Early on the window is not full yet.
+    double span = now < seconds_ ? now : seconds_;
+
+    return span > 0 ? bytes_ / span : 0;
+}
+
+
+void CopyStats::Counters::reset()
+{
+    bytes_read = bytes_written = bytes_padded = 0;
+    reads = failed_reads = failed_pages = retries = 0;
+    bad_regions = bad_region_bytes = 0;
+    read_wait_us = write_wait_us = 0;
+    read_us.reset();
+    write_us.reset();
+}
+
+CopyStats::CopyStats(FILE *fd, CopyObserver *next, double interval, double window):
+    fd_(fd),
+    next_(next),
+    interval_(interval),
+    start_(std::chrono::steady_clock::now()),
+    in_run_(false),
+    run_offset_(0),
+    run_length_(0),
+    run_start_(0),
+    last_progress_(0),
+    offset_(0),
+    read_rate_(window),
+    write_rate_(window)
+{
+    run_.reset();
+    total_.reset();
+}
+
+double CopyStats::now_() const
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_;
+
+    return elapsed.count();
+}
+
+void CopyStats::write_counters_(const Counters &counters, double seconds, bool buckets)
+{
+    fprintf(fd_, "\"bytes_read\":%llu,\"bytes_written\":%llu,\"bytes_padded\":%llu,"
+            "\"reads\":%llu,\"failed_reads\":%llu,\"failed_pages\":%llu,\"retries\":%llu,"
+            "\"bad_regions\":%llu,\"bad_region_bytes\":%llu,"
+            "\"read_wait_ms\":%.1f,\"write_wait_ms\":%.1f,",
+            (unsigned long long)counters.bytes_read,
+            (unsigned long long)counters.bytes_written,
+            (unsigned long long)counters.bytes_padded,
+            (unsigned long long)counters.reads,
+            (unsigned long long)counters.failed_reads,
+            (unsigned long long)counters.failed_pages,
+            (unsigned long long)counters.retries,
+            (unsigned long long)counters.bad_regions,
+            (unsigned long long)counters.bad_region_bytes,
+            counters.read_wait_us / 1000.0, counters.write_wait_us / 1000.0);
+
+    if (seconds > 0)
+    {
+        fprintf(fd_, "\"read_mbps\":%.1f,\"write_mbps\":%.1f,",
+                counters.bytes_read / MB / seconds, counters.bytes_written / MB / seconds);
+    }
+
+    fprintf(fd_, "\"read_us\":");
+    counters.read_us.write_json(fd_, buckets);
+    fprintf(fd_, ",\"write_us\":");
+    counters.write_us.write_json(fd_, buckets);
+}
+
+// Writes a progress line if it is time for one.
+void CopyStats::tick_()
+{
+    double now = now_();
+
+    if (now - last_progress_ < interval_) return;
+
+    last_progress_ = now;
+
+    fprintf(fd_, "{\"type\":\"progress\",\"t\":%.3f,\"offset\":%llu,"
+            "\"window_read_mbps\":%.1f,\"window_write_mbps\":%.1f,",
+            now, (unsigned long long)offset_,
+            read_rate_.rate(now) / MB, write_rate_.rate(now) / MB);
+    write_counters_(total_, 0, false);
+    fprintf(fd_, "}\n");
+    fflush(fd_);
+}
+
+// Writes trail the reads, so a write only counts towards the current run
+// if it lands in it. The summary counts them all.
+bool CopyStats::in_run_at_(uint64_t offset) const
+{
+    return in_run_ && offset >= run_offset_ && offset - run_offset_ < run_length_;
+}
+
+void CopyStats::end_run_(double now)
+{
+    if (!in_run_) return;
+
+    in_run_ = false;
+
+    fprintf(fd_, "{\"type\":\"run\",\"t\":%.3f,\"offset\":%llu,\"length\":%llu,\"seconds\":%.3f,",
+            now, (unsigned long long)run_offset_, (unsigned long long)run_length_,
+            now - run_start_);
+    write_counters_(run_, now - run_start_, false);
+    fprintf(fd_, "}\n");
+    fflush(fd_);
+}
+
+void CopyStats::finish()
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    double now = now_();
+
+    end_run_(now);
+
+    fprintf(fd_, "{\"type\":\"summary\",\"t\":%.3f,\"seconds\":%.3f,", now, now);
+    write_counters_(total_, now, true);
+    fprintf(fd_, "}\n");
+    fflush(fd_);
+}
+
+void CopyStats::on_read(uint64_t offset, size_t bytes_read, bool failed)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+
+        if (failed)
+        {
+            run_.failed_reads++;
+            total_.failed_reads++;
+        }
+
+        offset_ = offset + bytes_read;
+        tick_();
+    }
+
+    if (next_) next_->on_read(offset, bytes_read, failed);
+}
+
+void CopyStats::on_page_failure(uint64_t offset, int reason)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+
+        run_.failed_pages++;
+        total_.failed_pages++;
+    }
+
+    if (next_) next_->on_page_failure(offset, reason);
+}
+
+void CopyStats::on_run(uint64_t offset, uint64_t length)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        double now = now_();
+
+        end_run_(now);
+
+        in_run_ = true;
+        run_offset_ = offset_ = offset;
+        run_length_ = length;
+        run_start_ = now;
+        run_.reset();
+    }
+
+    if (next_) next_->on_run(offset, length);
+}
+
+void CopyStats::on_pad(uint64_t offset, uint64_t length)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+
+        end_run_(now_());
+        total_.bytes_padded += length;
+    }
+
+    if (next_) next_->on_pad(offset, length);
+}
+
+void CopyStats::on_read_size(uint64_t offset, size_t size)
+{
+    if (next_) next_->on_read_size(offset, size);
+}
+
+void CopyStats::on_bad_region(uint64_t offset, uint64_t length)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+
+        run_.bad_regions++;
+        total_.bad_regions++;
+        run_.bad_region_bytes += length;
+        total_.bad_region_bytes += length;
+    }
+
+    if (next_) next_->on_bad_region(offset, length);
+}
+
+void CopyStats::on_read_time(uint64_t offset, size_t bytes_read, uint64_t micros)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+
+        run_.reads++;
+        total_.reads++;
+        run_.bytes_read += bytes_read;
+        total_.bytes_read += bytes_read;
+        run_.read_us.add(micros);
+        total_.read_us.add(micros);
+        read_rate_.add(now_(), bytes_read);
+    }
+
+    if (next_) next_->on_read_time(offset, bytes_read, micros);
+}
+
+void CopyStats::on_retry(uint64_t offset, size_t length)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+
+        run_.retries++;
+        total_.retries++;
+    }
+
+    if (next_) next_->on_retry(offset, length);
+}
+
+void CopyStats::on_read_wait(uint64_t micros)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+
+        run_.read_wait_us += micros;
+        total_.read_wait_us += micros;
+    }
+
+    if (next_) next_->on_read_wait(micros);
+}
+
+void CopyStats::on_write_time(uint64_t offset, size_t length, uint64_t micros)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+
+        if (in_run_at_(offset))
+        {
+            run_.bytes_written += length;
+            run_.write_us.add(micros);
+        }
+
+        total_.bytes_written += length;
+        total_.write_us.add(micros);
+        write_rate_.add(now_(), length);
+        tick_();
+    }
+
+    if (next_) next_->on_write_time(offset, length, micros);
+}
+
+void CopyStats::on_write_wait(uint64_t offset, uint64_t micros)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+
+        if (in_run_at_(offset)) run_.write_wait_us += micros;
+        total_.write_wait_us += micros;
+    }
+
+    if (next_) next_->on_write_wait(offset, micros);
+}
@@ -0,0 +1,159 @@
+/*
+  Copyright 2026 Velocidex Innovations <mike@velocidex.com>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "pipeline.h"
+
+#include <stdio.h>
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+
+// Latencies in power of two buckets: bucket i counts the values in
+// [2^i, 2^(i+1)) microseconds, bucket 0 also counts zero.
+class LatencyHistogram
+{
+public:
+    static const int BUCKETS = 32;
+
+    LatencyHistogram() { reset(); }
+
+    void reset();
+    void add(uint64_t micros);
+
+    uint64_t count() const { return count_; }
+    uint64_t maximum() const { return max_; }
+    double mean() const { return count_ ? (double)total_ / count_ : 0; }
+
+    // The upper bound of the bucket that holds the fraction p of all
+    // values. Good to a factor of two.
+    uint64_t percentile(double p) const;
+
+    // {"count":..,"mean":..,"p50":..,"p90":..,"p99":..,"max":..}, and the
+    // bucket counts up to the last used one if buckets is set.
+    void write_json(FILE *fd, bool buckets) const;
+
+private:
+    uint64_t buckets_[BUCKETS];
+    uint64_t count_;
+    uint64_t total_;
+    uint64_t max_;
+};
+
+
+// Bytes per second over the last few seconds.
+class ThroughputWindow
+{
+public:
+    explicit ThroughputWindow(double seconds): seconds_(seconds), bytes_(0) {}
+
+    void reset();
+    void add(double now, uint64_t bytes);
+    double rate(double now);
+
+private:
+    struct Sample
+    {
+        double time;
+        uint64_t bytes;
+    };
+
+    void expire_(double now);
+
+    double seconds_;
+    uint64_t bytes_;   // Sum of the samples.
+    std::deque<Sample> samples_;
+};
+
+
+// Collects timings and counts from the copy engine and writes them to fd
+// as JSON lines: A "progress" line every interval seconds, a "run" line
+// when each run is done, and a "summary" line from finish(). Rates are
+// over a sliding window of window seconds for progress lines, and over
+// the whole run or image otherwise. Every callback is passed on to next,
+// so this can sit in front of another observer.
+//
+// A slow device shows up as long reads and a writer waiting for data, a
+// slow disk as long writes and a reader waiting for buffers.
+class CopyStats: public CopyObserver
+{
+public:
+    CopyStats(FILE *fd, CopyObserver *next, double interval = 1.0, double window = 5.0);
+
+    virtual void on_read(uint64_t offset, size_t bytes_read, bool failed);
+    virtual void on_page_failure(uint64_t offset, int reason);
+    virtual void on_run(uint64_t offset, uint64_t length);
+    virtual void on_pad(uint64_t offset, uint64_t length);
+    virtual void on_read_size(uint64_t offset, size_t size);
+    virtual void on_bad_region(uint64_t offset, uint64_t length);
+    virtual void on_read_time(uint64_t offset, size_t bytes_read, uint64_t micros);
+    virtual void on_retry(uint64_t offset, size_t length);
+    virtual void on_read_wait(uint64_t micros);
+    virtual void on_write_time(uint64_t offset, size_t length, uint64_t micros);
+    virtual void on_write_wait(uint64_t offset, uint64_t micros);
+
+    // Ends the last run and writes the summary.
+    void finish();
+
+private:
+    struct Counters
+    {
+        void reset();
+
+        uint64_t bytes_read;
+        uint64_t bytes_written;
+        uint64_t bytes_padded;
+        uint64_t reads;
+        uint64_t failed_reads;
+        uint64_t failed_pages;
+        uint64_t retries;
+        uint64_t bad_regions;
+        uint64_t bad_region_bytes;
+        uint64_t read_wait_us;
+        uint64_t write_wait_us;
+        LatencyHistogram read_us;
+        LatencyHistogram write_us;
+    };
+
+    // These are called with mu_ held.
+    double now_() const;
+    void tick_();
+    bool in_run_at_(uint64_t offset) const;
+    void end_run_(double now);
+    void write_counters_(const Counters &counters, double seconds, bool buckets);
+
+    FILE *fd_;
+    CopyObserver *next_;
+    double interval_;
+    std::chrono::steady_clock::time_point start_;
+
+    std::mutex mu_;
+    Counters run_;
+    Counters total_;
+    bool in_run_;
+    uint64_t run_offset_;
+    uint64_t run_length_;
+    double run_start_;
+    double last_progress_;
+    uint64_t offset_;     // Where the reader is.
+    ThroughputWindow read_rate_;
+    ThroughputWindow write_rate_;
+};
+
+#endif
@@ -17,200 +17,858 @@
 
 #include "winpmem.h"
 #include <time.h>
+#include <compressapi.h>
+#include <bcrypt.h>
+
+#pragma comment(lib, "bcrypt.lib")
 
 constexpr auto MAXIMUM_BULK_READ = (4096 * 4096);  // 16 MB bulk read
+constexpr auto MINIMUM_BULK_READ = 4096;  // Reads shrink down to a page around bad pages.
+constexpr auto PIPELINE_BUFFERS = 4;  // Bulk reads in flight between device and disk.
+constexpr auto DIRECT_WRITE_SIZE = (4 * 1024 * 1024);  // Unbuffered writes are gathered up to this.
+constexpr auto DIRECT_WRITES = 4;  // Unbuffered writes in flight.
+constexpr auto MAPPED_WINDOW_SIZE = (64 * 1024 * 1024);  // A multiple of the allocation granularity.
+constexpr auto PROBE_READ_SIZE = (1024 * 1024);  // Each probe read, clipped to the end of the run.
+constexpr auto PROBE_READS_PER_RUN = 8;  // Spread evenly over each run.
+constexpr auto EXTRACT_CACHE_CHUNKS = 4;  // Decompressed chunks kept while extracting.
+
+bool PmemDeviceSource::get_info(PWINPMEM_MEMORY_INFO info)
+{
+        BYTE infoBuffer[sizeof(WINPMEM_MEMORY_INFO) + sizeof(LARGE_INTEGER) * 32] = { 0 };
+        DWORD size;
+
+        RtlZeroMemory(info, sizeof(WINPMEM_MEMORY_INFO));
+
+        // Get the memory ranges.
+        if (!DeviceIoControl(fd_, IOCTL_GET_INFO,
+                             NULL, 0, // in
+                             (char *)&infoBuffer, sizeof(infoBuffer), // out
+                             &size, NULL))
+        {
+                return false;
+        }
+
+#ifdef _WIN64
+        RtlCopyMemory(info, infoBuffer, sizeof(WINPMEM_MEMORY_INFO));
+#else
+        {
+            SYSTEM_INFO sys_info = { 0 };
+
+            GetNativeSystemInfo(&sys_info);
+
+            switch (sys_info.wProcessorArchitecture)
+            {
+                case PROCESSOR_ARCHITECTURE_AMD64:
+                {
+                    DWORD dwOffset = FIELD_OFFSET(WINPMEM_MEMORY_INFO, PfnDataBase);
+                    RtlCopyMemory(info, infoBuffer, dwOffset);
+                    RtlCopyMemory(&info->PfnDataBase, infoBuffer + dwOffset + 32 * sizeof(LARGE_INTEGER), sizeof(WINPMEM_MEMORY_INFO) - dwOffset);
+                    break;
+                }
+                default:
+                    RtlCopyMemory(info, infoBuffer, sizeof(WINPMEM_MEMORY_INFO));
+                    break;
+            }
+        }
+#endif
+
+        return true;
+}
+
+bool PmemDeviceSource::get_runs(std::vector<MemoryRun> *runs)
+{
+        WINPMEM_MEMORY_INFO info;
+
+        if (!get_info(&info)) return false;
+
+        for (__int64 i = 0; i < info.NumberOfRuns.QuadPart; i++)
+        {
+                MemoryRun run = { (uint64_t)info.Run[i].BaseAddress.QuadPart,
+                                  (uint64_t)info.Run[i].NumberOfBytes.QuadPart };
+
+                runs->push_back(run);
+        }
+
+        return true;
+}
+
+
+bool PmemDeviceSource::read(uint64_t offset, unsigned char *buffer, size_t length,
+                            size_t *bytes_read)
+{
+        OVERLAPPED overlapped = { 0 };
+        DWORD read = 0;
+        BOOL result;
+
+        // A positional read saves the separate SetFilePointerEx() call. The
+        // handle is synchronous so ReadFile() still blocks until done.
+        overlapped.Offset = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+        result = ReadFile(fd_, buffer, (DWORD)length, &read, &overlapped);
+        *bytes_read = read;
+
+        return result ? true : false;
+}
+
+
+// Reads past unreadable pages in one call. The driver zeroes them and
+// tells us which they were, and why.
+bool PmemDeviceSource::read_all(uint64_t offset, unsigned char *buffer, size_t length,
+                                std::vector<PageFailure> *failures)
+{
+        WINPMEM_READ_CONTINUE request = { 0 };
+        PWINPMEM_READ_CONTINUE_RESULT result;
+        size_t pages = (size_t)(((offset % PAGE_SIZE) + length + PAGE_SIZE - 1) / PAGE_SIZE);
+        DWORD size = 0;
+
+        if (!continue_supported_) return false;
+
+        result_.resize(FIELD_OFFSET(WINPMEM_READ_CONTINUE_RESULT, Bitmap) + (pages + 3) / 4);
+
+        request.PhysicalAddress.QuadPart = offset;
+        request.Buffer = (u64)(ULONG_PTR)buffer;
+        request.Length = (u32)length;
+
+        if (!DeviceIoControl(fd_, IOCTL_READ_PHYSICAL_CONTINUE,
+                             &request, sizeof(request),
+                             &result_[0], (DWORD)result_.size(),
+                             &size, NULL))
+        {
+                continue_supported_ = false;
+                return false;
+        }
+
+        result = (PWINPMEM_READ_CONTINUE_RESULT)&result_[0];
+
+        for (size_t i = 0; result->FailedPages && i < pages; i++)
+        {
+                int reason = (result->Bitmap[i / 4] >> ((i % 4) * 2)) & 3;
+
+                if (reason != PMEM_PAGE_OK)
+                {
+                        PageFailure failure = { (offset & ~(uint64_t)(PAGE_SIZE - 1)) + i * PAGE_SIZE, reason };
+                        failures->push_back(failure);
+                }
+        }
+
+        return result->BytesRead == length;
+}
+
+
+// The same read with the mode of our choosing. The driver doesn't change
+// its mode for it, so this works before set_acquisition_mode().
+bool PmemDeviceSource::probe(unsigned __int32 mode, uint64_t offset, unsigned char *buffer,
+                             size_t length, size_t *failed_pages)
+{
+        WINPMEM_READ_CONTINUE request = { 0 };
+        size_t pages = (size_t)(((offset % PAGE_SIZE) + length + PAGE_SIZE - 1) / PAGE_SIZE);
+        DWORD size = 0;
+
+        result_.resize(FIELD_OFFSET(WINPMEM_READ_CONTINUE_RESULT, Bitmap) + (pages + 3) / 4);
+
+        request.PhysicalAddress.QuadPart = offset;
+        request.Buffer = (u64)(ULONG_PTR)buffer;
+        request.Length = (u32)length;
+        request.Mode = mode;
+
+        if (!DeviceIoControl(fd_, IOCTL_PROBE_READ,
+                             &request, sizeof(request),
+                             &result_[0], (DWORD)result_.size(),
+                             &size, NULL))
+        {
+                return false;
+        }
+
+        *failed_pages = ((PWINPMEM_READ_CONTINUE_RESULT)&result_[0])->FailedPages;
+
+        return true;
+}
+
+
+bool PmemDeviceSource::get_bad_pages(std::vector<WINPMEM_PAGE_RANGE> *ranges)
+{
+        const size_t header = FIELD_OFFSET(WINPMEM_BAD_PAGES, Range);
+        std::vector<unsigned char> buffer(header);
+        PWINPMEM_BAD_PAGES bad_pages;
+        DWORD size = 0;
+
+        // Too small a buffer only gets the number of ranges. More may turn
+        // up before the next try, so leave some room.
+        while (!DeviceIoControl(fd_, IOCTL_GET_BAD_PAGES,
+                                NULL, 0,
+                                &buffer[0], (DWORD)buffer.size(),
+                                &size, NULL))
+        {
+                if (GetLastError() != ERROR_MORE_DATA) return false;
+
+                bad_pages = (PWINPMEM_BAD_PAGES)&buffer[0];
+                buffer.resize(header + (bad_pages->NumberOfRanges + 64) * sizeof(WINPMEM_PAGE_RANGE));
+        }
+
+        bad_pages = (PWINPMEM_BAD_PAGES)&buffer[0];
+        ranges->assign(bad_pages->Range, bad_pages->Range + bad_pages->NumberOfRanges);
+
+        return true;
+}
+
+
+bool PmemDeviceSource::set_bad_pages(const std::vector<WINPMEM_PAGE_RANGE> &ranges)
+{
+        const size_t header = FIELD_OFFSET(WINPMEM_BAD_PAGES, Range);
+        std::vector<unsigned char> buffer(header + ranges.size() * sizeof(WINPMEM_PAGE_RANGE));
+        PWINPMEM_BAD_PAGES bad_pages = (PWINPMEM_BAD_PAGES)&buffer[0];
+        DWORD size = 0;
+
+        bad_pages->NumberOfRanges = (u32)ranges.size();
+        if (!ranges.empty())
+        {
+                RtlCopyMemory(bad_pages->Range, &ranges[0], ranges.size() * sizeof(WINPMEM_PAGE_RANGE));
+        }
+
+        return DeviceIoControl(fd_, IOCTL_SET_BAD_PAGES,
+                               &buffer[0], (DWORD)buffer.size(),
+                               NULL, 0,
+                               &size, NULL) ? true : false;
+}
+
+
+bool PmemDeviceSource::get_stats(PWINPMEM_STATS stats)
+{
+        DWORD size = 0;
+
+        return DeviceIoControl(fd_, IOCTL_GET_STATS,
+                               NULL, 0,
+                               stats, sizeof(WINPMEM_STATS),
+                               &size, NULL) && size == sizeof(WINPMEM_STATS);
+}
+
+bool PmemDeviceSource::reset_stats()
+{
+        DWORD size = 0;
+
+        return DeviceIoControl(fd_, IOCTL_RESET_STATS,
+                               NULL, 0,
+                               NULL, 0,
+                               &size, NULL) ? true : false;
+}
+
+
+bool Win32FileSink::write_data(const unsigned char *buffer, size_t length)
+{
+        DWORD bytes_written = 0;
+        BOOL result = WriteFile(fd_, buffer, (DWORD)length, &bytes_written, NULL);
+
+        return result && bytes_written == length;
+}
+
+bool Win32FileSink::skip(uint64_t length)
+{
+        LARGE_INTEGER distance;
+
+        distance.QuadPart = length;
+
+        // Extend the file up to the new position, so a hole at the very
+        // end of the image still counts.
+        if (!SetFilePointerEx(fd_, distance, NULL, FILE_CURRENT)) return false;
+
+        return SetEndOfFile(fd_) ? true : false;
+}
+
+
+Win32DirectFileSink::Win32DirectFileSink(HANDLE fd, size_t buffer_size, size_t count):
+        fd_(fd),
+        buffer_size_(buffer_size),
+        sector_size_(PAGE_SIZE),
+        slots_(count),
+        current_(0),
+        filled_(0),
+        offset_(0),
+        failed_at_(UINT64_MAX)
+{
+        for (size_t i = 0; i < slots_.size(); i++)
+        {
+                slots_[i].data = NULL;
+                slots_[i].overlapped.hEvent = NULL;
+                slots_[i].pending = false;
+        }
+}
+
+Win32DirectFileSink::~Win32DirectFileSink()
+{
+        for (size_t i = 0; i < slots_.size(); i++)
+        {
+                // The buffer must not go away under a running write.
+                if (slots_[i].pending) wait_(&slots_[i]);
+                if (slots_[i].overlapped.hEvent) CloseHandle(slots_[i].overlapped.hEvent);
+                free_aligned_buffer(slots_[i].data);
+        }
+}
+
+bool Win32DirectFileSink::open()
+{
+        FILE_STORAGE_INFO storage = { 0 };
+
+        // Unbuffered writes must be whole sectors from sector aligned
+        // memory. Pages are enough for the usual 512 and 4096 byte sectors.
+        if (GetFileInformationByHandleEx(fd_, FileStorageInfo, &storage, sizeof(storage)) &&
+            storage.LogicalBytesPerSector > sector_size_)
+        {
+                sector_size_ = storage.LogicalBytesPerSector;
+        }
+
+        if (buffer_size_ % sector_size_) return false;
+
+        for (size_t i = 0; i < slots_.size(); i++)
+        {
+                slots_[i].data = alloc_aligned_buffer(buffer_size_);
+                slots_[i].overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+                if (!slots_[i].data || !slots_[i].overlapped.hEvent) return false;
+        }
+
+        return true;
+}
+
+bool Win32DirectFileSink::wait_(Slot *slot)
+{
+        DWORD bytes_written = 0;
+        uint64_t offset = ((uint64_t)slot->overlapped.OffsetHigh << 32) | slot->overlapped.Offset;
+
+        slot->pending = false;
+
+        if (!GetOverlappedResult(fd_, &slot->overlapped, &bytes_written, TRUE))
+        {
+                if (offset < failed_at_) failed_at_ = offset;
+                return false;
+        }
+
+        return true;
+}
+
+// Starts writing the current slot, and waits for the next one to be free.
+bool Win32DirectFileSink::submit_()
+{
+        Slot *slot = &slots_[current_];
+        size_t length = (filled_ + sector_size_ - 1) / sector_size_ * sector_size_;
+        HANDLE event = slot->overlapped.hEvent;
+
+        // Only the last buffer is partial. What is behind the image is
+        // cut off again by finish().
+        memset(slot->data + filled_, 0, length - filled_);
+
+        ZeroMemory(&slot->overlapped, sizeof(slot->overlapped));
+        slot->overlapped.hEvent = event;
+        slot->overlapped.Offset = (DWORD)offset_;
+        slot->overlapped.OffsetHigh = (DWORD)(offset_ >> 32);
+
+        if (!WriteFile(fd_, slot->data, (DWORD)length, NULL, &slot->overlapped) &&
+            GetLastError() != ERROR_IO_PENDING)
+        {
+                if (offset_ < failed_at_) failed_at_ = offset_;
+                return false;
+        }
+
+        slot->pending = true;
+        offset_ += filled_;
+        filled_ = 0;
+
+        current_ = (current_ + 1) % slots_.size();
+        if (slots_[current_].pending) return wait_(&slots_[current_]);
+
+        return true;
+}
+
+bool Win32DirectFileSink::write(const unsigned char *buffer, size_t length)
+{
+        while (length)
+        {
+                size_t to_copy = buffer_size_ - filled_ < length ? buffer_size_ - filled_ : length;
+
+                memcpy(slots_[current_].data + filled_, buffer, to_copy);
+                filled_ += to_copy;
+                buffer += to_copy;
+                length -= to_copy;
+
+                if (filled_ == buffer_size_ && !submit_()) return false;
+        }
+
+        return true;
+}
+
+bool Win32DirectFileSink::pad(uint64_t length)
+{
+        // The file is preallocated, so the zeros must really be written.
+        while (length)
+        {
+                size_t to_fill = buffer_size_ - filled_ < length ? buffer_size_ - filled_ : (size_t)length;
+
+                memset(slots_[current_].data + filled_, 0, to_fill);
+                filled_ += to_fill;
+                length -= to_fill;
+
+                if (filled_ == buffer_size_ && !submit_()) return false;
+        }
+
+        return true;
+}
+
+Win32MappedFileSink::Win32MappedFileSink(HANDLE fd):
+        fd_(fd),
+        mapping_(NULL),
+        size_(0),
+        position_(0)
+{}
+
+Win32MappedFileSink::~Win32MappedFileSink()
+{
+        finish();
+}
+
+bool Win32MappedFileSink::open(uint64_t size)
+{
+        LARGE_INTEGER end;
+
+        end.QuadPart = size;
+        size_ = size;
+
+        if (!SetFilePointerEx(fd_, end, NULL, FILE_BEGIN) || !SetEndOfFile(fd_)) return false;
+
+        mapping_ = CreateFileMapping(fd_, NULL, PAGE_READWRITE, 0, 0, NULL);
+
+        return mapping_ != NULL;
+}
+
+// The view of a window, mapped if it isn't yet. Caller holds mu_.
+unsigned char *Win32MappedFileSink::view_(uint64_t window)
+{
+        std::map<uint64_t, unsigned char *>::iterator it = views_.find(window);
+        uint64_t offset = window * MAPPED_WINDOW_SIZE;
+        unsigned char *view;
+
+        if (it != views_.end()) return it->second;
+
+        view = (unsigned char *)MapViewOfFile(mapping_, FILE_MAP_WRITE,
+                                              (DWORD)(offset >> 32), (DWORD)offset,
+                                              (SIZE_T)min((uint64_t)MAPPED_WINDOW_SIZE, size_ - offset));
+        if (view) views_[window] = view;
+
+        return view;
+}
+
+unsigned char *Win32MappedFileSink::target(uint64_t offset, size_t length)
+{
+        uint64_t window = offset / MAPPED_WINDOW_SIZE;
+        unsigned char *view;
+
+        // Reads across two windows go through a buffer, that is only once
+        // per window.
+        if (!mapping_ || !length || offset + length > size_ ||
+            (offset + length - 1) / MAPPED_WINDOW_SIZE != window)
+        {
+                return NULL;
+        }
+
+        std::lock_guard<std::mutex> lock(mu_);
+
+        view = view_(window);
+
+        return view ? view + offset % MAPPED_WINDOW_SIZE : NULL;
+}
+
+// Moves on, and unmaps the windows that are done. The cache manager
+// writes them out in its own time.
+bool Win32MappedFileSink::advance_(uint64_t length)
+{
+        if (length > size_ - position_) return false;
+
+        position_ += length;
+
+        while (!views_.empty() && (views_.begin()->first + 1) * MAPPED_WINDOW_SIZE <= position_)
+        {
+                UnmapViewOfFile(views_.begin()->second);
+                views_.erase(views_.begin());
+        }
+
+        return true;
+}
+
+bool Win32MappedFileSink::write(const unsigned char *buffer, size_t length)
+{
+        std::lock_guard<std::mutex> lock(mu_);
+
+        while (length)
+        {
+                uint64_t offset = position_ % MAPPED_WINDOW_SIZE;
+                size_t to_copy = (size_t)min((uint64_t)length, MAPPED_WINDOW_SIZE - offset);
+                unsigned char *view = mapping_ ? view_(position_ / MAPPED_WINDOW_SIZE) : NULL;
+
+                if (!view || to_copy > size_ - position_) return false;
+
+                // Nothing to do if the engine read it right there.
+                if (view + offset != buffer) memcpy(view + offset, buffer, to_copy);
+
+                advance_(to_copy);
+                buffer += to_copy;
+                length -= to_copy;
+        }
+
+        return true;
+}
+
+bool Win32MappedFileSink::pad(uint64_t length)
+{
+        std::lock_guard<std::mutex> lock(mu_);
+
+        return advance_(length);
+}
+
+bool Win32MappedFileSink::finish()
+{
+        std::lock_guard<std::mutex> lock(mu_);
+
+        for (std::map<uint64_t, unsigned char *>::iterator it = views_.begin(); it != views_.end(); ++it)
+        {
+                UnmapViewOfFile(it->second);
+        }
+        views_.clear();
+
+        if (mapping_) CloseHandle(mapping_);
+        mapping_ = NULL;
+
+        return position_ == size_;
+}
+
+
+bool Win32DirectFileSink::finish()
+{
+        FILE_END_OF_FILE_INFO end_of_file;
+        bool result = true;
+
+        if (filled_) result = submit_();
+
+        for (size_t i = 0; i < slots_.size(); i++)
+        {
+                if (slots_[i].pending && !wait_(&slots_[i])) result = false;
+        }
+
+        // The last sector was written whole.
+        end_of_file.EndOfFile.QuadPart = offset_;
+
+        return result && SetFileInformationByHandle(fd_, FileEndOfFileInfo,
+                                                    &end_of_file, sizeof(end_of_file));
+}
+
+bool Win32DirectFileSink::cancel()
+{
+        FILE_END_OF_FILE_INFO end_of_file;
+
+        for (size_t i = 0; i < slots_.size(); i++)
+        {
+                if (slots_[i].pending) wait_(&slots_[i]);
+        }
+
+        // The current slot was never written.
+        end_of_file.EndOfFile.QuadPart = offset_ < failed_at_ ? offset_ : failed_at_;
+        filled_ = 0;
+
+        return SetFileInformationByHandle(fd_, FileEndOfFileInfo,
+                                          &end_of_file, sizeof(end_of_file)) ? true : false;
+}
+
+
+// Administrators have SE_MANAGE_VOLUME_NAME, but it is not enabled by
+// default.
+static bool enable_privilege(LPCTSTR name)
+{
+        TOKEN_PRIVILEGES privileges = { 0 };
+        HANDLE token = NULL;
+        BOOL result;
+
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &token)) return false;
+
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+        // AdjustTokenPrivileges() succeeds with ERROR_NOT_ALL_ASSIGNED if
+        // we don't hold the privilege.
+        result = LookupPrivilegeValue(NULL, name, &privileges.Privileges[0].Luid) &&
+                AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+                GetLastError() == ERROR_SUCCESS;
+
+        CloseHandle(token);
+        return result ? true : false;
+}
+
+
+typedef BOOL (WINAPI *CreateCompressorFn)(DWORD, PCOMPRESS_ALLOCATION_ROUTINES, PCOMPRESSOR_HANDLE);
+typedef BOOL (WINAPI *CompressFn)(COMPRESSOR_HANDLE, LPCVOID, SIZE_T, PVOID, SIZE_T, PSIZE_T);
+typedef BOOL (WINAPI *CloseCompressorFn)(COMPRESSOR_HANDLE);
+typedef BOOL (WINAPI *CreateDecompressorFn)(DWORD, PCOMPRESS_ALLOCATION_ROUTINES, PDECOMPRESSOR_HANDLE);
+typedef BOOL (WINAPI *DecompressFn)(DECOMPRESSOR_HANDLE, LPCVOID, SIZE_T, PVOID, SIZE_T, PSIZE_T);
+typedef BOOL (WINAPI *CloseDecompressorFn)(DECOMPRESSOR_HANDLE);
+
+static CreateCompressorFn pCreateCompressor = NULL;
+static CompressFn pCompress = NULL;
+static CloseCompressorFn pCloseCompressor = NULL;
+static CreateDecompressorFn pCreateDecompressor = NULL;
+static DecompressFn pDecompress = NULL;
+static CloseDecompressorFn pCloseDecompressor = NULL;
+
+// Only called from the main thread, before any worker starts.
+static bool load_compression_api()
+{
+        if (pCreateCompressor) return true;
+
+        HMODULE cabinet = LoadLibraryEx(TEXT("cabinet.dll"), NULL, LOAD_LIBRARY_SEARCH_SYSTEM32);
+
+        if (!cabinet) return false;
+
+        pCompress = (CompressFn)GetProcAddress(cabinet, "Compress");
+        pCloseCompressor = (CloseCompressorFn)GetProcAddress(cabinet, "CloseCompressor");
+        pCreateDecompressor = (CreateDecompressorFn)GetProcAddress(cabinet, "CreateDecompressor");
+        pDecompress = (DecompressFn)GetProcAddress(cabinet, "Decompress");
+        pCloseDecompressor = (CloseDecompressorFn)GetProcAddress(cabinet, "CloseDecompressor");
+        if (!pCompress || !pCloseCompressor ||
+            !pCreateDecompressor || !pDecompress || !pCloseDecompressor) return false;
+
+        pCreateCompressor = (CreateCompressorFn)GetProcAddress(cabinet, "CreateCompressor");
+
+        return pCreateCompressor != NULL;
+}
+
+static bool compression_api_algorithm(int algorithm, DWORD *api_algorithm)
+{
+        switch (algorithm)
+        {
+        case COMPRESSION_XPRESS:
+                *api_algorithm = COMPRESS_ALGORITHM_XPRESS;
+                return true;
+        case COMPRESSION_XPRESS_HUFF:
+                *api_algorithm = COMPRESS_ALGORITHM_XPRESS_HUFF;
+                return true;
+        default:
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return false;
+        }
+}
 
-/**
- * Pad file in pad range with zeros.
-*/
-__int64 WinPmem::pad(unsigned __int64 start, unsigned __int64 length)
+Win32Compressor::~Win32Compressor()
 {
-        DWORD bytes_written = 0;
-        BOOL result = FALSE;
-        unsigned char * paddingbuffer = (unsigned char * ) malloc(MAXIMUM_BULK_READ);
-        if (!paddingbuffer) {
+        if (handle_) pCloseCompressor((COMPRESSOR_HANDLE)handle_);
+}
+
+bool Win32Compressor::open(int algorithm)
+{
+        DWORD api_algorithm;
+        COMPRESSOR_HANDLE handle = NULL;
+
+        if (!compression_api_algorithm(algorithm, &api_algorithm)) return false;
+        if (!load_compression_api()) return false;
+
+        // Raw mode: chunk headers are our own, no need for the API's.
+        if (!pCreateCompressor(api_algorithm | COMPRESS_RAW, NULL, &handle)) return false;
+
+        handle_ = handle;
+        return true;
+}
+
+size_t Win32Compressor::compress(const unsigned char *input, size_t length,
+                                 unsigned char *output, size_t capacity)
+{
+        SIZE_T compressed_size = 0;
+
+        // Fails with ERROR_INSUFFICIENT_BUFFER if the chunk did not shrink.
+        if (!pCompress((COMPRESSOR_HANDLE)handle_, input, length, output, capacity,
+                       &compressed_size))
+        {
                 return 0;
-        };
-        ZeroMemory(paddingbuffer, MAXIMUM_BULK_READ);
-        
-        // More noisy than helpful perhaps?
-        Log(TEXT("\n(Omitting & padding reserved block 0x%llX - 0x%llX, length 0x%llx.) \n"), start, start+length, length); 
-        // Seriously not that interesting watching us writing lots of zeros.
+        }
+
+        return compressed_size;
+}
+
+Win32Sha256Hasher::~Win32Sha256Hasher()
+{
+        if (hash_) BCryptDestroyHash((BCRYPT_HASH_HANDLE)hash_);
+        if (algorithm_) BCryptCloseAlgorithmProvider((BCRYPT_ALG_HANDLE)algorithm_, 0);
+}
+
+bool Win32Sha256Hasher::open()
+{
+        BCRYPT_ALG_HANDLE algorithm = NULL;
 
-        while (length > 0) 
+        if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&algorithm, BCRYPT_SHA256_ALGORITHM, NULL, 0)))
         {
-                DWORD to_write = (DWORD)min((MAXIMUM_BULK_READ), length);  // Maximum buffer could be less than required pad length... that's why it's in a loop.
-                result = WriteFile(out_fd_, paddingbuffer, to_write, &bytes_written, NULL);
-                if ((!(result)) || (bytes_written != to_write))
-                {
-                        LogLastError(TEXT("Failed to write padding.\n"));
-                        goto error;
-                }
+                return false;
+        }
 
-                out_offset += bytes_written;
-                length -= bytes_written;
-        };
+        algorithm_ = algorithm;
+        return true;
+}
 
-        if (paddingbuffer) free(paddingbuffer);
+bool Win32Sha256Hasher::begin()
+{
+        BCRYPT_HASH_HANDLE hash = NULL;
 
-        return 1;
+        if (hash_)
+        {
+                BCryptDestroyHash((BCRYPT_HASH_HANDLE)hash_);
+                hash_ = NULL;
+        }
 
-        error:
-        return 0;
+        if (!BCRYPT_SUCCESS(BCryptCreateHash((BCRYPT_ALG_HANDLE)algorithm_, &hash, NULL, 0, NULL, 0, 0)))
+        {
+                return false;
+        }
+
+        hash_ = hash;
+        return true;
+}
+
+bool Win32Sha256Hasher::update(const unsigned char *buffer, size_t length)
+{
+        // Chunks are much smaller than a ULONG.
+        return BCRYPT_SUCCESS(BCryptHashData((BCRYPT_HASH_HANDLE)hash_, (PUCHAR)buffer, (ULONG)length, 0));
 }
 
+bool Win32Sha256Hasher::finish(Digest *digest)
+{
+        NTSTATUS status = BCryptFinishHash((BCRYPT_HASH_HANDLE)hash_, digest->bytes, sizeof(digest->bytes), 0);
 
+        BCryptDestroyHash((BCRYPT_HASH_HANDLE)hash_);
+        hash_ = NULL;
 
-__int64 WinPmem::copy_memory(unsigned __int64 start, unsigned __int64 end) {
-        LARGE_INTEGER large_start;
+        return BCRYPT_SUCCESS(status);
+}
 
-        unsigned __int64 dotCounter = 0;  // how much dots were already drawn.
+Win32Decompressor::~Win32Decompressor()
+{
+        if (handle_) pCloseDecompressor((DECOMPRESSOR_HANDLE)handle_);
+}
 
-        BOOL result = FALSE;
-        unsigned char * largebuffer = (unsigned char *) malloc(MAXIMUM_BULK_READ); // ~ 16 MB
-        unsigned char * nullbuffer = (unsigned char*)calloc(PAGE_SIZE, 1);  // One "padding" page, zeroed already.
+bool Win32Decompressor::open(int algorithm)
+{
+        DWORD api_algorithm;
+        DECOMPRESSOR_HANDLE handle = NULL;
 
-        if (start > max_physical_memory_)
+        if (!compression_api_algorithm(algorithm, &api_algorithm)) return false;
+        if (!load_compression_api()) return false;
+
+        if (!pCreateDecompressor(api_algorithm | COMPRESS_RAW, NULL, &handle)) return false;
+
+        handle_ = handle;
+        return true;
+}
+
+bool Win32Decompressor::decompress(const unsigned char *input, size_t length,
+                                   unsigned char *output, size_t raw_size)
+{
+        SIZE_T decompressed_size = 0;
+
+        if (!pDecompress((DECOMPRESSOR_HANDLE)handle_, input, length, output, raw_size,
+                         &decompressed_size))
         {
-                return 0;
+                return false;
         }
 
-        // Clamp the region to the top of physical memory.
-        if (end > max_physical_memory_)
+        return decompressed_size == raw_size;
+}
+
+
+void WinPmem::on_read(uint64_t offset, size_t bytes_read, bool failed)
+{
+        // Progress report, with '.' for every bulk read and 'x' at the
+        // exact position of the brick wall. Every line starts with the
+        // current read size. The stats file replaces it.
+        if (stats_filename_) return;
+
+        if (bytes_read)
         {
-            end = max_physical_memory_;
+                if ((dot_counter_ % 50) == 0)
+                {
+                        Log(TEXT("\n%02lld%% 0x%08llX [%5llu KB] "),
+                            (offset * 100) / max_physical_memory_,
+                            offset, (unsigned __int64)read_size_ / 1024);
+                }
+
+                Log(TEXT("."));
+                dot_counter_++;
+                offset += bytes_read;
         }
 
-        // More noisy than helpful perhaps?
-        Log(TEXT("\nWrite 0x%llx - 0x%llx, length: 0x%llx.\n"), start, end, (end-start));
-
-        while(start < end)
-        {
-                DWORD to_write = (DWORD) min((MAXIMUM_BULK_READ), end - start); // ReadFile wants a DWORD, for whatever reason.
-                DWORD bytes_read = 0;
-                DWORD bytes_written = 0;
-
-                large_start.QuadPart = start;
-
-                //printf(" - to_write: 0x%lx\n", (DWORD)to_write);
-                //printf(" - start: 0x%llx\n", start);
-
-                // seek
-                result = SetFilePointerEx(fd_, large_start, NULL, FILE_BEGIN);
-
-                if (!(result))
-                {
-                  LogLastError(TEXT("Failed to seek in the pmem device.\n"));
-                  goto error;
-                }
-
-                auto indicator = TEXT(".");
-
-                // read
-                result = ReadFile(fd_, largebuffer, to_write, &bytes_read, NULL);
-                
-                if (bytes_read)  // either Winpmem could read some bytes already ...
-                {
-                    // If Winpmem managed to read some bytes in the bulk read, 
-                    // Write them to file now.
-                    // This is even true if ReadFile returns an error, which means that Winpmem could not read all the requested bytes.
-                    // But if winpmem indicates it could read n bytes, these n bytes should be considered "good".
-                    // Don't throw away 15.7 MB bytes of your 16 MB request.
-                    result = WriteFile(out_fd_, largebuffer, bytes_read, &bytes_written, NULL);
-                    
-                    // Progress report, with '.'      
-                    if ((dotCounter % 50) == 0) 
-                    {
-                            Log(TEXT("\n%02lld%% 0x%08llX "), 
-                                (start * 100) / max_physical_memory_,
-                                start);
-                    }
-
-                    Log(indicator);
-                    dotCounter++;  // one dot was drawn
-                    
-                    // First, update the byte-counting variables already.
-                    out_offset += bytes_written; // Less than 16 MB if driver had to return earlier (and could not read the full 16 MB).
-                    start += bytes_written;
-                    
-                    if (!result)
-                    {
-                        // Also, Winpmem encountered a read error. There is no point of trying exactly that location again.
-                        // Instead, advance immediately one additional page, padded with zeros, and re-enter the loop with read pointer set on next page.
-                        
-                        // Progress report, with 'x', indicating exact position of the brick wall.
-                        
-                        indicator = TEXT("x");
-                        
-                        if ((dotCounter % 50) == 0) 
-                        {
-                                Log(TEXT("\n%02lld%% 0x%08llX "), 
-                                    (start * 100) / max_physical_memory_,
-                                    start);
-                        }
+        if (failed)
+        {
+                if ((dot_counter_ % 50) == 0)
+                {
+                        Log(TEXT("\n%02lld%% 0x%08llX [%5llu KB] "),
+                            (offset * 100) / max_physical_memory_,
+                            offset, (unsigned __int64)read_size_ / 1024);
+                }
 
-                        Log(indicator);
-                        dotCounter++; // one dot was drawn
-                        
-                        // Now write one zero-padded page which was reported by Winpmem at this position.
-                        result = WriteFile(out_fd_, nullbuffer, PAGE_SIZE, &bytes_written, NULL);
-                        
-                        if ((!result) || (bytes_written != PAGE_SIZE)) // ASSERT that 4096 have been written by WriteFile API.
-                        {
-                          LogLastError(TEXT("WriteFile API failed when writing bytes to disk.\n"));
-                          goto error;
-                        }
-                        
-                        out_offset += PAGE_SIZE;
-                        start += PAGE_SIZE;
-                        
-                        // We hereby advance by a page.
-                        
-                    }
-                }
-                else // the else case, no bytes read at all.
-                {
-                    // That's the case when you currently try-walk over an unreadable physical memory location.
-                    // Proceed yourself by another +1 page and try again. Write down the unreadable page as zero-padded page.
-                    
-                    indicator = TEXT("x");
-                        
-                    if ((dotCounter % 50) == 0) 
-                    {
-                            Log(TEXT("\n%02lld%% 0x%08llX "), 
-                                (start * 100) / max_physical_memory_,
-                                start);
-                    }
-
-                    Log(indicator);
-                    dotCounter++; // one dot was drawn
-                    
-                    result = WriteFile(out_fd_, nullbuffer, PAGE_SIZE, &bytes_written, NULL);
-                    
-                    if ((!result) || (bytes_written != PAGE_SIZE)) // ASSERT that 4096 have been written by WriteFile API.
-                    {
-                      LogLastError(TEXT("WriteFile API failed when writing bytes to disk.\n"));
-                      goto error;
-                    }
-                    
-                    out_offset += PAGE_SIZE;
-                    start += PAGE_SIZE;
-                    
-                    // We hereby advance by a page.
-                }
-                
+                Log(TEXT("x"));
+                dot_counter_++;
         }
+}
 
-        Log(TEXT("\n"));
-        if (largebuffer) free(largebuffer);
-        if (nullbuffer) free(nullbuffer);
-        return 1;
 
-error:
-        Log(TEXT("\n"));
-        if (largebuffer) free(largebuffer);
-        if (nullbuffer) free(nullbuffer);
-        return 0;
+void WinPmem::on_read_size(uint64_t offset, size_t size)
+{
+        // '<' where reads got smaller after a failure, '>' where they grew
+        // back.
+        if (!stats_filename_) Log(size < read_size_ ? TEXT("<") : TEXT(">"));
+
+        read_size_ = size;
+}
+
+
+void WinPmem::set_read_size_bounds(size_t min_size, size_t max_size)
+{
+        pipeline_.set_read_size_bounds(min_size, max_size);
+}
+
+
+void WinPmem::set_skip_bad_regions(bool skip)
+{
+        pipeline_.set_skip_bad_regions(skip);
+}
+
+
+void WinPmem::on_bad_region(uint64_t offset, uint64_t length)
+{
+        Log(TEXT("\n(Unreadable block 0x%llX - 0x%llX, length 0x%llx, skipping it.) \n"),
+            offset, offset + length, length);
+
+        dot_counter_ = 0;
+}
+
+
+void WinPmem::on_page_failure(uint64_t offset, int reason)
+{
+        failed_pages_++;
+
+        if (reason == PAGE_ACCESS_FAILED) access_failed_pages_++;
+        if (reason == PAGE_MAP_FAILED) map_failed_pages_++;
+        if (reason == PAGE_SKIPPED) skipped_pages_++;
+}
+
+
+void WinPmem::on_run(uint64_t offset, uint64_t length)
+{
+        // More noisy than helpful perhaps?
+        Log(TEXT("\nWrite 0x%llx - 0x%llx, length: 0x%llx.\n"), offset, offset + length, length);
+
+        dot_counter_ = 0;
+        out_offset += length;
+}
+
+
+void WinPmem::on_pad(uint64_t offset, uint64_t length)
+{
+        // Seriously not that interesting watching us writing lots of zeros.
+        Log(TEXT("\n(Omitting & padding reserved block 0x%llX - 0x%llX, length 0x%llx.) \n"), offset, offset + length, length);
+
+        out_offset += length;
 }
 
 
@@ -258,6 +916,42 @@ void WinPmem::print_mode_(unsigned __int32 mode)
 }
 
 
+// What the driver spent its time on in the current mode, on the console
+// and in the stats file if there is one.
+void WinPmem::print_driver_stats_(PmemDeviceSource *source, FILE *stats_fd)
+{
+        WINPMEM_STATS stats;
+        PWINPMEM_MODE_STATS mode;
+        double ms_per_cycle;
+
+        // Older drivers don't keep any.
+        if (mode_ >= WINPMEM_NUMBER_OF_MODES || !source->get_stats(&stats) || !stats.ElapsedCycles) return;
+
+        mode = &stats.Mode[mode_];
+        ms_per_cycle = stats.ElapsedTime / 1e4 / stats.ElapsedCycles;
+
+        Log(TEXT("\nDriver ("));
+        print_mode_(mode_);
+        Log(TEXT("): %llu reads, %llu pages mapped, %llu exceptions, %llu buffers not locked.\n")
+            TEXT("Waiting %.1f ms, locking buffers %.1f ms, mapping %.1f ms, copying %.1f ms.\n"),
+            mode->Reads, mode->PagesRemapped, mode->Exceptions, mode->MdlLockFailures,
+            mode->WaitCycles * ms_per_cycle, mode->MdlCycles * ms_per_cycle,
+            mode->RemapCycles * ms_per_cycle, mode->CopyCycles * ms_per_cycle);
+
+        if (stats_fd)
+        {
+                fprintf(stats_fd, "{\"type\":\"driver\",\"mode\":%u,\"reads\":%llu,\"bytes_read\":%llu,"
+                        "\"pages_remapped\":%llu,\"exceptions\":%llu,\"mdl_lock_failures\":%llu,"
+                        "\"wait_ms\":%.1f,\"mdl_ms\":%.1f,\"remap_ms\":%.1f,\"copy_ms\":%.1f}\n",
+                        mode_, mode->Reads, mode->BytesRead, mode->PagesRemapped, mode->Exceptions,
+                        mode->MdlLockFailures,
+                        mode->WaitCycles * ms_per_cycle, mode->MdlCycles * ms_per_cycle,
+                        mode->RemapCycles * ms_per_cycle, mode->CopyCycles * ms_per_cycle);
+                fflush(stats_fd);
+        }
+}
+
+
 // Display information about the memory geometry.
 // Simply drop a 'care package' info struct (you get that from the driver) into this function to get a nice printout.
 void WinPmem::print_memory_info(PWINPMEM_MEMORY_INFO pinfo)
@@ -284,40 +978,357 @@ void WinPmem::print_memory_info(PWINPMEM_MEMORY_INFO pinfo)
         return;
 }
 
+// Reads a spread of pages from every run with each mode, and picks the
+// one that failed on the fewest pages, the fastest of those if several
+// tie. The default mode if the driver can't probe.
+unsigned __int32 WinPmem::probe_modes_()
+{
+        static const unsigned __int32 modes[] = { PMEM_MODE_PTE, PMEM_MODE_PHYSICAL };
+        PmemDeviceSource source(fd_);
+        std::vector<MemoryRun> runs;
+        std::vector<unsigned char> buffer(PROBE_READ_SIZE);
+        LARGE_INTEGER frequency, start, end;
+        ModeProbe *best = NULL;
+
+        probes_.clear();
+        for (size_t k = 0; k < sizeof(modes) / sizeof(modes[0]); k++)
+        {
+                ModeProbe probe = { modes[k], true, 0, 0, 0, 0.0 };
+
+                probes_.push_back(probe);
+        }
+
+        if (!source.get_runs(&runs))
+        {
+                LogLastError(TEXT("Failed to get memory geometry,"));
+                return default_mode_;
+        }
+
+        QueryPerformanceFrequency(&frequency);
+
+        for (size_t i = 0; i < runs.size(); i++)
+        {
+                uint64_t last_offset = ~(uint64_t)0;
+
+                for (int j = 0; j < PROBE_READS_PER_RUN; j++)
+                {
+                        uint64_t offset = runs[i].offset +
+                                ((runs[i].length / PROBE_READS_PER_RUN * j) & ~(uint64_t)(PAGE_SIZE - 1));
+                        uint64_t left = runs[i].offset + runs[i].length - offset;
+                        size_t length = (size_t)(left < PROBE_READ_SIZE ? left : PROBE_READ_SIZE);
+
+                        // Small runs have fewer distinct places to read.
+                        if (!length || offset == last_offset) continue;
+                        last_offset = offset;
+
+                        // Take turns going first, so no mode always finds
+                        // the caches warmed up by another.
+                        for (size_t k = 0; k < probes_.size(); k++)
+                        {
+                                ModeProbe *probe = &probes_[(k + j) % probes_.size()];
+                                size_t failed_pages = 0;
+                                bool result;
+
+                                if (!probe->available) continue;
+
+                                QueryPerformanceCounter(&start);
+                                result = source.probe(probe->mode, offset, &buffer[0], length, &failed_pages);
+                                QueryPerformanceCounter(&end);
+
+                                if (!result)
+                                {
+                                        probe->available = false;
+                                        continue;
+                                }
+
+                                probe->reads++;
+                                probe->pages += (length + PAGE_SIZE - 1) / PAGE_SIZE;
+                                probe->failed_pages += failed_pages;
+                                probe->seconds += (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+                        }
+                }
+        }
+
+        for (size_t k = 0; k < probes_.size(); k++)
+        {
+                ModeProbe *probe = &probes_[k];
+
+                Log(TEXT("Probed "));
+                print_mode_(probe->mode);
+
+                if (!probe->available || !probe->reads)
+                {
+                        Log(TEXT(": not available.\n"));
+                        continue;
+                }
+
+                Log(TEXT(": %llu of %llu pages read in %.1f ms.\n"),
+                    probe->pages - probe->failed_pages, probe->pages, probe->seconds * 1000);
+
+                // Fewer failed pages first, then the shorter time for
+                // the same pages.
+                if (!best || probe->failed_pages < best->failed_pages ||
+                    (probe->failed_pages == best->failed_pages && probe->seconds < best->seconds))
+                {
+                        best = probe;
+                }
+        }
+
+        if (!best)
+        {
+                Log(TEXT("Unable to probe the acquisition modes, using the default.\n"));
+                return default_mode_;
+        }
+
+        return best->mode;
+}
+
+// A "probe" line per mode in the stats file, saying which was picked.
+void WinPmem::write_probes_(FILE *stats_fd)
+{
+        for (size_t k = 0; k < probes_.size(); k++)
+        {
+                ModeProbe *probe = &probes_[k];
+
+                fprintf(stats_fd, "{\"type\":\"probe\",\"mode\":%u,\"available\":%s,\"chosen\":%s,"
+                        "\"reads\":%llu,\"pages\":%llu,\"failed_pages\":%llu,\"ms\":%.1f,\"mbps\":%.1f}\n",
+                        probe->mode,
+                        probe->available ? "true" : "false",
+                        probe->mode == mode_ ? "true" : "false",
+                        probe->reads, probe->pages, probe->failed_pages, probe->seconds * 1000,
+                        probe->seconds > 0 ? probe->pages * PAGE_SIZE / (1024.0 * 1024.0) / probe->seconds : 0.0);
+        }
+        fflush(stats_fd);
+}
+
+// The image metadata, with the mode it was taken in and what the probes
+// found when it was picked, in <image>.info. Nothing when writing to
+// stdout.
+bool WinPmem::write_info_(PWINPMEM_MEMORY_INFO info)
+{
+        bool result = false;
+        TCHAR *info_filename = NULL;
+        char *metadata = NULL;
+        FILE *info_fd = NULL;
+
+        if (!output_filename_) return true;
+
+        info_filename = aswprintf(TEXT("%s.info"), output_filename_);
+        metadata = store_metadata_(info);
+
+        if (!info_filename || !metadata || _tfopen_s(&info_fd, info_filename, TEXT("w")))
+        {
+                goto exit;
+        }
+
+        fputs(metadata, info_fd);
+        fprintf(info_fd, "acquisition_mode: %u\n", mode_);
+
+        if (!probes_.empty())
+        {
+                fprintf(info_fd, "mode_probes:\n");
+        }
+
+        for (size_t k = 0; k < probes_.size(); k++)
+        {
+                ModeProbe *probe = &probes_[k];
+
+                fprintf(info_fd, "  - mode: %u\n"
+                        "    available: %s\n"
+                        "    chosen: %s\n"
+                        "    reads: %llu\n"
+                        "    pages: %llu\n"
+                        "    failed_pages: %llu\n"
+                        "    ms: %.1f\n"
+                        "    mbps: %.1f\n",
+                        probe->mode,
+                        probe->available ? "true" : "false",
+                        probe->mode == mode_ ? "true" : "false",
+                        probe->reads, probe->pages, probe->failed_pages, probe->seconds * 1000,
+                        probe->seconds > 0 ? probe->pages * PAGE_SIZE / (1024.0 * 1024.0) / probe->seconds : 0.0);
+        }
+
+        fprintf(info_fd, "...\n");  // The end of the YAML file.
+
+        result = !fclose(info_fd);
+        info_fd = NULL;
+
+exit:
+        if (info_fd) fclose(info_fd);
+        free(info_filename);
+        free(metadata);
+
+        if (!result)
+        {
+                LogError(TEXT("Failed to write the image info file.\n"));
+        }
+
+        return result;
+}
+
 __int64 WinPmem::set_acquisition_mode(unsigned __int32 mode)
 {
-        DWORD size;
-        BOOL result = FALSE;
+        DWORD size;
+        BOOL result = FALSE;
+
+        if (mode == PMEM_MODE_AUTO)
+        {
+                mode = probe_modes_();
+        }
+
+        // let's do some sanity checking first.
+        if (! ((mode == PMEM_MODE_PHYSICAL) || (mode == PMEM_MODE_PTE)) )
+        {
+                Log(TEXT("This mode is not available!"));
+                return -1;
+        }
+
+        result = DeviceIoControl(fd_, IOCTL_SET_MODE,
+                                                &mode, 4, // in
+                                                NULL, 0,  // out
+                                          &size, NULL);
+
+        // Set the acquisition mode.
+        if(!(result))
+        {
+                Log(TEXT("Failed to set acquisition mode %lu "), mode);
+                LogLastError(L"");
+                print_mode_(mode);
+                Log(TEXT("\n"));
+                return -1;
+        }
+
+        mode_ = mode;
+        return 1;
+}
+
+__int64 WinPmem::set_compression(int algorithm)
+{
+        Win32Compressor compressor;
+
+        // Fail early if this Windows has no compression API.
+        if (algorithm != COMPRESSION_NONE && !compressor.open(algorithm))
+        {
+                LogLastError(TEXT("Compression is not available on this system."));
+                return -1;
+        }
+
+        compression_ = algorithm;
+        return 1;
+}
+
+void WinPmem::set_hash_file(TCHAR *hash_filename)
+{
+        hash_filename_ = hash_filename;
+}
+
+void WinPmem::set_baseline_file(TCHAR *baseline_filename)
+{
+        baseline_filename_ = baseline_filename;
+}
+
+void WinPmem::set_output_mode(int mode)
+{
+        output_mode_ = mode;
+}
+
+void WinPmem::set_bad_pages_file(TCHAR *bad_pages_filename)
+{
+        bad_pages_filename_ = bad_pages_filename;
+}
+
+void WinPmem::set_stats_file(TCHAR *stats_filename)
+{
+        stats_filename_ = stats_filename;
+}
+
+// The file has a line for each range: the first page frame number and the
+// number of pages, both in hex. Lines starting with # are comments.
+void WinPmem::load_bad_pages_(PmemDeviceSource *source)
+{
+        std::vector<WINPMEM_PAGE_RANGE> ranges;
+        unsigned __int64 pages = 0;
+        char line[128];
+        FILE *fd = NULL;
+
+        // Nothing saved yet, this is the first run.
+        if (_tfopen_s(&fd, bad_pages_filename_, TEXT("r"))) return;
+
+        while (fgets(line, sizeof(line), fd))
+        {
+                WINPMEM_PAGE_RANGE range = { 0 };
+
+                if (line[0] == '#') continue;
+
+                if (sscanf_s(line, "%llx %llx", &range.FirstPage, &range.NumberOfPages) == 2)
+                {
+                        ranges.push_back(range);
+                        pages += range.NumberOfPages;
+                }
+        }
+
+        fclose(fd);
+
+        if (!source->set_bad_pages(ranges))
+        {
+                LogLastError(TEXT("Unable to give the unreadable pages to the driver."));
+                return;
+        }
+
+        Log(TEXT("Loaded %llu unreadable pages in %llu ranges from %s.\n"),
+            pages, (unsigned __int64)ranges.size(), bad_pages_filename_);
+}
+
+void WinPmem::save_bad_pages_(PmemDeviceSource *source)
+{
+        std::vector<WINPMEM_PAGE_RANGE> ranges;
+        unsigned __int64 pages = 0;
+        FILE *fd = NULL;
+        bool result = true;
 
-        // let's do some sanity checking first.
-        if (! ((mode == PMEM_MODE_PHYSICAL) || (mode == PMEM_MODE_PTE)) )
+        if (!source->get_bad_pages(&ranges))
         {
-                Log(TEXT("This mode is not available!"));
-                return -1;
+                LogLastError(TEXT("Unable to get the unreadable pages from the driver."));
+                return;
         }
 
-        result = DeviceIoControl(fd_, IOCTL_SET_MODE,
-                                                &mode, 4, // in
-                                                NULL, 0,  // out
-                                          &size, NULL);
+        if (_tfopen_s(&fd, bad_pages_filename_, TEXT("w")))
+        {
+                LogError(TEXT("Unable to write the unreadable pages.\n"));
+                return;
+        }
 
-        // Set the acquisition mode.
-        if(!(result))
+        fprintf(fd, "# Unreadable pages: first page frame number, number of pages.\n");
+
+        for (size_t i = 0; i < ranges.size(); i++)
         {
-                Log(TEXT("Failed to set acquisition mode %lu "), mode);
-                LogLastError(L"");
-                print_mode_(mode);
-                Log(TEXT("\n"));
-                return -1;
+                result = result && fprintf(fd, "0x%llx 0x%llx\n",
+                                           ranges[i].FirstPage, ranges[i].NumberOfPages) > 0;
+                pages += ranges[i].NumberOfPages;
         }
 
-        mode_ = mode;
-        return 1;
+        if (fclose(fd) || !result)
+        {
+                LogError(TEXT("Unable to write the unreadable pages.\n"));
+                return;
+        }
+
+        Log(TEXT("Saved %llu unreadable pages in %llu ranges to %s.\n"),
+            pages, (unsigned __int64)ranges.size(), bad_pages_filename_);
+}
+
+void WinPmem::set_worker_threads(unsigned __int32 threads)
+{
+        worker_threads_ = threads;
 }
 
-__int64 WinPmem::create_output_file(TCHAR *output_filename)
+__int64 WinPmem::create_output_file(TCHAR *output_filename, bool sparse)
 {
         __int64 status = 1;
+        DWORD size = 0;
+
+        sparse_output_ = false;
+        output_filename_ = NULL;
 
         // The special file name of - means we should use stdout.
 
@@ -325,13 +1336,43 @@ __int64 WinPmem::create_output_file(TCHAR *output_filename)
         {
                 out_fd_ = GetStdHandle(STD_OUTPUT_HANDLE);
                 suppress_output = TRUE;
+                output_mode_ = OUTPUT_BUFFERED;
                 status = 1;
-                goto exit;
+                goto exit;  // Can't seek in a pipe, so never sparse.
+        }
+
+        output_filename_ = output_filename;
+
+        if (output_mode_ == OUTPUT_UNBUFFERED)
+        {
+                out_fd_ = CreateFile(output_filename,
+                                     GENERIC_WRITE,
+                                     FILE_SHARE_READ,
+                                     NULL,
+                                     CREATE_ALWAYS,
+                                     FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING |
+                                     FILE_FLAG_WRITE_THROUGH | FILE_FLAG_OVERLAPPED,
+                                     NULL);
+
+                if (out_fd_ != INVALID_HANDLE_VALUE)
+                {
+                        // The file is preallocated, holes would only
+                        // fragment it again.
+                        if (sparse)
+                        {
+                                Log(TEXT("Unbuffered output is not sparse, writing zeros instead.\n"));
+                        }
+
+                        goto exit;
+                }
+
+                LogLastError(TEXT("Unable to create an unbuffered output file, writing through the cache instead."));
+                output_mode_ = OUTPUT_BUFFERED;
         }
 
-        // Create the output file.
+        // Create the output file. A mapping needs read access as well.
         out_fd_ = CreateFile(output_filename,
-                                           GENERIC_WRITE,
+                                           output_mode_ == OUTPUT_MAPPED ? GENERIC_READ | GENERIC_WRITE : GENERIC_WRITE,
                                            FILE_SHARE_READ,
                                            NULL,
                                            CREATE_ALWAYS,
@@ -345,6 +1386,20 @@ __int64 WinPmem::create_output_file(TCHAR *output_filename)
                 goto exit;
         }
 
+        if (sparse)
+        {
+                // Not every file system can do this (e.g. FAT). Then we
+                // just write the zeros.
+                if (DeviceIoControl(out_fd_, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &size, NULL))
+                {
+                        sparse_output_ = true;
+                }
+                else
+                {
+                        LogLastError(TEXT("Unable to make the output file sparse, writing zeros instead."));
+                }
+        }
+
 exit:
         return status;
 }
@@ -353,12 +1408,24 @@ __int64 WinPmem::write_raw_image()
 {
         // Somewhere to store the info from the driver;
         WINPMEM_MEMORY_INFO info;
-        DWORD size;
         BOOL result = FALSE;
-        __int64 i;
         __int64 status = -1;
         SYSTEMTIME st;
-        BYTE infoBuffer[sizeof(WINPMEM_MEMORY_INFO) + sizeof(LARGE_INTEGER) * 32] = { 0 };
+        PmemDeviceSource source(fd_);
+        Win32FileSink *file_sink = NULL;
+        Win32DirectFileSink *direct_sink = NULL;
+        Win32MappedFileSink *mapped_sink = NULL;
+        CompressingSink *compressing_sink = NULL;
+        std::vector<BlockCompressor *> compressors;
+        HashingSink *hashing_sink = NULL;
+        Win32Sha256Hasher *hasher = NULL;
+        std::vector<ChunkHasher *> hashers;
+        unsigned __int32 threads = worker_threads_;
+        FILE *hash_fd = NULL;
+        HashTree baseline;
+        FILE *baseline_fd = NULL;
+        CopyStats *stats = NULL;
+        FILE *stats_fd = NULL;
 
         if(out_fd_==INVALID_HANDLE_VALUE)
         {
@@ -366,43 +1433,133 @@ __int64 WinPmem::write_raw_image()
                 goto exit;
         }
 
-        RtlZeroMemory(&info, sizeof(WINPMEM_MEMORY_INFO));
+        if (baseline_filename_ && !hash_filename_)
+        {
+                LogError(TEXT("A delta image needs a hash tree file to merge it back.\n"));
+                goto exit;
+        }
 
-        // Get the memory ranges.
-        result = DeviceIoControl(fd_, IOCTL_GET_INFO,
-                                                NULL, 0, // in
-                                                (char *)&infoBuffer, sizeof(infoBuffer), // out
-                                                &size, NULL);
+        if (output_mode_ == OUTPUT_MAPPED && compression_ != COMPRESSION_NONE)
+        {
+                Log(TEXT("A compressed image can not be mapped, writing it through the cache instead.\n"));
+        }
+        else if (output_mode_ == OUTPUT_MAPPED && baseline_filename_)
+        {
+                Log(TEXT("A delta image can not be mapped, writing it through the cache instead.\n"));
+        }
 
-        if (!(result))
+        if (output_mode_ == OUTPUT_UNBUFFERED)
         {
-                LogLastError(TEXT("Failed to get memory geometry,"));
-                status = -1;
-                goto exit;
+                direct_sink = new Win32DirectFileSink(out_fd_, DIRECT_WRITE_SIZE, DIRECT_WRITES);
+                if (!direct_sink->open())
+                {
+                        LogLastError(TEXT("Unable to set up unbuffered writes."));
+                        goto exit;
+                }
+
+                image_sink_ = direct_sink;
         }
-#ifdef _WIN64
-        RtlCopyMemory(&info, infoBuffer, sizeof(WINPMEM_MEMORY_INFO));
-#else
+        else if (output_mode_ == OUTPUT_MAPPED && compression_ == COMPRESSION_NONE && !baseline_filename_)
         {
-            SYSTEM_INFO sys_info = { 0 };
+                // Mapped once the size of the image is known.
+                mapped_sink = new Win32MappedFileSink(out_fd_);
+                image_sink_ = mapped_sink;
+        }
+        else
+        {
+                // Holes don't help a compressed image, zero chunks are tiny anyway.
+                file_sink = new Win32FileSink(out_fd_, sparse_output_ && compression_ == COMPRESSION_NONE);
+                image_sink_ = file_sink;
+        }
 
-            GetNativeSystemInfo(&sys_info);
+        if (!threads)
+        {
+                // Leave one CPU for the reader.
+                threads = std::thread::hardware_concurrency();
+                threads = threads > 1 ? threads - 1 : 1;
+        }
 
-            switch (sys_info.wProcessorArchitecture)
-            {
-                case PROCESSOR_ARCHITECTURE_AMD64:
+        if (compression_ != COMPRESSION_NONE)
+        {
+                for (unsigned __int32 j = 0; j < threads; j++)
                 {
-                    DWORD dwOffset = FIELD_OFFSET(WINPMEM_MEMORY_INFO, PfnDataBase);
-                    RtlCopyMemory(&info, infoBuffer, dwOffset);
-                    RtlCopyMemory(&info.PfnDataBase, infoBuffer + dwOffset + 32 * sizeof(LARGE_INTEGER), sizeof(WINPMEM_MEMORY_INFO) - dwOffset);
-                    break;
+                        Win32Compressor *compressor = new Win32Compressor();
+
+                        compressors.push_back(compressor);
+                        if (!compressor->open(compression_))
+                        {
+                                LogLastError(TEXT("Unable to create a compressor."));
+                                goto exit;
+                        }
                 }
-                default:
-                    RtlCopyMemory(&info, infoBuffer, sizeof(WINPMEM_MEMORY_INFO));
-                    break;
-            }
+
+                compressing_sink = new CompressingSink(image_sink_, compression_, compressors,
+                                                       COMPRESSED_CHUNK_SIZE);
+                image_sink_ = compressing_sink;
+
+                Log(TEXT("Compressing the image with %s on %u threads.\n"),
+                    compression_ == COMPRESSION_XPRESS ? TEXT("XPRESS") : TEXT("XPRESS_HUFF"),
+                    threads);
+        }
+
+        // The hash is of the raw image, so it goes in front of the
+        // compressor.
+        if (hash_filename_)
+        {
+                hasher = new Win32Sha256Hasher();
+                if (!hasher->open())
+                {
+                        LogLastError(TEXT("Unable to create a SHA-256 hasher."));
+                        goto exit;
+                }
+
+                for (unsigned __int32 j = 0; j < threads; j++)
+                {
+                        Win32Sha256Hasher *worker = new Win32Sha256Hasher();
+
+                        hashers.push_back(worker);
+                        if (!worker->open())
+                        {
+                                LogLastError(TEXT("Unable to create a SHA-256 hasher."));
+                                goto exit;
+                        }
+                }
+
+                hashing_sink = new HashingSink(image_sink_, hasher, hashers, HASH_CHUNK_SIZE);
+                image_sink_ = hashing_sink;
+
+                // Memory is read into the mapped file and hashed there.
+                hashing_sink->set_in_place(mapped_sink != NULL);
+        }
+
+        if (baseline_filename_)
+        {
+                if (_tfopen_s(&baseline_fd, baseline_filename_, TEXT("r")))
+                {
+                        LogError(TEXT("Unable to open the baseline hash tree.\n"));
+                        goto exit;
+                }
+
+                result = read_hash_tree(baseline_fd, &baseline);
+                fclose(baseline_fd);
+                baseline_fd = NULL;
+
+                if (!result || baseline.chunk_size != HASH_CHUNK_SIZE)
+                {
+                        LogError(TEXT("The baseline is not a hash tree of 1 MB chunks.\n"));
+                        goto exit;
+                }
+
+                hashing_sink->set_baseline(&baseline);
+                Log(TEXT("Writing only the chunks that changed since the baseline.\n"));
+        }
+
+        if (!source.get_info(&info))
+        {
+                LogLastError(TEXT("Failed to get memory geometry,"));
+                status = -1;
+                goto exit;
         }
-#endif
 
         GetSystemTime(&st);
         printf("The system time is: %02d:%02d:%02d\n", st.wHour, st.wMinute, st.wSecond);
@@ -415,47 +1572,211 @@ __int64 WinPmem::write_raw_image()
         #endif
 
         print_memory_info(&info);
+
+        // A raw image is exactly as large as physical memory. Allocating it
+        // all at once keeps it in a few extents. NTFS completes writes
+        // that extend the file, or its valid data, synchronously, so both
+        // are set up front or only one write would be in flight at a
+        // time. finish() cuts the file back to what was written.
+        if (direct_sink && compression_ == COMPRESSION_NONE && !baseline_filename_)
+        {
+                FILE_END_OF_FILE_INFO end_of_file;
+
+                end_of_file.EndOfFile.QuadPart = max_physical_memory_;
+                if (!SetFileInformationByHandle(out_fd_, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file)))
+                {
+                        LogLastError(TEXT("Unable to preallocate the output file, writes extend it one at a time."));
+                }
+                // Until it is overwritten, the file holds whatever was on
+                // the disk before. If imaging fails the file is cut back
+                // to what was written on the way out.
+                else if (enable_privilege(SE_MANAGE_VOLUME_NAME) &&
+                         SetFileValidData(out_fd_, max_physical_memory_))
+                {
+                        Log(TEXT("Preallocated 0x%llx bytes with valid data, %u unbuffered writes in flight.\n"),
+                            max_physical_memory_, DIRECT_WRITES);
+                }
+                else
+                {
+                        Log(TEXT("Preallocated 0x%llx bytes. Without SE_MANAGE_VOLUME_NAME the file system zeroes\n")
+                            TEXT("the file ahead of the writes, so they complete one at a time.\n"),
+                            max_physical_memory_);
+                }
+        }
+
+        if (mapped_sink && !mapped_sink->open(max_physical_memory_))
+        {
+                LogLastError(TEXT("Unable to map the output file."));
+                status = -1;
+                goto exit;
+        }
+
+        if (bad_pages_filename_) load_bad_pages_(&source);
+
+        if (stats_filename_)
+        {
+                if (!_tcscmp(stats_filename_, TEXT("-")))
+                {
+                        stats_fd = stderr;
+                }
+                else if (_tfopen_s(&stats_fd, stats_filename_, TEXT("w")))
+                {
+                        LogError(TEXT("Unable to create the stats file.\n"));
+                        goto exit;
+                }
+
+                stats = new CopyStats(stats_fd, this);
+                write_probes_(stats_fd);
+        }
         fflush(stdout);
 
         // write ranges and pass non ranges
 
-        __int64 current = 0;
+        source.reset_stats();
+
+        dot_counter_ = 0;
+        failed_pages_ = access_failed_pages_ = map_failed_pages_ = skipped_pages_ = 0;
+        read_size_ = pipeline_.buffer_size();  // Reads start at the largest size.
+
+        // Unreadable pages are zero padded by the pipeline, so the only
+        // failure here is the output.
+        result = pipeline_.copy_image(&source, image_sink_, stats ? (CopyObserver *)stats : this);
+
+        if (stats) stats->finish();
+
+        if (!result)
+        {
+                Log(TEXT("\n"));
+                LogLastError(TEXT("Copying memory went wrong! Perhaps check if there is enough space to write? Cancelling & terminating.\n"));
+                status = -1;
+                goto exit;
+        }
+
+        if (failed_pages_)
+        {
+                Log(TEXT("\n%llu pages could not be read and were zero padded (%llu blocked, %llu not mappable, %llu skipped in unreadable regions)."),
+                    failed_pages_, access_failed_pages_, map_failed_pages_, skipped_pages_);
+        }
+
+        Log(TEXT("\n"));
+
+        print_driver_stats_(&source, stats_fd);
+
+        if (bad_pages_filename_) save_bad_pages_(&source);
 
-        for (i=0; i < info.NumberOfRuns.QuadPart; i++)
+        if (hashing_sink)
         {
-                if(info.Run[i].BaseAddress.QuadPart > current)
+                char root[HASH_DIGEST_SIZE * 2 + 1];
+
+                if (!hashing_sink->finish())
                 {
-                  // pad zeros from current until begin of next RAM memory region.
-                  if (!pad(current, info.Run[i].BaseAddress.QuadPart - current))
-                  {
-                        printf("padding went terribly wrong! Cancelling & terminating. \n");
-                        fflush(stdout);
+                        LogError(TEXT("Failed to hash the image.\n"));
                         status = -1;
                         goto exit;
-                  }
                 }
 
-                // write next RAM memory region to file.
+                if (_tfopen_s(&hash_fd, hash_filename_, TEXT("w")) ||
+                    !hashing_sink->write_tree(hash_fd, "SHA256"))
+                {
+                        LogError(TEXT("Failed to write the hash tree.\n"));
+                        status = -1;
+                        goto exit;
+                }
 
-                result = (BOOL) copy_memory(info.Run[i].BaseAddress.QuadPart, info.Run[i].BaseAddress.QuadPart + info.Run[i].NumberOfBytes.QuadPart);
+                result = !fclose(hash_fd);
+                hash_fd = NULL;
 
                 if (!result)
                 {
-                    printf("Copying memory at run 0x%08llX went wrong! Perhaps check if there is enough space to write? Cancelling & terminating.\n", info.Run[i].BaseAddress.QuadPart);
-                    fflush(stdout);
-                    status = -1;
-                    goto exit;
+                        LogError(TEXT("Failed to write the hash tree.\n"));
+                        status = -1;
+                        goto exit;
+                }
+
+                for (size_t j = 0; j < HASH_DIGEST_SIZE; j++)
+                {
+                        sprintf_s(root + j * 2, sizeof(root) - j * 2, "%02x", hashing_sink->root().bytes[j]);
+                }
+
+                Log(TEXT("\nSHA-256 hash tree root: %S\n"), root);
+
+                if (baseline_filename_)
+                {
+                        Log(TEXT("Wrote %llu of %llu chunks, the others are in the baseline.\n"),
+                            (unsigned long long)hashing_sink->delta_chunks(),
+                            (unsigned long long)hashing_sink->leaves().size());
                 }
+        }
+
+        if (compressing_sink)
+        {
+                if (!compressing_sink->finish())
+                {
+                        LogLastError(TEXT("Failed to write the end of the compressed image.\n"));
+                        status = -1;
+                        goto exit;
+                }
+
+                Log(TEXT("\nCompressed 0x%llx bytes to 0x%llx bytes.\n"),
+                    compressing_sink->raw_bytes(), compressing_sink->stored_bytes());
+        }
 
-                // update current cursor offset.
+        if (mapped_sink && !mapped_sink->finish())
+        {
+                LogError(TEXT("Failed to write all of the mapped image.\n"));
+                status = -1;
+                goto exit;
+        }
 
-                current = info.Run[i].BaseAddress.QuadPart + info.Run[i].NumberOfBytes.QuadPart;
+        if (direct_sink && !direct_sink->finish())
+        {
+                LogLastError(TEXT("Failed to write the end of the image.\n"));
+                status = -1;
+                goto exit;
+        }
+        else if (sparse_output_ && file_sink)
+        {
+                Log(TEXT("\n0x%llx of 0x%llx bytes were left as holes in the sparse image.\n"), file_sink->hole_bytes(), max_physical_memory_);
         }
 
+        // The image is complete without it, so only say it is missing.
+        write_info_(&info);
+
         // All is well.
         status = 1;
 
         exit:
+        if (hash_fd) fclose(hash_fd);
+
+        delete stats;
+        if (stats_fd && stats_fd != stderr) fclose(stats_fd);
+
+        // These stop their workers, so they go before the hashers and
+        // the compressors.
+        delete hashing_sink;
+        for (size_t j = 0; j < hashers.size(); j++)
+        {
+                delete hashers[j];
+        }
+        delete hasher;
+
+        delete compressing_sink;
+        for (size_t j = 0; j < compressors.size(); j++)
+        {
+                delete compressors[j];
+        }
+        // Behind what was written, a preallocated file holds whatever was
+        // on the disk before.
+        if (direct_sink && status != 1 && !direct_sink->cancel())
+        {
+                LogLastError(TEXT("Unable to cut the failed image back to what was written."));
+        }
+
+        delete file_sink;
+        delete direct_sink;
+        delete mapped_sink;
+        image_sink_ = NULL;
+
         CloseHandle(out_fd_);
         out_fd_ = INVALID_HANDLE_VALUE;
 
@@ -466,6 +1787,82 @@ __int64 WinPmem::write_raw_image()
 }
 
 
+__int64 WinPmem::extract_image(TCHAR *compressed_filename)
+{
+        __int64 status = -1;
+        Win32Decompressor decompressor;
+        CompressedImageReader reader(&decompressor, EXTRACT_CACHE_CHUNKS);
+        Win32FileSink *file_sink = NULL;
+        FILE *fd = NULL;
+
+        if (out_fd_ == INVALID_HANDLE_VALUE)
+        {
+                LogError(TEXT("Must open an output file first."));
+                goto exit;
+        }
+
+        if (_tfopen_s(&fd, compressed_filename, TEXT("rb")))
+        {
+                LogError(TEXT("Unable to open the compressed image.\n"));
+                goto exit;
+        }
+
+        // The reader owns fd from here on.
+        if (!reader.open(fd))
+        {
+                LogError(TEXT("Not a compressed image, or its index is corrupt.\n"));
+                goto exit;
+        }
+
+        // An image of only stored chunks needs no decompressor.
+        if (reader.algorithm() != COMPRESSION_NONE && !decompressor.open(reader.algorithm()))
+        {
+                LogLastError(TEXT("Unable to create a decompressor."));
+                goto exit;
+        }
+
+        Log(TEXT("Extracting 0x%llx bytes.\n"), reader.size());
+
+        file_sink = new Win32FileSink(out_fd_, sparse_output_);
+        max_physical_memory_ = reader.size();
+        dot_counter_ = 0;
+        failed_pages_ = access_failed_pages_ = map_failed_pages_ = skipped_pages_ = 0;
+        read_size_ = pipeline_.buffer_size();
+
+        // The gaps between runs are padded just like when imaging.
+        if (!pipeline_.copy_image(&reader, file_sink, this))
+        {
+                Log(TEXT("\n"));
+                LogLastError(TEXT("Failed to write the extracted image."));
+                goto exit;
+        }
+
+        // The reader only fails on a corrupt chunk, which the pipeline
+        // would have zero padded.
+        if (failed_pages_)
+        {
+                LogError(TEXT("\nSome chunks of the compressed image are corrupt.\n"));
+                goto exit;
+        }
+
+        if (sparse_output_)
+        {
+                Log(TEXT("\n0x%llx of 0x%llx bytes were left as holes in the sparse image.\n"),
+                    file_sink->hole_bytes(), max_physical_memory_);
+        }
+
+        Log(TEXT("\n"));
+        status = 1;
+
+        exit:
+        delete file_sink;
+
+        CloseHandle(out_fd_);
+        out_fd_ = INVALID_HANDLE_VALUE;
+
+        return status;
+}
+
 WinPmem::WinPmem():
         fd_(INVALID_HANDLE_VALUE),
         buffer_size_(0x1000), // can be used for write enabled mode.
@@ -479,9 +1876,29 @@ WinPmem::WinPmem():
         metadata_len_(0),
         driver_filename_(NULL),
         driver_is_tempfile_(false),
-        out_offset(0)
+        out_offset(0),
+        pipeline_(MAXIMUM_BULK_READ, PIPELINE_BUFFERS),
+        dot_counter_(0),
+        failed_pages_(0),
+        access_failed_pages_(0),
+        map_failed_pages_(0),
+        skipped_pages_(0),
+        read_size_(MAXIMUM_BULK_READ),
+        sparse_output_(false),
+        output_mode_(OUTPUT_BUFFERED),
+        image_sink_(NULL),
+        compression_(COMPRESSION_NONE),
+        hash_filename_(NULL),
+        baseline_filename_(NULL),
+        bad_pages_filename_(NULL),
+        stats_filename_(NULL),
+        worker_threads_(0),
+        output_filename_(NULL)
 
-        {}
+        {
+                pipeline_.set_read_size_bounds(MINIMUM_BULK_READ, MAXIMUM_BULK_READ);
+                pipeline_.set_skip_bad_regions(true);
+        }
 
 
 WinPmem::~WinPmem()
@@ -517,7 +1934,10 @@ void WinPmem::Log(const TCHAR *message, ...)
   va_start(ap, message);
   vwprintf(message, ap);
   va_end(ap);
-  fflush(stdout);
+
+  // Flushing every progress dot costs a write when stdout is a file.
+  size_t length = _tcslen(message);
+  if (length && message[length - 1] == '\n') fflush(stdout);
 }
 
 
@@ -740,7 +2160,8 @@ __int64 WinPmem::uninstall_driver()
 
 
 /* Create a YAML file describing the image encoded into a null terminated
-   string. Caller will own the memory.
+   string. Caller will own the memory, and ends the YAML file after adding
+   what it knows.
  */
 char *store_metadata_(PWINPMEM_MEMORY_INFO info)
 {
@@ -791,8 +2212,7 @@ char *store_metadata_(PWINPMEM_MEMORY_INFO info)
                                   "NtBuildNumber: %#llx\n"
                                   "NtBuildNumberAddr: %#llx\n"
                                   "KernBase: %#llx\n"
-                                  "Arch: %s\n"
-                                  "...\n",  // This is the end of a YAML file.
+                                  "Arch: %s\n",
                                   time_buffer,
                                   info->CR3.QuadPart,
                                   info->NtBuildNumber.QuadPart,
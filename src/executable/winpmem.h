@@ -6,6 +6,8 @@
 #include <stdarg.h>
 #include <varargs.h>
 
+#include <map>
+
 typedef LARGE_INTEGER PHYSICAL_ADDRESS, *PPHYSICAL_ADDRESS;
 
 typedef struct _PHYSICAL_MEMORY_RANGE {
@@ -16,14 +18,232 @@ typedef struct _PHYSICAL_MEMORY_RANGE {
 #include "..\userspace_interface\ctl_codes.h"
 #include "..\userspace_interface\winpmem_shared.h"
 
+#include "pipeline.h"
+#include "sparse.h"
+#include "compress.h"
+#include "hash.h"
+#include "stats.h"
+
 static TCHAR version[] = TEXT(PMEM_DRIVER_VERSION) TEXT(" ") TEXT(__DATE__);
 
 // These numbers are set in the resource editor for the FILE resource.
 #define WINPMEM_64BIT_DRIVER 104
 #define WINPMEM_32BIT_DRIVER 105
 
+// Not a driver mode: set_acquisition_mode() probes the modes and picks
+// the best one.
+#define PMEM_MODE_AUTO 0xFF
+
+// How one mode did on the probe reads.
+struct ModeProbe
+{
+        unsigned __int32 mode;
+        bool available;           // Until the driver refused a probe.
+        unsigned __int64 reads;
+        unsigned __int64 pages;
+        unsigned __int64 failed_pages;
+        double seconds;
+};
+
+// How write_raw_image() writes the image file.
+enum OutputMode
+{
+        OUTPUT_BUFFERED = 0,    // WriteFile() through the file system cache.
+        OUTPUT_UNBUFFERED = 1,  // Win32DirectFileSink.
+        OUTPUT_MAPPED = 2       // Win32MappedFileSink.
+};
+
+
+// Reads from the pmem device handle.
+class PmemDeviceSource: public PhysicalMemorySource
+{
+public:
+        PmemDeviceSource(HANDLE fd): fd_(fd), continue_supported_(true) {}
+
+        // The memory geometry from the driver.
+        bool get_info(PWINPMEM_MEMORY_INFO info);
+
+        virtual bool get_runs(std::vector<MemoryRun> *runs);
+        virtual bool read(uint64_t offset, unsigned char *buffer, size_t length,
+                          size_t *bytes_read);
+        virtual bool read_all(uint64_t offset, unsigned char *buffer, size_t length,
+                              std::vector<PageFailure> *failures);
+
+        // The pages the driver remembers as unreadable. Reads of them fail
+        // at once.
+        bool get_bad_pages(std::vector<WINPMEM_PAGE_RANGE> *ranges);
+        bool set_bad_pages(const std::vector<WINPMEM_PAGE_RANGE> &ranges);
+
+        // Reads like read_all() but with mode, whatever mode the driver is
+        // in. Fails if the driver can't read with mode, or can't probe.
+        bool probe(unsigned __int32 mode, uint64_t offset, unsigned char *buffer,
+                   size_t length, size_t *failed_pages);
+
+        // Where the driver's reads spent their time, per mode, since the
+        // last reset.
+        bool get_stats(PWINPMEM_STATS stats);
+        bool reset_stats();
+
+private:
+        HANDLE fd_;
+
+        // Older drivers don't know IOCTL_READ_PHYSICAL_CONTINUE.
+        bool continue_supported_;
+        std::vector<unsigned char> result_;
+};
+
+// Writes to the image file handle. If sparse, zero pages and padding
+// become holes in the file.
+class Win32FileSink: public SparseSink
+{
+public:
+        Win32FileSink(HANDLE fd, bool sparse): fd_(fd) { set_sparse(sparse); }
+
+protected:
+        virtual bool write_data(const unsigned char *buffer, size_t length);
+        virtual bool skip(uint64_t length);
 
-class WinPmem
+private:
+        HANDLE fd_;
+};
+
+// Writes to an image file opened with FILE_FLAG_NO_BUFFERING,
+// FILE_FLAG_WRITE_THROUGH and FILE_FLAG_OVERLAPPED, so the image does not
+// go through the system cache and push out the working sets of the host.
+// The data is gathered into page aligned buffers, and up to count of them
+// are being written at a time.
+class Win32DirectFileSink: public ImageSink
+{
+public:
+        Win32DirectFileSink(HANDLE fd, size_t buffer_size, size_t count);
+        virtual ~Win32DirectFileSink();
+
+        bool open();
+
+        virtual bool write(const unsigned char *buffer, size_t length);
+        virtual bool pad(uint64_t length);
+
+        // Writes the last partial buffer, waits for all writes and cuts
+        // the file to the size of the image.
+        bool finish();
+
+        // After a failure: Waits for the writes in flight and cuts the
+        // file back to the bytes that were written, so none of a
+        // preallocated file is left holding what was on the disk before.
+        bool cancel();
+
+private:
+        struct Slot
+        {
+                unsigned char *data;
+                OVERLAPPED overlapped;
+                bool pending;
+        };
+
+        bool submit_();
+        bool wait_(Slot *slot);
+
+        HANDLE fd_;
+        size_t buffer_size_;
+        size_t sector_size_;
+        std::vector<Slot> slots_;
+        size_t current_;
+        size_t filled_;       // Bytes in the current slot.
+        uint64_t offset_;     // Where the current slot goes in the file.
+        uint64_t failed_at_;  // The first write that failed, if any did.
+};
+
+// Writes a raw image through a mapping of the output file, in windows
+// that are mapped as the image gets to them. The engine reads straight
+// into the mapped views, so the driver fills the pages of the file cache
+// and nothing is copied in user mode. The file is grown to the size of
+// the image up front, so padding costs nothing: the new file reads as
+// zeros already.
+class Win32MappedFileSink: public ImageSink
+{
+public:
+        Win32MappedFileSink(HANDLE fd);
+        virtual ~Win32MappedFileSink();
+
+        // The handle must be open for reading and writing.
+        bool open(uint64_t size);
+
+        virtual bool write(const unsigned char *buffer, size_t length);
+        virtual bool pad(uint64_t length);
+        virtual unsigned char *target(uint64_t offset, size_t length);
+
+        // Unmaps the file. Returns false unless all of it was written.
+        bool finish();
+
+private:
+        unsigned char *view_(uint64_t window);
+        bool advance_(uint64_t length);
+
+        HANDLE fd_;
+        HANDLE mapping_;
+        uint64_t size_;
+        uint64_t position_;   // Where the next write goes.
+
+        // The engine maps windows ahead of position_ on the reader
+        // thread, so the views are protected by mu_.
+        std::mutex mu_;
+        std::map<uint64_t, unsigned char *> views_;
+};
+
+// Compresses chunks with the Windows compression API in cabinet.dll. The
+// DLL is loaded on first use since it only ships with Windows 8 and up.
+class Win32Compressor: public BlockCompressor
+{
+public:
+        Win32Compressor(): handle_(NULL) {}
+        virtual ~Win32Compressor();
+
+        // algorithm is one of COMPRESSION_XPRESS or COMPRESSION_XPRESS_HUFF.
+        bool open(int algorithm);
+
+        virtual size_t compress(const unsigned char *input, size_t length,
+                                unsigned char *output, size_t capacity);
+
+private:
+        void *handle_;
+};
+
+// SHA-256 from the CNG API.
+class Win32Sha256Hasher: public ChunkHasher
+{
+public:
+        Win32Sha256Hasher(): algorithm_(NULL), hash_(NULL) {}
+        virtual ~Win32Sha256Hasher();
+
+        bool open();
+
+        virtual bool begin();
+        virtual bool update(const unsigned char *buffer, size_t length);
+        virtual bool finish(Digest *digest);
+
+private:
+        void *algorithm_;
+        void *hash_;
+};
+
+// The other side of Win32Compressor, for CompressedImageReader.
+class Win32Decompressor: public BlockDecompressor
+{
+public:
+        Win32Decompressor(): handle_(NULL) {}
+        virtual ~Win32Decompressor();
+
+        bool open(int algorithm);
+
+        virtual bool decompress(const unsigned char *input, size_t length,
+                                unsigned char *output, size_t raw_size);
+
+private:
+        void *handle_;
+};
+
+
+class WinPmem: public CopyObserver
 {
 public:
 
@@ -33,18 +253,66 @@ public:
         virtual __int64 install_driver();
         virtual __int64 uninstall_driver();
         virtual __int64 set_write_enabled();
+        // PMEM_MODE_AUTO picks the mode that reads the most pages, the
+        // fastest of them if several do, by timing a few reads from every
+        // run with each.
         virtual __int64 set_acquisition_mode(unsigned __int32 mode);
         virtual void set_driver_filename(TCHAR *driver_filename);
         virtual void print_memory_info(PWINPMEM_MEMORY_INFO pinfo);
 
         // In order to create an image:
 
-        // 1. Create an output file with create_output_file()
+        // 1. Create an output file with create_output_file(). A sparse
+        //    file leaves zero pages and gaps between runs as holes.
         // 2. Select either write_raw_image() or write_crashdump().
         // 3. When this object is deleted, the file is closed.
-        virtual __int64 create_output_file(TCHAR *output_filename);
+        virtual __int64 create_output_file(TCHAR *output_filename, bool sparse = false);
         virtual __int64 write_raw_image();
 
+        // Decompress an image written with set_compression(), or a
+        // compressed delta, to the output file instead of imaging
+        // memory. Needs no driver.
+        virtual __int64 extract_image(TCHAR *compressed_filename);
+
+        // Compress the raw image with algorithm (a CompressionAlgorithm).
+        // Must be called before write_raw_image().
+        virtual __int64 set_compression(int algorithm);
+
+        // How to write the image file (an OutputMode). Must be set before
+        // create_output_file().
+        virtual void set_output_mode(int mode);
+
+        // Hash the raw image while it is written, and write the SHA-256
+        // hash tree to this file.
+        virtual void set_hash_file(TCHAR *hash_filename);
+
+        // Only write the chunks that changed since the image with the
+        // hash tree in this file. Needs set_hash_file(), as the tree of
+        // the delta is needed to merge it back.
+        virtual void set_baseline_file(TCHAR *baseline_filename);
+
+        // Give the driver the unreadable pages in this file, if it exists,
+        // and save the ones it knows of there after imaging.
+        virtual void set_bad_pages_file(TCHAR *bad_pages_filename);
+
+        // Write read and write timings, throughput and failure counts to
+        // this file as JSON lines while imaging, instead of the progress
+        // dots. "-" is stderr.
+        virtual void set_stats_file(TCHAR *stats_filename);
+
+        // Threads for each of compression and hashing, or one per spare
+        // CPU if 0.
+        virtual void set_worker_threads(unsigned __int32 threads);
+
+        // Bulk reads shrink to min_size around bad pages and grow back to
+        // max_size where memory reads cleanly.
+        virtual void set_read_size_bounds(size_t min_size, size_t max_size);
+
+        // On by default: Once the end of a region of bad pages has been
+        // found with a few probes, zero fill it without reading it. Its
+        // pages are counted as skipped.
+        virtual void set_skip_bad_regions(bool skip);
+
         // This is set if output should be suppressed (e.g. if we pipe the
         // image to the STDOUT).
         __int64 suppress_output;
@@ -61,9 +329,15 @@ protected:
         virtual void Log(const TCHAR *message, ...);
         virtual void LogLastError(TCHAR *message);
 
-        __int64 pad(unsigned __int64 start, unsigned __int64 length);
+        // Progress report from the copy pipeline.
+        virtual void on_read(uint64_t offset, size_t bytes_read, bool failed);
+        virtual void on_page_failure(uint64_t offset, int reason);
+        virtual void on_run(uint64_t offset, uint64_t length);
+        virtual void on_pad(uint64_t offset, uint64_t length);
+        virtual void on_read_size(uint64_t offset, size_t size);
+        virtual void on_bad_region(uint64_t offset, uint64_t length);
+
         __int64 copy_memory_small(unsigned __int64 start, unsigned __int64 end);
-        __int64 copy_memory(unsigned __int64 start, unsigned __int64 end);
 
         // The file handle to the pmem device.
         HANDLE fd_;
@@ -82,12 +356,51 @@ protected:
         // Current offset in output file (Total bytes written so far).
         unsigned __int64 out_offset;
 
+        // Copies runs from the device to the image. Its buffers are reused
+        // for every run.
+        CopyPipeline pipeline_;
+        unsigned __int64 dot_counter_;
+        unsigned __int64 failed_pages_;
+        unsigned __int64 access_failed_pages_;
+        unsigned __int64 map_failed_pages_;
+        unsigned __int64 skipped_pages_;
+        size_t read_size_;
+
+        // Zero pages are left as holes in the image.
+        bool sparse_output_;
+
+        // How the image file was opened.
+        int output_mode_;
+
+        // Where runs and padding are written while write_raw_image() is
+        // running. This is the image file, maybe behind a compressor and
+        // a hasher.
+        ImageSink *image_sink_;
+        int compression_;
+        TCHAR *hash_filename_;
+        TCHAR *baseline_filename_;
+        TCHAR *bad_pages_filename_;
+        TCHAR *stats_filename_;
+        unsigned __int32 worker_threads_;
+
+        // The image file, NULL when writing to stdout.
+        TCHAR *output_filename_;
+
         // The current acquisition mode.
         unsigned __int32 mode_;
         unsigned __int32 default_mode_;
 
+        // What PMEM_MODE_AUTO found, if it was used.
+        std::vector<ModeProbe> probes_;
+
 private:
         void print_mode_(unsigned __int32 mode);
+        unsigned __int32 probe_modes_();
+        void write_probes_(FILE *stats_fd);
+        bool write_info_(PWINPMEM_MEMORY_INFO info);
+        void print_driver_stats_(PmemDeviceSource *source, FILE *stats_fd);
+        void load_bad_pages_(PmemDeviceSource *source);
+        void save_bad_pages_(PmemDeviceSource *source);
         char * metadata_;
         DWORD metadata_len_;
 
@@ -106,4 +419,5 @@ class WinPmem64: public WinPmem
 
 
 char *asprintf(const char *fmt, ...);
+char *store_metadata_(PWINPMEM_MEMORY_INFO info);
 TCHAR *aswprintf(const TCHAR *fmt, ...);
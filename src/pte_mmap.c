@@ -41,25 +41,60 @@ __declspec(noinline) _IRQL_requires_max_(APC_LEVEL)
 PTE_STATUS virt_find_pte(_In_ VIRT_ADDR vaddr, _Out_  volatile PPTE * pPTE);
 
 __declspec(noinline) _IRQL_requires_max_(APC_LEVEL)
-BOOLEAN setupBackupForOriginalRoguePage(_Inout_ PPTE_METHOD_DATA pPtedata);
+PTE_STATUS virt_find_pte_ex(_In_ VIRT_ADDR vaddr, _Out_  volatile PPTE * pPTE, _In_ BOOLEAN must_be_present);
+
+__declspec(noinline) _IRQL_requires_max_(APC_LEVEL)
+PTE_STATUS pte_remap_rogue_range(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ PHYS_ADDR Phys_addr, _In_ ULONG pages);
+
+__declspec(noinline) _IRQL_requires_max_(APC_LEVEL)
+BOOLEAN setupBackupForOriginalRoguePage(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ PVOID rogue_page);
 
 __declspec(noinline) _IRQL_requires_max_(APC_LEVEL)
 VOID restoreOriginalRoguePage(_Inout_ PPTE_METHOD_DATA pPtedata);
 
+_IRQL_requires_max_(APC_LEVEL)
+BOOLEAN setupRogueWindow(_Inout_ PPTE_METHOD_DATA pPtedata);
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID restoreRogueWindow(_Inout_ PPTE_METHOD_DATA pPtedata);
+
+KIPI_BROADCAST_WORKER flushRogueWindow;
+
+_IRQL_requires_max_(APC_LEVEL)
+BOOLEAN setupRoguePagePool(_Inout_ PPTE_POOL pPool);
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID restoreRoguePagePool(_Inout_ PPTE_POOL pPool);
+
+_IRQL_requires_max_(APC_LEVEL)
+PPTE_METHOD_DATA acquireRoguePage(_Inout_ PPTE_POOL pPool);
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID releaseRoguePage(_Inout_ PPTE_POOL pPool, _In_ PPTE_METHOD_DATA pPtedata);
+
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text( NONPAGED , pte_remap_rogue_page )
 #pragma alloc_text( NONPAGED , print_pte_contents )
 #pragma alloc_text( NONPAGED , virt_find_pte )
+#pragma alloc_text( NONPAGED , virt_find_pte_ex )
+#pragma alloc_text( NONPAGED , pte_remap_rogue_range )
 #pragma alloc_text( NONPAGED , setupBackupForOriginalRoguePage )
 #pragma alloc_text( NONPAGED , restoreOriginalRoguePage)
+#pragma alloc_text( NONPAGED , setupRogueWindow )
+#pragma alloc_text( NONPAGED , restoreRogueWindow )
+#pragma alloc_text( NONPAGED , flushRogueWindow )
+#pragma alloc_text( NONPAGED , setupRoguePagePool )
+#pragma alloc_text( NONPAGED , restoreRoguePagePool )
+#pragma alloc_text( NONPAGED , acquireRoguePage )
+#pragma alloc_text( NONPAGED , releaseRoguePage )
 #endif
 
 
 // Edit the page tables to relink a virtual address to a specific physical page.
 //
 // Argument 1: the physical address to map to.
-// The intrinsic rogue page section (nonpaged, 4096-aligned, RW, cached) will be used for this.
+// A rogue page of the intrinsic rogue page section (nonpaged, 4096-aligned, RW, cached) will be used for this.
 //
 // Returns:
 //  PTE_SUCCESS or PTE_ERROR
@@ -92,9 +127,52 @@ PTE_STATUS pte_remap_rogue_page(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ PHYS_ADD
     // Change the pte to point to the new offset.
     pPtedata->rogue_pte->page_frame = PAGE_TO_PFN(Phys_addr);
 
-    // Flush the old pte from the tlbs in the system.
-    // __invlpg(pPtedata->page_aligned_rogue_ptr.pointer);
-    // Not needed anymore, PTE has cache disable bit set. Changes to PTE have immediate result.
+    // Flush the old pte from the tlb of this processor.
+    // A rogue page of the pool may have been used on another processor before, so this
+    // processor can still hold a translation from its previous owner. The caller keeps
+    // the thread on this processor while it uses the page, so the other processors never matter.
+    __invlpg(pPtedata->page_aligned_rogue_ptr.pointer);
+
+    return PTE_SUCCESS;
+}
+
+// Edit the page tables to relink the rogue window to a run of contiguous physical pages.
+//
+// Argument 1: the physical address of the first page to map to.
+// Argument 2: the number of pages, at most the size of the window.
+//
+// Returns:
+//  PTE_SUCCESS or PTE_ERROR
+//
+// Remarks: the same rules as for pte_remap_rogue_page apply. The caller owns the window and stays on this processor.
+//
+__declspec(noinline) _IRQL_requires_max_(APC_LEVEL)
+PTE_STATUS pte_remap_rogue_range(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ PHYS_ADDR Phys_addr, _In_ ULONG pages)
+{
+    PTE new_pte;
+    ULONG i;
+
+    if (!(Phys_addr && pPtedata && pages)) return PTE_ERROR;
+
+    if ((Phys_addr & ~PAGE_MASK) || (pages > pPtedata->window_pages))
+    {
+        WinDbgPrint("Failed to map %u pages at %llx into the rogue window!\n", pages, Phys_addr);
+        return PTE_ERROR;
+    }
+
+    #if PRINT_PTE_REMAP_ACTIONS == 1
+    WinDbgPrint("Remapping window %p to %llx (%u pages)\n", pPtedata->window_ptr.pointer, Phys_addr, pages);
+    #endif
+
+    new_pte.value = pPtedata->window_template.value;
+
+    for (i = 0; i < pages; i++)
+    {
+        new_pte.page_frame = PAGE_TO_PFN(Phys_addr) + i;
+        pPtedata->window_pte[i]->value = new_pte.value;
+
+        __invlpg((PVOID) (pPtedata->window_ptr.value + ((ULONG_PTR) i * PAGE_SIZE)));
+    }
 
     return PTE_SUCCESS;
 }
@@ -150,6 +228,14 @@ void print_pte_contents(_In_ PTE * pte)
 //
 __declspec(noinline) _IRQL_requires_max_(APC_LEVEL)
 PTE_STATUS virt_find_pte(_In_ VIRT_ADDR vaddr, _Out_  volatile PPTE * pPTE)
+{
+    return virt_find_pte_ex(vaddr, pPTE, TRUE);
+}
+
+// The same, but must_be_present FALSE also finds a PTE that is not (yet) present.
+// Such an address must not belong to a large page.
+__declspec(noinline) _IRQL_requires_max_(APC_LEVEL)
+PTE_STATUS virt_find_pte_ex(_In_ VIRT_ADDR vaddr, _Out_  volatile PPTE * pPTE, _In_ BOOLEAN must_be_present)
 {
     CR3 cr3;
     PPML4E pml4;
@@ -238,6 +324,12 @@ PTE_STATUS virt_find_pte(_In_ VIRT_ADDR vaddr, _Out_  volatile PPTE * pPTE)
 
     if (pde->large_page)
     {
+        if (!must_be_present)
+        {
+            WinDbgPrint("Error, address %llx belongs to a 2MB large page:\n", vaddr.value);
+            goto error;
+        }
+
         final_pPTE = (PPTE) pde; // this is basically like a PTE, just like one tier level above. Though not 100%.
         *pPTE = final_pPTE;
         WinDbgPrint("Final 'PTE' --large page PDE-- (at %p) : %llx.\n", final_pPTE, final_pPTE->value);
@@ -258,7 +350,7 @@ PTE_STATUS virt_find_pte(_In_ VIRT_ADDR vaddr, _Out_  volatile PPTE * pPTE)
 
     if (!final_pPTE) goto error;
 
-    if (!final_pPTE->present)
+    if (must_be_present && !final_pPTE->present)
     {
         WinDbgPrint("Error, address %llx has no valid mapping in PT:\n", vaddr.value);
         print_pte_contents( final_pPTE );
@@ -279,11 +371,11 @@ error:
 
 
 __declspec(noinline) _IRQL_requires_max_(APC_LEVEL)
-BOOLEAN setupBackupForOriginalRoguePage(_Inout_ PPTE_METHOD_DATA pPtedata)
+BOOLEAN setupBackupForOriginalRoguePage(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ PVOID rogue_page)
 {
     // Backup original rogue PTE.
 
-    pPtedata->page_aligned_rogue_ptr.pointer = ROGUE_PAGE_MAGICMARKER; // a pointer that features bit-accessing.
+    pPtedata->page_aligned_rogue_ptr.pointer = rogue_page; // a pointer that features bit-accessing.
     pPtedata->loglevel = PTE_ERR;
     pPtedata->pte_method_is_ready_to_use = FALSE;
 
@@ -307,6 +399,7 @@ BOOLEAN setupBackupForOriginalRoguePage(_Inout_ PPTE_METHOD_DATA pPtedata)
 
     // Backup original rogue PFN.
     pPtedata->original_addr = PFN_TO_PAGE(pPtedata->rogue_pte->page_frame);
+    pPtedata->original_marker = *(volatile UINT64 *) rogue_page;
 
     if (!pPtedata->original_addr) // not going to fail until there is some voodoo VSM magic going on. Better be safe than sorry.
     {
@@ -356,9 +449,9 @@ VOID restoreOriginalRoguePage(_Inout_ PPTE_METHOD_DATA pPtedata)
     }
     else
     {
-        if ('G' == ROGUE_PAGE_MAGICMARKER[0])
+        if (pPtedata->original_marker == *(volatile UINT64 *) pPtedata->page_aligned_rogue_ptr.pointer)
         {
-            DbgPrint("Rogue page restored: %s\n", ROGUE_PAGE_MAGICMARKER);
+            DbgPrint("Rogue page %p restored.\n", pPtedata->page_aligned_rogue_ptr.pointer);
             return;
         }
         else goto errorprint;
@@ -371,4 +464,203 @@ errorprint:
     return;
 }
 
+
+// Reserves the rogue window of a rogue page: ROGUE_WINDOW_PAGES pages of system address space,
+// without any memory behind them. We only want their PTEs.
+// The rogue page must be set up already, its PTE serves as the template for the window PTEs.
+_IRQL_requires_max_(APC_LEVEL)
+BOOLEAN setupRogueWindow(_Inout_ PPTE_METHOD_DATA pPtedata)
+{
+    VIRT_ADDR page;
+    volatile PPTE pPTE = NULL;
+    ULONG i;
+
+    pPtedata->window_pages = 0;
+    pPtedata->window_ptr.pointer = MmAllocateMappingAddress((SIZE_T) ROGUE_WINDOW_PAGES * PAGE_SIZE, PMEM_POOL_TAG);
+
+    if (!pPtedata->window_ptr.pointer)
+    {
+        DbgPrint("Warning: no address space for the rogue window. Only single pages will be remapped.\n");
+        return FALSE;
+    }
+
+    for (i = 0; i < ROGUE_WINDOW_PAGES; i++)
+    {
+        page.value = pPtedata->window_ptr.value + ((ULONG_PTR) i * PAGE_SIZE);
+
+        // The PTEs of one page table are consecutive. Only walk the page tables again
+        // when the window crosses into the next one.
+        if ((i == 0) || (page.pt_index == 0))
+        {
+            if (virt_find_pte_ex(page, &pPTE, FALSE) != PTE_SUCCESS)
+            {
+                DbgPrint("Warning: rogue window setup failed (virt_find_pte failed). Only single pages will be remapped.\n");
+                goto error;
+            }
+        }
+        else
+        {
+            pPTE++;
+        }
+
+        if (i == 0)
+        {
+            pPtedata->window_original = pPTE->value;
+        }
+
+        // The reserved PTEs are expected to be not present and all alike. Anything else is not ours to touch.
+        if (pPTE->present || (pPTE->value != pPtedata->window_original))
+        {
+            DbgPrint("Warning: rogue window setup failed (unexpected PTE %llx). Only single pages will be remapped.\n", pPTE->value);
+            goto error;
+        }
+
+        pPtedata->window_pte[i] = pPTE;
+    }
+
+    // Same attributes as the rogue page, including the cache disable bit.
+    pPtedata->window_template.value = pPtedata->rogue_pte->value;
+    pPtedata->window_template.present = 1;
+
+    pPtedata->window_pages = ROGUE_WINDOW_PAGES;
+
+    return TRUE;
+
+error:
+    MmFreeMappingAddress(pPtedata->window_ptr.pointer, PMEM_POOL_TAG);
+    pPtedata->window_ptr.pointer = NULL;
+    return FALSE;
+}
+
+// Runs on every processor: forget the translations of the rogue window.
+ULONG_PTR flushRogueWindow(_In_ ULONG_PTR Argument)
+{
+    PPTE_METHOD_DATA pPtedata = (PPTE_METHOD_DATA) Argument;
+    ULONG i;
+
+    for (i = 0; i < pPtedata->window_pages; i++)
+    {
+        __invlpg((PVOID) (pPtedata->window_ptr.value + ((ULONG_PTR) i * PAGE_SIZE)));
+    }
+
+    return 0;
+}
+
+// Puts the window PTEs back the way the memory manager gave them to us and returns the address space.
+_IRQL_requires_max_(APC_LEVEL)
+VOID restoreRogueWindow(_Inout_ PPTE_METHOD_DATA pPtedata)
+{
+    ULONG i;
+
+    if (!pPtedata->window_pages)
+    {
+        return;
+    }
+
+    for (i = 0; i < pPtedata->window_pages; i++)
+    {
+        pPtedata->window_pte[i]->value = pPtedata->window_original;
+    }
+
+    // Other processors may still cache translations from earlier readers.
+    // The memory manager does not know about them, so we flush them ourselves.
+    KeIpiGenericCall(flushRogueWindow, (ULONG_PTR) pPtedata);
+
+    MmFreeMappingAddress(pPtedata->window_ptr.pointer, PMEM_POOL_TAG);
+
+    pPtedata->window_pages = 0;
+    pPtedata->window_ptr.pointer = NULL;
+}
+
+
+// Sets up every rogue page of the pool.
+// The magic marker page is the first one, the others come from ROGUE_PAGE_POOL.
+// A page that fails setup is simply left out of the pool.
+_IRQL_requires_max_(APC_LEVEL)
+BOOLEAN setupRoguePagePool(_Inout_ PPTE_POOL pPool)
+{
+    ULONG i;
+    PVOID rogue_page;
+
+    pPool->pte_method_is_ready_to_use = FALSE;
+    pPool->number_of_pages = 0;
+    pPool->busy = 0;
+
+    for (i = 0; i < ROGUE_PAGE_POOL_SIZE; i++)
+    {
+        rogue_page = (i == 0) ? (PVOID) ROGUE_PAGE_MAGICMARKER : (PVOID) ROGUE_PAGE_POOL[i - 1];
+
+        // The magic marker page has its marker already, the pool pages are zeros.
+        if (i) *(volatile UINT64 *) rogue_page = ROGUE_PAGE_POOL_MARKER ^ i;
+
+        if (setupBackupForOriginalRoguePage(&pPool->page[pPool->number_of_pages], rogue_page))
+        {
+            // Without a window the rogue page still works, one page at a time.
+            setupRogueWindow(&pPool->page[pPool->number_of_pages]);
+
+            pPool->number_of_pages++;
+        }
+    }
+
+    WinDbgPrint("Rogue page pool: %u of %u pages ready.\n", pPool->number_of_pages, ROGUE_PAGE_POOL_SIZE);
+
+    if (!pPool->number_of_pages) return FALSE;
+
+    KeInitializeSemaphore(&pPool->free_pages, pPool->number_of_pages, pPool->number_of_pages);
+
+    pPool->pte_method_is_ready_to_use = TRUE;
+
+    return TRUE;
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID restoreRoguePagePool(_Inout_ PPTE_POOL pPool)
+{
+    ULONG i;
+
+    if (pPool->pte_method_is_ready_to_use == FALSE)
+    {
+        return;
+    }
+
+    for (i = 0; i < pPool->number_of_pages; i++)
+    {
+        restoreRogueWindow(&pPool->page[i]);
+        restoreOriginalRoguePage(&pPool->page[i]);
+    }
+
+    pPool->pte_method_is_ready_to_use = FALSE;
+}
+
+// Claims a free rogue page of the pool, waiting if all of them are in use.
+// Every page handed out must be given back with releaseRoguePage.
+_IRQL_requires_max_(APC_LEVEL)
+PPTE_METHOD_DATA acquireRoguePage(_Inout_ PPTE_POOL pPool)
+{
+    ULONG i;
+
+    KeWaitForSingleObject(&pPool->free_pages, Executive, KernelMode, FALSE, NULL);
+
+    // The semaphore guarantees there is a free page, we only need to find it.
+    for (;;)
+    {
+        for (i = 0; i < pPool->number_of_pages; i++)
+        {
+            if (!InterlockedBitTestAndSet(&pPool->busy, i))
+            {
+                return &pPool->page[i];
+            }
+        }
+    }
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID releaseRoguePage(_Inout_ PPTE_POOL pPool, _In_ PPTE_METHOD_DATA pPtedata)
+{
+    LONG i = (LONG) (pPtedata - &pPool->page[0]);
+
+    InterlockedBitTestAndReset(&pPool->busy, i);
+    KeReleaseSemaphore(&pPool->free_pages, IO_NO_INCREMENT, 1, FALSE);
+}
+
 #endif
@@ -37,11 +37,29 @@
 #define PFN_TO_PAGE(pfn) (pfn << PAGE_SHIFT)
 #define PAGE_TO_PFN(pfn) (pfn >> PAGE_SHIFT)
 
+// The number of rogue pages, including the magic marker page. Every PTE mode
+// read claims one of them for itself, so this many reads can remap and copy
+// in parallel.
+#define ROGUE_PAGE_POOL_SIZE (8)
+
+// The pool pages start out as zeros. Each gets this, xored with its index, in
+// its first qword at setup, so the restore check tells it from a zero page.
+#define ROGUE_PAGE_POOL_MARKER (0x6C6F6F506D6D5057ULL)  // "WPmmPool"
+
+// Every rogue page also gets a window of this many contiguous rogue PTEs, so a
+// run of physical pages can be remapped in one step and copied with one memcpy.
+// At most 512, i.e. a whole page table. The window only costs system address space.
+#define ROGUE_WINDOW_PAGES (512)
+
 #if defined(_WIN64)
 
 __declspec(allocate(".roguepage")) unsigned char ROGUE_PAGE_MAGICMARKER[] = "GiveSectionToWinpmem=1\n";
 // This needed to make PTE method work. ;-)
 
+// The rest of the pool lives in the same section, one page each.
+__declspec(allocate(".roguepage")) __declspec(align(0x1000))
+unsigned char ROGUE_PAGE_POOL[ROGUE_PAGE_POOL_SIZE - 1][PAGE_SIZE] = { 0 };
+
 #endif
 
 typedef union _VIRT_ADDR
@@ -179,8 +197,35 @@ typedef struct _PTE_METHOD_DATA
     VIRT_ADDR page_aligned_rogue_ptr;
     volatile PPTE rogue_pte;
     PHYS_ADDR original_addr;
+    UINT64 original_marker;  // The first bytes of the rogue page, to verify the restore.
     PTE_LOGLEVEL loglevel;
+
+    // The rogue window. window_pages is zero if it could not be set up,
+    // then only the single rogue page is used.
+    VIRT_ADDR window_ptr;
+    ULONG window_pages;
+    PTE window_template;        // The rogue page PTE, everything but the page frame is copied from it.
+    UINT64 window_original;     // The (not present) value of all window PTEs before we used them.
+    volatile PPTE window_pte[ROGUE_WINDOW_PAGES];
 } PTE_METHOD_DATA, *PPTE_METHOD_DATA;
 
 
+// A pool of rogue pages. A reader takes a free page out of the pool,
+// remaps it as often as it likes and gives it back when done.
+typedef struct _PTE_POOL
+{
+    BOOLEAN pte_method_is_ready_to_use;
+
+    // Only the pages that were set up successfully are used.
+    ULONG number_of_pages;
+    PTE_METHOD_DATA page[ROGUE_PAGE_POOL_SIZE];
+
+    // One bit per page that is currently claimed by a reader.
+    volatile LONG busy;
+
+    // Counts the free pages, so readers wait here when all pages are busy.
+    KSEMAPHORE free_pages;
+} PTE_POOL, *PPTE_POOL;
+
+
 #endif
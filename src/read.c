@@ -63,7 +63,9 @@ _IRQL_requires_max_(PASSIVE_LEVEL)
 ULONG PhysicalMemoryPartialRead(_In_ HANDLE memoryHandle,
                                 _In_ LARGE_INTEGER physAddr,
                                 _Inout_ unsigned char * buf,
-                                _In_ ULONG count)
+                                _In_ ULONG count,
+                                _Out_opt_ PULONG failure,
+                                _Inout_ PWINPMEM_MODE_STATS stats)
 {
     ULONG page_offset = physAddr.QuadPart % PAGE_SIZE;
     ULONG to_read = min(PAGE_SIZE - page_offset, count);
@@ -71,6 +73,9 @@ ULONG PhysicalMemoryPartialRead(_In_ HANDLE memoryHandle,
     SIZE_T ViewSize = PAGE_SIZE;
     NTSTATUS ntstatus = STATUS_SUCCESS;
     ULONG result = 0;
+    ULONG64 cycles;
+
+    if (failure) *failure = PMEM_PAGE_MAP_FAILED;
 
     if (!(memoryHandle && physAddr.QuadPart && buf && count))
     {
@@ -78,9 +83,11 @@ ULONG PhysicalMemoryPartialRead(_In_ HANDLE memoryHandle,
     }
 
     // The mapview should never fail on physical memory device.
+    cycles = __rdtsc();
     ntstatus = ZwMapViewOfSection(memoryHandle, ZwCurrentProcess() ,
                   &mapped_buffer, 0L, PAGE_SIZE, &physAddr,
                   &ViewSize, ViewUnmap, 0, PAGE_READONLY);
+    stats->RemapCycles += __rdtsc() - cycles;
 
     if ((ntstatus != STATUS_SUCCESS) || (!mapped_buffer))
     {
@@ -102,6 +109,9 @@ ULONG PhysicalMemoryPartialRead(_In_ HANDLE memoryHandle,
     // The approach: we very carefully check if it's readable and if yes, we return the bytes.
     // Otherwise we return immediately with a read error.
 
+    stats->PagesRemapped++;
+    cycles = __rdtsc();
+
     try // Might not be readable for various reasons.
     {
         RtlCopyMemory(buf, mapped_buffer + page_offset, to_read);
@@ -109,14 +119,337 @@ ULONG PhysicalMemoryPartialRead(_In_ HANDLE memoryHandle,
     except(EXCEPTION_EXECUTE_HANDLER)
     {
         ntstatus = GetExceptionCode();
+        stats->Exceptions++;
         WinDbgPrint("Warning: read error %08x (method: phys mem device): unable to read %u bytes from %p.\n", ntstatus, to_read, mapped_buffer+page_offset);
+        if (failure) *failure = PMEM_PAGE_ACCESS_FAILED;
         goto error;
     }
 
     result = to_read;
 
 error:
+    stats->CopyCycles += __rdtsc() - cycles;
+
+    cycles = __rdtsc();
     if (mapped_buffer) ZwUnmapViewOfSection(ZwCurrentProcess(), mapped_buffer);
+    stats->RemapCycles += __rdtsc() - cycles;
+
+    return result;
+}
+
+
+// Copies page by page until the first page that cannot be read.
+// Returns the number of good bytes.
+_IRQL_requires_max_(APC_LEVEL)
+ULONG CopyUntilFault(_Inout_ unsigned char * buf, _In_ unsigned char * toxic_source, _In_ ULONG page_offset, _In_ ULONG count)
+{
+    ULONG result = 0;
+    ULONG to_copy;
+
+    while (result < count)
+    {
+        to_copy = min(PAGE_SIZE - ((page_offset + result) % PAGE_SIZE), count - result);
+
+        try
+        {
+            RtlCopyMemory(buf + result, toxic_source + result, to_copy);
+        }
+        except(EXCEPTION_EXECUTE_HANDLER)
+        {
+            break;
+        }
+
+        result += to_copy;
+    }
+
+    return result;
+}
+
+
+// Method I, cached version.
+// Mapping a view for every page costs a map and an unmap syscall plus a TLB shootdown per page.
+// Instead each handle keeps a small LRU set of large views into \Device\PhysicalMemory, clipped to the physical
+// memory run they are in. The views live in the address space of the process that opened the handle
+// and are torn down when that handle is cleaned up.
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+PPMEM_FILE_CONTEXT createFileContext(VOID)
+{
+    PPMEM_FILE_CONTEXT context = NULL;
+
+    PAGED_CODE();
+
+    // The ERESOURCE must live in nonpaged memory.
+    context = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(PMEM_FILE_CONTEXT), PMEM_POOL_TAG);
+    if (!context) return NULL;
+
+    RtlZeroMemory(context, sizeof(PMEM_FILE_CONTEXT));
+
+    context->owner = PsGetCurrentProcess();
+    ObReferenceObject(context->owner);
+
+    ExInitializeResourceLite(&context->lock);
+
+    return context;
+}
+
+
+// Unmaps all cached views. Needs the owner's address space, which we attach to if needed.
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID cleanupFileContext(_Inout_ PPMEM_FILE_CONTEXT context)
+{
+    KAPC_STATE apc_state;
+    BOOLEAN attached = FALSE;
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (!context) return;
+
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&context->lock, TRUE);
+
+    if (PsGetCurrentProcess() != context->owner)
+    {
+        KeStackAttachProcess((PRKPROCESS) context->owner, &apc_state);
+        attached = TRUE;
+    }
+
+    for (i = 0; i < PMEM_VIEW_CACHE_SIZE; i++)
+    {
+        if (context->views[i].base)
+        {
+            ZwUnmapViewOfSection(ZwCurrentProcess(), context->views[i].base);
+            context->views[i].base = NULL;
+        }
+    }
+
+    if (attached) KeUnstackDetachProcess(&apc_state);
+
+    ExReleaseResourceLite(&context->lock);
+    KeLeaveCriticalRegion();
+}
+
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID freeFileContext(_In_ PPMEM_FILE_CONTEXT context)
+{
+    PAGED_CODE();
+
+    if (!context) return;
+
+    cleanupFileContext(context);
+
+    if (context->ranges) ExFreePool(context->ranges);
+
+    ExDeleteResourceLite(&context->lock);
+    ObDereferenceObject(context->owner);
+
+    ExFreePoolWithTag(context, PMEM_POOL_TAG);
+}
+
+
+// Caller holds the lock (shared is enough).
+_IRQL_requires_max_(APC_LEVEL)
+PPMEM_VIEW lookupView(_In_ PPMEM_FILE_CONTEXT context, _In_ LARGE_INTEGER physAddr)
+{
+    ULONG i;
+
+    for (i = 0; i < PMEM_VIEW_CACHE_SIZE; i++)
+    {
+        PPMEM_VIEW view = &context->views[i];
+
+        if (view->base &&
+            (physAddr.QuadPart >= view->physAddr.QuadPart) &&
+            (physAddr.QuadPart < view->physAddr.QuadPart + view->size))
+        {
+            return view;
+        }
+    }
+
+    return NULL;
+}
+
+
+// Maps a new view around physAddr, evicting the least recently used one if the cache is full.
+// Caller holds the lock exclusively.
+// Returns NULL if physAddr is not in a physical memory run, or if the mapping failed.
+_IRQL_requires_max_(PASSIVE_LEVEL)
+PPMEM_VIEW mapView(_Inout_ PPMEM_FILE_CONTEXT context, _In_ HANDLE memoryHandle, _In_ LARGE_INTEGER physAddr)
+{
+    PPHYSICAL_MEMORY_RANGE run = NULL;
+    PPMEM_VIEW view = NULL;
+    LARGE_INTEGER viewBase;
+    ULONG64 viewEnd;
+    SIZE_T ViewSize;
+    PUCHAR mapped_buffer = NULL;
+    NTSTATUS ntstatus;
+    ULONG i;
+
+    if (!context->ranges)
+    {
+        context->ranges = MmGetPhysicalMemoryRanges();
+        if (!context->ranges) return NULL;
+    }
+
+    // The last entry contains zero for both.
+    for (i = 0; context->ranges[i].BaseAddress.QuadPart || context->ranges[i].NumberOfBytes.QuadPart; i++)
+    {
+        if ((physAddr.QuadPart >= context->ranges[i].BaseAddress.QuadPart) &&
+            (physAddr.QuadPart < context->ranges[i].BaseAddress.QuadPart + context->ranges[i].NumberOfBytes.QuadPart))
+        {
+            run = &context->ranges[i];
+            break;
+        }
+    }
+
+    // Not RAM. Leave it to the uncached path.
+    if (!run) return NULL;
+
+    viewBase.QuadPart = max(run->BaseAddress.QuadPart, physAddr.QuadPart & ~((LONGLONG) PMEM_VIEW_SIZE - 1));
+    viewEnd = min((ULONG64) (run->BaseAddress.QuadPart + run->NumberOfBytes.QuadPart),
+                  (ULONG64) (physAddr.QuadPart & ~((LONGLONG) PMEM_VIEW_SIZE - 1)) + PMEM_VIEW_SIZE);
+
+    // Take a free slot, or else the least recently used one.
+    for (i = 0; i < PMEM_VIEW_CACHE_SIZE; i++)
+    {
+        if (!context->views[i].base)
+        {
+            view = &context->views[i];
+            break;
+        }
+
+        if (!view || (context->views[i].last_used < view->last_used))
+        {
+            view = &context->views[i];
+        }
+    }
+
+    if (view->base)
+    {
+        ZwUnmapViewOfSection(ZwCurrentProcess(), view->base);
+        view->base = NULL;
+    }
+
+    ViewSize = (SIZE_T) (viewEnd - viewBase.QuadPart);
+
+    // The section offset and view size may come back rounded.
+    ntstatus = ZwMapViewOfSection(memoryHandle, ZwCurrentProcess(),
+                  &mapped_buffer, 0L, ViewSize, &viewBase,
+                  &ViewSize, ViewUnmap, 0, PAGE_READONLY);
+
+    if ((ntstatus != STATUS_SUCCESS) || (!mapped_buffer))
+    {
+        WinDbgPrint("Error %08x (method: phys mem device): ZwMapViewOfSection failed for a view at 0x%llX.\n", ntstatus, viewBase.QuadPart);
+        return NULL;
+    }
+
+    view->base = mapped_buffer;
+    view->physAddr = viewBase;
+    view->size = (ULONG) ViewSize;
+
+    return view;
+}
+
+
+// Returns the number of bytes read up to the first unreadable page, or the end of the view.
+// Falls back to PhysicalMemoryPartialRead if there is no cache, or physAddr is not RAM.
+_IRQL_requires_max_(PASSIVE_LEVEL)
+ULONG PhysicalMemoryCachedRead(_In_opt_ PPMEM_FILE_CONTEXT context,
+                               _In_ HANDLE memoryHandle,
+                               _In_ LARGE_INTEGER physAddr,
+                               _Inout_ unsigned char * buf,
+                               _In_ ULONG count,
+                               _Out_opt_ PULONG failure,
+                               _Inout_ PWINPMEM_MODE_STATS stats)
+{
+    PPMEM_VIEW view = NULL;
+    ULONG offset;
+    ULONG to_read;
+    ULONG result = 0;
+    NTSTATUS ntstatus = STATUS_SUCCESS;
+    ULONG64 cycles;
+
+    if (failure) *failure = PMEM_PAGE_MAP_FAILED;
+
+    if (!(memoryHandle && physAddr.QuadPart && buf && count))
+    {
+        return 0;
+    }
+
+    // The views are only valid in the address space of the process that owns them.
+    if (!context || (PsGetCurrentProcess() != context->owner))
+    {
+        return PhysicalMemoryPartialRead(memoryHandle, physAddr, buf, count, failure, stats);
+    }
+
+    cycles = __rdtsc();
+    KeEnterCriticalRegion();
+    ExAcquireResourceSharedLite(&context->lock, TRUE);
+    stats->WaitCycles += __rdtsc() - cycles;
+
+    view = lookupView(context, physAddr);
+    if (!view)
+    {
+        cycles = __rdtsc();
+        ExReleaseResourceLite(&context->lock);
+        ExAcquireResourceExclusiveLite(&context->lock, TRUE);
+        stats->WaitCycles += __rdtsc() - cycles;
+
+        // Someone else might have mapped it in the meantime.
+        view = lookupView(context, physAddr);
+        if (!view)
+        {
+            cycles = __rdtsc();
+            view = mapView(context, memoryHandle, physAddr);
+            stats->RemapCycles += __rdtsc() - cycles;
+
+            if (view) stats->PagesRemapped += view->size / PAGE_SIZE;
+        }
+
+        ExConvertExclusiveToSharedLite(&context->lock);
+    }
+
+    if (view)
+    {
+        InterlockedExchange64(&view->last_used, InterlockedIncrement64(&context->clock));
+
+        offset = (ULONG) (physAddr.QuadPart - view->physAddr.QuadPart);
+        to_read = min(view->size - offset, count);
+
+        // =warning=
+        // The same applies as in PhysicalMemoryPartialRead: any page in the view might be blocked by the HV layer.
+        cycles = __rdtsc();
+
+        try
+        {
+            RtlCopyMemory(buf, view->base + offset, to_read);
+            result = to_read;
+        }
+        except(EXCEPTION_EXECUTE_HANDLER)
+        {
+            ntstatus = GetExceptionCode();
+            result = 0;
+        }
+
+        if (ntstatus != STATUS_SUCCESS)
+        {
+            stats->Exceptions++;
+            result = CopyUntilFault(buf, view->base + offset, offset, to_read);
+            if (failure) *failure = PMEM_PAGE_ACCESS_FAILED;
+            WinDbgPrint("Warning: read error %08x (method: phys mem device): unable to read %u bytes from %llx.\n", ntstatus, to_read - result, physAddr.QuadPart + result);
+        }
+
+        stats->CopyCycles += __rdtsc() - cycles;
+    }
+
+    ExReleaseResourceLite(&context->lock);
+    KeLeaveCriticalRegion();
+
+    if (!view)
+    {
+        result = PhysicalMemoryPartialRead(memoryHandle, physAddr, buf, count, failure, stats);
+    }
 
     return result;
 }
@@ -126,7 +459,7 @@ error:
 // This method is thread-safe and does not need protection of a mutex.
 // It can work at higher IRQL but doesn't.
 // Read a single page using MmMapIoSpace.
-ULONG MapIOPagePartialRead(_In_ LARGE_INTEGER physAddr, _Inout_ unsigned char * buf, _In_ ULONG count)
+ULONG MapIOPagePartialRead(_In_ LARGE_INTEGER physAddr, _Inout_ unsigned char * buf, _In_ ULONG count, _Out_opt_ PULONG failure, _Inout_ PWINPMEM_MODE_STATS stats)
 {
     NTSTATUS ntStatus = STATUS_SUCCESS;
     ULONG page_offset = physAddr.QuadPart % PAGE_SIZE;
@@ -134,6 +467,9 @@ ULONG MapIOPagePartialRead(_In_ LARGE_INTEGER physAddr, _Inout_ unsigned char *
     PUCHAR mapped_buffer = NULL;
     LARGE_INTEGER ViewBase;
     ULONG result = 0;
+    ULONG64 cycles = 0;
+
+    if (failure) *failure = PMEM_PAGE_MAP_FAILED;
 
     if (!(physAddr.QuadPart && buf && count))
     {
@@ -168,11 +504,16 @@ ULONG MapIOPagePartialRead(_In_ LARGE_INTEGER physAddr, _Inout_ unsigned char *
 
     try // Might not be readable for various reasons.
     {
+        cycles = __rdtsc();
         mapped_buffer = MmMapIoSpace(ViewBase, PAGE_SIZE, MmCached);  // <= just DON'T on unlocked pages.
+        stats->RemapCycles += __rdtsc() - cycles;
 
         if (mapped_buffer)
         {
+            stats->PagesRemapped++;
+            cycles = __rdtsc();
             RtlCopyMemory(buf, mapped_buffer+page_offset, to_read);
+            stats->CopyCycles += __rdtsc() - cycles;
         }
         else
         {
@@ -183,13 +524,18 @@ ULONG MapIOPagePartialRead(_In_ LARGE_INTEGER physAddr, _Inout_ unsigned char *
     except(EXCEPTION_EXECUTE_HANDLER)
     {
         ntStatus = GetExceptionCode();
+        stats->Exceptions++;
+        stats->CopyCycles += __rdtsc() - cycles;
         WinDbgPrint("Warning: read error %08x (method: map I/O): unable to read %u bytes from %p.\n", ntStatus, to_read, mapped_buffer+page_offset);
+        if (failure) *failure = PMEM_PAGE_ACCESS_FAILED;
         return 0;
     }
 
     result = to_read;
 
+    cycles = __rdtsc();
     if (mapped_buffer) MmUnmapIoSpace(mapped_buffer, PAGE_SIZE);
+    stats->RemapCycles += __rdtsc() - cycles;
 
     return result;
 }
@@ -198,11 +544,11 @@ ULONG MapIOPagePartialRead(_In_ LARGE_INTEGER physAddr, _Inout_ unsigned char *
 #if defined(_WIN64)
 
 // Method III.
-// !! This method is not thread-safe and crucially requires protection of a mutex.
+// !! This method is not thread-safe on a single rogue page. The caller must own the rogue page (see acquireRoguePage).
 // Read a single page using direct PTE mapping.
 // General purpose reading: yes.
 _IRQL_requires_max_(APC_LEVEL)
-ULONG PTEMmapPartialRead(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ LARGE_INTEGER physAddr, _Inout_ unsigned char * buf, _In_ ULONG count)
+ULONG PTEMmapPartialRead(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ LARGE_INTEGER physAddr, _Inout_ unsigned char * buf, _In_ ULONG count, _Out_opt_ PULONG failure, _Inout_ PWINPMEM_MODE_STATS stats)
 {
     NTSTATUS ntStatus = STATUS_SUCCESS;
     ULONG page_offset = physAddr.QuadPart % PAGE_SIZE;
@@ -210,6 +556,9 @@ ULONG PTEMmapPartialRead(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ LARGE_INTEGER p
     LARGE_INTEGER viewPage;
     ULONG result = 0;
     unsigned char * toxic_source = NULL;
+    ULONG64 cycles;
+
+    if (failure) *failure = PMEM_PAGE_MAP_FAILED;
 
     if (!(pPtedata && physAddr.QuadPart && buf && count))
     {
@@ -219,8 +568,13 @@ ULONG PTEMmapPartialRead(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ LARGE_INTEGER p
     // Round to page size
     viewPage.QuadPart = physAddr.QuadPart - page_offset;
 
+    cycles = __rdtsc();
+
     if (pte_remap_rogue_page(pPtedata, viewPage.QuadPart) == PTE_SUCCESS)
     {
+        stats->RemapCycles += __rdtsc() - cycles;
+        stats->PagesRemapped++;
+
         toxic_source = (PVOID) (((ULONG_PTR) pPtedata->page_aligned_rogue_ptr.value) + page_offset); // toxic, but not the userspace buffer this time.
 
         // =warning=
@@ -232,6 +586,8 @@ ULONG PTEMmapPartialRead(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ LARGE_INTEGER p
         // The approach: we very carefully check if it's readable and if yes, we return the bytes.
         // Otherwise we return immediately with a read error.
 
+        cycles = __rdtsc();
+
         try  // Might not be readable for various reasons.
         {
             RtlCopyMemory(buf, toxic_source, to_read); // copy from rogue page to usermode NEITHER buffer.
@@ -239,86 +595,520 @@ ULONG PTEMmapPartialRead(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ LARGE_INTEGER p
         } except(EXCEPTION_EXECUTE_HANDLER)
         {
             ntStatus = GetExceptionCode();
+            stats->Exceptions++;
+            stats->CopyCycles += __rdtsc() - cycles;
             WinDbgPrint("Warning: read error %08x (method: PTE remap): unable to read %u bytes from %llx.\n", ntStatus, to_read, viewPage.QuadPart);
+            if (failure) *failure = PMEM_PAGE_ACCESS_FAILED;
             return 0;
         }
+
+        stats->CopyCycles += __rdtsc() - cycles;
         result = to_read;
     }
 
     return result;
 }
+
+
+// Method III, bulk version.
+// The same as PTEMmapPartialRead, but remaps a whole run of pages into the rogue window
+// and copies it in one go. Reads up to the size of the window.
+// Returns the number of bytes read up to the first unreadable page.
+_IRQL_requires_max_(APC_LEVEL)
+ULONG PTEMmapWindowRead(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ LARGE_INTEGER physAddr, _Inout_ unsigned char * buf, _In_ ULONG count, _Out_opt_ PULONG failure, _Inout_ PWINPMEM_MODE_STATS stats)
+{
+    NTSTATUS ntStatus = STATUS_SUCCESS;
+    ULONG page_offset = physAddr.QuadPart % PAGE_SIZE;
+    ULONG pages = 0;
+    ULONG to_read = 0;
+    LARGE_INTEGER viewPage;
+    ULONG result = 0;
+    unsigned char * toxic_source = NULL;
+    ULONG64 cycles;
+
+    if (failure) *failure = PMEM_PAGE_MAP_FAILED;
+
+    if (!(pPtedata && physAddr.QuadPart && buf && count))
+    {
+        return 0;
+    }
+
+    // No window? One page at a time then.
+    if (!pPtedata->window_pages)
+    {
+        return PTEMmapPartialRead(pPtedata, physAddr, buf, count, failure, stats);
+    }
+
+    pages = min(pPtedata->window_pages, (page_offset + count + PAGE_SIZE - 1) / PAGE_SIZE);
+    to_read = min((pages * PAGE_SIZE) - page_offset, count);
+
+    // Round to page size
+    viewPage.QuadPart = physAddr.QuadPart - page_offset;
+
+    cycles = __rdtsc();
+
+    if (pte_remap_rogue_range(pPtedata, viewPage.QuadPart, pages) == PTE_SUCCESS)
+    {
+        stats->RemapCycles += __rdtsc() - cycles;
+        stats->PagesRemapped += pages;
+
+        toxic_source = (PVOID) (((ULONG_PTR) pPtedata->window_ptr.value) + page_offset);
+
+        // =warning=
+        // The same applies as in PTEMmapPartialRead: any page in the run might be blocked by the HV layer.
+        // If the whole run can't be copied at once, find out how far we get page by page.
+
+        cycles = __rdtsc();
+
+        try
+        {
+            RtlCopyMemory(buf, toxic_source, to_read);
+            result = to_read;
+        }
+        except(EXCEPTION_EXECUTE_HANDLER)
+        {
+            ntStatus = GetExceptionCode();
+            result = 0;
+        }
+
+        if (ntStatus != STATUS_SUCCESS)
+        {
+            stats->Exceptions++;
+            result = CopyUntilFault(buf, toxic_source, page_offset, to_read);
+            if (failure) *failure = PMEM_PAGE_ACCESS_FAILED;
+            WinDbgPrint("Warning: read error %08x (method: PTE remap): unable to read %u bytes from %llx.\n", ntStatus, to_read - result, viewPage.QuadPart + page_offset + result);
+        }
+
+        stats->CopyCycles += __rdtsc() - cycles;
+    }
+
+    return result;
+}
 #endif
 
+
+// The known bad pages.
+// A blocked page costs an exception and a debug print on every read. The hypervisor blocks the same
+// pages every time, so after the first fault the page is remembered, and later reads of it fail at once.
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID initBadPages(_Out_ PPMEM_BAD_PAGES bad_pages)
+{
+    PAGED_CODE();
+
+    RtlZeroMemory(bad_pages, sizeof(PMEM_BAD_PAGES));
+    ExInitializeResourceLite(&bad_pages->lock);
+    bad_pages->initialized = TRUE;
+}
+
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID freeBadPages(_Inout_ PPMEM_BAD_PAGES bad_pages)
+{
+    PAGED_CODE();
+
+    if (!bad_pages->initialized) return;
+
+    if (bad_pages->ranges) ExFreePoolWithTag(bad_pages->ranges, PMEM_POOL_TAG);
+    bad_pages->ranges = NULL;
+    bad_pages->count = 0;
+
+    ExDeleteResourceLite(&bad_pages->lock);
+    bad_pages->initialized = FALSE;
+}
+
+
+// Index of the first range that ends at or after page, so page is in it, right behind it or before it.
+// Caller holds the lock (shared is enough).
+_IRQL_requires_max_(APC_LEVEL)
+ULONG findBadPageRange(_In_ PPMEM_BAD_PAGES bad_pages, _In_ ULONG64 page)
+{
+    ULONG low = 0;
+    ULONG high = bad_pages->count;
+    ULONG middle;
+
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+
+        if (bad_pages->ranges[middle].FirstPage + bad_pages->ranges[middle].NumberOfPages < page)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+
+// Returns the first known bad page at or after page, or MAXULONG64 if there is none.
+_IRQL_requires_max_(APC_LEVEL)
+ULONG64 nextBadPage(_In_ PPMEM_BAD_PAGES bad_pages, _In_ ULONG64 page)
+{
+    ULONG64 result = MAXULONG64;
+    ULONG i;
+
+    // Nothing is known bad on most machines. No need to take the lock for that.
+    if (!bad_pages->initialized || !bad_pages->count) return MAXULONG64;
+
+    KeEnterCriticalRegion();
+    ExAcquireResourceSharedLite(&bad_pages->lock, TRUE);
+
+    i = findBadPageRange(bad_pages, page + 1);
+    if (i < bad_pages->count)
+    {
+        result = max(bad_pages->ranges[i].FirstPage, page);
+    }
+
+    ExReleaseResourceLite(&bad_pages->lock);
+    KeLeaveCriticalRegion();
+
+    return result;
+}
+
+
+// Adds a range of pages, merged with all ranges it overlaps or touches.
+// Caller holds the lock exclusively. Returns FALSE if there is no room for another range.
+_IRQL_requires_max_(APC_LEVEL)
+BOOLEAN insertBadPages(_Inout_ PPMEM_BAD_PAGES bad_pages, _In_ ULONG64 first_page, _In_ ULONG64 number_of_pages)
+{
+    PWINPMEM_PAGE_RANGE ranges = NULL;
+    ULONG count = bad_pages->count;
+    ULONG64 end = first_page + number_of_pages;
+    ULONG low, high;
+
+    if (!number_of_pages) return TRUE;
+
+    if (!bad_pages->ranges)
+    {
+        bad_pages->ranges = ExAllocatePoolWithTag(NonPagedPoolNx,
+                                WINPMEM_MAX_BAD_PAGE_RANGES * sizeof(WINPMEM_PAGE_RANGE), PMEM_POOL_TAG);
+        if (!bad_pages->ranges) return FALSE;
+    }
+
+    ranges = bad_pages->ranges;
+
+    // The new range merges with [low, high).
+    low = findBadPageRange(bad_pages, first_page);
+    for (high = low; (high < count) && (ranges[high].FirstPage <= end); high++);
+
+    if (low == high)
+    {
+        if (count >= WINPMEM_MAX_BAD_PAGE_RANGES) return FALSE;
+
+        RtlMoveMemory(&ranges[low + 1], &ranges[low], (count - low) * sizeof(WINPMEM_PAGE_RANGE));
+        ranges[low].FirstPage = first_page;
+        ranges[low].NumberOfPages = number_of_pages;
+        bad_pages->count = count + 1;
+
+        return TRUE;
+    }
+
+    first_page = min(first_page, ranges[low].FirstPage);
+    end = max(end, ranges[high - 1].FirstPage + ranges[high - 1].NumberOfPages);
+
+    ranges[low].FirstPage = first_page;
+    ranges[low].NumberOfPages = end - first_page;
+
+    RtlMoveMemory(&ranges[low + 1], &ranges[high], (count - high) * sizeof(WINPMEM_PAGE_RANGE));
+    bad_pages->count = count - (high - low - 1);
+
+    return TRUE;
+}
+
+
+// Remembers a page that faulted.
+_IRQL_requires_max_(APC_LEVEL)
+VOID addBadPage(_Inout_ PPMEM_BAD_PAGES bad_pages, _In_ ULONG64 page)
+{
+    if (!bad_pages->initialized) return;
+
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&bad_pages->lock, TRUE);
+
+    if (!insertBadPages(bad_pages, page, 1))
+    {
+        WinDbgPrint("Warning: no room to remember bad page 0x%llX.\n", page);
+    }
+
+    ExReleaseResourceLite(&bad_pages->lock);
+    KeLeaveCriticalRegion();
+}
+
+
+// Copies the known bad pages to out. If not all ranges fit, only the header is filled in,
+// with the number of ranges there are, and STATUS_BUFFER_OVERFLOW is returned.
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS getBadPages(_In_ PPMEM_BAD_PAGES bad_pages, _Out_ PWINPMEM_BAD_PAGES out, _In_ ULONG out_size, _Out_ PULONG used)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG header = FIELD_OFFSET(WINPMEM_BAD_PAGES, Range);
+    ULONG i;
+
+    PAGED_CODE();
+
+    *used = 0;
+
+    if (out_size < header) return STATUS_INFO_LENGTH_MISMATCH;
+
+    RtlZeroMemory(out, header);
+    *used = header;
+
+    if (!bad_pages->initialized) return STATUS_SUCCESS;
+
+    KeEnterCriticalRegion();
+    ExAcquireResourceSharedLite(&bad_pages->lock, TRUE);
+
+    out->NumberOfRanges = bad_pages->count;
+
+    for (i = 0; i < bad_pages->count; i++)
+    {
+        out->NumberOfPages += bad_pages->ranges[i].NumberOfPages;
+    }
+
+    if ((out_size - header) / sizeof(WINPMEM_PAGE_RANGE) >= bad_pages->count)
+    {
+        RtlCopyMemory(out->Range, bad_pages->ranges, bad_pages->count * sizeof(WINPMEM_PAGE_RANGE));
+        *used += bad_pages->count * sizeof(WINPMEM_PAGE_RANGE);
+    }
+    else
+    {
+        status = STATUS_BUFFER_OVERFLOW;
+    }
+
+    ExReleaseResourceLite(&bad_pages->lock);
+    KeLeaveCriticalRegion();
+
+    return status;
+}
+
+
+// Replaces the known bad pages with the ranges in in. The ranges need not be sorted.
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS setBadPages(_Inout_ PPMEM_BAD_PAGES bad_pages, _In_ PWINPMEM_BAD_PAGES in, _In_ ULONG in_size)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG header = FIELD_OFFSET(WINPMEM_BAD_PAGES, Range);
+    ULONG number_of_ranges;
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (!bad_pages->initialized) return STATUS_DEVICE_NOT_READY;
+
+    if (in_size < header) return STATUS_INFO_LENGTH_MISMATCH;
+
+    number_of_ranges = in->NumberOfRanges;
+
+    if ((number_of_ranges > WINPMEM_MAX_BAD_PAGE_RANGES) ||
+        (in_size < header + number_of_ranges * sizeof(WINPMEM_PAGE_RANGE)))
+    {
+        return STATUS_INFO_LENGTH_MISMATCH;
+    }
+
+    for (i = 0; i < number_of_ranges; i++)
+    {
+        // Page frame numbers past the 64 bit physical address space make no sense.
+        if ((in->Range[i].FirstPage > MAXULONG64 / PAGE_SIZE) ||
+            (in->Range[i].NumberOfPages > MAXULONG64 / PAGE_SIZE - in->Range[i].FirstPage))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&bad_pages->lock, TRUE);
+
+    bad_pages->count = 0;
+
+    for (i = 0; i < number_of_ranges; i++)
+    {
+        if (!insertBadPages(bad_pages, in->Range[i].FirstPage, in->Range[i].NumberOfPages))
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+    }
+
+    ExReleaseResourceLite(&bad_pages->lock);
+    KeLeaveCriticalRegion();
+
+    return status;
+}
+
+
+// Read statistics.
+// WINPMEM_MODE_STATS is all u64 counters, so these go through it as an array.
+
+#define PMEM_STATS_COUNTERS (sizeof(WINPMEM_MODE_STATS) / sizeof(u64))
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID resetStats(_Out_ PPMEM_STATS stats)
+{
+    volatile LONG64 * counters = (volatile LONG64 *) stats->mode;
+    ULONG i;
+
+    PAGED_CODE();
+
+    // Not zeroed in one go: a reader on another processor may be adding to them.
+    for (i = 0; i < WINPMEM_NUMBER_OF_MODES * PMEM_STATS_COUNTERS; i++)
+    {
+        InterlockedExchange64(&counters[i], 0);
+    }
+
+    InterlockedExchange64(&stats->reset_cycles, (LONG64) __rdtsc());
+    InterlockedExchange64(&stats->reset_time, (LONG64) KeQueryInterruptTime());
+}
+
+
+// Adds the counters of one read.
+_IRQL_requires_max_(APC_LEVEL)
+VOID addStats(_Inout_ PPMEM_STATS stats, _In_ ULONG mode, _In_ PWINPMEM_MODE_STATS read_stats)
+{
+    volatile LONG64 * counters;
+    PLONG64 values = (PLONG64) read_stats;
+    ULONG i;
+
+    if (mode >= WINPMEM_NUMBER_OF_MODES) return;
+
+    counters = (volatile LONG64 *) &stats->mode[mode];
+
+    // Most of them stay zero on a clean read.
+    for (i = 0; i < PMEM_STATS_COUNTERS; i++)
+    {
+        if (values[i]) InterlockedAdd64(&counters[i], values[i]);
+    }
+}
+
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID getStats(_In_ PPMEM_STATS stats, _Out_ PWINPMEM_STATS out)
+{
+    volatile LONG64 * counters = (volatile LONG64 *) stats->mode;
+    PLONG64 values = (PLONG64) out->Mode;
+    ULONG i;
+
+    PAGED_CODE();
+
+    // 64 bit reads are not atomic on x86.
+    for (i = 0; i < WINPMEM_NUMBER_OF_MODES * PMEM_STATS_COUNTERS; i++)
+    {
+        values[i] = InterlockedCompareExchange64(&counters[i], 0, 0);
+    }
+
+    out->ElapsedCycles = __rdtsc() - (ULONG64) InterlockedCompareExchange64(&stats->reset_cycles, 0, 0);
+    out->ElapsedTime = KeQueryInterruptTime() - (ULONG64) InterlockedCompareExchange64(&stats->reset_time, 0, 0);
+}
+
+
+// Reads howMuchToRead bytes of physical memory with the given method (PMEM_MODE_*, usually extension->mode)
+// into a buffer that is already mapped into system space.
+// Without failures: returns STATUS_IO_DEVICE_ERROR at the first unreadable page; *total_read has the good bytes before it.
+// With failures: unreadable pages are zeroed and recorded in the failure bitmap, and the read goes on.
+// With bad_pages: pages in it are never touched, they fail as if they faulted, and pages that fault are added.
+// Only reads with the mode of the device pass it (usually &extension->bad_pages). A page that faults with one
+// method may read with another, so probes of the other methods leave it alone.
 _IRQL_requires_max_(APC_LEVEL)
 NTSTATUS DeviceRead(_In_ PDEVICE_EXTENSION extension,
+                    _In_ ULONG mode,
+                    _In_opt_ PPMEM_FILE_CONTEXT context,
+                    _Inout_opt_ PPMEM_BAD_PAGES bad_pages,
                     _In_ LARGE_INTEGER physAddr_cursor,
-                    _Inout_ unsigned char * toxic_buffer_cursor, _In_ ULONG howMuchToRead,
+                    _Inout_ unsigned char * buffer_cursor, _In_ ULONG howMuchToRead,
+                    _Inout_opt_ PPMEM_READ_FAILURES failures,
                     _Out_ PULONG total_read)
 {
     ULONG bytes_read = 0;
     ULONG current_read_window = 0;
-    unsigned char * mdl_buffer = NULL;
-    PMDL mdl = NULL;
+    ULONG to_read = 0;
+    ULONG failure = PMEM_PAGE_MAP_FAILED;
+    ULONG page;
+    ULONG64 bad_page = MAXULONG64;
+    LONGLONG first_page = physAddr_cursor.QuadPart / PAGE_SIZE;
     NTSTATUS status = STATUS_SUCCESS;
+    WINPMEM_MODE_STATS stats;
+    ULONG64 cycles;
+    #if defined(_WIN64)
+    PPTE_METHOD_DATA pPtedata = NULL;
+    PROCESSOR_NUMBER processor;
+    GROUP_AFFINITY affinity;
+    GROUP_AFFINITY previous_affinity;
+    #endif
 
     *total_read = 0;
 
     if (!howMuchToRead) return STATUS_SUCCESS;  // read 0 bytes? Fine, already finished then.
 
-    // Fast mutex, APC LEVEL, and the three methods:
-    // The fast mutex sets the IRQL to APC_LEVEL. ZwMapViewOfSection (or ZwReadFile) requires PASSIVE_LEVEL and will not work on APC_LEVEL.
-    // The PTE method is not thread-safe and needs mutex protection. The other two methods are thread-safe.
+    RtlZeroMemory(&stats, sizeof(stats));
+
+    // The rogue page pool and the three methods:
+    // The PTE method is not thread-safe on a single rogue page. Each reader takes its own rogue page out of the pool,
+    // so readers on different processors remap and copy in parallel. The other two methods are thread-safe.
+    // Nothing here raises the IRQL. ZwMapViewOfSection (or ZwReadFile) requires PASSIVE_LEVEL and will not work on APC_LEVEL.
 
     #if defined(_WIN64)
-    if (extension->mode == PMEM_MODE_PTE)  // The PTE method is not thread-safe.
+    if (mode == PMEM_MODE_PTE)
     {
-        ExAcquireFastMutex(&extension->mu); // Don't forget to always free the Mutex!
+        cycles = __rdtsc();
+        pPtedata = acquireRoguePage(&extension->pte_pool); // Don't forget to always give it back!
+        stats.WaitCycles += __rdtsc() - cycles;
+
+        // Stay on this processor while we own the rogue page. Only the TLB of this processor
+        // ever sees our remapping then, and a local invlpg is all it takes.
+        KeGetCurrentProcessorNumberEx(&processor);
+        RtlZeroMemory(&affinity, sizeof(affinity));
+        affinity.Group = processor.Group;
+        affinity.Mask = (KAFFINITY) 1 << processor.Number;
+        KeSetSystemGroupAffinityThread(&affinity, &previous_affinity);
     }
     #endif
 
     while (*total_read < howMuchToRead)
     {
-        current_read_window =  min(PAGE_SIZE, howMuchToRead - *total_read);  
-        // read windows is either PAGE_SIZE (maximum), or a remaining rest: 
-        // total read minus all that has already been read.
+        // Don't read into the next known bad page.
+        to_read = howMuchToRead - *total_read;
+        if (bad_pages) bad_page = nextBadPage(bad_pages, physAddr_cursor.QuadPart / PAGE_SIZE);
 
-        // Allocate an mdl. Must be freed afterwards (if the call succeeds).
-        mdl = IoAllocateMdl(toxic_buffer_cursor, current_read_window,  FALSE, TRUE, NULL); // <= toxic buffer address increases each time in the loop.
-        if (!mdl)
+        if (bad_page == (ULONG64) physAddr_cursor.QuadPart / PAGE_SIZE)
         {
-            status = STATUS_INSUFFICIENT_RESOURCES;
-            goto end;
+            to_read = 0;
         }
-
-        try
+        else if (bad_page != MAXULONG64)
         {
-            MmProbeAndLockPages(mdl, UserMode, IoWriteAccess);
+            to_read = (ULONG) min((ULONG64) to_read, bad_page * PAGE_SIZE - physAddr_cursor.QuadPart);
         }
-        except(EXCEPTION_EXECUTE_HANDLER)
+
+        current_read_window =  min(PAGE_SIZE, to_read);
+        // read windows is either PAGE_SIZE (maximum), or a remaining rest:
+        // total read minus all that has already been read.
+
+        #if defined(_WIN64)
+        // The PTE method reads a whole rogue window at a time.
+        if (pPtedata && pPtedata->window_pages)
         {
-            status = GetExceptionCode();
-            DbgPrint("Error %08x: exception while locking usermode buffer.\n", status);
-            IoFreeMdl(mdl);
-            goto end;
+            current_read_window = min(pPtedata->window_pages * PAGE_SIZE - (ULONG) (physAddr_cursor.QuadPart % PAGE_SIZE),
+                                      to_read);
         }
+        #endif
 
-        // Okay, probed for write access and locked in physical memory.
-
-        mdl_buffer = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority );
+        failure = PMEM_PAGE_MAP_FAILED;
 
-        if (!mdl_buffer)
+        if (!to_read)
         {
-            MmUnlockPages(mdl);
-            IoFreeMdl(mdl);
-            status = STATUS_INSUFFICIENT_RESOURCES;
-            goto end;
+            bytes_read = 0;
+            failure = PMEM_PAGE_ACCESS_FAILED;
         }
-
-        if (extension->mode == PMEM_MODE_PHYSICAL)
+        else if (mode == PMEM_MODE_PHYSICAL)
         {
             if (KeGetCurrentIrql() == PASSIVE_LEVEL)
             {
-                bytes_read = PhysicalMemoryPartialRead(extension->MemoryHandle, physAddr_cursor, mdl_buffer, current_read_window);
+                // The cached views hold more than a page.
+                current_read_window = to_read;
+                bytes_read = PhysicalMemoryCachedRead(context, extension->MemoryHandle, physAddr_cursor, buffer_cursor, current_read_window, &failure, &stats);
             }
             else
             {
@@ -326,14 +1116,14 @@ NTSTATUS DeviceRead(_In_ PDEVICE_EXTENSION extension,
                 bytes_read = 0;
             }
         }
-        else if (extension->mode == PMEM_MODE_IOSPACE)
+        else if (mode == PMEM_MODE_IOSPACE)
         {
-            bytes_read = MapIOPagePartialRead(physAddr_cursor, mdl_buffer, current_read_window);
+            bytes_read = MapIOPagePartialRead(physAddr_cursor, buffer_cursor, current_read_window, &failure, &stats);
         }
         #if defined(_WIN64)
-        else if (extension->mode == PMEM_MODE_PTE)
+        else if (mode == PMEM_MODE_PTE)
         {
-            bytes_read = PTEMmapPartialRead(&extension->pte_data, physAddr_cursor, mdl_buffer, current_read_window);
+            bytes_read = PTEMmapWindowRead(pPtedata, physAddr_cursor, buffer_cursor, current_read_window, &failure, &stats);
         }
         #endif
         else
@@ -341,6 +1131,26 @@ NTSTATUS DeviceRead(_In_ PDEVICE_EXTENSION extension,
             bytes_read = 0;
         }
 
+        // Don't fault on this page again.
+        if ((bytes_read==0) && to_read && (failure == PMEM_PAGE_ACCESS_FAILED) && bad_pages)
+        {
+            addBadPage(bad_pages, physAddr_cursor.QuadPart / PAGE_SIZE);
+        }
+
+        if ((bytes_read==0) && failures)
+        {
+            // Zero the rest of the page, note why and go on with the next page.
+            bytes_read = min(PAGE_SIZE - (ULONG) (physAddr_cursor.QuadPart % PAGE_SIZE), howMuchToRead - *total_read);
+            RtlZeroMemory(buffer_cursor, bytes_read);
+
+            page = (ULONG) (physAddr_cursor.QuadPart / PAGE_SIZE - first_page);
+            failures->bitmap[page / 4] |= (UCHAR) (failure << ((page % 4) * 2));
+
+            failures->failed_pages++;
+            if (failure == PMEM_PAGE_ACCESS_FAILED) failures->access_failed_pages++;
+            else failures->map_failed_pages++;
+        }
+
         if (bytes_read==0)
         {
             // As it is now, the issue is that we do not know whether a real error happened or 'only' a VSM/Hyper-v induced read error.
@@ -353,30 +1163,106 @@ NTSTATUS DeviceRead(_In_ PDEVICE_EXTENSION extension,
             // Thus, on read error, the usermode buffer will be left unscathed.
             // As a usermode program author, on read error, please remember this, especially when using uninitialized malloc'ed buffers!
 
-            WinDbgPrint("Device read: an error occurred: no bytes read.\n");
-            MmUnlockPages(mdl);
-            IoFreeMdl(mdl);
+            if (to_read) WinDbgPrint("Device read: an error occurred: no bytes read.\n");
             status = STATUS_IO_DEVICE_ERROR; // The reading method failed.
             goto end;
         }
 
-        MmUnlockPages(mdl);
-        IoFreeMdl(mdl);
-
         physAddr_cursor.QuadPart += bytes_read;
-        toxic_buffer_cursor += bytes_read;
+        buffer_cursor += bytes_read;
         *total_read += bytes_read;
 
     } // while loop
 
 end:
     #if defined(_WIN64)
-    if (extension->mode == PMEM_MODE_PTE)
+    if (pPtedata)
     {
-        ExReleaseFastMutex(&extension->mu);
+        KeRevertToUserGroupAffinityThread(&previous_affinity);
+        releaseRoguePage(&extension->pte_pool, pPtedata);
     }
     #endif
 
+    stats.Reads = 1;
+    stats.BytesRead = *total_read;
+    addStats(&extension->stats, mode, &stats);
+
+    return status;
+}
+
+
+// Reads into a usermode buffer.
+// The whole buffer is probed, locked and mapped into system space once per request, not once per page.
+_IRQL_requires_max_(APC_LEVEL)
+NTSTATUS DeviceReadUserBuffer(_In_ PDEVICE_EXTENSION extension,
+                              _In_ ULONG mode,
+                              _In_opt_ PPMEM_FILE_CONTEXT context,
+                              _Inout_opt_ PPMEM_BAD_PAGES bad_pages,
+                              _In_ LARGE_INTEGER physAddr,
+                              _Inout_ unsigned char * toxic_buffer, _In_ ULONG howMuchToRead,
+                              _Inout_opt_ PPMEM_READ_FAILURES failures,
+                              _Out_ PULONG total_read)
+{
+    unsigned char * mdl_buffer = NULL;
+    PMDL mdl = NULL;
+    NTSTATUS status = STATUS_SUCCESS;
+    WINPMEM_MODE_STATS stats;
+    ULONG64 cycles = __rdtsc();
+
+    *total_read = 0;
+
+    if (!howMuchToRead) return STATUS_SUCCESS;
+
+    // DeviceRead counts the read itself, this only counts the locking.
+    RtlZeroMemory(&stats, sizeof(stats));
+
+    // Allocate an mdl for the whole buffer. Must be freed afterwards (if the call succeeds).
+    mdl = IoAllocateMdl(toxic_buffer, howMuchToRead,  FALSE, TRUE, NULL);
+    if (!mdl)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+
+    try
+    {
+        MmProbeAndLockPages(mdl, UserMode, IoWriteAccess);
+    }
+    except(EXCEPTION_EXECUTE_HANDLER)
+    {
+        status = GetExceptionCode();
+        DbgPrint("Error %08x: exception while locking usermode buffer.\n", status);
+    }
+
+    if (status != STATUS_SUCCESS)
+    {
+        IoFreeMdl(mdl);
+        goto end;
+    }
+
+    // Okay, probed for write access and locked in physical memory.
+
+    mdl_buffer = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+    stats.MdlCycles += __rdtsc() - cycles;
+
+    if (mdl_buffer)
+    {
+        status = DeviceRead(extension, mode, context, bad_pages, physAddr, mdl_buffer, howMuchToRead, failures, total_read);
+    }
+    else
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    cycles = __rdtsc();
+    MmUnlockPages(mdl); // Also releases the system mapping.
+    IoFreeMdl(mdl);
+
+end:
+    stats.MdlCycles += __rdtsc() - cycles;
+    if (!mdl_buffer) stats.MdlLockFailures++;
+    addStats(&extension->stats, mode, &stats);
+
     return status;
 }
 
@@ -483,7 +1369,8 @@ BOOLEAN pmemFastIoRead (
            (extension->mode == PMEM_MODE_PTE) ||
            (extension->mode == PMEM_MODE_PHYSICAL));
 
-    status = DeviceRead(extension, physAddr, toxic_buffer, BufLen, &total_read);
+    status = DeviceReadUserBuffer(extension, extension->mode, FileObject->FsContext, &extension->bad_pages,
+                                  physAddr, toxic_buffer, BufLen, NULL, &total_read);
 
     // Also check the return of Device Read. Do not simply return.
     if ((status != STATUS_SUCCESS) || (total_read == 0))
@@ -606,7 +1493,8 @@ NTSTATUS PmemRead(IN PDEVICE_OBJECT  DeviceObject, IN PIRP  Irp)
            (extension->mode == PMEM_MODE_PTE) ||
            (extension->mode == PMEM_MODE_PHYSICAL));
 
-    status = DeviceRead(extension, physAddr, toxic_buffer, BufLen, &total_read);
+    status = DeviceReadUserBuffer(extension, extension->mode, pIoStackIrp->FileObject->FsContext, &extension->bad_pages,
+                                  physAddr, toxic_buffer, BufLen, NULL, &total_read);
 
     // Also check the return of Device Read. Do not simply return.
     if ((status != STATUS_SUCCESS) || (total_read == 0))
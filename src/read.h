@@ -44,18 +44,89 @@ _IRQL_requires_max_(PASSIVE_LEVEL)
 
 _IRQL_requires_max_(APC_LEVEL)
     NTSTATUS DeviceRead(_In_ PDEVICE_EXTENSION extension,
+                    _In_ ULONG mode,
+                    _In_opt_ PPMEM_FILE_CONTEXT context,
+                    _Inout_opt_ PPMEM_BAD_PAGES bad_pages,
                     _In_ LARGE_INTEGER physAddr_cursor,
-                    _Inout_ unsigned char * toxic_buffer_cursor, _In_ ULONG howMuchToRead,
+                    _Inout_ unsigned char * buffer_cursor, _In_ ULONG howMuchToRead,
+                    _Inout_opt_ PPMEM_READ_FAILURES failures,
+                    _Out_ PULONG total_read);
+
+_IRQL_requires_max_(APC_LEVEL)
+    NTSTATUS DeviceReadUserBuffer(_In_ PDEVICE_EXTENSION extension,
+                    _In_ ULONG mode,
+                    _In_opt_ PPMEM_FILE_CONTEXT context,
+                    _Inout_opt_ PPMEM_BAD_PAGES bad_pages,
+                    _In_ LARGE_INTEGER physAddr,
+                    _Inout_ unsigned char * toxic_buffer, _In_ ULONG howMuchToRead,
+                    _Inout_opt_ PPMEM_READ_FAILURES failures,
                     _Out_ PULONG total_read);
 
 _IRQL_requires_max_(PASSIVE_LEVEL)
-    ULONG PhysicalMemoryPartialRead(_In_ HANDLE memoryHandle, _In_ LARGE_INTEGER physAddr, _Inout_ unsigned char * buf, _In_ ULONG count);
+    ULONG PhysicalMemoryPartialRead(_In_ HANDLE memoryHandle, _In_ LARGE_INTEGER physAddr, _Inout_ unsigned char * buf, _In_ ULONG count, _Out_opt_ PULONG failure, _Inout_ PWINPMEM_MODE_STATS stats);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+    PPMEM_FILE_CONTEXT createFileContext(VOID);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+    VOID cleanupFileContext(_Inout_ PPMEM_FILE_CONTEXT context);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+    VOID freeFileContext(_In_ PPMEM_FILE_CONTEXT context);
+
+_IRQL_requires_max_(APC_LEVEL)
+    PPMEM_VIEW lookupView(_In_ PPMEM_FILE_CONTEXT context, _In_ LARGE_INTEGER physAddr);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+    PPMEM_VIEW mapView(_Inout_ PPMEM_FILE_CONTEXT context, _In_ HANDLE memoryHandle, _In_ LARGE_INTEGER physAddr);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+    ULONG PhysicalMemoryCachedRead(_In_opt_ PPMEM_FILE_CONTEXT context, _In_ HANDLE memoryHandle, _In_ LARGE_INTEGER physAddr, _Inout_ unsigned char * buf, _In_ ULONG count, _Out_opt_ PULONG failure, _Inout_ PWINPMEM_MODE_STATS stats);
 
 // Capable of working higher than PASSIVE level, but not needed.
-ULONG MapIOPagePartialRead(_In_ LARGE_INTEGER physAddr, _Inout_ unsigned char * buf, _In_ ULONG count);
+ULONG MapIOPagePartialRead(_In_ LARGE_INTEGER physAddr, _Inout_ unsigned char * buf, _In_ ULONG count, _Out_opt_ PULONG failure, _Inout_ PWINPMEM_MODE_STATS stats);
+
+_IRQL_requires_max_(APC_LEVEL)
+    ULONG PTEMmapPartialRead(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ LARGE_INTEGER physAddr, _Inout_ unsigned char * buf, _In_ ULONG count, _Out_opt_ PULONG failure, _Inout_ PWINPMEM_MODE_STATS stats);
+
+_IRQL_requires_max_(APC_LEVEL)
+    ULONG PTEMmapWindowRead(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ LARGE_INTEGER physAddr, _Inout_ unsigned char * buf, _In_ ULONG count, _Out_opt_ PULONG failure, _Inout_ PWINPMEM_MODE_STATS stats);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+    VOID initBadPages(_Out_ PPMEM_BAD_PAGES bad_pages);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+    VOID freeBadPages(_Inout_ PPMEM_BAD_PAGES bad_pages);
+
+_IRQL_requires_max_(APC_LEVEL)
+    ULONG findBadPageRange(_In_ PPMEM_BAD_PAGES bad_pages, _In_ ULONG64 page);
+
+_IRQL_requires_max_(APC_LEVEL)
+    ULONG64 nextBadPage(_In_ PPMEM_BAD_PAGES bad_pages, _In_ ULONG64 page);
+
+_IRQL_requires_max_(APC_LEVEL)
+    BOOLEAN insertBadPages(_Inout_ PPMEM_BAD_PAGES bad_pages, _In_ ULONG64 first_page, _In_ ULONG64 number_of_pages);
+
+_IRQL_requires_max_(APC_LEVEL)
+    VOID addBadPage(_Inout_ PPMEM_BAD_PAGES bad_pages, _In_ ULONG64 page);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS getBadPages(_In_ PPMEM_BAD_PAGES bad_pages, _Out_ PWINPMEM_BAD_PAGES out, _In_ ULONG out_size, _Out_ PULONG used);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+    NTSTATUS setBadPages(_Inout_ PPMEM_BAD_PAGES bad_pages, _In_ PWINPMEM_BAD_PAGES in, _In_ ULONG in_size);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+    VOID resetStats(_Out_ PPMEM_STATS stats);
+
+_IRQL_requires_max_(APC_LEVEL)
+    VOID addStats(_Inout_ PPMEM_STATS stats, _In_ ULONG mode, _In_ PWINPMEM_MODE_STATS read_stats);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+    VOID getStats(_In_ PPMEM_STATS stats, _Out_ PWINPMEM_STATS out);
 
 _IRQL_requires_max_(APC_LEVEL)
-    ULONG PTEMmapPartialRead(_Inout_ PPTE_METHOD_DATA pPtedata, _In_ LARGE_INTEGER physAddr, _Inout_ unsigned char * buf, _In_ ULONG count);
+    ULONG CopyUntilFault(_Inout_ unsigned char * buf, _In_ unsigned char * toxic_source, _In_ ULONG page_offset, _In_ ULONG count);
 
 
 #ifdef ALLOC_PRAGMA
@@ -63,10 +134,30 @@ _IRQL_requires_max_(APC_LEVEL)
 #pragma alloc_text( PAGE , pmemFastIoRead )
 #pragma alloc_text( PAGE , PmemRead )
 #pragma alloc_text( PAGE , PmemWrite )
+#pragma alloc_text( PAGE , createFileContext )
+#pragma alloc_text( PAGE , cleanupFileContext )
+#pragma alloc_text( PAGE , freeFileContext )
+#pragma alloc_text( PAGE , mapView )
+#pragma alloc_text( PAGE , initBadPages )
+#pragma alloc_text( PAGE , freeBadPages )
+#pragma alloc_text( PAGE , getBadPages )
+#pragma alloc_text( PAGE , setBadPages )
+#pragma alloc_text( PAGE , resetStats )
+#pragma alloc_text( PAGE , getStats )
 #pragma alloc_text( NONPAGED , DeviceRead )
+#pragma alloc_text( NONPAGED , DeviceReadUserBuffer )
 #pragma alloc_text( NONPAGED , PhysicalMemoryPartialRead )
+#pragma alloc_text( NONPAGED , PhysicalMemoryCachedRead )
+#pragma alloc_text( NONPAGED , lookupView )
 #pragma alloc_text( NONPAGED , MapIOPagePartialRead )
 #pragma alloc_text( NONPAGED , PTEMmapPartialRead )
+#pragma alloc_text( NONPAGED , PTEMmapWindowRead )
+#pragma alloc_text( NONPAGED , CopyUntilFault )
+#pragma alloc_text( NONPAGED , findBadPageRange )
+#pragma alloc_text( NONPAGED , nextBadPage )
+#pragma alloc_text( NONPAGED , insertBadPages )
+#pragma alloc_text( NONPAGED , addBadPage )
+#pragma alloc_text( NONPAGED , addStats )
 #endif
 
 // The very often called routines should be in nonpaged memory, it would waste time if they were paged out.
@@ -0,0 +1,392 @@
+/*
+  Copyright 2026 Velocidex Innovations <mike@velocidex.com>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// Round trip check of compressed images: Writes an image with gaps
+// through CompressingSink and reads it back with CompressedImageReader,
+// checks that the LRU cache saves decompressing chunks again, and that
+// images with a broken index are refused. A run length codec stands in
+// for XPRESS, so nothing here needs Windows:
+//
+//   g++ -O2 -std=c++11 -pthread -I../executable compress_check.cpp
+//       ../executable/compress.cpp ../executable/pipeline.cpp
+
+#include "compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_SIZE (64 * 1024)
+#define CHUNK_COUNT 20
+
+static int failures = 0;
+
+#define CHECK(x) do { if (!(x)) { printf("%s:%d: %s failed.\n", __FILE__, __LINE__, #x); failures++; } } while (0)
+
+
+// (count, byte) pairs. Random data does not fit, and is stored.
+class RunLengthCompressor: public BlockCompressor
+{
+public:
+    virtual size_t compress(const unsigned char *input, size_t length,
+                            unsigned char *output, size_t capacity)
+    {
+        size_t out = 0;
+
+        for (size_t i = 0; i < length;)
+        {
+            size_t run = 1;
+
+            while (i + run < length && run < 255 && input[i + run] == input[i]) run++;
+
+            if (out + 2 > capacity) return 0;
+
+            output[out++] = (unsigned char)run;
+            output[out++] = input[i];
+            i += run;
+        }
+
+        return out;
+    }
+};
+
+class RunLengthDecompressor: public BlockDecompressor
+{
+public:
+    RunLengthDecompressor(): calls_(0) {}
+
+    virtual bool decompress(const unsigned char *input, size_t length,
+                            unsigned char *output, size_t raw_size)
+    {
+        size_t out = 0;
+
+        calls_++;
+
+        for (size_t i = 0; i + 1 < length; i += 2)
+        {
+            if (out + input[i] > raw_size) return false;
+
+            memset(output + out, input[i + 1], input[i]);
+            out += input[i];
+        }
+
+        return out == raw_size && length % 2 == 0;
+    }
+
+    uint64_t calls() const { return calls_; }
+
+private:
+    uint64_t calls_;
+};
+
+
+// Keeps the image in memory.
+class MemorySink: public ImageSink
+{
+public:
+    virtual bool write(const unsigned char *buffer, size_t length)
+    {
+        data.insert(data.end(), buffer, buffer + length);
+        return true;
+    }
+
+    std::vector<unsigned char> data;
+};
+
+
+// The even chunks compress, the odd ones are noise and are stored.
+static bool make_test_file(const char *filename, std::vector<unsigned char> *data)
+{
+    FILE *fd = fopen(filename, "wb");
+    uint32_t x = 1;
+
+    if (!fd) return false;
+
+    data->resize(CHUNK_SIZE * CHUNK_COUNT);
+
+    for (size_t i = 0; i < data->size(); i++)
+    {
+        x = x * 1103515245 + 12345;
+        (*data)[i] = (i / CHUNK_SIZE) % 2 ? (unsigned char)(x >> 16) : (unsigned char)(i / PAGE_SIZE);
+    }
+
+    if (fwrite(data->data(), 1, data->size(), fd) != data->size())
+    {
+        fclose(fd);
+        return false;
+    }
+
+    return fclose(fd) == 0;
+}
+
+static bool read_file(const char *filename, std::vector<unsigned char> *data)
+{
+    FILE *fd = fopen(filename, "rb");
+    unsigned char buffer[PAGE_SIZE];
+    size_t n;
+
+    if (!fd) return false;
+
+    data->clear();
+    while ((n = fread(buffer, 1, sizeof(buffer), fd)) > 0)
+    {
+        data->insert(data->end(), buffer, buffer + n);
+    }
+
+    fclose(fd);
+    return true;
+}
+
+static bool write_file(const char *filename, const std::vector<unsigned char> &data)
+{
+    FILE *fd = fopen(filename, "wb");
+
+    if (!fd) return false;
+
+    bool result = fwrite(data.data(), 1, data.size(), fd) == data.size();
+
+    return fclose(fd) == 0 && result;
+}
+
+// Does the reader take the image in data?
+static bool opens(const char *filename, const std::vector<unsigned char> &data)
+{
+    RunLengthDecompressor decompressor;
+    CompressedImageReader reader(&decompressor, 2);
+
+    return write_file(filename, data) && reader.open(filename);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *source_filename = "compress_check.dat";
+    const char *image_filename = "compress_check.wpmc";
+    const char *broken_filename = "compress_check_broken.wpmc";
+    std::vector<unsigned char> data;
+    std::vector<unsigned char> expected;
+    std::vector<MemoryRun> runs;
+
+    if (!make_test_file(source_filename, &data))
+    {
+        printf("Unable to create %s.\n", source_filename);
+        return -1;
+    }
+
+    // Two runs and a gap between them, and a short last chunk.
+    MemoryRun first = { 0, 3 * CHUNK_SIZE + 3 * PAGE_SIZE };
+    MemoryRun second = { 6 * CHUNK_SIZE, 13 * CHUNK_SIZE + 5 * PAGE_SIZE };
+
+    runs.push_back(first);
+    runs.push_back(second);
+
+    expected.assign(second.offset + second.length, 0);
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        memcpy(&expected[runs[i].offset], &data[runs[i].offset], runs[i].length);
+    }
+
+    // Write the image.
+    {
+        FileSource source;
+        FileSink file_sink;
+        RunLengthCompressor compressor1, compressor2;
+        std::vector<BlockCompressor *> compressors;
+        CopyPipeline pipeline(CHUNK_SIZE * 3 / 2, 4);
+
+        compressors.push_back(&compressor1);
+        compressors.push_back(&compressor2);
+
+        CHECK(source.open(source_filename));
+        source.set_runs(runs);
+        CHECK(file_sink.open(image_filename));
+
+        CompressingSink sink(&file_sink, COMPRESSION_XPRESS, compressors, CHUNK_SIZE);
+
+        CHECK(pipeline.copy_image(&source, &sink, NULL));
+        CHECK(sink.finish());
+        CHECK(sink.image_size() == expected.size());
+        CHECK(sink.stored_bytes() < sink.raw_bytes());
+    }
+
+    // Read it all back through the pipeline, as winpmem -x does.
+    {
+        RunLengthDecompressor decompressor;
+        CompressedImageReader reader(&decompressor, 2);
+        std::vector<MemoryRun> read_runs;
+        MemorySink sink;
+        CopyPipeline pipeline(CHUNK_SIZE, 4);
+
+        CHECK(reader.open(image_filename));
+        CHECK(reader.algorithm() == COMPRESSION_XPRESS);
+        CHECK(reader.size() == expected.size());
+
+        CHECK(reader.get_runs(&read_runs));
+        CHECK(read_runs.size() == runs.size());
+        for (size_t i = 0; i < read_runs.size() && i < runs.size(); i++)
+        {
+            CHECK(read_runs[i].offset == runs[i].offset && read_runs[i].length == runs[i].length);
+        }
+
+        CHECK(pipeline.copy_image(&reader, &sink, NULL));
+        CHECK(sink.data == expected);
+
+        // Random reads, some across chunks and into the gap.
+        uint32_t x = 7;
+        std::vector<unsigned char> buffer(3 * CHUNK_SIZE);
+
+        for (int i = 0; i < 1000; i++)
+        {
+            x = x * 1103515245 + 12345;
+            uint64_t offset = (x >> 8) % expected.size();
+            x = x * 1103515245 + 12345;
+            size_t length = (size_t)std::min((uint64_t)((x >> 8) % buffer.size()) + 1,
+                                             expected.size() - offset);
+            size_t bytes_read = 0;
+
+            CHECK(reader.read(offset, buffer.data(), length, &bytes_read));
+            CHECK(bytes_read == length);
+            CHECK(!memcmp(buffer.data(), &expected[offset], length));
+        }
+
+        // Past the end fails, but the bytes before it are there.
+        size_t bytes_read = 0;
+
+        CHECK(!reader.read(expected.size() - 16, buffer.data(), 32, &bytes_read));
+        CHECK(bytes_read == 16);
+    }
+
+    // The cache keeps the two most recently used chunks. Even chunks are
+    // compressed, so they count as calls.
+    {
+        RunLengthDecompressor decompressor;
+        CompressedImageReader reader(&decompressor, 2);
+        unsigned char buffer[16];
+        size_t bytes_read;
+
+        CHECK(reader.open(image_filename));
+
+        reader.read(0 * CHUNK_SIZE, buffer, sizeof(buffer), &bytes_read);
+        reader.read(2 * CHUNK_SIZE, buffer, sizeof(buffer), &bytes_read);
+        reader.read(0 * CHUNK_SIZE + 100, buffer, sizeof(buffer), &bytes_read);
+        CHECK(decompressor.calls() == 2);
+
+        // Chunk 2 is the least recently used, so it makes room for 8.
+        reader.read(8 * CHUNK_SIZE, buffer, sizeof(buffer), &bytes_read);
+        reader.read(0 * CHUNK_SIZE, buffer, sizeof(buffer), &bytes_read);
+        CHECK(decompressor.calls() == 3);
+
+        reader.read(2 * CHUNK_SIZE, buffer, sizeof(buffer), &bytes_read);
+        CHECK(decompressor.calls() == 4);
+        CHECK(!memcmp(buffer, &expected[2 * CHUNK_SIZE], sizeof(buffer)));
+
+        // The gap needs no chunk at all.
+        reader.read(4 * CHUNK_SIZE, buffer, sizeof(buffer), &bytes_read);
+        CHECK(decompressor.calls() == 4);
+
+        // Stored chunks are only copied.
+        reader.read(1 * CHUNK_SIZE, buffer, sizeof(buffer), &bytes_read);
+        CHECK(decompressor.calls() == 4);
+        CHECK(!memcmp(buffer, &expected[1 * CHUNK_SIZE], sizeof(buffer)));
+    }
+
+    // A broken index is refused.
+    {
+        std::vector<unsigned char> image;
+        std::vector<unsigned char> broken;
+        CompressedImageFooter footer;
+        CompressedChunkEntry entry;
+
+        CHECK(read_file(image_filename, &image));
+        CHECK(image.size() > sizeof(footer));
+        CHECK(opens(broken_filename, image));
+
+        size_t footer_offset = image.size() - sizeof(footer);
+
+        memcpy(&footer, &image[footer_offset], sizeof(footer));
+        size_t entry_offset = (size_t)footer.index_offset;
+
+        // Truncated.
+        broken.assign(image.begin(), image.end() - 1);
+        CHECK(!opens(broken_filename, broken));
+
+        // Not an image.
+        broken = image;
+        broken[0] = 'X';
+        CHECK(!opens(broken_filename, broken));
+
+        // No index.
+        broken = image;
+        broken[footer_offset + offsetof(CompressedImageFooter, magic)] = 'X';
+        CHECK(!opens(broken_filename, broken));
+
+        // Counts that don't fill the file up to the footer.
+        broken = image;
+        ((CompressedImageFooter *)&broken[footer_offset])->chunk_count++;
+        CHECK(!opens(broken_filename, broken));
+
+        broken = image;
+        ((CompressedImageFooter *)&broken[footer_offset])->range_count = UINT64_MAX / 2;
+        CHECK(!opens(broken_filename, broken));
+
+        // A chunk larger than the chunk size.
+        broken = image;
+        memcpy(&entry, &broken[entry_offset], sizeof(entry));
+        entry.raw_size = CHUNK_SIZE + 1;
+        memcpy(&broken[entry_offset], &entry, sizeof(entry));
+        CHECK(!opens(broken_filename, broken));
+
+        // Data that runs into the index.
+        broken = image;
+        memcpy(&entry, &broken[entry_offset], sizeof(entry));
+        entry.file_offset = footer.index_offset;
+        memcpy(&broken[entry_offset], &entry, sizeof(entry));
+        CHECK(!opens(broken_filename, broken));
+
+        // Chunks out of order.
+        broken = image;
+        memcpy(&entry, &broken[entry_offset + sizeof(entry)], sizeof(entry));
+        memcpy(&broken[entry_offset], &entry, sizeof(entry));
+        CHECK(!opens(broken_filename, broken));
+
+        // Corrupt data opens, but does not read.
+        broken = image;
+        memcpy(&entry, &broken[entry_offset], sizeof(entry));
+        CHECK(entry.stored_size < entry.raw_size);
+        broken[(size_t)entry.file_offset] ^= 0x01;
+        CHECK(write_file(broken_filename, broken));
+        {
+            RunLengthDecompressor decompressor;
+            CompressedImageReader reader(&decompressor, 2);
+            unsigned char buffer[16];
+            size_t bytes_read;
+
+            CHECK(reader.open(broken_filename));
+            CHECK(!reader.read(0, buffer, sizeof(buffer), &bytes_read));
+        }
+    }
+
+    remove(source_filename);
+    remove(image_filename);
+    remove(broken_filename);
+
+    if (failures)
+    {
+        printf("%d checks failed.\n", failures);
+        return -1;
+    }
+
+    printf("All checks passed.\n");
+    return 0;
+}
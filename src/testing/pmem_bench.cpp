@@ -0,0 +1,271 @@
+/*
+  Copyright 2026 Velocidex Innovations <mike@velocidex.com>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// Benchmarks the imager's copy engine against a file backed stand-in for
+// the pmem device, for a range of read sizes and bad page densities.
+// Nothing here needs Windows, so throughput regressions can be caught
+// on any build machine:
+//
+//   g++ -O2 -std=c++11 -pthread -I../executable pmem_bench.cpp
+//       ../executable/pipeline.cpp ../executable/stats.cpp
+
+#include "pipeline.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+#define MB (1024 * 1024)
+
+// How the engine reads. The first two behave like ReadFile() on the
+// device, which returns nothing at all if any page fails.
+enum BenchMode
+{
+    MODE_FIXED,      // Every read is buffer bytes.
+    MODE_ADAPTIVE,   // Reads shrink down to a page around failures.
+    MODE_READ_ALL,   // The driver reads past failures.
+    MODE_SKIP,       // Adaptive, and bad regions are zero filled without
+                     // reading them once probes find their end.
+    MODE_COUNT
+};
+
+static const char *mode_names[] = { "fixed", "adaptive", "read_all", "skip" };
+
+
+// Throws the image away, we only time the engine.
+class NullSink: public ImageSink
+{
+public:
+    NullSink(): written_(0) {}
+
+    virtual bool write(const unsigned char *buffer, size_t length)
+    {
+        written_ += length;
+        return true;
+    }
+
+    virtual bool pad(uint64_t length)
+    {
+        written_ += length;
+        return true;
+    }
+
+    uint64_t written() const { return written_; }
+
+private:
+    uint64_t written_;
+};
+
+
+class FailureCounter: public CopyObserver
+{
+public:
+    FailureCounter(): failed_pages_(0) {}
+
+    virtual void on_page_failure(uint64_t offset, int reason) { failed_pages_++; }
+
+    uint64_t failed_pages() const { return failed_pages_; }
+
+private:
+    uint64_t failed_pages_;
+};
+
+
+static bool make_test_file(const char *filename, uint64_t size)
+{
+    FILE *fd = fopen(filename, "wb");
+    std::vector<unsigned char> buffer(MB);
+    uint32_t x = 1;
+
+    if (!fd) return false;
+
+    for (uint64_t written = 0; written < size; written += buffer.size())
+    {
+        for (size_t i = 0; i < buffer.size(); i++)
+        {
+            x = x * 1103515245 + 12345;
+            buffer[i] = (unsigned char)(x >> 16);
+        }
+
+        if (fwrite(buffer.data(), 1, buffer.size(), fd) != buffer.size())
+        {
+            fclose(fd);
+            return false;
+        }
+    }
+
+    return fclose(fd) == 0;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+           "  -f [filename]  Read this file instead of a generated one.\n"
+           "  -s [MB]        Size of the generated file (Default 256).\n"
+           "  -l [us]        Latency of every read call (Default 0).\n"
+           "  -m [us]        Latency of every MB read (Default 0).\n"
+           "  -r [count]     Repeat every test this many times (Default 3).\n"
+           "  -g [MB]        Make a region this large in the middle of the\n"
+           "                 image unreadable (Default 0).\n"
+           "  -j [filename]  Write the engine's timings for every test to\n"
+           "                 this file as JSON lines.\n",
+           name);
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t buffer_sizes[] = { 64 * 1024, MB, 4 * MB, 16 * MB };
+    static const double error_rates[] = { 0, 0.0001, 0.01 };
+    const char *filename = NULL;
+    const char *generated = "pmem_bench.dat";
+    uint64_t size = 256 * (uint64_t)MB;
+    uint32_t call_us = 0;
+    uint32_t mb_us = 0;
+    int repeats = 3;
+    uint64_t region = 0;
+    const char *stats_filename = NULL;
+    FILE *stats_fd = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (argv[i][0] != '-' || !argv[i][1] || argv[i][2] || i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return -1;
+        }
+
+        switch (argv[i++][1])
+        {
+        case 'f': filename = argv[i]; break;
+        case 's': size = strtoull(argv[i], NULL, 0) * MB; break;
+        case 'l': call_us = (uint32_t)strtoul(argv[i], NULL, 0); break;
+        case 'm': mb_us = (uint32_t)strtoul(argv[i], NULL, 0); break;
+        case 'r': repeats = atoi(argv[i]); break;
+        case 'g': region = strtoull(argv[i], NULL, 0) * MB; break;
+        case 'j': stats_filename = argv[i]; break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (!filename)
+    {
+        if (!make_test_file(generated, size))
+        {
+            printf("Unable to create %s.\n", generated);
+            return -1;
+        }
+        filename = generated;
+    }
+
+    if (stats_filename && !(stats_fd = fopen(stats_filename, "w")))
+    {
+        printf("Unable to create %s.\n", stats_filename);
+        return -1;
+    }
+
+    printf("%-10s %-8s %-9s %10s %12s %12s\n",
+           "buffer", "errors", "mode", "MB/s", "calls/GB", "bad pages");
+
+    for (size_t b = 0; b < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); b++)
+    {
+        for (size_t e = 0; e < sizeof(error_rates) / sizeof(error_rates[0]); e++)
+        {
+            for (int mode = 0; mode < MODE_COUNT; mode++)
+            {
+                CopyPipeline pipeline(buffer_sizes[b], 4);
+                double best = 0;
+                uint64_t calls = 0;
+                uint64_t failed_pages = 0;
+                uint64_t copied = 0;
+
+                for (int r = 0; r < repeats; r++)
+                {
+                    FileSource source;
+                    NullSink sink;
+                    FailureCounter counter;
+
+                    if (!source.open(filename))
+                    {
+                        printf("Unable to open %s.\n", filename);
+                        return -1;
+                    }
+
+                    source.set_error_rate(error_rates[e], 1);
+                    if (region)
+                    {
+                        source.add_bad_range((source.size() - region) / 2 / PAGE_SIZE * PAGE_SIZE,
+                                             region);
+                    }
+                    source.set_latency(call_us, mb_us);
+                    source.set_read_all(mode == MODE_READ_ALL);
+                    source.set_short_reads(false);
+
+                    if (mode == MODE_ADAPTIVE || mode == MODE_SKIP)
+                    {
+                        pipeline.set_read_size_bounds(PAGE_SIZE, buffer_sizes[b]);
+                    }
+
+                    pipeline.set_skip_bad_regions(mode == MODE_SKIP);
+
+                    CopyStats stats(stats_fd, &counter);
+
+                    if (stats_fd)
+                    {
+                        fprintf(stats_fd, "{\"type\":\"test\",\"buffer\":%zu,\"errors\":%g,"
+                                "\"mode\":\"%s\",\"repeat\":%d}\n",
+                                buffer_sizes[b], error_rates[e], mode_names[mode], r);
+                    }
+
+                    auto start = std::chrono::steady_clock::now();
+
+                    if (!pipeline.copy_image(&source, &sink,
+                                             stats_fd ? (CopyObserver *)&stats : &counter))
+                    {
+                        printf("Copy failed.\n");
+                        return -1;
+                    }
+
+                    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+                    if (stats_fd) stats.finish();
+                    double rate = sink.written() / (double)MB / elapsed.count();
+
+                    if (rate > best) best = rate;
+
+                    calls = source.calls();
+                    failed_pages = counter.failed_pages();
+                    copied = sink.written();
+                }
+
+                printf("%-10zu %-8g %-9s %10.1f %12.1f %12llu\n",
+                       buffer_sizes[b], error_rates[e],
+                       mode_names[mode],
+                       best, copied ? calls * 1024.0 * MB / copied : 0.0,
+                       (unsigned long long)failed_pages);
+                fflush(stdout);
+            }
+        }
+    }
+
+    if (stats_fd) fclose(stats_fd);
+    if (filename == generated) remove(generated);
+
+    return 0;
+}
@@ -12,6 +12,35 @@
 
 #define IOCTL_REVERSE_SEARCH_QUERY  CTL_CODE(0x22, 0x104, 3, 3)
 
+// Reads physical memory into the output buffer. Uses METHOD_OUT_DIRECT (2), so the output
+// buffer is locked once for the whole request. The input is a WINPMEM_READ_PHYSICAL.
+#define IOCTL_READ_PHYSICAL  CTL_CODE(0x22, 0x105, 2, 3)
+
+// Reads many physical ranges in one call. The input is a WINPMEM_READ_BATCH.
+#define IOCTL_READ_BATCH  CTL_CODE(0x22, 0x106, 3, 3)
+
+// Reads past unreadable pages and reports them in a bitmap. The input is a WINPMEM_READ_CONTINUE,
+// the output a WINPMEM_READ_CONTINUE_RESULT.
+#define IOCTL_READ_PHYSICAL_CONTINUE  CTL_CODE(0x22, 0x107, 3, 3)
+
+// The pages the driver found unreadable so far. Both use METHOD_BUFFERED (0) and a WINPMEM_BAD_PAGES.
+// Getting them with too small an output buffer only fills in the header.
+#define IOCTL_GET_BAD_PAGES  CTL_CODE(0x22, 0x108, 0, 3)
+
+// Replaces the set of unreadable pages, e.g. with the one of the last run on this host.
+#define IOCTL_SET_BAD_PAGES  CTL_CODE(0x22, 0x109, 0, 3)
+
+// Read counters and cycle timings per acquisition mode. METHOD_BUFFERED (0), the output is a WINPMEM_STATS.
+#define IOCTL_GET_STATS  CTL_CODE(0x22, 0x10A, 0, 3)
+
+// Zeroes the counters, e.g. before timing one mode against another. No input or output.
+#define IOCTL_RESET_STATS  CTL_CODE(0x22, 0x10B, 0, 3)
+
+// IOCTL_READ_PHYSICAL_CONTINUE with the method in WINPMEM_READ_CONTINUE.Mode rather than the one set with
+// IOCTL_SET_MODE, for timing the methods against each other. Works before a mode is set and does not set one.
+// Probes ignore the bad pages of IOCTL_GET_BAD_PAGES, and the pages they fail on are not added to them.
+#define IOCTL_PROBE_READ  CTL_CODE(0x22, 0x10C, 3, 3)
+
 /*
 // REM :
 #define METHOD_BUFFERED                 0
@@ -73,4 +73,109 @@ typedef struct _WINPMEM_MEMORY_INFO
 
 #pragma pack(pop)
 
+
+// Input of IOCTL_READ_PHYSICAL. The memory at PhysicalAddress is read into the output buffer.
+typedef struct _WINPMEM_READ_PHYSICAL
+{
+  LARGE_INTEGER PhysicalAddress;
+} WINPMEM_READ_PHYSICAL, *PWINPMEM_READ_PHYSICAL;
+
+
+// IOCTL_READ_BATCH.
+// The output buffer starts with NumberOfDescriptors WINPMEM_READ_STATUS entries, one per descriptor.
+// Each descriptor places its data at OutputOffset in the output buffer, behind the status entries.
+#define WINPMEM_MAX_READ_DESCRIPTORS (0x10000)
+
+typedef struct _WINPMEM_READ_DESCRIPTOR
+{
+  LARGE_INTEGER PhysicalAddress;
+  u32 Length;
+  u32 OutputOffset;
+} WINPMEM_READ_DESCRIPTOR, *PWINPMEM_READ_DESCRIPTOR;
+
+typedef struct _WINPMEM_READ_BATCH
+{
+  u32 NumberOfDescriptors;
+  u32 Reserved;
+  WINPMEM_READ_DESCRIPTOR Descriptor[1];
+} WINPMEM_READ_BATCH, *PWINPMEM_READ_BATCH;
+
+typedef struct _WINPMEM_READ_STATUS
+{
+  u32 Status;     // The NTSTATUS of this read.
+  u32 BytesRead;  // Good bytes, also on error: the read stops at the first unreadable page.
+} WINPMEM_READ_STATUS, *PWINPMEM_READ_STATUS;
+
+
+// IOCTL_READ_PHYSICAL_CONTINUE and IOCTL_PROBE_READ.
+// Unreadable pages are zeroed and the read carries on. The result has a bitmap with two bits per page
+// (page i at bit 2*(i%4) of byte i/4, counted from the page of PhysicalAddress) saying why it failed:
+#define PMEM_PAGE_OK             (0)
+#define PMEM_PAGE_ACCESS_FAILED  (1)  // Mapped, but reading it faulted. Usually blocked by the hypervisor (VSM).
+#define PMEM_PAGE_MAP_FAILED     (2)  // Could not be mapped at all.
+
+typedef struct _WINPMEM_READ_CONTINUE
+{
+  LARGE_INTEGER PhysicalAddress;
+  u64 Buffer;  // Usermode address of the data buffer.
+  u32 Length;
+  u32 Mode;    // IOCTL_PROBE_READ only: the PMEM_MODE_* to read with.
+} WINPMEM_READ_CONTINUE, *PWINPMEM_READ_CONTINUE;
+
+typedef struct _WINPMEM_READ_CONTINUE_RESULT
+{
+  u32 BytesRead;
+  u32 FailedPages;
+  u32 AccessFailedPages;
+  u32 MapFailedPages;
+  u8 Bitmap[1];  // (pages + 3) / 4 bytes.
+} WINPMEM_READ_CONTINUE_RESULT, *PWINPMEM_READ_CONTINUE_RESULT;
+
+
+// IOCTL_GET_BAD_PAGES and IOCTL_SET_BAD_PAGES.
+// Pages that faulted on access, as sorted ranges of page frame numbers. Reads of these
+// fail at once as PMEM_PAGE_ACCESS_FAILED, without touching the page.
+#define WINPMEM_MAX_BAD_PAGE_RANGES (0x4000)
+
+typedef struct _WINPMEM_PAGE_RANGE
+{
+  u64 FirstPage;  // Page frame number.
+  u64 NumberOfPages;
+} WINPMEM_PAGE_RANGE, *PWINPMEM_PAGE_RANGE;
+
+typedef struct _WINPMEM_BAD_PAGES
+{
+  u32 NumberOfRanges;
+  u32 Reserved;
+  u64 NumberOfPages;  // In all ranges. Ignored by IOCTL_SET_BAD_PAGES.
+  WINPMEM_PAGE_RANGE Range[1];
+} WINPMEM_BAD_PAGES, *PWINPMEM_BAD_PAGES;
+
+
+// IOCTL_GET_STATS and IOCTL_RESET_STATS.
+// What reads spent their time on since the driver was loaded or the counters were reset, for each
+// acquisition mode (Mode[PMEM_MODE_*]). Cycles are time stamp counter ticks, ElapsedCycles / ElapsedTime
+// gives their rate. Reads are counted when they finish, so a read running over a reset may be lost.
+#define WINPMEM_NUMBER_OF_MODES (3)
+
+typedef struct _WINPMEM_MODE_STATS
+{
+  u64 Reads;            // Reads into one buffer, whatever the IOCTL or read path.
+  u64 BytesRead;
+  u64 PagesRemapped;    // Pages mapped to read them: PTE remaps, views of \Device\PhysicalMemory or MmMapIoSpace.
+  u64 Exceptions;       // Faults caught while copying.
+  u64 MdlLockFailures;  // Usermode buffers that could not be locked or mapped.
+  u64 WaitCycles;       // Waiting for a rogue page or for the view cache.
+  u64 MdlCycles;        // Locking and mapping usermode buffers.
+  u64 RemapCycles;      // Mapping and unmapping physical memory.
+  u64 CopyCycles;       // Copying from the mapping, faults included.
+} WINPMEM_MODE_STATS, *PWINPMEM_MODE_STATS;
+
+typedef struct _WINPMEM_STATS
+{
+  u64 ElapsedCycles;  // Since the last reset.
+  u64 ElapsedTime;    // Since the last reset, in 100ns units.
+  WINPMEM_MODE_STATS Mode[WINPMEM_NUMBER_OF_MODES];
+} WINPMEM_STATS, *PWINPMEM_STATS;
+
 #endif
@@ -30,9 +30,15 @@ DRIVER_INITIALIZE DriverEntry;
 _IRQL_requires_max_(PASSIVE_LEVEL)
 NTSTATUS AddMemoryRanges(PWINPMEM_MEMORY_INFO info) ;
 
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS CheckAcquisitionMode(PDEVICE_EXTENSION ext, ULONG mode);
+
 _IRQL_requires_max_(PASSIVE_LEVEL)
 __drv_dispatchType(IRP_MJ_CREATE)  __drv_dispatchType(IRP_MJ_CLOSE) DRIVER_DISPATCH wddCreateClose;
 
+_IRQL_requires_max_(PASSIVE_LEVEL)
+__drv_dispatchType(IRP_MJ_CLEANUP) DRIVER_DISPATCH wddCleanup;
+
 _IRQL_requires_max_(PASSIVE_LEVEL)
 __drv_dispatchType(IRP_MJ_DEVICE_CONTROL) DRIVER_DISPATCH wddDispatchDeviceControl;
 
@@ -42,7 +48,9 @@ __drv_dispatchType(IRP_MJ_DEVICE_CONTROL) DRIVER_DISPATCH wddDispatchDeviceContr
 #pragma alloc_text( PAGE , IoUnload )
 #pragma alloc_text( INIT , DriverEntry )
 #pragma alloc_text( PAGE , AddMemoryRanges )
+#pragma alloc_text( PAGE , CheckAcquisitionMode )
 #pragma alloc_text( PAGE , wddCreateClose )
+#pragma alloc_text( PAGE , wddCleanup )
 #pragma alloc_text( PAGE , wddDispatchDeviceControl )
 #endif
 
@@ -65,9 +73,10 @@ VOID IoUnload(IN PDRIVER_OBJECT DriverObject)
         ext = (PDEVICE_EXTENSION) pDeviceObject->DeviceExtension;
 
         #if defined(_WIN64)
-        if (ext->pte_data.pte_method_is_ready_to_use) restoreOriginalRoguePage(&ext->pte_data);
+        if (ext->pte_pool.pte_method_is_ready_to_use) restoreRoguePagePool(&ext->pte_pool);
         #endif
         if (ext->MemoryHandle) ZwClose(ext->MemoryHandle);
+        freeBadPages(&ext->bad_pages);
 
         RtlInitUnicodeString (&DeviceLinkUnicodeString, L"\\??\\" PMEM_DEVICE_NAME);
         IoDeleteSymbolicLink (&DeviceLinkUnicodeString);
@@ -129,14 +138,104 @@ NTSTATUS AddMemoryRanges(PWINPMEM_MEMORY_INFO info)
   return STATUS_SUCCESS;
 }
 
+// Whether reads can use this method (a PMEM_MODE_*) on this system.
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS CheckAcquisitionMode(PDEVICE_EXTENSION ext, ULONG mode)
+{
+    PAGED_CODE();
+
+    switch(mode)
+    {
+        case PMEM_MODE_PHYSICAL:
+            if (!ext->MemoryHandle)
+            {
+                DbgPrint("Error: the acquisition mode 'physical memory device' failed setup and is not available.\n");
+                return STATUS_NOT_SUPPORTED;
+            }
+            return STATUS_SUCCESS;
+
+        case PMEM_MODE_IOSPACE:
+            // always works, if it works.
+            return STATUS_SUCCESS;
+
+        case PMEM_MODE_PTE:
+
+            #if defined(_WIN64)
+            if (!ext->pte_pool.pte_method_is_ready_to_use)
+            {
+                DbgPrint("Error: the acquisition mode PTE is not available for your system.\n");
+                return STATUS_NOT_SUPPORTED;
+            }
+            return STATUS_SUCCESS;
+            #else
+
+            DbgPrint("PTE Remapping has not been implemented on 32 bit OS.\n");
+            return STATUS_NOT_IMPLEMENTED;
+
+            #endif
+
+        default:
+            DbgPrint("Invalid acquisition mode %u.\n", mode);
+            return STATUS_INVALID_PARAMETER;
+    }
+}
+
 
 
 NTSTATUS wddCreateClose(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 {
+  PIO_STACK_LOCATION IrpStack;
+  NTSTATUS status = STATUS_SUCCESS;
+
+  PAGED_CODE();
+
   if (!DeviceObject || !Irp)
   {
     return STATUS_INVALID_PARAMETER;
   }
+
+  IrpStack = IoGetCurrentIrpStackLocation(Irp);
+
+  // Every handle gets its own view cache.
+  if (IrpStack->MajorFunction == IRP_MJ_CREATE)
+  {
+    IrpStack->FileObject->FsContext = createFileContext();
+    if (!IrpStack->FileObject->FsContext)
+    {
+      status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+  }
+  else if (IrpStack->MajorFunction == IRP_MJ_CLOSE)
+  {
+    freeFileContext(IrpStack->FileObject->FsContext);
+    IrpStack->FileObject->FsContext = NULL;
+  }
+
+  Irp->IoStatus.Status = status;
+  Irp->IoStatus.Information = 0;
+
+  IoCompleteRequest(Irp,IO_NO_INCREMENT);
+  return status;
+}
+
+
+// The last handle to the file object is gone. We are (usually) in the context of the process that
+// opened it, so this is where the views of the view cache are unmapped.
+NTSTATUS wddCleanup(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
+{
+  PIO_STACK_LOCATION IrpStack;
+
+  PAGED_CODE();
+
+  if (!DeviceObject || !Irp)
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  IrpStack = IoGetCurrentIrpStackLocation(Irp);
+
+  cleanupFileContext(IrpStack->FileObject->FsContext);
+
   Irp->IoStatus.Status = STATUS_SUCCESS;
   Irp->IoStatus.Information = 0;
 
@@ -180,6 +279,14 @@ NTSTATUS wddDispatchDeviceControl(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP
     OutputLen = IrpStack->Parameters.DeviceIoControl.OutputBufferLength;
     InputLen = IrpStack->Parameters.DeviceIoControl.InputBufferLength;
     IoControlCode = IrpStack->Parameters.DeviceIoControl.IoControlCode;
+
+    // Only METHOD_NEITHER ioctls hand us raw usermode pointers that need nailing.
+    // For the others the I/O manager already buffered or locked the buffers for us.
+    if (METHOD_FROM_CTL_CODE(IoControlCode) != METHOD_NEITHER)
+    {
+        inBuffer = NULL;
+        outBuffer = NULL;
+    }
 	
 	// Point 1: the inputbuffer.
 	
@@ -351,62 +458,73 @@ NTSTATUS wddDispatchDeviceControl(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP
 
         mode = *(PULONG)mdl_inbuffer;
 
-        switch(mode)
-        {
-            case PMEM_MODE_PHYSICAL:
-                if (ext->MemoryHandle)
-                {
-                    WinDbgPrint("SET MODE: using physical memory device for acquisition.\n");
-                    status = STATUS_SUCCESS;
-                    ext->mode = mode;
-                }
-                else
-                {
-                    DbgPrint("Error: the acquisition mode 'physical memory device' failed setup and is not available.\n");
-                    status = STATUS_NOT_SUPPORTED;
-                }
-                break;
-
-            case PMEM_MODE_IOSPACE:
-                // always works, if it works.
-                WinDbgPrint("SET MODE: Using MmMapIoSpace for acquisition.\n");
-                status = STATUS_SUCCESS;
-                ext->mode = mode;
-                break;
-
-            case PMEM_MODE_PTE:
-
-                #if defined(_WIN64)
-                if (ext->pte_data.pte_method_is_ready_to_use)
-                {
-                    WinDbgPrint("SET MODE: Using PTE Remapping for acquisition.\n");
-                    status = STATUS_SUCCESS;
-                    ext->mode = mode;
-                }
-                else
-                {
-                    DbgPrint("Error: the acquisition mode PTE is not available for your system.\n");
-                    status = STATUS_NOT_SUPPORTED;
-                }
-                #else
-
-                DbgPrint("PTE Remapping has not been implemented on 32 bit OS.\n");
-                status = STATUS_NOT_IMPLEMENTED;
-
-                #endif
-
-                break;
-
-            default:
-                DbgPrint("Invalid acquisition mode %u.\n", mode);
-                status = STATUS_INVALID_PARAMETER;
-
-        }; // switch mode
+        status = CheckAcquisitionMode(ext, mode);
 
+        if (status == STATUS_SUCCESS)
+        {
+            WinDbgPrint("SET MODE: using method %u for acquisition.\n", mode);
+            ext->mode = mode;
+        }
 
     }; break;  // end of IOCTL_SET_MODE
 
 
+    // Bulk read. METHOD_OUT_DIRECT: the I/O manager probes, locks and describes the whole
+    // output buffer with a single MDL before we get called, so it is locked once per request.
+    case IOCTL_READ_PHYSICAL:
+    {
+        PWINPMEM_READ_PHYSICAL pRead = NULL;
+        unsigned char * read_buffer = NULL;
+        ULONG total_read = 0;
+
+        if (!((ext->mode == PMEM_MODE_IOSPACE) ||
+              (ext->mode == PMEM_MODE_PTE) ||
+              (ext->mode == PMEM_MODE_PHYSICAL)))
+        {
+            DbgPrint("Error in IOCTL_READ_PHYSICAL: no mode set for reading.\n");
+            status = STATUS_DEVICE_NOT_READY;
+            goto exit;
+        }
+
+        if ((!Irp->AssociatedIrp.SystemBuffer) || (InputLen < sizeof(WINPMEM_READ_PHYSICAL)))
+        {
+            DbgPrint("Error: no (adequate) inbuffer in IOCTL_READ_PHYSICAL.\n");
+            status = STATUS_INFO_LENGTH_MISMATCH;
+            goto exit;
+        }
+
+        if ((!Irp->MdlAddress) || (!OutputLen))
+        {
+            DbgPrint("Error: no outbuffer in IOCTL_READ_PHYSICAL.\n");
+            status = STATUS_INVALID_PARAMETER;
+            goto exit;
+        }
+
+        pRead = (PWINPMEM_READ_PHYSICAL) Irp->AssociatedIrp.SystemBuffer;
+
+        read_buffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority );
+        if (!read_buffer)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+
+        status = DeviceRead(ext, ext->mode, IrpStack->FileObject->FsContext, &ext->bad_pages,
+                            pRead->PhysicalAddress, read_buffer, OutputLen, NULL, &total_read);
+
+        // Same as PmemRead: a read error reports no bytes at all.
+        if ((status != STATUS_SUCCESS) || (total_read == 0))
+        {
+            WinDbgPrint("Error in IOCTL_READ_PHYSICAL: read error occurred: no bytes read.\n");
+            status = STATUS_IO_DEVICE_ERROR;
+            goto exit;
+        }
+
+        Irp->IoStatus.Information = total_read;
+
+    }; break;  // end of IOCTL_READ_PHYSICAL
+
+
 #if PMEM_WRITE_ENABLED == 1
     case IOCTL_WRITE_ENABLE: // Actually this is a switch. You can turn write support off/on again.
     {
@@ -428,7 +546,7 @@ NTSTATUS wddDispatchDeviceControl(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP
         PHYS_ADDR Out_PhysAddr = 0;
         ULONG page_offset;
 
-        if (!ext->pte_data.pte_method_is_ready_to_use)
+        if (!ext->pte_pool.pte_method_is_ready_to_use)
         {
             DbgPrint("Error: the acquisition mode PTE is not available for your system.\n");
             status = STATUS_NOT_SUPPORTED;
@@ -508,6 +626,233 @@ NTSTATUS wddDispatchDeviceControl(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP
 
     } ; break; // IOCTL_REVERSE_SEARCH_QUERY
 
+    // Scatter/gather read. Many small reads for the price of one kernel transition.
+    // The output buffer starts with one WINPMEM_READ_STATUS per descriptor, the data goes behind it.
+    case IOCTL_READ_BATCH:
+    {
+        PWINPMEM_READ_BATCH pBatch = NULL;
+        PWINPMEM_READ_STATUS pStatus = NULL;
+        WINPMEM_READ_DESCRIPTOR descriptor;
+        ULONG number_of_descriptors = 0;
+        ULONG status_size = 0;
+        ULONG total_read = 0;
+        ULONG_PTR used = 0;
+        ULONG i;
+
+        if (!((ext->mode == PMEM_MODE_IOSPACE) ||
+              (ext->mode == PMEM_MODE_PTE) ||
+              (ext->mode == PMEM_MODE_PHYSICAL)))
+        {
+            DbgPrint("Error in IOCTL_READ_BATCH: no mode set for reading.\n");
+            status = STATUS_DEVICE_NOT_READY;
+            goto exit;
+        }
+
+        if ((!mdl_inbuffer) || (InputLen < FIELD_OFFSET(WINPMEM_READ_BATCH, Descriptor)))
+        {
+            DbgPrint("Error: no (adequate) inbuffer in IOCTL_READ_BATCH.\n");
+            status = STATUS_INFO_LENGTH_MISMATCH;
+            goto exit;
+        }
+
+        pBatch = (PWINPMEM_READ_BATCH) mdl_inbuffer;
+
+        // The usermode program can still change the buffer under our feet. Fetch everything exactly once.
+        number_of_descriptors = pBatch->NumberOfDescriptors;
+
+        if ((number_of_descriptors > WINPMEM_MAX_READ_DESCRIPTORS) ||
+            (InputLen < FIELD_OFFSET(WINPMEM_READ_BATCH, Descriptor) + number_of_descriptors * sizeof(WINPMEM_READ_DESCRIPTOR)))
+        {
+            DbgPrint("Error: too many descriptors (%u) in IOCTL_READ_BATCH.\n", number_of_descriptors);
+            status = STATUS_INFO_LENGTH_MISMATCH;
+            goto exit;
+        }
+
+        status_size = number_of_descriptors * sizeof(WINPMEM_READ_STATUS);
+
+        if ((!mdl_outbuffer) || (OutputLen < status_size))
+        {
+            DbgPrint("Error: no (adequate) outbuffer in IOCTL_READ_BATCH.\n");
+            status = STATUS_INFO_LENGTH_MISMATCH;
+            goto exit;
+        }
+
+        pStatus = (PWINPMEM_READ_STATUS) mdl_outbuffer;
+        used = status_size;
+
+        for (i = 0; i < number_of_descriptors; i++)
+        {
+            RtlCopyMemory(&descriptor, &pBatch->Descriptor[i], sizeof(WINPMEM_READ_DESCRIPTOR));
+
+            total_read = 0;
+
+            // The data must neither overlap the status array nor run off the end of the buffer.
+            if ((descriptor.OutputOffset < status_size) ||
+                (descriptor.OutputOffset > OutputLen) ||
+                (descriptor.Length > OutputLen - descriptor.OutputOffset))
+            {
+                pStatus[i].Status = (u32) STATUS_INVALID_PARAMETER;
+                pStatus[i].BytesRead = 0;
+                continue;
+            }
+
+            pStatus[i].Status = (u32) DeviceRead(ext, ext->mode, IrpStack->FileObject->FsContext, &ext->bad_pages,
+                                                 descriptor.PhysicalAddress,
+                                                 mdl_outbuffer + descriptor.OutputOffset, descriptor.Length, NULL, &total_read);
+            pStatus[i].BytesRead = total_read;
+
+            used = max(used, (ULONG_PTR) descriptor.OutputOffset + total_read);
+        }
+
+        // Errors are reported per descriptor.
+        Irp->IoStatus.Information = used;
+        status = STATUS_SUCCESS;
+
+    }; break;  // end of IOCTL_READ_BATCH
+
+    // Reads past unreadable pages. They are zeroed and reported in a bitmap, with a reason for each,
+    // so usermode does not have to find every bad page with a retry of its own.
+    // A probe is the same read with the method in the request instead of the mode of the device, which
+    // it leaves alone. Usermode times the methods against each other with it before setting the mode.
+    case IOCTL_READ_PHYSICAL_CONTINUE:
+    case IOCTL_PROBE_READ:
+    {
+        WINPMEM_READ_CONTINUE request;
+        PWINPMEM_READ_CONTINUE_RESULT pResult = NULL;
+        PMEM_READ_FAILURES failures;
+        ULONG mode = ext->mode;
+        ULONG pages = 0;
+        ULONG bitmap_size = 0;
+        ULONG total_read = 0;
+
+        if ((!mdl_inbuffer) || (InputLen < sizeof(WINPMEM_READ_CONTINUE)))
+        {
+            DbgPrint("Error: no (adequate) inbuffer in IOCTL_READ_PHYSICAL_CONTINUE.\n");
+            status = STATUS_INFO_LENGTH_MISMATCH;
+            goto exit;
+        }
+
+        // Fetch once, the usermode program can still change it.
+        RtlCopyMemory(&request, mdl_inbuffer, sizeof(WINPMEM_READ_CONTINUE));
+
+        if (IoControlCode == IOCTL_PROBE_READ)
+        {
+            mode = request.Mode;
+
+            status = CheckAcquisitionMode(ext, mode);
+            if (status != STATUS_SUCCESS) goto exit;
+        }
+        else if (!((mode == PMEM_MODE_IOSPACE) ||
+                   (mode == PMEM_MODE_PTE) ||
+                   (mode == PMEM_MODE_PHYSICAL)))
+        {
+            DbgPrint("Error in IOCTL_READ_PHYSICAL_CONTINUE: no mode set for reading.\n");
+            status = STATUS_DEVICE_NOT_READY;
+            goto exit;
+        }
+
+        if ((!request.Buffer) || (!request.Length) || (request.Buffer >= MM_USER_PROBE_ADDRESS))
+        {
+            DbgPrint("Error in IOCTL_READ_PHYSICAL_CONTINUE: bad data buffer.\n");
+            status = STATUS_INVALID_PARAMETER;
+            goto exit;
+        }
+
+        pages = (ULONG) (((request.PhysicalAddress.QuadPart % PAGE_SIZE) + request.Length + PAGE_SIZE - 1) / PAGE_SIZE);
+        bitmap_size = (pages + 3) / 4;
+
+        if ((!mdl_outbuffer) || (OutputLen < FIELD_OFFSET(WINPMEM_READ_CONTINUE_RESULT, Bitmap) + bitmap_size))
+        {
+            DbgPrint("Error: no (adequate) outbuffer in IOCTL_READ_PHYSICAL_CONTINUE.\n");
+            status = STATUS_INFO_LENGTH_MISMATCH;
+            goto exit;
+        }
+
+        pResult = (PWINPMEM_READ_CONTINUE_RESULT) mdl_outbuffer;
+        RtlZeroMemory(pResult, FIELD_OFFSET(WINPMEM_READ_CONTINUE_RESULT, Bitmap) + bitmap_size);
+
+        RtlZeroMemory(&failures, sizeof(failures));
+        failures.bitmap = pResult->Bitmap;
+
+        // Probes neither trust nor add to the bad pages of the device's mode, or the first method
+        // to fault on a page would make it fail fast for every method timed after it.
+        status = DeviceReadUserBuffer(ext, mode, IrpStack->FileObject->FsContext,
+                                      IoControlCode == IOCTL_PROBE_READ ? NULL : &ext->bad_pages,
+                                      request.PhysicalAddress,
+                                      (unsigned char *) (ULONG_PTR) request.Buffer, request.Length, &failures, &total_read);
+
+        if (status != STATUS_SUCCESS)
+        {
+            DbgPrint("Error in IOCTL_READ_PHYSICAL_CONTINUE: %08x.\n", status);
+            goto exit;
+        }
+
+        pResult->BytesRead = total_read;
+        pResult->FailedPages = failures.failed_pages;
+        pResult->AccessFailedPages = failures.access_failed_pages;
+        pResult->MapFailedPages = failures.map_failed_pages;
+
+        Irp->IoStatus.Information = FIELD_OFFSET(WINPMEM_READ_CONTINUE_RESULT, Bitmap) + bitmap_size;
+
+    }; break;  // end of IOCTL_READ_PHYSICAL_CONTINUE
+
+    // The pages that faulted so far, to be given back with IOCTL_SET_BAD_PAGES on the next run.
+    case IOCTL_GET_BAD_PAGES:
+    {
+        ULONG used = 0;
+
+        if (!Irp->AssociatedIrp.SystemBuffer)
+        {
+            DbgPrint("Error: no outbuffer in IOCTL_GET_BAD_PAGES.\n");
+            status = STATUS_INFO_LENGTH_MISMATCH;
+            goto exit;
+        }
+
+        // On STATUS_BUFFER_OVERFLOW the header still goes back, with the number of ranges there are.
+        status = getBadPages(&ext->bad_pages, (PWINPMEM_BAD_PAGES) Irp->AssociatedIrp.SystemBuffer, OutputLen, &used);
+        Irp->IoStatus.Information = used;
+
+    }; break;  // end of IOCTL_GET_BAD_PAGES
+
+    case IOCTL_SET_BAD_PAGES:
+    {
+        if (!Irp->AssociatedIrp.SystemBuffer)
+        {
+            DbgPrint("Error: no inbuffer in IOCTL_SET_BAD_PAGES.\n");
+            status = STATUS_INFO_LENGTH_MISMATCH;
+            goto exit;
+        }
+
+        status = setBadPages(&ext->bad_pages, (PWINPMEM_BAD_PAGES) Irp->AssociatedIrp.SystemBuffer, InputLen);
+
+        if (status != STATUS_SUCCESS)
+        {
+            DbgPrint("Error in IOCTL_SET_BAD_PAGES: %08x.\n", status);
+        }
+
+    }; break;  // end of IOCTL_SET_BAD_PAGES
+
+    // Where reads spend their time, per acquisition mode.
+    case IOCTL_GET_STATS:
+    {
+        if (!Irp->AssociatedIrp.SystemBuffer || (OutputLen < sizeof(WINPMEM_STATS)))
+        {
+            DbgPrint("Error: outbuffer too small in IOCTL_GET_STATS.\n");
+            status = STATUS_INFO_LENGTH_MISMATCH;
+            goto exit;
+        }
+
+        getStats(&ext->stats, (PWINPMEM_STATS) Irp->AssociatedIrp.SystemBuffer);
+        Irp->IoStatus.Information = sizeof(WINPMEM_STATS);
+
+    }; break;  // end of IOCTL_GET_STATS
+
+    case IOCTL_RESET_STATS:
+    {
+        resetStats(&ext->stats);
+
+    }; break;  // end of IOCTL_RESET_STATS
+
     default:
     {
         WinDbgPrint("Invalid IOCTRL %u\n", IoControlCode);
@@ -582,6 +927,7 @@ NTSTATUS DriverEntry (IN PDRIVER_OBJECT DriverObject,
 
     DriverObject->MajorFunction[IRP_MJ_CREATE] = wddCreateClose;
     DriverObject->MajorFunction[IRP_MJ_CLOSE] = wddCreateClose;
+    DriverObject->MajorFunction[IRP_MJ_CLEANUP] = wddCleanup;
     DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = wddDispatchDeviceControl;
     DriverObject->MajorFunction[IRP_MJ_READ] = PmemRead; // copies tons of data, always in the range of Gigabytes.
 
@@ -649,6 +995,9 @@ NTSTATUS DriverEntry (IN PDRIVER_OBJECT DriverObject,
 
     extension->kernelbase.QuadPart = KernelGetModuleBaseByPtr();
 
+    initBadPages(&extension->bad_pages);
+    resetStats(&extension->stats);
+
     // Setup physical memory device handle from Windows.
     if (!setupPhysMemSectionHandle(&extension->MemoryHandle))
     {
@@ -667,25 +1016,18 @@ NTSTATUS DriverEntry (IN PDRIVER_OBJECT DriverObject,
 		DbgPrint("Warning: level 5 paging system found.\n");
 		DbgPrint("You can try the physical memory device method, but the PTE method is not implemented for level 5.\n");
 		DbgPrint("Warning: Winpmem has never been tested on level 5 paging systems.\n");
-		extension->pte_data.pte_method_is_ready_to_use = FALSE;
+		extension->pte_pool.pte_method_is_ready_to_use = FALSE;
 	}
 	else // PTE method setup.
 	{
-		if (!setupBackupForOriginalRoguePage(&extension->pte_data))
+		// This indicates it is usable if at least one rogue page could be set up.
+		if (!setupRoguePagePool(&extension->pte_pool))
 		{
-			extension->pte_data.pte_method_is_ready_to_use = FALSE;
 			DbgPrint("Warning: PTE method failed (unknown reason)!\n(You will not be able to use this method).\n");
 		}
-		else
-		{
-			// Indicate it is usable now.
-			extension->pte_data.pte_method_is_ready_to_use = TRUE;
-		}
 	}
     #endif
 
-    ExInitializeFastMutex(&extension->mu);
-
     WinDbgPrint("Driver initialization completed.\n");
     return ntstatus;
 
@@ -51,6 +51,33 @@ DECLARE_UNICODE_STRING_SIZE(eventLogKeyEntry, DEFAULT_SIZE_STR);
 
 extern PUSHORT NtBuildNumber;  // (pre-existing build number.)
 
+/*
+  Pages that faulted on access. Every fault costs an exception and a debug print, and the
+  hypervisor blocks the same pages on every read, so they are remembered for all handles.
+  Sorted, disjoint and non adjacent ranges.
+*/
+typedef struct _PMEM_BAD_PAGES
+{
+  ERESOURCE lock;
+  BOOLEAN initialized;
+
+  /* WINPMEM_MAX_BAD_PAGE_RANGES entries, allocated on first use. Once full, no more pages are added. */
+  PWINPMEM_PAGE_RANGE ranges;
+  volatile ULONG count;
+
+} PMEM_BAD_PAGES, *PPMEM_BAD_PAGES;
+
+/*
+  Counters for IOCTL_GET_STATS. Each read gathers its own on the stack and adds them here once
+  with interlocked operations, so readers on different processors don't fight over them per page.
+*/
+typedef struct _PMEM_STATS
+{
+  WINPMEM_MODE_STATS mode[WINPMEM_NUMBER_OF_MODES];
+  volatile LONG64 reset_cycles;  // __rdtsc() at the last reset.
+  volatile LONG64 reset_time;    // KeQueryInterruptTime() at the last reset.
+} PMEM_STATS, *PPMEM_STATS;
+
 /*
   Our Device Extension Structure.
 */
@@ -61,7 +88,7 @@ typedef struct _DEVICE_EXTENSION
 
   #if defined(_WIN64)
   /* If we read by using the PTE method  */
-  PTE_METHOD_DATA  pte_data;
+  PTE_POOL  pte_pool;
   #endif
 
   /* How we should acquire memory. */
@@ -73,10 +100,55 @@ typedef struct _DEVICE_EXTENSION
 
   LARGE_INTEGER kernelbase;  // Kernelbase, for user info
 
-  FAST_MUTEX mu;
+  PMEM_BAD_PAGES bad_pages;
+
+  PMEM_STATS stats;
 
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
+/*
+  The view cache for reading from \\Device\\PhysicalMemory.
+*/
+#define PMEM_VIEW_SIZE (8 * 1024 * 1024)  // Views are aligned to this, and clipped to their physical memory run.
+#define PMEM_VIEW_CACHE_SIZE (8)
+
+typedef struct _PMEM_VIEW
+{
+  PUCHAR base;             // Where the view is mapped in the owner process, NULL if the slot is free.
+  LARGE_INTEGER physAddr;  // The physical address of the first byte of the view.
+  ULONG size;
+  volatile LONG64 last_used;
+} PMEM_VIEW, *PPMEM_VIEW;
+
+/*
+  Per handle state. Hangs off FileObject->FsContext.
+*/
+typedef struct _PMEM_FILE_CONTEXT
+{
+  /* The process that opened the handle. The views are mapped into its address space. */
+  PEPROCESS owner;
+
+  ERESOURCE lock;
+  volatile LONG64 clock;
+
+  /* The physical memory runs, fetched on first use. */
+  PPHYSICAL_MEMORY_RANGE ranges;
+
+  PMEM_VIEW views[PMEM_VIEW_CACHE_SIZE];
+
+} PMEM_FILE_CONTEXT, *PPMEM_FILE_CONTEXT;
+
+/*
+  Where DeviceRead records the pages it could not read, if asked to continue past them.
+*/
+typedef struct _PMEM_READ_FAILURES
+{
+  PUCHAR bitmap;  // 2 bits per page (a PMEM_PAGE_* reason), zeroed by the caller.
+  ULONG failed_pages;
+  ULONG access_failed_pages;
+  ULONG map_failed_pages;
+} PMEM_READ_FAILURES, *PPMEM_READ_FAILURES;
+
 // 5e1ce668-47cb-410e-a664-5c705ae4d71b
 DEFINE_GUID(GUID_DEVCLASS_PMEM_DUMPER,
             0x5e1ce668L,